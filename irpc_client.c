@@ -17,16 +17,22 @@
  **/
 
 #include <stdio.h>
+#include <string.h>
 #include <strings.h>
 #include <stdlib.h>
+#include <unistd.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/time.h>
+#include <sys/un.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 
 #include "libirpc.h"
 
+static const char *server_ip = NULL;
+static int server_port;
+
 static int
 create_client_socket()
 {
@@ -73,24 +79,74 @@ connect_or_die(const char *ip, int port)
     return sock;
 }
 
+static int
+connect_unix_or_die(const char *path)
+{
+    struct sockaddr_un server;
+    int sock = socket(PF_UNIX, SOCK_STREAM, 0);
+    
+    if (sock == -1 || strlen(path) >= sizeof(server.sun_path)) {
+        fprintf(stderr, "Error! Failed to create a client socket: %s\n", path);
+        exit(1);
+    }
+    
+    bzero(&server, sizeof server);
+    server.sun_family = AF_UNIX;
+    strcpy(server.sun_path, path);
+    
+    if (connect(sock, (struct sockaddr *)&server, sizeof server) == -1) {
+        fprintf(stderr, "Error! Failed to connect to a server at: %s\n", path);
+        exit(1);
+    }
+    
+    return sock;
+}
+
+/* ci.reconnect hook, the session survives a dropped connection. */
+static int
+reconnect_server(struct irpc_connection_info *ci)
+{
+    int sock = create_client_socket();
+    
+    (void)ci;
+    
+    if (sock != -1 && try_connect(sock, server_ip, server_port) == -1) {
+        close(sock);
+        sock = -1;
+    }
+    
+    return sock;
+}
+
 static irpc_retval_t
-usb_init(struct irpc_info *info)
+usb_session_open(struct irpc_info *info)
 {
-    irpc_func_t func = IRPC_USB_INIT;
+    irpc_func_t func = IRPC_USB_SESSION_OPEN;
     irpc_context_t ctx = IRPC_CONTEXT_CLIENT;
     
+    // Init and enumeration in one round trip.
+    info->session.flags = IRPC_SESSION_ENUMERATE;
+    
     return irpc_call(func, ctx, info);
 }
 
-
-static void
-usb_print_device_list(struct irpc_info *info)
+/* For servers without IRPC_USB_SESSION_OPEN. */
+static irpc_retval_t
+usb_legacy_open(struct irpc_info *info)
 {
-    irpc_func_t func = IRPC_USB_GET_DEVICE_LIST;
     irpc_context_t ctx = IRPC_CONTEXT_CLIENT;
+    irpc_retval_t retval = IRPC_FAILURE;
     
-    (void)irpc_call(func, ctx, info);
+    retval = irpc_call(IRPC_USB_INIT, ctx, info);
+    if (retval == IRPC_SUCCESS)
+        (void)irpc_call(IRPC_USB_GET_DEVICE_LIST, ctx, info);
     
+    return retval;
+}
+
+static void
+usb_print_device_list(struct irpc_info *info)
+{
     struct irpc_device_list devlist = info->devlist;
     
     printf("irpc_client: n_devs: %d\n", devlist.n_devs);
@@ -102,6 +158,9 @@ usb_print_device_list(struct irpc_info *info)
         printf("irpc_client: [%d] bus_number: %d\n", i, dev.bus_number);
         printf("irpc_client: [%d] device_address: %d\n", i, dev.device_address);
         printf("irpc_client: [%d] num configurations: %d\n", i, dev.num_configurations);
+        if (info->ci.version)
+            printf("irpc_client: [%d] id: %04x:%04x\n", i,
+                   info->session.ids[i] >> 16, info->session.ids[i] & 0xffff);
     }
 }
 
@@ -164,24 +223,32 @@ usb_open_device(struct irpc_info *info)
 }
 
 static irpc_retval_t
-usb_claim_interface(struct irpc_info *info)
+usb_claim_release_interface(struct irpc_info *info)
 {
-    irpc_func_t func = IRPC_USB_CLAIM_INTERFACE;
-    irpc_context_t ctx = IRPC_CONTEXT_CLIENT;
-
+    struct irpc_batch_op ops[] = {
+        { IRPC_USB_CLAIM_INTERFACE, info, 0 },
+        { IRPC_USB_RELEASE_INTERFACE, info, 0 },
+    };
+    irpc_retval_t retval = IRPC_FAILURE;
+    
     info->intf = 0;
     
-    return irpc_call(func, ctx, info);
+    // Both in one round trip, no release without a claim.
+    retval = irpc_call_batch(ops, 2, IRPC_BATCH_STOP_ON_ERROR);
+    if (ops[0].retval < 0)
+        printf("irpc_client: usb_claim_interface failed\n");
+    else if (ops[1].retval < 0)
+        printf("irpc_client: usb_release_interface failed\n");
+    
+    return retval;
 }
 
 static irpc_retval_t
-usb_release_interface(struct irpc_info *info)
+usb_delegate(struct irpc_info *info)
 {
-    irpc_func_t func = IRPC_USB_RELEASE_INTERFACE;
+    irpc_func_t func = IRPC_USB_DELEGATE;
     irpc_context_t ctx = IRPC_CONTEXT_CLIENT;
     
-    info->intf = 0;
-    
     return irpc_call(func, ctx, info);
 }
 
@@ -194,25 +261,47 @@ usb_close(struct irpc_info *info)
     irpc_call(func, ctx, info);
 }
 
+static int
+connect_server_or_die(int argc, char **argv)
+{
+    int port;
+    
+    if (argc == 2)
+        return connect_unix_or_die(argv[1]);
+    
+    sscanf(argv[2], "%d", &port);
+    server_ip = argv[1];
+    server_port = port;
+    return connect_or_die(argv[1], port);
+}
+
 int main(int argc, char **argv)
 {
     irpc_retval_t retval = IRPC_FAILURE;
     struct irpc_info info;
-    int port;
     
     bzero(&info, sizeof(struct irpc_info));
 
-    if (argc < 3) {
-        printf("irpc_client: ip port\n");
+    if (argc < 3 && !(argc == 2 && argv[1][0] == '/')) {
+        printf("irpc_client: ip port | unix_socket_path\n");
         return retval;
     }
     
-    sscanf(argv[2], "%d", &port);
-    info.ci.server_sock = connect_or_die(argv[1], port);
-    
-    retval = usb_init(&info);
+    info.ci.server_sock = connect_server_or_die(argc, argv);
+    if (server_ip)
+        info.ci.reconnect = reconnect_server;
+    
+    retval = usb_session_open(&info);
+    if (retval < 0 && info.session.version == 0) {
+        // The server predates session negotiation, start over on the
+        // connection which replaced the old one.
+        printf("irpc_client: falling back to usb_init\n");
+        if (info.ci.server_sock == -1)
+            info.ci.server_sock = connect_server_or_die(argc, argv);
+        retval = usb_legacy_open(&info);
+    }
     if (retval < 0) {
-        printf("irpc_client: usb_init failed\n");
+        printf("irpc_client: usb_session_open failed\n");
         return retval;
     }
     
@@ -234,17 +323,13 @@ int main(int argc, char **argv)
         return retval;
     }
     
-    retval = usb_claim_interface(&info);
-    if (retval < 0) {
-        printf("irpc_client: usb_claim_interface failed\n");
-        goto exit;
-    }
+    // Local clients drive the data path directly if the server agrees.
+    if ((info.session.caps & IRPC_CAP_DELEGATE) &&
+        usb_delegate(&info) == IRPC_SUCCESS)
+        printf("irpc_client: usbfs delegation active\n");
     
-    retval = usb_release_interface(&info);
-    if (retval < 0)
-        printf("irpc_client: usb_release_interface failed\n");
+    retval = usb_claim_release_interface(&info);
     
-exit:
     usb_close(&info);
     usb_exit(&info);
     
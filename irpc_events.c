@@ -0,0 +1,315 @@
+/**
+ * libirpc - irpc_events.c
+ * Copyright (C) 2010 Manuel Gebele
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+#include "irpc_events.h"
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <sys/eventfd.h>
+#include <libusb-1.0/libusb.h>
+
+#define IRPC_EVENTS_MAX_WAIT    1000    /* ms, upper bound of one poll() */
+
+struct events_ctx {
+    struct libusb_context *ctx;
+    int refs;                       /* Sessions sharing the context */
+    struct events_ctx *next;
+};
+
+struct irpc_events {
+    pthread_t thread;
+    pthread_mutex_t lock;           /* Held while handling events */
+    struct events_ctx *ctxs;
+    unsigned gen;                   /* Bumped when the fd set changes */
+    int wake_fd;
+    int stop;
+    // Event thread only.
+    struct pollfd *pfds;
+    struct libusb_context **owner;  /* Context of each pfds entry */
+    int npfds, cap;
+};
+
+static void
+events_wake(struct irpc_events *ev)
+{
+    uint64_t one = 1;
+    
+    (void)write(ev->wake_fd, &one, sizeof one);
+}
+
+static void
+events_changed(struct irpc_events *ev)
+{
+    __sync_fetch_and_add(&ev->gen, 1);
+    events_wake(ev);
+}
+
+/* libusb pollfd notifiers, may run on any thread. */
+static void LIBUSB_CALL
+events_pollfd_added(int fd, short events, void *user_data)
+{
+    (void)fd;
+    (void)events;
+    
+    events_changed(user_data);
+}
+
+static void LIBUSB_CALL
+events_pollfd_removed(int fd, void *user_data)
+{
+    (void)fd;
+    
+    events_changed(user_data);
+}
+
+static int
+events_reserve(struct irpc_events *ev, int n)
+{
+    struct pollfd *pfds;
+    struct libusb_context **owner;
+    
+    if (n <= ev->cap)
+        return 0;
+    
+    if (!(pfds = realloc(ev->pfds, n * sizeof(struct pollfd))))
+        return -1;
+    ev->pfds = pfds;
+    if (!(owner = realloc(ev->owner, n * sizeof(struct libusb_context *))))
+        return -1;
+    ev->owner = owner;
+    ev->cap = n;
+    
+    return 0;
+}
+
+/* Called with ev->lock held. */
+static void
+events_rebuild(struct irpc_events *ev)
+{
+    const struct libusb_pollfd **fds;
+    struct events_ctx *ec;
+    int i;
+    
+    ev->npfds = 0;
+    if (events_reserve(ev, 1) != 0)
+        return;
+    
+    ev->pfds[0].fd = ev->wake_fd;
+    ev->pfds[0].events = POLLIN;
+    ev->owner[0] = NULL;
+    ev->npfds = 1;
+    
+    for (ec = ev->ctxs; ec; ec = ec->next) {
+        if (!(fds = libusb_get_pollfds(ec->ctx)))
+            continue;
+        for (i = 0; fds[i]; i++) {
+            if (events_reserve(ev, ev->npfds + 1) != 0)
+                break;
+            ev->pfds[ev->npfds].fd = fds[i]->fd;
+            ev->pfds[ev->npfds].events = fds[i]->events;
+            ev->owner[ev->npfds] = ec->ctx;
+            ev->npfds++;
+        }
+        free(fds);
+    }
+}
+
+/* Called with ev->lock held. */
+static int
+events_timeout(struct irpc_events *ev)
+{
+    struct events_ctx *ec;
+    struct timeval tv;
+    int ms = IRPC_EVENTS_MAX_WAIT, t;
+    
+    for (ec = ev->ctxs; ec; ec = ec->next) {
+        if (libusb_get_next_timeout(ec->ctx, &tv) != 1)
+            continue;
+        t = tv.tv_sec * 1000 + (tv.tv_usec + 999) / 1000;
+        if (t < ms)
+            ms = t;
+    }
+    
+    return ms;
+}
+
+static void *
+events_thread(void *arg)
+{
+    struct irpc_events *ev = arg;
+    struct timeval zero = { 0, 0 };
+    struct events_ctx *ec;
+    unsigned gen = 0;
+    uint64_t val;
+    int rebuild = 1, timeout, n, i;
+    
+    while (1) {
+        pthread_mutex_lock(&ev->lock);
+        if (ev->stop) {
+            pthread_mutex_unlock(&ev->lock);
+            break;
+        }
+        if (rebuild) {
+            gen = __sync_fetch_and_add(&ev->gen, 0);
+            events_rebuild(ev);
+            rebuild = 0;
+        }
+        timeout = events_timeout(ev);
+        pthread_mutex_unlock(&ev->lock);
+        
+        n = poll(ev->pfds, ev->npfds, timeout);
+        if (n < 0)
+            continue;
+        
+        if (ev->pfds[0].revents & POLLIN)
+            (void)read(ev->wake_fd, &val, sizeof val);
+        
+        pthread_mutex_lock(&ev->lock);
+        if (gen != __sync_fetch_and_add(&ev->gen, 0)) {
+            // Contexts or their fds changed, the results may be stale.
+            rebuild = 1;
+        } else if (n == 0) {
+            // Timeouts expired.
+            for (ec = ev->ctxs; ec; ec = ec->next)
+                libusb_handle_events_timeout(ec->ctx, &zero);
+        } else {
+            // Contexts own consecutive entries, handle each once.
+            for (i = 1; i < ev->npfds; i++) {
+                if (!ev->pfds[i].revents)
+                    continue;
+                libusb_handle_events_timeout(ev->owner[i], &zero);
+                while (i + 1 < ev->npfds && ev->owner[i + 1] == ev->owner[i])
+                    i++;
+            }
+        }
+        pthread_mutex_unlock(&ev->lock);
+    }
+    
+    return NULL;
+}
+
+struct irpc_events *
+irpc_events_new(void)
+{
+    struct irpc_events *ev = calloc(1, sizeof(struct irpc_events));
+    
+    if (!ev)
+        return NULL;
+    
+    if ((ev->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1) {
+        free(ev);
+        return NULL;
+    }
+    
+    pthread_mutex_init(&ev->lock, NULL);
+    
+    if (pthread_create(&ev->thread, NULL, events_thread, ev) != 0) {
+        pthread_mutex_destroy(&ev->lock);
+        close(ev->wake_fd);
+        free(ev);
+        return NULL;
+    }
+    
+    return ev;
+}
+
+void
+irpc_events_free(struct irpc_events *ev)
+{
+    struct events_ctx *ec;
+    
+    pthread_mutex_lock(&ev->lock);
+    ev->stop = 1;
+    pthread_mutex_unlock(&ev->lock);
+    events_wake(ev);
+    
+    pthread_join(ev->thread, NULL);
+    
+    while ((ec = ev->ctxs)) {
+        ev->ctxs = ec->next;
+        libusb_set_pollfd_notifiers(ec->ctx, NULL, NULL, NULL);
+        free(ec);
+    }
+    
+    pthread_mutex_destroy(&ev->lock);
+    close(ev->wake_fd);
+    free(ev->pfds);
+    free(ev->owner);
+    free(ev);
+}
+
+int
+irpc_events_add(struct irpc_events *ev, struct libusb_context *ctx)
+{
+    struct events_ctx *ec;
+    
+    pthread_mutex_lock(&ev->lock);
+    for (ec = ev->ctxs; ec; ec = ec->next) {
+        if (ec->ctx == ctx) {
+            ec->refs++;
+            pthread_mutex_unlock(&ev->lock);
+            return 0;
+        }
+    }
+    
+    if (!(ec = calloc(1, sizeof(struct events_ctx)))) {
+        pthread_mutex_unlock(&ev->lock);
+        return -1;
+    }
+    
+    ec->ctx = ctx;
+    ec->refs = 1;
+    libusb_set_pollfd_notifiers(ctx, events_pollfd_added, events_pollfd_removed, ev);
+    ec->next = ev->ctxs;
+    ev->ctxs = ec;
+    pthread_mutex_unlock(&ev->lock);
+    
+    events_changed(ev);
+    
+    return 0;
+}
+
+void
+irpc_events_remove(struct irpc_events *ev, struct libusb_context *ctx)
+{
+    struct events_ctx **p, *ec = NULL;
+    
+    // The thread holds the lock while handling events, so once it is
+    // ours the context is no longer in use.
+    pthread_mutex_lock(&ev->lock);
+    for (p = &ev->ctxs; *p; p = &(*p)->next) {
+        if ((*p)->ctx == ctx) {
+            if (--(*p)->refs == 0) {
+                ec = *p;
+                *p = ec->next;
+                libusb_set_pollfd_notifiers(ctx, NULL, NULL, NULL);
+            }
+            break;
+        }
+    }
+    pthread_mutex_unlock(&ev->lock);
+    
+    if (ec) {
+        free(ec);
+        events_changed(ev);
+    }
+}
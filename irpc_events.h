@@ -0,0 +1,48 @@
+/**
+ * libirpc - irpc_events.h
+ * Copyright (C) 2010 Manuel Gebele
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+#ifndef IRPC_EVENTS_H
+#define IRPC_EVENTS_H
+
+/*
+ * Dedicated thread handling the libusb events of all registered
+ * contexts.  Asynchronous transfers complete (and their callbacks run)
+ * on this thread only, so request workers never run a nested libusb
+ * event loop or wait for another thread's.
+ */
+
+struct libusb_context;
+struct irpc_events;
+
+struct irpc_events *
+irpc_events_new(void);
+
+void
+irpc_events_free(struct irpc_events *ev);
+
+int
+irpc_events_add(struct irpc_events *ev, struct libusb_context *ctx);
+
+/*
+ * Registrations are counted per context.  Once the last one has been
+ * removed the thread no longer touches ctx.
+ */
+void
+irpc_events_remove(struct irpc_events *ev, struct libusb_context *ctx);
+
+#endif /* IRPC_EVENTS_H */
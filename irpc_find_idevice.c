@@ -19,6 +19,7 @@
 #include <stdio.h>
 #include <strings.h>
 #include <stdlib.h>
+#include <unistd.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/time.h>
@@ -74,6 +75,26 @@ connect_or_die(const char *ip, int port)
     return sock;
 }
 
+static irpc_retval_t
+usb_session_open(struct irpc_info *info)
+{
+    irpc_func_t func = IRPC_USB_SESSION_OPEN;
+    irpc_context_t ctx = IRPC_CONTEXT_CLIENT;
+    struct irpc_session *session = &info->session;
+    
+    // Let the server pick the recovery devices while it initializes.
+    session->flags = IRPC_SESSION_ENUMERATE;
+    session->vendor_id = APPLE_VENDOR_ID;
+    session->products[0] = kRecoveryMode1;
+    session->products[1] = kRecoveryMode2;
+    session->products[2] = kRecoveryMode3;
+    session->products[3] = kRecoveryMode4;
+    session->products[4] = kDfuMode;
+    session->n_products = 5;
+    return irpc_call(func, ctx, info);
+}
+
+/* For servers without IRPC_USB_SESSION_OPEN. */
 static irpc_retval_t
 usb_init(struct irpc_info *info)
 {
@@ -91,7 +112,7 @@ usb_exit(struct irpc_info *info)
 }
 
 static void
-try_to_find_idevice(struct irpc_info *info)
+try_to_find_idevice_legacy(struct irpc_info *info)
 {
     irpc_func_t func = IRPC_USB_GET_DEVICE_LIST;
     irpc_context_t ctx = IRPC_CONTEXT_CLIENT;
@@ -126,6 +147,25 @@ try_to_find_idevice(struct irpc_info *info)
     printf("[*] No recovery device found\n");
 }
 
+static void
+try_to_find_idevice(struct irpc_info *info)
+{
+    if (!info->ci.version) {
+        try_to_find_idevice_legacy(info);
+        return;
+    }
+    
+    // The session open reply only lists matching devices.
+    if (info->devlist.n_devs > 0) {
+        int id = info->session.ids[0];
+        // Got apple device
+        printf("[*] Found device in recovery mode (%04x:%04x)\n",
+               id >> 16, id & 0xffff);
+        return;
+    }
+    printf("[*] No recovery device found\n");
+}
+
 int
 main(int argc, char **argv)
 {
@@ -143,13 +183,20 @@ main(int argc, char **argv)
     sscanf(argv[2], "%d", &port);
     info.ci.server_sock = connect_or_die(argv[1], port);
     
-    retval = usb_init(&info);
+    printf("[*] Looking on %s for recovery device...\n", argv[1]);
+    retval = usb_session_open(&info);
+    if (retval < 0 && info.session.version == 0) {
+        // The server predates session negotiation, start over on the
+        // connection which replaced the old one.
+        if (info.ci.server_sock == -1)
+            info.ci.server_sock = connect_or_die(argv[1], port);
+        retval = usb_init(&info);
+    }
     if (retval < 0) {
-        printf("irpc_find_idevice: usb_init failed\n");
+        printf("irpc_find_idevice: usb_session_open failed\n");
         return 1;
     }
     
-    printf("[*] Looking on %s for recovery device...\n", argv[1]);
     try_to_find_idevice(&info);
     
     usb_exit(&info);
@@ -0,0 +1,221 @@
+/**
+ * libirpc - irpc_lz.c
+ * Copyright (C) 2010 Manuel Gebele
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+#include "irpc_lz.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#define LZ_HASH_BITS        12
+#define LZ_MIN_MATCH        4
+#define LZ_MAX_BLOCK        65536   /* Positions fit the table */
+#define LZ_MF_LIMIT         12      /* No match starts this close to the end */
+#define LZ_LAST_LITERALS    5       /* The block ends with literals */
+
+static uint32_t
+lz_read32(const unsigned char *p)
+{
+    uint32_t v;
+    
+    memcpy(&v, p, sizeof v);
+    
+    return v;
+}
+
+static unsigned
+lz_hash(uint32_t v)
+{
+    return (v * 2654435761U) >> (32 - LZ_HASH_BITS);
+}
+
+/* Lengths past the 4 bits of the token follow in bytes of 255. */
+static unsigned char *
+lz_put_len(unsigned char *op, int len)
+{
+    while (len >= 255) {
+        *op++ = 255;
+        len -= 255;
+    }
+    *op++ = (unsigned char)len;
+    
+    return op;
+}
+
+/* Bytes a sequence with lit literals takes at most, besides the match. */
+static int
+lz_seq_size(int lit)
+{
+    return 1 + lit / 255 + 1 + lit;
+}
+
+int
+irpc_lz_compress(const char *src, int n, char *dst, int cap)
+{
+    const unsigned char *base = (const unsigned char *)src;
+    const unsigned char *ip = base, *anchor = base, *end = base + n;
+    const unsigned char *ref;
+    unsigned char *op = (unsigned char *)dst, *oend = op + cap;
+    unsigned char *token;
+    uint16_t table[1 << LZ_HASH_BITS];
+    unsigned h;
+    int lit, len;
+    
+    if (n < 0 || n > LZ_MAX_BLOCK || cap <= 0)
+        return 0;
+    
+    memset(table, 0, sizeof table);
+    
+    // Blocks shorter than the limits are literals only.
+    if (n > LZ_MF_LIMIT) {
+        ip++;
+        while (ip < end - LZ_MF_LIMIT) {
+            h = lz_hash(lz_read32(ip));
+            ref = base + table[h];
+            table[h] = (uint16_t)(ip - base);
+            if (ref >= ip || lz_read32(ref) != lz_read32(ip)) {
+                ip++;
+                continue;
+            }
+            
+            // Take in the literals the match also covers.
+            while (ip > anchor && ref > base && ip[-1] == ref[-1]) {
+                ip--;
+                ref--;
+            }
+            len = LZ_MIN_MATCH;
+            while (ip + len < end - LZ_LAST_LITERALS && ip[len] == ref[len])
+                len++;
+            
+            lit = (int)(ip - anchor);
+            if (lz_seq_size(lit) + 2 + (len - LZ_MIN_MATCH) / 255 + 1 > oend - op)
+                return 0;
+            
+            token = op++;
+            *token = (unsigned char)((lit < 15 ? lit : 15) << 4);
+            if (lit >= 15)
+                op = lz_put_len(op, lit - 15);
+            memcpy(op, anchor, lit);
+            op += lit;
+            
+            *op++ = (unsigned char)((ip - ref) & 0xff);
+            *op++ = (unsigned char)((ip - ref) >> 8);
+            
+            len -= LZ_MIN_MATCH;
+            *token |= (unsigned char)(len < 15 ? len : 15);
+            if (len >= 15)
+                op = lz_put_len(op, len - 15);
+            
+            ip += len + LZ_MIN_MATCH;
+            anchor = ip;
+        }
+    }
+    
+    lit = (int)(end - anchor);
+    if (lz_seq_size(lit) > oend - op)
+        return 0;
+    
+    token = op++;
+    *token = (unsigned char)((lit < 15 ? lit : 15) << 4);
+    if (lit >= 15)
+        op = lz_put_len(op, lit - 15);
+    memcpy(op, anchor, lit);
+    op += lit;
+    
+    return (int)(op - (unsigned char *)dst);
+}
+
+/*
+ * A length continued in bytes of 255, -1 if the block ends first or
+ * it exceeds max.
+ */
+static int
+lz_get_len(const unsigned char **ip,
+           const unsigned char *iend,
+           int len,
+           int max)
+{
+    unsigned b;
+    
+    do {
+        if (*ip >= iend || len > max)
+            return -1;
+        b = *(*ip)++;
+        len += b;
+    } while (b == 255);
+    
+    return len;
+}
+
+int
+irpc_lz_decompress(const char *src, int n, char *dst, int cap)
+{
+    const unsigned char *ip = (const unsigned char *)src, *iend = ip + n;
+    unsigned char *op = (unsigned char *)dst, *oend = op + cap;
+    const unsigned char *ref;
+    unsigned token;
+    int lit, len, off;
+    
+    if (n <= 0 || cap < 0)
+        return -1;
+    
+    for (;;) {
+        token = *ip++;
+        
+        lit = token >> 4;
+        if (lit == 15 && (lit = lz_get_len(&ip, iend, lit, oend - op)) < 0)
+            return -1;
+        if (lit > iend - ip || lit > oend - op)
+            return -1;
+        memcpy(op, ip, lit);
+        ip += lit;
+        op += lit;
+        
+        // The last sequence has no match.
+        if (ip == iend)
+            break;
+        
+        if (iend - ip < 2)
+            return -1;
+        off = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if (off == 0 || off > op - (unsigned char *)dst)
+            return -1;
+        
+        len = token & 15;
+        if (len == 15 && (len = lz_get_len(&ip, iend, len, oend - op)) < 0)
+            return -1;
+        len += LZ_MIN_MATCH;
+        if (len > oend - op)
+            return -1;
+        
+        // Matches may overlap the bytes they produce.
+        ref = op - off;
+        if (off >= len) {
+            memcpy(op, ref, len);
+            op += len;
+        } else {
+            while (len-- > 0)
+                *op++ = *ref++;
+        }
+        
+        if (ip >= iend)
+            return -1;
+    }
+    
+    return (int)(op - (unsigned char *)dst);
+}
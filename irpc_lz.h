@@ -0,0 +1,44 @@
+/**
+ * libirpc - irpc_lz.h
+ * Copyright (C) 2010 Manuel Gebele
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+#ifndef IRPC_LZ_H
+#define IRPC_LZ_H
+
+/*
+ * Block compression for transfer payloads, in the LZ4 block format:
+ * sequences of literals followed by a match within the last 64 KiB,
+ * found through a small hash table of 4 byte prefixes.  Fast rather
+ * than tight, blocks are at most 64 KiB.
+ */
+
+/*
+ * Compresses n bytes of src into dst.  Returns the compressed size, 0
+ * if it does not fit into cap bytes: a cap of n - 1 tells whether
+ * compressing saves anything at all.
+ */
+int
+irpc_lz_compress(const char *src, int n, char *dst, int cap);
+
+/*
+ * Decompresses the n bytes of src into dst.  Returns the decompressed
+ * size, -1 if src is not a valid block or does not fit into cap bytes.
+ */
+int
+irpc_lz_decompress(const char *src, int n, char *dst, int cap);
+
+#endif /* IRPC_LZ_H */
@@ -0,0 +1,150 @@
+/**
+ * libirpc - irpc_lz_test.c
+ * Copyright (C) 2010 Manuel Gebele
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "irpc_lz.h"
+
+#define BLOCK       65536
+#define BOUND       (BLOCK + BLOCK / 255 + 16)
+#define CANARY      0x5a
+#define GUARD       64
+
+static char src[BLOCK];
+static char packed[BOUND];
+static char out[BLOCK + GUARD];
+static int failures = 0;
+
+static void
+check(int ok, const char *what, int n)
+{
+    if (ok)
+        return;
+    
+    printf("irpc_lz_test: %s failed (%d bytes)\n", what, n);
+    failures++;
+}
+
+/* Decompresses into out, -2 if it wrote past cap. */
+static int
+unpack(const char *buf, int n, int cap)
+{
+    int len, i;
+    
+    memset(out, CANARY, sizeof out);
+    len = irpc_lz_decompress(buf, n, out, cap);
+    for (i = cap; i < cap + GUARD; i++)
+        if ((unsigned char)out[i] != CANARY)
+            return -2;
+    
+    return len;
+}
+
+static void
+round_trip(const char *what, int n, int compressible)
+{
+    int len;
+    
+    len = irpc_lz_compress(src, n, packed, BOUND);
+    check(len > 0, what, n);
+    if (len <= 0)
+        return;
+    
+    // Random data must not pass for compressible.
+    if (!compressible)
+        check(irpc_lz_compress(src, n, packed + BOUND / 2, n - 1) == 0,
+              what, n);
+    else
+        check(len < n, what, n);
+    
+    check(unpack(packed, len, n) == n && memcmp(out, src, n) == 0, what, n);
+    // One byte short of room fails instead of writing past it.
+    check(unpack(packed, len, n - 1) == -1, what, n);
+}
+
+static void
+truncated(int n)
+{
+    int len, cut, got;
+    
+    len = irpc_lz_compress(src, n, packed, BOUND);
+    for (cut = 0; cut < len; cut++) {
+        got = unpack(packed, cut, n);
+        check(got != -2 && (got != n || memcmp(out, src, n) != 0),
+              "truncated", cut);
+    }
+}
+
+static void
+bad_offset(void)
+{
+    // 4 literals, then a match 5 bytes back, with 4 there.
+    static const char far[] = { 0x40, 'a', 'b', 'c', 'd', 5, 0, 0x50,
+                                'e', 'f', 'g', 'h', 'i' };
+    // A match at offset 0.
+    static const char zero[] = { 0x40, 'a', 'b', 'c', 'd', 0, 0, 0x50,
+                                 'e', 'f', 'g', 'h', 'i' };
+    // The same with offset 4 is valid.
+    static const char good[] = { 0x40, 'a', 'b', 'c', 'd', 4, 0, 0x50,
+                                 'e', 'f', 'g', 'h', 'i' };
+    
+    check(unpack(far, sizeof far, BLOCK) == -1, "offset past start", 5);
+    check(unpack(zero, sizeof zero, BLOCK) == -1, "offset 0", 0);
+    check(unpack(good, sizeof good, BLOCK) == 13 &&
+          memcmp(out, "abcdabcdefghi", 13) == 0, "offset 4", 4);
+}
+
+int main(int argc, char **argv)
+{
+    static const int sizes[] = { 64, 1000, 4096, BLOCK };
+    int i, k;
+    
+    (void)argc;
+    (void)argv;
+    srand(1);
+    
+    for (k = 0; k < (int)(sizeof sizes / sizeof sizes[0]); k++) {
+        for (i = 0; i < sizes[k]; i++)
+            src[i] = (char)rand();
+        round_trip("random", sizes[k], 0);
+        
+        // Text with repeats, and runs overlapping their own output.
+        for (i = 0; i < sizes[k]; i++)
+            src[i] = "irpc bulk payload "[i % 18] + (i / 4096);
+        round_trip("compressible", sizes[k], 1);
+        
+        memset(src, 0, sizes[k]);
+        round_trip("zeros", sizes[k], 1);
+    }
+    
+    // Compressible start, random end.
+    for (i = 0; i < 4096; i++)
+        src[i] = i < 2048 ? "abcdefgh"[i % 8] : (char)rand();
+    round_trip("mixed", 4096, 1);
+    truncated(4096);
+    
+    bad_offset();
+    check(unpack(packed, 0, BLOCK) == -1, "empty", 0);
+    
+    if (failures == 0)
+        printf("irpc_lz_test: ok\n");
+    
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,111 @@
+/**
+ * libirpc - irpc_pool.c
+ * Copyright (C) 2010 Manuel Gebele
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+#include "irpc_pool.h"
+
+#include <stdlib.h>
+
+#define IRPC_POOL_MIN 256                   /* Bytes of class 0 */
+
+/* Precedes every buffer, keeps the data aligned like malloc() does. */
+struct irpc_pool_buf {
+    union {
+        struct {
+            struct irpc_pool_buf *next;     /* While kept */
+            int cls;                        /* IRPC_POOL_CLASSES: not kept */
+        } h;
+        long double align;
+    } u;
+};
+
+static int
+irpc_pool_class(size_t sz)
+{
+    int cls = 0;
+    
+    while (cls < IRPC_POOL_CLASSES && sz > (size_t)IRPC_POOL_MIN << 2 * cls)
+        cls++;
+    
+    return cls;
+}
+
+static int
+irpc_pool_keep(int cls)
+{
+    int n = IRPC_POOL_KEEP / (IRPC_POOL_MIN << 2 * cls);
+    
+    // Two of the largest, a bulk request in flight and the next one.
+    return n < 2 ? 2 : n;
+}
+
+void *
+irpc_pool_get(struct irpc_pool *pool, size_t sz)
+{
+    struct irpc_pool_buf *b;
+    int cls = irpc_pool_class(sz);
+    
+    if (cls < IRPC_POOL_CLASSES && (b = pool->free[cls])) {
+        pool->free[cls] = b->u.h.next;
+        pool->nfree[cls]--;
+        return b + 1;
+    }
+    
+    if (cls < IRPC_POOL_CLASSES)
+        sz = (size_t)IRPC_POOL_MIN << 2 * cls;
+    if (!(b = malloc(sizeof(struct irpc_pool_buf) + sz)))
+        return NULL;
+    b->u.h.cls = cls;
+    
+    return b + 1;
+}
+
+void
+irpc_pool_put(struct irpc_pool *pool, void *buf)
+{
+    struct irpc_pool_buf *b;
+    int cls;
+    
+    if (!buf)
+        return;
+    
+    b = (struct irpc_pool_buf *)buf - 1;
+    cls = b->u.h.cls;
+    if (cls == IRPC_POOL_CLASSES || pool->nfree[cls] >= irpc_pool_keep(cls)) {
+        free(b);
+        return;
+    }
+    
+    b->u.h.next = pool->free[cls];
+    pool->free[cls] = b;
+    pool->nfree[cls]++;
+}
+
+void
+irpc_pool_drain(struct irpc_pool *pool)
+{
+    struct irpc_pool_buf *b;
+    int cls;
+    
+    for (cls = 0; cls < IRPC_POOL_CLASSES; cls++) {
+        while ((b = pool->free[cls])) {
+            pool->free[cls] = b->u.h.next;
+            free(b);
+        }
+        pool->nfree[cls] = 0;
+    }
+}
@@ -0,0 +1,56 @@
+/**
+ * libirpc - irpc_pool.h
+ * Copyright (C) 2010 Manuel Gebele
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+#ifndef IRPC_POOL_H
+#define IRPC_POOL_H
+
+#include <stddef.h>
+
+/*
+ * Buffers of a connection in size classes of 256 bytes to 64 KiB, for
+ * the requests it sends and the jobs running them.  Buffers put back
+ * are kept for the next request of their class, up to about
+ * IRPC_POOL_KEEP bytes a class, so a connection in a steady state
+ * allocates nothing.  Larger buffers are not kept.  A pool is not
+ * locked, only the thread owning the connection uses it.
+ */
+
+#define IRPC_POOL_CLASSES 5                 /* 256 << 2 * class bytes */
+#define IRPC_POOL_KEEP    65536             /* Bytes kept per class */
+
+struct irpc_pool_buf;
+
+/* Zeroed pools are empty. */
+struct irpc_pool {
+    struct irpc_pool_buf *free[IRPC_POOL_CLASSES];
+    int nfree[IRPC_POOL_CLASSES];
+};
+
+/* Returns NULL if out of memory. */
+void *
+irpc_pool_get(struct irpc_pool *pool, size_t sz);
+
+/* Puts back a buffer of irpc_pool_get(), NULL is ignored. */
+void
+irpc_pool_put(struct irpc_pool *pool, void *buf);
+
+/* Frees the buffers kept, those handed out may still be put back. */
+void
+irpc_pool_drain(struct irpc_pool *pool);
+
+#endif /* IRPC_POOL_H */
@@ -0,0 +1,136 @@
+/**
+ * libirpc - irpc_pool_test.c
+ * Copyright (C) 2010 Manuel Gebele
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+#include <stdio.h>
+#include <string.h>
+
+#include "irpc_pool.h"
+
+#define MIN         256
+#define MANY        300
+
+static struct irpc_pool pool;
+static int failures = 0;
+
+static void
+check(int ok, const char *what, int n)
+{
+    if (ok)
+        return;
+    
+    printf("irpc_pool_test: %s failed (%d)\n", what, n);
+    failures++;
+}
+
+static int
+kept(void)
+{
+    int cls, n = 0;
+    
+    for (cls = 0; cls < IRPC_POOL_CLASSES; cls++)
+        n += pool.nfree[cls];
+    
+    return n;
+}
+
+static void
+reuse(void)
+{
+    void *a, *b;
+    size_t sz;
+    int cls;
+    
+    for (cls = 0; cls < IRPC_POOL_CLASSES; cls++) {
+        sz = (size_t)MIN << 2 * cls;
+        // The whole class size is usable, whatever was asked for.
+        a = irpc_pool_get(&pool, sz / 2 + 1);
+        memset(a, cls, sz);
+        irpc_pool_put(&pool, a);
+        check(pool.nfree[cls] == 1, "kept", cls);
+        b = irpc_pool_get(&pool, sz);
+        check(a == b, "reused", cls);
+        check(pool.nfree[cls] == 0, "taken", cls);
+        
+        // One byte more is the next class.
+        irpc_pool_put(&pool, b);
+        a = irpc_pool_get(&pool, sz + 1);
+        check(a != b && pool.nfree[cls] == 1, "next class", cls);
+        irpc_pool_put(&pool, a);
+    }
+    
+    irpc_pool_drain(&pool);
+    check(kept() == 0, "drained", kept());
+}
+
+static void
+large(void)
+{
+    size_t sz = (size_t)MIN << 2 * IRPC_POOL_CLASSES;
+    void *a = irpc_pool_get(&pool, sz);
+    
+    memset(a, 1, sz);
+    irpc_pool_put(&pool, a);
+    check(kept() == 0, "large not kept", kept());
+    
+    irpc_pool_put(&pool, NULL);
+    check(kept() == 0, "NULL ignored", kept());
+}
+
+/* Each class keeps IRPC_POOL_KEEP bytes, but at least two buffers. */
+static void
+limit(void)
+{
+    static void *bufs[MANY];
+    size_t sz;
+    int cls, i, keep;
+    
+    for (cls = 0; cls < IRPC_POOL_CLASSES; cls++) {
+        sz = (size_t)MIN << 2 * cls;
+        keep = IRPC_POOL_KEEP / (int)sz;
+        if (keep < 2)
+            keep = 2;
+        for (i = 0; i < MANY; i++)
+            bufs[i] = irpc_pool_get(&pool, sz);
+        for (i = 0; i < MANY; i++)
+            irpc_pool_put(&pool, bufs[i]);
+        check(pool.nfree[cls] == keep, "keep limit", cls);
+    }
+    
+    // Buffers handed out before a drain may still come back.
+    bufs[0] = irpc_pool_get(&pool, MIN);
+    irpc_pool_drain(&pool);
+    check(kept() == 0, "drained", kept());
+    irpc_pool_put(&pool, bufs[0]);
+    check(pool.nfree[0] == 1, "put after drain", 0);
+    irpc_pool_drain(&pool);
+}
+
+int main(int argc, char **argv)
+{
+    (void)argc;
+    (void)argv;
+    
+    reuse();
+    large();
+    limit();
+    
+    if (failures == 0)
+        printf("irpc_pool_test: ok\n");
+    
+    return failures == 0 ? 0 : 1;
+}
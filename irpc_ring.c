@@ -0,0 +1,97 @@
+/**
+ * libirpc - irpc_ring.c
+ * Copyright (C) 2010 Manuel Gebele
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+#include "irpc_ring.h"
+
+#include <stdlib.h>
+
+int
+irpc_ring_init(struct irpc_ring *ring, unsigned size)
+{
+    unsigned i;
+    
+    if (size == 0 || (size & (size - 1)))
+        return -1;
+    
+    if (!(ring->slots = malloc(size * sizeof(struct irpc_ring_slot))))
+        return -1;
+    
+    for (i = 0; i < size; i++)
+        ring->slots[i].seq = i;
+    
+    ring->mask = size - 1;
+    ring->head = 0;
+    ring->tail = 0;
+    
+    return 0;
+}
+
+void
+irpc_ring_exit(struct irpc_ring *ring)
+{
+    free(ring->slots);
+    ring->slots = NULL;
+}
+
+int
+irpc_ring_push(struct irpc_ring *ring, void *data)
+{
+    struct irpc_ring_slot *slot;
+    unsigned pos = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+    unsigned seq;
+    int dif;
+    
+    while (1) {
+        slot = &ring->slots[pos & ring->mask];
+        seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        dif = (int)(seq - pos);
+        
+        if (dif == 0) {
+            if (__atomic_compare_exchange_n(&ring->tail, &pos, pos + 1, 1,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+            // pos has been reloaded.
+        } else if (dif < 0) {
+            // The consumer has not freed this slot yet.
+            return -1;
+        } else {
+            pos = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+        }
+    }
+    
+    slot->data = data;
+    __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+    
+    return 0;
+}
+
+void *
+irpc_ring_pop(struct irpc_ring *ring)
+{
+    struct irpc_ring_slot *slot = &ring->slots[ring->head & ring->mask];
+    void *data;
+    
+    if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != ring->head + 1)
+        return NULL;
+    
+    data = slot->data;
+    __atomic_store_n(&slot->seq, ring->head + ring->mask + 1, __ATOMIC_RELEASE);
+    ring->head++;
+    
+    return data;
+}
@@ -0,0 +1,58 @@
+/**
+ * libirpc - irpc_ring.h
+ * Copyright (C) 2010 Manuel Gebele
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+#ifndef IRPC_RING_H
+#define IRPC_RING_H
+
+/*
+ * Bounded lock-free ring of pointers for many producers and a single
+ * consumer.  Every slot carries a sequence number telling whether it
+ * may be written (seq == pos) or read (seq == pos + 1) at position pos,
+ * so producers only contend on the tail and the consumer never blocks
+ * them.
+ */
+
+struct irpc_ring_slot {
+    unsigned seq;
+    void *data;
+};
+
+struct irpc_ring {
+    struct irpc_ring_slot *slots;
+    unsigned mask;
+    unsigned head;                          /* Consumer only */
+    char pad[64];                           /* Keep tail off head's line */
+    unsigned tail;                          /* Claimed by producers */
+};
+
+/* size must be a power of two. */
+int
+irpc_ring_init(struct irpc_ring *ring, unsigned size);
+
+void
+irpc_ring_exit(struct irpc_ring *ring);
+
+/* Returns -1 if the ring is full. */
+int
+irpc_ring_push(struct irpc_ring *ring, void *data);
+
+/* Consumer side, NULL if the ring is empty. */
+void *
+irpc_ring_pop(struct irpc_ring *ring);
+
+#endif /* IRPC_RING_H */
@@ -0,0 +1,141 @@
+/**
+ * libirpc - irpc_ring_test.c
+ * Copyright (C) 2010 Manuel Gebele
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include "irpc_ring.h"
+
+#define SIZE        8
+#define PRODUCERS   4
+#define ITEMS       200000
+
+static struct irpc_ring ring;
+static int failures = 0;
+
+static void
+check(int ok, const char *what, int n)
+{
+    if (ok)
+        return;
+    
+    printf("irpc_ring_test: %s failed (%d)\n", what, n);
+    failures++;
+}
+
+/* Items are never NULL, that means empty. */
+static void *
+item(int producer, int seq)
+{
+    return (void *)(uintptr_t)(((uintptr_t)producer << 24 | seq) + 1);
+}
+
+static void
+single(void)
+{
+    int i, round;
+    
+    check(irpc_ring_init(&ring, 6) == -1, "size not a power of two", 6);
+    check(irpc_ring_init(&ring, 0) == -1, "size 0", 0);
+    check(irpc_ring_init(&ring, SIZE) == 0, "init", SIZE);
+    check(irpc_ring_pop(&ring) == NULL, "pop empty", 0);
+    
+    for (i = 0; i < SIZE; i++)
+        check(irpc_ring_push(&ring, item(0, i)) == 0, "push", i);
+    check(irpc_ring_push(&ring, item(0, SIZE)) == -1, "push full", SIZE);
+    for (i = 0; i < SIZE; i++)
+        check(irpc_ring_pop(&ring) == item(0, i), "pop in order", i);
+    check(irpc_ring_pop(&ring) == NULL, "pop drained", SIZE);
+    
+    // Partial fills, so head and tail wrap at every offset.
+    for (round = 0; round < 1000; round++) {
+        for (i = 0; i < round % SIZE + 1; i++)
+            check(irpc_ring_push(&ring, item(1, i)) == 0, "push wrapped", round);
+        for (i = 0; i < round % SIZE + 1; i++)
+            check(irpc_ring_pop(&ring) == item(1, i), "pop wrapped", round);
+        check(irpc_ring_pop(&ring) == NULL, "pop wrapped empty", round);
+    }
+    
+    irpc_ring_exit(&ring);
+}
+
+static void *
+producer(void *arg)
+{
+    int id = (int)(intptr_t)arg;
+    int seq;
+    
+    for (seq = 0; seq < ITEMS; seq++) {
+        while (irpc_ring_push(&ring, item(id, seq)) == -1)
+            sched_yield();
+    }
+    
+    return NULL;
+}
+
+/* Every item arrives once, each producer's in the order pushed. */
+static void
+multi(void)
+{
+    pthread_t threads[PRODUCERS];
+    int next[PRODUCERS] = { 0 };
+    int i, got = 0, id, seq;
+    uintptr_t v;
+    void *data;
+    
+    check(irpc_ring_init(&ring, SIZE) == 0, "init", SIZE);
+    for (i = 0; i < PRODUCERS; i++)
+        pthread_create(&threads[i], NULL, producer, (void *)(intptr_t)i);
+    
+    while (got < PRODUCERS * ITEMS) {
+        if (!(data = irpc_ring_pop(&ring))) {
+            sched_yield();
+            continue;
+        }
+        v = (uintptr_t)data - 1;
+        id = (int)(v >> 24);
+        seq = (int)(v & 0xffffff);
+        // Keep draining on a mismatch, the producers wait for room.
+        check(id < PRODUCERS && seq == next[id], "producer order", seq);
+        if (id < PRODUCERS)
+            next[id] = seq + 1;
+        got++;
+    }
+    
+    for (i = 0; i < PRODUCERS; i++)
+        pthread_join(threads[i], NULL);
+    check(got == PRODUCERS * ITEMS, "items received", got);
+    check(irpc_ring_pop(&ring) == NULL, "pop after all", got);
+    irpc_ring_exit(&ring);
+}
+
+int main(int argc, char **argv)
+{
+    (void)argc;
+    (void)argv;
+    
+    single();
+    multi();
+    
+    if (failures == 0)
+        printf("irpc_ring_test: ok\n");
+    
+    return failures == 0 ? 0 : 1;
+}
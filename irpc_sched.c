@@ -0,0 +1,506 @@
+/**
+ * libirpc - irpc_sched.c
+ * Copyright (C) 2010 Manuel Gebele
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+#include "irpc_sched.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#define IRPC_SCHED_HASH     64      /* Buckets of the device queue table */
+#define IRPC_SCHED_BATCH    8       /* Jobs run before a queue yields */
+#define IRPC_SCHED_URGENT   4       /* Urgent jobs queued while head waits */
+#define IRPC_SCHED_DEQUE    16      /* Initial deque capacity */
+
+enum irpc_queue_state {
+    IRPC_QUEUE_IDLE,                /* No jobs, in no deque */
+    IRPC_QUEUE_SCHEDULED,           /* In exactly one worker deque */
+    IRPC_QUEUE_RUNNING,             /* Owned by exactly one worker */
+    IRPC_QUEUE_HELD,                /* Waits for irpc_sched_release() */
+};
+
+struct irpc_queue {
+    pthread_mutex_t lock;
+    struct irpc_job *head, *tail;
+    struct irpc_job *urgent, *urgent_tail;  /* Run ahead of head */
+    int urgent_run;                 /* Urgent jobs since head last ran */
+    enum irpc_queue_state state;
+    int home;                       /* Worker which ran it last */
+    int key;
+    int dead;                       /* Free once idle */
+    int held;                       /* See irpc_sched_hold() */
+    struct irpc_queue *hnext;
+};
+
+struct irpc_worker {
+    struct irpc_sched *sched;
+    pthread_t thread;
+    int id;
+    unsigned seed;                  /* Victim selection */
+    pthread_mutex_t lock;           /* Protects the deque */
+    struct irpc_queue **dq;
+    int cap, top, count;
+};
+
+struct irpc_sched {
+    int nworkers;
+    struct irpc_worker *workers;
+    pthread_mutex_t idle_lock;
+    pthread_cond_t idle_cond;
+    int idle;
+    int stop;
+    int runnable;                   /* Queues sitting in deques */
+    int next_home;
+    pthread_mutex_t table_lock;
+    struct irpc_queue *table[IRPC_SCHED_HASH];
+};
+
+// -----------------------------------------------------------------------------
+#pragma mark Deques
+// -----------------------------------------------------------------------------
+
+static void
+deque_grow(struct irpc_worker *w)
+{
+    struct irpc_queue **dq;
+    int cap = w->cap ? w->cap * 2 : IRPC_SCHED_DEQUE;
+    int i;
+
+    if (!(dq = malloc(cap * sizeof(struct irpc_queue *))))
+        abort();
+    for (i = 0; i < w->count; i++)
+        dq[i] = w->dq[(w->top + i) % w->cap];
+
+    free(w->dq);
+    w->dq = dq;
+    w->cap = cap;
+    w->top = 0;
+}
+
+/* New work goes to the bottom, the owner takes it from there. */
+static void
+deque_push_bottom(struct irpc_worker *w, struct irpc_queue *q)
+{
+    pthread_mutex_lock(&w->lock);
+    if (w->count == w->cap)
+        deque_grow(w);
+    w->dq[(w->top + w->count) % w->cap] = q;
+    w->count++;
+    pthread_mutex_unlock(&w->lock);
+}
+
+/* A queue which used up its batch goes to the back of the line. */
+static void
+deque_push_top(struct irpc_worker *w, struct irpc_queue *q)
+{
+    pthread_mutex_lock(&w->lock);
+    if (w->count == w->cap)
+        deque_grow(w);
+    w->top = (w->top + w->cap - 1) % w->cap;
+    w->dq[w->top] = q;
+    w->count++;
+    pthread_mutex_unlock(&w->lock);
+}
+
+static struct irpc_queue *
+deque_pop_bottom(struct irpc_worker *w)
+{
+    struct irpc_queue *q = NULL;
+
+    pthread_mutex_lock(&w->lock);
+    if (w->count > 0) {
+        w->count--;
+        q = w->dq[(w->top + w->count) % w->cap];
+    }
+    pthread_mutex_unlock(&w->lock);
+
+    return q;
+}
+
+/* Thieves take the oldest entry. */
+static struct irpc_queue *
+deque_steal_top(struct irpc_worker *w)
+{
+    struct irpc_queue *q = NULL;
+
+    pthread_mutex_lock(&w->lock);
+    if (w->count > 0) {
+        q = w->dq[w->top];
+        w->top = (w->top + 1) % w->cap;
+        w->count--;
+    }
+    pthread_mutex_unlock(&w->lock);
+
+    return q;
+}
+
+// -----------------------------------------------------------------------------
+#pragma mark Workers
+// -----------------------------------------------------------------------------
+
+static void
+sched_make_runnable(struct irpc_sched *sched)
+{
+    __sync_fetch_and_add(&sched->runnable, 1);
+
+    pthread_mutex_lock(&sched->idle_lock);
+    if (sched->idle > 0)
+        pthread_cond_signal(&sched->idle_cond);
+    pthread_mutex_unlock(&sched->idle_lock);
+}
+
+static struct irpc_queue *
+sched_steal(struct irpc_sched *sched, struct irpc_worker *self)
+{
+    struct irpc_queue *q;
+    int i, start = rand_r(&self->seed) % sched->nworkers;
+
+    for (i = 0; i < sched->nworkers; i++) {
+        struct irpc_worker *victim = &sched->workers[(start + i) % sched->nworkers];
+        if (victim == self)
+            continue;
+        if ((q = deque_steal_top(victim)))
+            return q;
+    }
+
+    return NULL;
+}
+
+/* Next job of a locked queue, urgent ones first. */
+static struct irpc_job *
+queue_pop(struct irpc_queue *q)
+{
+    struct irpc_job *job;
+
+    if ((job = q->urgent)) {
+        if (!(q->urgent = job->next))
+            q->urgent_tail = NULL;
+    } else if ((job = q->head)) {
+        if (!(q->head = job->next))
+            q->tail = NULL;
+        q->urgent_run = 0;
+    }
+
+    return job;
+}
+
+static void
+sched_run_queue(struct irpc_worker *w, struct irpc_queue *q)
+{
+    struct irpc_job *job;
+    int n;
+
+    pthread_mutex_lock(&q->lock);
+    q->state = IRPC_QUEUE_RUNNING;
+    q->home = w->id;
+    pthread_mutex_unlock(&q->lock);
+
+    for (n = 0; ; n++) {
+        pthread_mutex_lock(&q->lock);
+        if (q->held) {
+            q->state = IRPC_QUEUE_HELD;
+            pthread_mutex_unlock(&q->lock);
+            return;
+        }
+        if (n == IRPC_SCHED_BATCH || !(job = queue_pop(q)))
+            break;
+        pthread_mutex_unlock(&q->lock);
+
+        job->run(job);
+    }
+
+    // Still locked.
+    if (q->head || q->urgent) {
+        q->state = IRPC_QUEUE_SCHEDULED;
+        pthread_mutex_unlock(&q->lock);
+        deque_push_top(w, q);
+        sched_make_runnable(w->sched);
+        return;
+    }
+    q->state = IRPC_QUEUE_IDLE;
+    if (q->dead) {
+        pthread_mutex_unlock(&q->lock);
+        pthread_mutex_destroy(&q->lock);
+        free(q);
+        return;
+    }
+    pthread_mutex_unlock(&q->lock);
+}
+
+static void *
+sched_worker(void *arg)
+{
+    struct irpc_worker *w = arg;
+    struct irpc_sched *sched = w->sched;
+    struct irpc_queue *q;
+
+    while (1) {
+        if (!(q = deque_pop_bottom(w)))
+            q = sched_steal(sched, w);
+
+        if (q) {
+            __sync_fetch_and_sub(&sched->runnable, 1);
+            sched_run_queue(w, q);
+            continue;
+        }
+
+        pthread_mutex_lock(&sched->idle_lock);
+        while (!sched->stop &&
+               __atomic_load_n(&sched->runnable, __ATOMIC_RELAXED) == 0) {
+            sched->idle++;
+            pthread_cond_wait(&sched->idle_cond, &sched->idle_lock);
+            sched->idle--;
+        }
+        if (sched->stop) {
+            pthread_mutex_unlock(&sched->idle_lock);
+            break;
+        }
+        pthread_mutex_unlock(&sched->idle_lock);
+    }
+
+    return NULL;
+}
+
+// -----------------------------------------------------------------------------
+#pragma mark Public API
+// -----------------------------------------------------------------------------
+
+struct irpc_sched *
+irpc_sched_new(int nworkers)
+{
+    struct irpc_sched *sched;
+    int i;
+
+    if (nworkers < 1)
+        nworkers = 1;
+
+    if (!(sched = calloc(1, sizeof(struct irpc_sched))))
+        return NULL;
+    if (!(sched->workers = calloc(nworkers, sizeof(struct irpc_worker)))) {
+        free(sched);
+        return NULL;
+    }
+
+    sched->nworkers = nworkers;
+    pthread_mutex_init(&sched->idle_lock, NULL);
+    pthread_cond_init(&sched->idle_cond, NULL);
+    pthread_mutex_init(&sched->table_lock, NULL);
+
+    for (i = 0; i < nworkers; i++) {
+        struct irpc_worker *w = &sched->workers[i];
+        w->sched = sched;
+        w->id = i;
+        w->seed = i + 1;
+        pthread_mutex_init(&w->lock, NULL);
+        deque_grow(w);
+    }
+
+    for (i = 0; i < nworkers; i++) {
+        if (pthread_create(&sched->workers[i].thread, NULL,
+                           sched_worker, &sched->workers[i]) != 0)
+            abort();
+    }
+
+    return sched;
+}
+
+void
+irpc_sched_free(struct irpc_sched *sched)
+{
+    struct irpc_queue *q, *next;
+    int i;
+
+    pthread_mutex_lock(&sched->idle_lock);
+    sched->stop = 1;
+    pthread_cond_broadcast(&sched->idle_cond);
+    pthread_mutex_unlock(&sched->idle_lock);
+
+    for (i = 0; i < sched->nworkers; i++) {
+        pthread_join(sched->workers[i].thread, NULL);
+        pthread_mutex_destroy(&sched->workers[i].lock);
+        free(sched->workers[i].dq);
+    }
+
+    for (i = 0; i < IRPC_SCHED_HASH; i++) {
+        for (q = sched->table[i]; q; q = next) {
+            next = q->hnext;
+            pthread_mutex_destroy(&q->lock);
+            free(q);
+        }
+    }
+
+    pthread_mutex_destroy(&sched->table_lock);
+    pthread_mutex_destroy(&sched->idle_lock);
+    pthread_cond_destroy(&sched->idle_cond);
+    free(sched->workers);
+    free(sched);
+}
+
+struct irpc_queue *
+irpc_sched_queue_new(struct irpc_sched *sched)
+{
+    struct irpc_queue *q = calloc(1, sizeof(struct irpc_queue));
+
+    if (!q)
+        return NULL;
+
+    pthread_mutex_init(&q->lock, NULL);
+    q->state = IRPC_QUEUE_IDLE;
+    q->key = -1;
+
+    // Spread new queues over the workers, stealing balances the rest.
+    pthread_mutex_lock(&sched->table_lock);
+    q->home = sched->next_home++ % sched->nworkers;
+    pthread_mutex_unlock(&sched->table_lock);
+
+    return q;
+}
+
+struct irpc_queue *
+irpc_sched_queue(struct irpc_sched *sched, int key)
+{
+    struct irpc_queue *q;
+    unsigned bucket = (unsigned)key % IRPC_SCHED_HASH;
+
+    pthread_mutex_lock(&sched->table_lock);
+    for (q = sched->table[bucket]; q; q = q->hnext) {
+        if (q->key == key)
+            break;
+    }
+    pthread_mutex_unlock(&sched->table_lock);
+
+    if (q)
+        return q;
+
+    if (!(q = irpc_sched_queue_new(sched)))
+        return NULL;
+    q->key = key;
+
+    pthread_mutex_lock(&sched->table_lock);
+    q->hnext = sched->table[bucket];
+    sched->table[bucket] = q;
+    pthread_mutex_unlock(&sched->table_lock);
+
+    return q;
+}
+
+void
+irpc_sched_queue_free(struct irpc_queue *q)
+{
+    pthread_mutex_lock(&q->lock);
+    if (q->state != IRPC_QUEUE_IDLE) {
+        // The worker running it frees it when done.
+        q->dead = 1;
+        pthread_mutex_unlock(&q->lock);
+        return;
+    }
+    pthread_mutex_unlock(&q->lock);
+
+    pthread_mutex_destroy(&q->lock);
+    free(q);
+}
+
+void
+irpc_sched_hold(struct irpc_queue *q)
+{
+    pthread_mutex_lock(&q->lock);
+    q->held = 1;
+    pthread_mutex_unlock(&q->lock);
+}
+
+void
+irpc_sched_release(struct irpc_sched *sched, struct irpc_queue *q)
+{
+    pthread_mutex_lock(&q->lock);
+    q->held = 0;
+
+    // Released before the job returned, its worker carries on.
+    if (q->state != IRPC_QUEUE_HELD) {
+        pthread_mutex_unlock(&q->lock);
+        return;
+    }
+
+    if (q->head || q->urgent) {
+        q->state = IRPC_QUEUE_SCHEDULED;
+        pthread_mutex_unlock(&q->lock);
+        deque_push_bottom(&sched->workers[q->home], q);
+        sched_make_runnable(sched);
+        return;
+    }
+
+    q->state = IRPC_QUEUE_IDLE;
+    if (q->dead) {
+        pthread_mutex_unlock(&q->lock);
+        pthread_mutex_destroy(&q->lock);
+        free(q);
+        return;
+    }
+    pthread_mutex_unlock(&q->lock);
+}
+
+static void
+sched_submit(struct irpc_sched *sched,
+             struct irpc_queue *q,
+             struct irpc_job *job,
+             int urgent)
+{
+    struct irpc_job **head, **tail;
+    int schedule = 0;
+
+    job->next = NULL;
+
+    pthread_mutex_lock(&q->lock);
+    // A steady supply of urgent jobs must not starve the one at head,
+    // past the limit they queue up like the others.
+    if (urgent && q->head && q->urgent_run++ >= IRPC_SCHED_URGENT)
+        urgent = 0;
+    head = urgent ? &q->urgent : &q->head;
+    tail = urgent ? &q->urgent_tail : &q->tail;
+    if (*tail)
+        (*tail)->next = job;
+    else
+        *head = job;
+    *tail = job;
+
+    if (q->state == IRPC_QUEUE_IDLE) {
+        q->state = IRPC_QUEUE_SCHEDULED;
+        schedule = 1;
+    }
+    pthread_mutex_unlock(&q->lock);
+
+    if (schedule) {
+        deque_push_bottom(&sched->workers[q->home], q);
+        sched_make_runnable(sched);
+    }
+}
+
+void
+irpc_sched_submit(struct irpc_sched *sched,
+                  struct irpc_queue *q,
+                  struct irpc_job *job)
+{
+    sched_submit(sched, q, job, 0);
+}
+
+void
+irpc_sched_submit_urgent(struct irpc_sched *sched,
+                         struct irpc_queue *q,
+                         struct irpc_job *job)
+{
+    sched_submit(sched, q, job, 1);
+}
@@ -0,0 +1,83 @@
+/**
+ * libirpc - irpc_sched.h
+ * Copyright (C) 2010 Manuel Gebele
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+#ifndef IRPC_SCHED_H
+#define IRPC_SCHED_H
+
+/*
+ * Executor for server requests.  Jobs are submitted to queues; the
+ * jobs of one queue run one after another, different queues run in
+ * parallel on a pool of worker threads.  Every worker owns a deque of
+ * runnable queues and idle workers steal from the others.
+ */
+
+struct irpc_job {
+    struct irpc_job *next;
+    void (*run)(struct irpc_job *job);
+};
+
+struct irpc_queue;
+struct irpc_sched;
+
+struct irpc_sched *
+irpc_sched_new(int nworkers);
+
+void
+irpc_sched_free(struct irpc_sched *sched);
+
+/* Shared queue for key (e.g. a device), created on first use. */
+struct irpc_queue *
+irpc_sched_queue(struct irpc_sched *sched, int key);
+
+/* Private queue, e.g. for a connection without an opened device. */
+struct irpc_queue *
+irpc_sched_queue_new(struct irpc_sched *sched);
+
+/* Free a private queue, it must not have jobs left. */
+void
+irpc_sched_queue_free(struct irpc_queue *q);
+
+void
+irpc_sched_submit(struct irpc_sched *sched,
+                  struct irpc_queue *q,
+                  struct irpc_job *job);
+
+/*
+ * Like irpc_sched_submit(), but the job runs ahead of the jobs waiting
+ * in the queue (after the urgent ones submitted before it).  Once a few
+ * jobs went ahead of the first waiting one, urgent jobs queue up
+ * normally until it ran.  Jobs which must run in order are only
+ * submitted urgently while none of them waits.
+ */
+void
+irpc_sched_submit_urgent(struct irpc_sched *sched,
+                         struct irpc_queue *q,
+                         struct irpc_job *job);
+
+/*
+ * Called by a running job whose work continues elsewhere (e.g. an
+ * asynchronous transfer): the queue runs no further jobs until
+ * irpc_sched_release(), which may be called from any thread.
+ */
+void
+irpc_sched_hold(struct irpc_queue *q);
+
+void
+irpc_sched_release(struct irpc_sched *sched, struct irpc_queue *q);
+
+#endif /* IRPC_SCHED_H */
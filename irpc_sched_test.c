@@ -0,0 +1,191 @@
+/**
+ * libirpc - irpc_sched_test.c
+ * Copyright (C) 2010 Manuel Gebele
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "irpc_sched.h"
+
+#define WORKERS     4
+#define QUEUES      16
+#define JOBS        2000
+#define WAIT_MS     10000
+
+struct test_job {
+    struct irpc_job job;                    /* First, run() casts back */
+    int queue;
+    int seq;
+};
+
+static struct irpc_sched *sched;
+static struct test_job jobs[QUEUES][JOBS];
+static int running[QUEUES];                 /* Jobs of the queue running */
+static int next[QUEUES];                    /* Expected seq */
+static int done = 0;
+static int order[16];                       /* seq of the jobs run, in order */
+static int norder = 0;
+static int held = 0;
+static int failures = 0;
+
+static void
+check(int ok, const char *what, int n)
+{
+    if (ok)
+        return;
+    
+    printf("irpc_sched_test: %s failed (%d)\n", what, n);
+    failures++;
+}
+
+/* Waits until *count reaches n, 0 on timeout. */
+static int
+wait_for(int *count, int n)
+{
+    int ms;
+    
+    for (ms = 0; ms < WAIT_MS; ms++) {
+        if (__atomic_load_n(count, __ATOMIC_ACQUIRE) >= n)
+            return 1;
+        usleep(1000);
+    }
+    
+    return 0;
+}
+
+static void
+run_serial(struct irpc_job *job)
+{
+    struct test_job *t = (struct test_job *)job;
+    volatile int spin;
+    
+    check(__sync_fetch_and_add(&running[t->queue], 1) == 0,
+          "one job per queue at a time", t->queue);
+    check(next[t->queue] == t->seq, "queue order", t->seq);
+    next[t->queue] = t->seq + 1;
+    for (spin = 0; spin < 100; spin++)
+        ;
+    __sync_fetch_and_sub(&running[t->queue], 1);
+    __sync_fetch_and_add(&done, 1);
+}
+
+/* Shared device queues and private ones, all fed at once. */
+static void
+serial(void)
+{
+    struct irpc_queue *queues[QUEUES];
+    int q, i;
+    
+    for (q = 0; q < QUEUES; q++) {
+        queues[q] = q % 2 ? irpc_sched_queue(sched, q) :
+                            irpc_sched_queue_new(sched);
+        check(queues[q] != NULL, "queue", q);
+    }
+    check(irpc_sched_queue(sched, 1) == queues[1], "same key, same queue", 1);
+    
+    for (i = 0; i < JOBS; i++) {
+        for (q = 0; q < QUEUES; q++) {
+            jobs[q][i].job.run = run_serial;
+            jobs[q][i].queue = q;
+            jobs[q][i].seq = i;
+            irpc_sched_submit(sched, queues[q], &jobs[q][i].job);
+        }
+    }
+    
+    check(wait_for(&done, QUEUES * JOBS), "all jobs run", QUEUES * JOBS);
+    for (q = 0; q < QUEUES; q++) {
+        check(next[q] == JOBS, "jobs run per queue", next[q]);
+        if (q % 2 == 0)
+            irpc_sched_queue_free(queues[q]);
+    }
+}
+
+static void
+run_record(struct irpc_job *job)
+{
+    struct test_job *t = (struct test_job *)job;
+    
+    order[norder] = t->seq;
+    __atomic_store_n(&norder, norder + 1, __ATOMIC_RELEASE);
+}
+
+static struct irpc_queue *hold_q;
+
+static void
+run_hold(struct irpc_job *job)
+{
+    run_record(job);
+    irpc_sched_hold(hold_q);
+    __atomic_store_n(&held, 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * The queue is held while jobs 1 and 2 wait, then urgent ones come in:
+ * four go ahead of job 1, the rest queue up behind job 2.
+ */
+static void
+urgent(void)
+{
+    static const int expect[] = { 0, 10, 11, 12, 13, 1, 2, 14, 15 };
+    struct test_job t[16];
+    int i, n;
+    
+    hold_q = irpc_sched_queue_new(sched);
+    for (i = 0; i < 16; i++) {
+        t[i].job.run = i ? run_record : run_hold;
+        t[i].seq = i;
+    }
+    
+    irpc_sched_submit(sched, hold_q, &t[0].job);
+    check(wait_for(&held, 1), "hold", 0);
+    irpc_sched_submit(sched, hold_q, &t[1].job);
+    irpc_sched_submit(sched, hold_q, &t[2].job);
+    for (i = 10; i < 16; i++)
+        irpc_sched_submit_urgent(sched, hold_q, &t[i].job);
+    
+    usleep(10000);
+    n = __atomic_load_n(&norder, __ATOMIC_ACQUIRE);
+    check(n == 1, "held", n);
+    irpc_sched_release(sched, hold_q);
+    
+    n = sizeof expect / sizeof expect[0];
+    check(wait_for(&norder, n), "released", n);
+    for (i = 0; i < n; i++)
+        check(order[i] == expect[i], "urgent order", i);
+    irpc_sched_queue_free(hold_q);
+}
+
+int main(int argc, char **argv)
+{
+    (void)argc;
+    (void)argv;
+    
+    if (!(sched = irpc_sched_new(WORKERS))) {
+        printf("irpc_sched_test: irpc_sched_new failed\n");
+        return 1;
+    }
+    
+    serial();
+    urgent();
+    irpc_sched_free(sched);
+    
+    if (failures == 0)
+        printf("irpc_sched_test: ok\n");
+    
+    return failures == 0 ? 0 : 1;
+}
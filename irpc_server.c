@@ -16,14 +16,193 @@
   * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  **/
 
+#define _GNU_SOURCE                         /* struct ucred */
+
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <limits.h>
+#include <string.h>
 #include <strings.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+#include <poll.h>
+#include <sys/random.h>
+#include <libusb-1.0/libusb.h>
 
 #include "libirpc.h"
+#include "irpc_events.h"
+#include "irpc_pool.h"
+#include "irpc_ring.h"
+#include "irpc_sched.h"
+#include "irpc_uring.h"
+#include "tpl.h"
+
+#define IRPC_MAX_EVENTS     64
+#define IRPC_IDLE_TIMEOUT   300     /* Seconds until an idle client is dropped */
+#define IRPC_SWEEP_INTERVAL 10      /* Seconds between idle client sweeps */
+#define IRPC_WORKERS        8       /* Default number of worker threads */
+#define IRPC_DONE_RING      2       /* Completed jobs not yet picked up */
+#define IRPC_MAX_IOV        16      /* Replies written by one sendmsg() */
+#define IRPC_RESUME_GRACE   30      /* Seconds a lost session waits for a resume */
+#define IRPC_RESUME_BACKLOG 128     /* Sent replies kept for a resume */
+#define IRPC_HANDOFF_TIMEOUT 10     /* Seconds to finish requests before a handoff */
+#define IRPC_CLIENT_BUDGET  1024    /* KiB of requests and replies per client */
+#define IRPC_GLOBAL_BUDGET  65536   /* KiB of requests and replies of all clients */
+#define IRPC_READ_BUFSZ     8192    /* epoll: bytes read from a client at once */
+
+/* A reply waiting to be sent (or kept for a resume). */
+struct irpc_reply {
+    struct irpc_reply *next;
+    struct irpc_client *cl;
+    char *buf;
+    size_t len;
+    int num;                                /* Replies are numbered from 1 */
+    int passes_fd;                          /* buf is a struct irpc_fd_msg */
+};
+
+/* Buffer of a reply passing an fd: one byte carrying SCM_RIGHTS data. */
+struct irpc_fd_msg {
+    char byte;
+    int fd;                                 /* Own copy, closed with it */
+    struct msghdr msg;
+    struct iovec iov;
+    union {
+        char buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } ctl;
+};
+
+/* A request packet read while its client was over budget. */
+struct irpc_packet {
+    struct irpc_packet *next;
+    size_t len;
+    char img[];
+};
+
+/* Calls of a data stream which run in turn, see client_stripe(). */
+struct irpc_stripe {
+    struct irpc_stripe *next;
+    struct irpc_client *cl;                 /* Data stream it came by */
+    int seq;                                /* Its turn within the set */
+    int ncalls;                             /* Announced */
+    int n;                                  /* Gathered */
+    irpc_func_t func[IRPC_MAX_STRIPE_CALLS];
+    void *img[IRPC_MAX_STRIPE_CALLS];
+    size_t sz[IRPC_MAX_STRIPE_CALLS];
+};
+
+/* Per client state of the event loop. */
+struct irpc_client {
+    struct irpc_info info;
+    tpl_gather_t *gs;                       /* Partial packet */
+    irpc_func_t func;                       /* Function being gathered */
+    int have_func;                          /* Waiting for its arguments */
+    int seq;                                /* Number of the last request */
+    int closing;                            /* Close after this read */
+    time_t last_active;
+    struct irpc_client *next, *prev;
+    // Executor state, see client_queue().
+    int jobs;                               /* Submitted, not completed */
+    struct irpc_queue *q;                   /* Queue of the last job */
+    struct irpc_queue *own;                 /* Private queue */
+    struct server_job *cur_job;             /* Job run by a worker */
+    struct irpc_pool pool;                  /* Jobs and their requests */
+    int cleaned;                            /* libusb state torn down */
+    struct libusb_context *ev_ctx;          /* Registered with usb_events */
+    struct irpc_reply *outq, *outq_tail;    /* Replies not yet sent */
+    size_t outq_off;                        /* epoll: sent part of outq */
+    // Resumable sessions, see client_resume().
+    int replies;                            /* Number of the last reply */
+    struct irpc_reply *sent, *sent_tail;    /* Last replies sent */
+    int nsent;
+    time_t detached;                        /* Lost its connection */
+    // Memory budget, see client_throttle().
+    size_t mem;                             /* Requests and replies held */
+    int throttled;                          /* Not read from */
+    struct irpc_client *throttle_next;
+    struct irpc_packet *held, *held_tail;   /* Read meanwhile */
+    // Data streams, see client_attach().
+    struct irpc_client *owner;              /* Session of a data stream */
+    struct irpc_client *streams;            /* Data streams of the session */
+    struct irpc_client *stream_next;
+    int stripe_set;                         /* Set of the streams */
+    int stripe_next;                        /* Stripe to run next */
+    struct irpc_stripe *stripes;            /* Waiting for their turn */
+    struct irpc_stripe *stripe;             /* Being gathered */
+    // io_uring backend only.
+    int inflight;                           /* Outstanding ring requests */
+    int sends_inflight;                     /* Sends of the current chain */
+    struct irpc_client *dirty_next;         /* Has replies to submit */
+    int dirty;
+    int shut;                               /* Receive side shut down */
+};
+
+/*
+ * A request handed to the executor.  Workers run the requests, or
+ * submit them as transfers completed by the usb_events thread, and
+ * pass them back to the event loop through done_ring, announced by
+ * done_efd.  The event loop sends the replies collected by the job.
+ */
+struct server_job {
+    struct irpc_job job;
+    struct irpc_client *cl;
+    struct irpc_client *owner;              /* Runs on its session */
+    struct irpc_queue *q;
+    irpc_func_t func;
+    int cleanup;                            /* Tear down libusb state only */
+    int seq;                                /* Number of the request */
+    long long received;                     /* irpc_clock_ms() at arrival */
+    void *img;                              /* Copy of the argument packet */
+    size_t sz;
+    struct irpc_reply *replies, *replies_tail;
+    int pending;                            /* Worker plus transfer */
+    int held;                               /* Holds q while in transfer */
+    struct server_job *done_next;           /* In done_over */
+};
+
+static struct irpc_client *clients = NULL;
+static struct irpc_sched *sched = NULL;
+static struct irpc_events *usb_events = NULL;
+static int epoll_fd = -1;
+static int done_efd = -1;
+static int done_armed = 0;                  /* done_efd has been written */
+static struct irpc_ring done_ring;
+static pthread_mutex_t done_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct server_job *done_over = NULL; /* Spilled from a full done_ring */
+static struct server_job *done_over_tail = NULL;
+static struct server_job *done_taken = NULL; /* done_over, being picked up */
+static int done_spill = 0;                  /* Jobs go to done_over */
+static size_t client_budget = IRPC_CLIENT_BUDGET * 1024;
+static size_t global_budget = IRPC_GLOBAL_BUDGET * 1024;
+static size_t mem_used = 0;                 /* Charged to all clients */
+static int nclients = 0;
+static struct irpc_client *throttled = NULL;
+
+/*
+ * Set by the event loop in use: drop the connection of a client but
+ * keep its session, move the connection of a client to another one,
+ * send queued replies, stop and restart reading from a client.
+ */
+static void (*backend_detach)(struct irpc_client *cl);
+static void (*backend_adopt)(struct irpc_client *cl, struct irpc_client *from);
+static void (*backend_kick)(struct irpc_client *cl);
+static void (*backend_throttle)(struct irpc_client *cl);
+static void (*backend_unthrottle)(struct irpc_client *cl);
 
 static int
 init_connection_or_die(int port)
@@ -53,59 +232,2975 @@ init_connection_or_die(int port)
     return sockfd;
 }
 
+/*
+ * Local clients connect through a unix socket and may request the
+ * usbfs fd of the opened device (see IRPC_USB_DELEGATE).  Access is
+ * controlled by the permissions of the socket file.
+ */
+static int
+init_unix_connection_or_die(const char *path, mode_t mode)
+{
+    int sockfd, rc;
+    mode_t mask;
+    struct sockaddr_un self;
+    
+    if (strlen(path) >= sizeof(self.sun_path))
+        exit(1);
+    
+    if ((sockfd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+        exit(1);
+    
+    bzero(&self, sizeof(self));
+    
+    self.sun_family = AF_UNIX;
+    strcpy(self.sun_path, path);
+    
+    unlink(path);
+    
+    // Created private, mode only ever widens the access.
+    mask = umask(077);
+    rc = bind(sockfd, (struct sockaddr *)&self, sizeof(self));
+    umask(mask);
+    if (rc != 0)
+        exit(1);
+    
+    if (chmod(path, mode) != 0)
+        exit(1);
+    
+    if (listen(sockfd, 20) != 0)
+        exit(1);
+    
+    return sockfd;
+}
+
 static void
-server_loop(int sock)
+set_nonblocking(int sock)
 {
-    struct irpc_info info;
-    struct timeval timeout;
-    fd_set sockset;
+    int flags = fcntl(sock, F_GETFL, 0);
+    
+    if (flags != -1)
+        fcntl(sock, F_SETFL, flags | O_NONBLOCK);
+}
+
+/*
+ * Replies are coalesced by the server itself, Nagle would only hold
+ * back the replies of pipelined (batched) requests for a delayed ACK.
+ * Fails harmlessly on unix sockets.
+ */
+static void
+set_nodelay(int sock)
+{
+    int on = 1;
+    
+    (void)setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &on, sizeof on);
+}
+
+static void
+streams_reset(struct irpc_client *s);
+
+/* Compression ratio and cost of the bulk data of a session. */
+static void
+client_report(struct irpc_client *cl)
+{
+    struct irpc_zstats *zs = &cl->info.ci.zstats;
+    
+    if (zs->frames == 0)
+        return;
+    
+    fprintf(stderr,
+            "irpc_server: session framed %lld bytes as %lld (%.2fx), "
+            "%d of %d frames stored, %lld us\n",
+            zs->raw,
+            zs->wire,
+            zs->wire > 0 ? (double)zs->raw / zs->wire : 1.0,
+            zs->stored,
+            zs->frames,
+            zs->us);
+}
+
+/* Frees a reply, closing the fd it passes. */
+static void
+reply_free(struct irpc_reply *r)
+{
+    if (r->passes_fd)
+        close(((struct irpc_fd_msg *)r->buf)->fd);
+    free(r->buf);
+    free(r);
+}
+
+static void
+client_close(struct irpc_client *cl)
+{
+    struct irpc_client **p;
+    struct irpc_packet *pk;
+    struct irpc_reply *r;
+    
+    client_report(cl);
+    
+    // Without one of its streams the set is incomplete.
+    if (cl->owner)
+        streams_reset(cl->owner);
+    streams_reset(cl);
+    
+    if (cl->throttled) {
+        for (p = &throttled; *p != cl; p = &(*p)->throttle_next)
+            ;
+        *p = cl->throttle_next;
+    }
+    mem_used -= cl->mem;
+    nclients--;
+    
+    if (cl->info.ci.client_sock != -1)
+        close(cl->info.ci.client_sock);
+    
+    if (cl->gs) {
+        free(cl->gs->img);
+        free(cl->gs);
+    }
+    
+    if (cl->own)
+        irpc_sched_queue_free(cl->own);
     
-    bzero(&info, sizeof(struct irpc_info));
+    while ((pk = cl->held)) {
+        cl->held = pk->next;
+        free(pk);
+    }
+    
+    while ((r = cl->outq)) {
+        cl->outq = r->next;
+        reply_free(r);
+    }
+    
+    while ((r = cl->sent)) {
+        cl->sent = r->next;
+        reply_free(r);
+    }
+    
+    irpc_pool_drain(&cl->pool);
+    
+    if (cl->prev)
+        cl->prev->next = cl->next;
+    else
+        clients = cl->next;
+    if (cl->next)
+        cl->next->prev = cl->prev;
+    
+    free(cl);
+}
+
+// -----------------------------------------------------------------------------
+#pragma mark Memory Budgets
+// -----------------------------------------------------------------------------
+
+/*
+ * The requests waiting for a worker, along with IRPC_REPLY_RESERVE for
+ * their replies, and the replies waiting to be sent are charged to
+ * their client.  Partial packets are bounded by IRPC_MAX_PACKET, the
+ * replies kept for a resume by IRPC_RESUME_BACKLOG.  A client over its
+ * budget, or over its share of the global budget while that is
+ * exceeded, is not read from until it is down to half of it: its
+ * requests back up in the socket instead of the server.  Clients
+ * knowing IRPC_USB_CREDIT are granted the budget and stay within it.
+ */
+
+static void
+client_charge(struct irpc_client *cl, long n)
+{
+    cl->mem += n;
+    mem_used += n;
+}
+
+static size_t
+client_share(void)
+{
+    return global_budget / (nclients > 0 ? nclients : 1);
+}
+
+static int
+client_over(struct irpc_client *cl)
+{
+    return cl->mem > client_budget ||
+           (mem_used > global_budget && cl->mem > client_share());
+}
+
+static int
+client_under(struct irpc_client *cl)
+{
+    return cl->mem <= client_budget / 2 &&
+           (mem_used <= global_budget || cl->mem <= client_share() / 2);
+}
+
+/*
+ * Packets read after the client went over budget, e.g. the rest of a
+ * read, wait for it to get under budget again.
+ */
+static int
+client_hold(struct irpc_client *cl, void *img, size_t sz)
+{
+    struct irpc_packet *pk;
+    
+    if (!(pk = malloc(sizeof(struct irpc_packet) + sz)))
+        return -1;
     
-    FD_ZERO(&sockset);
-    FD_SET(sock, &sockset);
+    memcpy(pk->img, img, sz);
+    pk->len = sz;
+    pk->next = NULL;
+    if (cl->held_tail)
+        cl->held_tail->next = pk;
+    else
+        cl->held = pk;
+    cl->held_tail = pk;
+    client_charge(cl, sizeof(struct irpc_packet) + sz);
     
-    timeout.tv_sec = 10;
-    timeout.tv_usec = 0;
+    return 0;
+}
+
+static void
+client_drop_held(struct irpc_client *cl)
+{
+    struct irpc_packet *pk;
     
-    if (select(sock + 1, &sockset, NULL, NULL, &timeout) == -1) {
-        fprintf(stderr, "Error! select()\n");
+    while ((pk = cl->held)) {
+        cl->held = pk->next;
+        client_charge(cl, -(long)(sizeof(struct irpc_packet) + pk->len));
+        free(pk);
+    }
+    cl->held_tail = NULL;
+}
+
+/* Stops reading from the client if it is over budget. */
+static void
+client_throttle(struct irpc_client *cl)
+{
+    if (cl->throttled || cl->closing || !client_over(cl))
         return;
+    
+    cl->throttled = 1;
+    cl->throttle_next = throttled;
+    throttled = cl;
+    if (backend_throttle)
+        backend_throttle(cl);
+}
+
+/* Reads again from the clients which got under budget. */
+static void
+clients_unthrottle(void)
+{
+    struct irpc_client **p = &throttled, *cl;
+    
+    while ((cl = *p)) {
+        if (!client_under(cl) && !cl->closing) {
+            p = &cl->throttle_next;
+            continue;
+        }
+        // Off the list first, reading may free it or throttle it again.
+        *p = cl->throttle_next;
+        cl->throttled = 0;
+        if (!cl->closing)
+            backend_unthrottle(cl);
     }
+}
+
+// -----------------------------------------------------------------------------
+#pragma mark Session Resume
+// -----------------------------------------------------------------------------
+
+/*
+ * A client whose session holds a token (see IRPC_USB_RESUME) outlives
+ * its connection by IRPC_RESUME_GRACE seconds.  Its jobs go on, their
+ * replies are queued.  A resume from a new connection moves the
+ * connection to the client and sends what the client missed: the last
+ * IRPC_RESUME_BACKLOG replies sent are kept for that.
+ */
+
+static unsigned long long
+client_token(void)
+{
+    unsigned long long token = 0;
     
-    info.ci.client_sock = accept(sock, NULL, NULL);
-    if (info.ci.client_sock == -1) {
-        fprintf(stderr, "Error! Failed to accept an incoming connection.\n");
+    // The token is all it takes to resume the session.
+    if (getrandom(&token, sizeof token, 0) != sizeof token)
+        return 0;
+    
+    return token;
+}
+
+/* A reply has been written, keep it in case it does not arrive. */
+static void
+client_sent(struct irpc_client *cl, struct irpc_reply *r)
+{
+    struct irpc_reply *old;
+    
+    client_charge(cl, -(long)r->len);
+    
+    if (!cl->info.ci.token || r->num == 0) {
+        reply_free(r);
         return;
     }
     
-    while (1) {
-        irpc_func_t func = irpc_read_func(info.ci.client_sock);
-        irpc_call(func, IRPC_CONTEXT_SERVER, &info);
+    r->next = NULL;
+    if (cl->sent_tail)
+        cl->sent_tail->next = r;
+    else
+        cl->sent = r;
+    cl->sent_tail = r;
+    
+    if (++cl->nsent > IRPC_RESUME_BACKLOG) {
+        old = cl->sent;
+        cl->sent = old->next;
+        cl->nsent--;
+        reply_free(old);
+    }
+}
+
+/* The connection is gone, the session waits for a resume. */
+static void
+client_orphan(struct irpc_client *cl)
+{
+    // A partial request is sent again, so are the ones held back.
+    if (cl->gs) {
+        free(cl->gs->img);
+        free(cl->gs);
+        cl->gs = NULL;
+    }
+    client_drop_held(cl);
+    cl->have_func = 0;
+    cl->outq_off = 0;
+    cl->detached = time(NULL);
+}
 
-        if (func == IRPC_USB_EXIT)
-            goto done;
-	}
+/*
+ * Queue the replies after number replies again, ahead of the ones not
+ * sent yet.  Fails if some of them are no longer kept.
+ */
+static int
+client_replay(struct irpc_client *cl, int replies)
+{
+    struct irpc_reply *r;
+    int oldest;
+    
+    // The reply to an earlier resume which never went out.
+    while ((r = cl->outq) && r->num == 0) {
+        cl->outq = r->next;
+        client_charge(cl, -(long)r->len);
+        reply_free(r);
+    }
+    if (!cl->outq)
+        cl->outq_tail = NULL;
     
-done:
-    close(info.ci.client_sock);
+    if (cl->sent)
+        oldest = cl->sent->num;
+    else if (cl->outq)
+        oldest = cl->outq->num;
+    else
+        oldest = cl->replies + 1;
+    
+    if (replies > cl->replies || replies + 1 < oldest)
+        return -1;
+    
+    while ((r = cl->sent) && r->num <= replies) {
+        cl->sent = r->next;
+        reply_free(r);
+    }
+    
+    for (r = cl->sent; r; r = r->next)
+        client_charge(cl, r->len);
+    if (cl->sent) {
+        cl->sent_tail->next = cl->outq;
+        if (!cl->outq)
+            cl->outq_tail = cl->sent_tail;
+        cl->outq = cl->sent;
+    }
+    cl->sent = cl->sent_tail = NULL;
+    cl->nsent = 0;
+    
+    return 0;
 }
 
-int main(int argc, char *argv[])
-{   
-    int sock, port;
+/* The reply to a resume goes first. */
+static int
+client_resume_reply(struct irpc_client *cl, int status, int seq)
+{
+    struct irpc_reply *r;
+    void *buf;
+    size_t sz;
     
-    if (argc < 2) {
-        printf("irpc_server: port\n");
-        return 1;
+    if (irpc_resume_reply(status, seq, cl->info.ci.token, &buf, &sz) != 0)
+        return -1;
+    
+    if (!(r = calloc(1, sizeof(struct irpc_reply)))) {
+        free(buf);
+        return -1;
     }
     
-    sscanf(argv[1], "%d", &port);
-    sock = init_connection_or_die(port);
+    r->cl = cl;
+    r->buf = buf;
+    r->len = sz;
+    r->next = cl->outq;
+    cl->outq = r;
+    if (!cl->outq_tail)
+        cl->outq_tail = r;
+    client_charge(cl, sz);
+    
+    return 0;
+}
+
+/* IRPC_USB_RESUME from the new connection cl, it gives up cl. */
+static void
+client_resume(struct irpc_client *cl, unsigned long long token, int replies)
+{
+    struct irpc_client *s;
+    int status = 0;
+    
+    for (s = clients; s; s = s->next)
+        if (s != cl && !s->closing && s->info.ci.token == token)
+            break;
     
-    server_loop(sock);
+    if (!s) {
+        status = LIBUSB_ERROR_NOT_FOUND;
+    } else {
+        // The old connection may not have noticed it is gone.
+        if (!s->detached)
+            backend_detach(s);
+        if (s->info.ci.client_sock != -1)
+            status = LIBUSB_ERROR_BUSY;
+        else if (client_replay(s, replies) != 0)
+            status = LIBUSB_ERROR_OVERFLOW;
+        else if (client_resume_reply(s, 0, s->seq) != 0)
+            status = LIBUSB_ERROR_NO_MEM;
+    }
     
-    close(sock);
+    if (status != 0) {
+        if (client_resume_reply(cl, status, 0) == 0)
+            backend_kick(cl);
+        return;
+    }
+    
+    s->detached = 0;
+    s->last_active = time(NULL);
+    backend_adopt(s, cl);
+    cl->closing = 1;
+}
+
+// -----------------------------------------------------------------------------
+#pragma mark Executor
+// -----------------------------------------------------------------------------
+
+static void
+job_done(struct server_job *sj)
+{
+    uint64_t one = 1;
+    
+    // A full ring spills to done_over, later jobs follow them there.
+    if (__atomic_load_n(&done_spill, __ATOMIC_ACQUIRE) ||
+        irpc_ring_push(&done_ring, sj) != 0) {
+        sj->done_next = NULL;
+        pthread_mutex_lock(&done_lock);
+        if (done_over_tail)
+            done_over_tail->done_next = sj;
+        else
+            done_over = sj;
+        done_over_tail = sj;
+        __atomic_store_n(&done_spill, 1, __ATOMIC_RELEASE);
+        pthread_mutex_unlock(&done_lock);
+    }
+    
+    // Wake the event loop once per batch, not once per job.
+    if (__atomic_exchange_n(&done_armed, 1, __ATOMIC_SEQ_CST) == 0)
+        (void)write(done_efd, &one, sizeof one);
+}
+
+/* Drops a reference, the last one completes the job. */
+static void
+job_put(struct server_job *sj)
+{
+    struct irpc_queue *q = sj->q;
+    int held;
+    
+    if (__sync_sub_and_fetch(&sj->pending, 1) > 0)
+        return;
+    
+    // Complete before releasing, so the next job completes after it.
+    held = sj->held;
+    job_done(sj);
+    if (held)
+        irpc_sched_release(sched, q);
+}
+
+/* irpc_connection_info.async_begin hook, runs on a worker thread. */
+static void
+job_async_begin(struct irpc_connection_info *ci)
+{
+    struct server_job *sj = ((struct irpc_client *)ci)->cur_job;
+    
+    __sync_fetch_and_add(&sj->pending, 1);
+    sj->held = 1;
+    irpc_sched_hold(sj->q);
+}
+
+/*
+ * irpc_connection_info.async_end hook, runs on the usb_events thread.
+ * Its queue is held, so cur_job is still the job of the transfer.
+ */
+static void
+job_async_end(struct irpc_connection_info *ci)
+{
+    job_put(((struct irpc_client *)ci)->cur_job);
+}
+
+/*
+ * irpc_connection_info.send_reply hook, runs on a worker or the
+ * usb_events thread.  The reply is kept with the job and sent once
+ * the event loop picks up the completed job.
+ */
+static int
+job_send_reply(struct irpc_connection_info *ci, void *buf, size_t sz)
+{
+    struct irpc_client *cl = (struct irpc_client *)ci;
+    struct server_job *sj = cl->cur_job;
+    struct irpc_reply *r;
+    
+    if (!(r = calloc(1, sizeof(struct irpc_reply)))) {
+        free(buf);
+        return -1;
+    }
+    
+    // Replies go back by the data stream the request came by.
+    r->cl = sj->cl;
+    r->buf = buf;
+    r->len = sz;
+    
+    if (sj->replies_tail)
+        sj->replies_tail->next = r;
+    else
+        sj->replies = r;
+    sj->replies_tail = r;
+    
+    return 0;
+}
+
+/*
+ * irpc_connection_info.send_reply_fd hook.  The fd follows the reply
+ * with a byte of its own, an skb carrying SCM_RIGHTS data must not be
+ * merged with replies the client reads by read().
+ */
+static int
+job_send_reply_fd(struct irpc_connection_info *ci, void *buf, size_t sz,
+                  int fd)
+{
+    struct irpc_client *cl = (struct irpc_client *)ci;
+    struct server_job *sj = cl->cur_job;
+    struct irpc_fd_msg *fm = NULL;
+    struct irpc_reply *r = NULL;
+    struct cmsghdr *cmsg;
+    
+    // The handle may be closed before the event loop sends the fd,
+    // its number must not pass for a file opened in the meantime.
+    if ((fd = fcntl(fd, F_DUPFD_CLOEXEC, 0)) == -1 ||
+        !(fm = calloc(1, sizeof(struct irpc_fd_msg))) ||
+        !(r = calloc(1, sizeof(struct irpc_reply))) ||
+        job_send_reply(ci, buf, sz) != 0) {
+        if (fd != -1)
+            close(fd);
+        if (!fm || !r)
+            free(buf);
+        free(r);
+        free(fm);
+        return -1;
+    }
+    
+    fm->fd = fd;
+    fm->iov.iov_base = &fm->byte;
+    fm->iov.iov_len = 1;
+    fm->msg.msg_iov = &fm->iov;
+    fm->msg.msg_iovlen = 1;
+    fm->msg.msg_control = fm->ctl.buf;
+    fm->msg.msg_controllen = sizeof(fm->ctl.buf);
+    cmsg = CMSG_FIRSTHDR(&fm->msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+    
+    r->cl = sj->cl;
+    r->buf = (char *)fm;
+    r->len = 1;
+    r->passes_fd = 1;
+    
+    sj->replies_tail->next = r;
+    sj->replies_tail = r;
+    
+    return 0;
+}
+
+/* Runs on a worker thread. */
+static void
+job_run(struct irpc_job *job)
+{
+    struct server_job *sj = (struct server_job *)job;
+    struct irpc_client *cl = sj->owner ? sj->owner : sj->cl;
+    struct irpc_connection_info *ci = &cl->info.ci;
+    
+    // The context must be gone from the event thread before libusb_exit().
+    if ((sj->cleanup || sj->func == IRPC_USB_EXIT) && cl->ev_ctx) {
+        irpc_events_remove(usb_events, cl->ev_ctx);
+        cl->ev_ctx = NULL;
+    }
+    
+    if (sj->cleanup) {
+        irpc_server_cleanup(ci);
+    } else {
+        cl->cur_job = sj;
+        ci->req_img = sj->img;
+        ci->req_sz = sj->sz;
+        ci->seq = sj->seq;
+        ci->received = sj->received;
+        
+        irpc_call(sj->func, IRPC_CONTEXT_SERVER, &cl->info);
+        
+        ci->req_img = NULL;
+        ci->req_sz = 0;
+    }
+    
+    if (ci->ctx != cl->ev_ctx) {
+        if (cl->ev_ctx)
+            irpc_events_remove(usb_events, cl->ev_ctx);
+        cl->ev_ctx = NULL;
+        if (ci->ctx && irpc_events_add(usb_events, ci->ctx) == 0)
+            cl->ev_ctx = ci->ctx;
+    }
+    
+    job_put(sj);
+}
+
+/* Call before draining done_ring, later jobs wake the loop again. */
+static void
+jobs_rearm(void)
+{
+    __atomic_store_n(&done_armed, 0, __ATOMIC_SEQ_CST);
+}
+
+/*
+ * The next completed job, NULL if there is none.  Jobs in the ring
+ * completed ahead of the spilled ones of their queue, so they go
+ * first.  Jobs stop spilling once both are empty.
+ */
+static struct server_job *
+jobs_next(void)
+{
+    struct server_job *sj;
+    
+    if ((sj = irpc_ring_pop(&done_ring)))
+        return sj;
+    
+    if (!done_taken && __atomic_load_n(&done_spill, __ATOMIC_ACQUIRE)) {
+        pthread_mutex_lock(&done_lock);
+        done_taken = done_over;
+        done_over = done_over_tail = NULL;
+        if (!done_taken)
+            __atomic_store_n(&done_spill, 0, __ATOMIC_RELEASE);
+        pthread_mutex_unlock(&done_lock);
+    }
+    
+    if ((sj = done_taken))
+        done_taken = sj->done_next;
+    
+    return sj;
+}
+
+/* Moves the replies of a completed job to the client's queue. */
+static int
+client_take_replies(struct irpc_client *cl, struct server_job *sj)
+{
+    struct irpc_reply *r;
+    int n = 0;
+    
+    while ((r = sj->replies)) {
+        sj->replies = r->next;
+        r->next = NULL;
+        // A passed fd is no reply of its own and not kept for a resume.
+        r->num = r->passes_fd ? 0 : ++cl->replies;
+        if (cl->shut) {
+            reply_free(r);
+            continue;
+        }
+        if (cl->outq_tail)
+            cl->outq_tail->next = r;
+        else
+            cl->outq = r;
+        cl->outq_tail = r;
+        client_charge(cl, r->len);
+        n++;
+    }
+    
+    // Replies the client does not read hold back its requests.
+    client_throttle(cl);
+    
+    return n;
+}
+
+/*
+ * Requests of a connection run in order: while it has jobs in flight
+ * new ones go to the same queue.  Otherwise connections which opened
+ * a device share the queue of that device, so requests to one device
+ * are serialized while different devices are served in parallel.
+ */
+static struct irpc_queue *
+client_queue(struct irpc_client *cl)
+{
+    int key;
+    
+    if (cl->jobs > 0)
+        return cl->q;
+    
+    if ((key = irpc_device_key(&cl->info.ci)) != -1)
+        return irpc_sched_queue(sched, key);
+    
+    if (!cl->own)
+        cl->own = irpc_sched_queue_new(sched);
+    
+    return cl->own;
+}
+
+/*
+ * Control transfers and status calls do not wait for the bulk
+ * transfers other clients queued for the device.  Calls changing the
+ * device's state (reset, configuration, alternate setting, close) keep
+ * their place.  Only calls of a client without jobs pending are moved
+ * ahead, so its own calls still run in order.
+ */
+static int
+client_urgent(struct irpc_client *cl, irpc_func_t func, int cleanup)
+{
+    if (cl->jobs > 0 || cleanup)
+        return 0;
+    
+    switch (func)
+    {
+        case IRPC_USB_CONTROL_TRANSFER:
+        case IRPC_USB_GET_DEVICE_DESCRIPTOR:
+        case IRPC_USB_GET_CONFIGURATION:
+        case IRPC_USB_GET_STRING_DESCRIPTOR_ASCII:
+        case IRPC_USB_PING:
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+/*
+ * The calls of a data stream run on its session, in the session's
+ * queue.  They are numbered 0, IRPC_USB_CANCEL cannot reach them.
+ * img is a buffer of cl->pool the job takes over, it goes back to the
+ * pool once the job completed, or right away if it is not queued.
+ */
+static int
+client_submit_image(struct irpc_client *cl,
+                    irpc_func_t func,
+                    int cleanup,
+                    void *img,
+                    size_t sz)
+{
+    struct irpc_client *run = cl->owner ? cl->owner : cl;
+    struct server_job *sj;
+    struct irpc_queue *q;
+    int urgent = run == cl && client_urgent(cl, func, cleanup);
+    
+    if ((run != cl && run->closing) ||
+        !(q = client_queue(run)) ||
+        !(sj = irpc_pool_get(&cl->pool, sizeof(struct server_job)))) {
+        irpc_pool_put(&cl->pool, img);
+        return -1;
+    }
+    
+    memset(sj, 0, sizeof(struct server_job));
+    sj->img = img;
+    sj->sz = sz;
+    sj->job.run = job_run;
+    sj->cl = cl;
+    sj->owner = cl->owner;
+    sj->q = q;
+    sj->func = func;
+    sj->cleanup = cleanup;
+    sj->seq = run == cl ? cl->seq : 0;
+    sj->received = irpc_clock_ms();
+    sj->pending = 1;
+    
+    run->q = q;
+    run->jobs++;
+    if (run != cl)
+        cl->jobs++;
+    client_charge(cl, sz + IRPC_REPLY_RESERVE);
+    client_throttle(cl);
+    
+    if (urgent)
+        irpc_sched_submit_urgent(sched, q, &sj->job);
+    else
+        irpc_sched_submit(sched, q, &sj->job);
+    
+    return 0;
+}
+
+static int
+client_submit(struct irpc_client *cl,
+              irpc_func_t func,
+              int cleanup,
+              void *img,
+              size_t sz)
+{
+    void *copy = NULL;
+    
+    // The gathered image is only valid during the callback.
+    if (sz > 0) {
+        if (!(copy = irpc_pool_get(&cl->pool, sz)))
+            return -1;
+        memcpy(copy, img, sz);
+    }
+    
+    return client_submit_image(cl, func, cleanup, copy, sz);
+}
+
+/*
+ * A closing client must outlive its jobs.  Its libusb state is torn
+ * down by one more job on its queue, so closing never blocks the event
+ * loop.  Returns 1 once the client may be freed.
+ */
+static int
+client_retire(struct irpc_client *cl)
+{
+    if (cl->jobs > 0)
+        return 0;
+    
+    if (!cl->cleaned) {
+        cl->cleaned = 1;
+        if (cl->info.ci.ctx || cl->info.ci.handle) {
+            if (client_submit(cl, IRPC_USB_EXIT, 1, NULL, 0) == 0)
+                return 0;
+            irpc_server_cleanup(&cl->info.ci);
+        }
+    }
+    
+    return 1;
+}
+
+static void
+client_attach(struct irpc_client *cl, unsigned long long token, int set);
+
+static int
+client_stripe(struct irpc_client *cl, void *img, size_t sz);
+
+static int
+client_dispatch(struct irpc_client *cl, void *img, size_t sz)
+{
+    unsigned long long token;
+    int replies, set;
+    
+    if (cl->owner)
+        return client_stripe(cl, img, sz);
+    
+    if (cl->func == IRPC_USB_STREAM_ATTACH) {
+        if (irpc_attach_from_image(img, sz, &token, &set) != IRPC_SUCCESS)
+            cl->closing = 1;
+        else
+            client_attach(cl, token, set);
+        return 0;
+    }
+    
+    // Ignore anything the client sends after its exit, its session ends.
+    if (cl->func == IRPC_USB_EXIT) {
+        cl->closing = 1;
+        cl->info.ci.token = 0;
+    }
+    
+    // A cancel must not wait behind the request it cancels.
+    if (cl->func == IRPC_USB_CANCEL) {
+        irpc_server_cancel(&cl->info.ci, img, sz);
+        return 0;
+    }
+    
+    if (cl->func == IRPC_USB_RESUME) {
+        if (irpc_resume_from_image(img, sz, &token, &replies) != IRPC_SUCCESS) {
+            cl->closing = 1;
+            return 0;
+        }
+        if (token) {
+            // Read no further once the connection went to the session.
+            client_resume(cl, token, replies);
+            return cl->closing ? -1 : 0;
+        }
+        // Asks for a token, the job replies it.
+        if (!cl->info.ci.token && (cl->info.ci.caps & IRPC_CAP_RESUME))
+            cl->info.ci.token = client_token();
+    }
+    cl->seq++;
+    
+    if (client_submit(cl, cl->func, 0, img, sz) != 0) {
+        fprintf(stderr, "Error! Failed to queue a client request.\n");
+        cl->closing = 1;
+    }
+    
+    return 0;
+}
+
+// -----------------------------------------------------------------------------
+#pragma mark Data Streams
+// -----------------------------------------------------------------------------
+
+/*
+ * A connection which sends IRPC_USB_STREAM_ATTACH with the token of a
+ * session becomes one of its data streams (see irpc_streams_open()).
+ * The transfers it sends come in stripes, each announced with its turn
+ * within the set of streams.  A stripe waits until the ones before it
+ * came by the other streams, then its calls are submitted to the
+ * session's queue, so they run in the order the client wrote them.
+ * The replies go back by the data stream.  A new set, or a stream
+ * failing, ends the streams of the session along with the stripes
+ * waiting for their turn.
+ */
+
+static void
+stripe_free(struct irpc_stripe *sp)
+{
+    int i;
+    
+    for (i = 0; i < sp->n; i++) {
+        client_charge(sp->cl, -(long)sp->sz[i]);
+        irpc_pool_put(&sp->cl->pool, sp->img[i]);
+    }
+    irpc_pool_put(&sp->cl->pool, sp);
+}
+
+static void
+streams_reset(struct irpc_client *s)
+{
+    struct irpc_client *d;
+    struct irpc_stripe *sp;
+    
+    while ((d = s->streams)) {
+        s->streams = d->stream_next;
+        d->stream_next = NULL;
+        d->owner = NULL;
+        if ((sp = d->stripe)) {
+            d->stripe = NULL;
+            stripe_free(sp);
+        }
+        // The backend notices and frees it.
+        d->closing = 1;
+        if (d->info.ci.client_sock != -1)
+            shutdown(d->info.ci.client_sock, SHUT_RDWR);
+    }
+    
+    while ((sp = s->stripes)) {
+        s->stripes = sp->next;
+        stripe_free(sp);
+    }
+    s->stripe_next = 0;
+}
+
+static int
+client_attach_reply(struct irpc_client *cl, int status)
+{
+    struct irpc_reply *r;
+    void *buf;
+    size_t sz;
+    
+    if (irpc_attach_reply(status, &buf, &sz) != 0)
+        return -1;
+    
+    if (!(r = calloc(1, sizeof(struct irpc_reply)))) {
+        free(buf);
+        return -1;
+    }
+    
+    r->cl = cl;
+    r->buf = buf;
+    r->len = sz;
+    if (cl->outq_tail)
+        cl->outq_tail->next = r;
+    else
+        cl->outq = r;
+    cl->outq_tail = r;
+    client_charge(cl, sz);
+    
+    return 0;
+}
+
+/* IRPC_USB_STREAM_ATTACH, only as the first request of cl. */
+static void
+client_attach(struct irpc_client *cl, unsigned long long token, int set)
+{
+    struct irpc_client *s, *d;
+    int status = 0, n = 0;
+    
+    for (s = clients; token && s; s = s->next)
+        if (s != cl && !s->closing && !s->owner && s->info.ci.token == token)
+            break;
+    
+    if (!token || !s || !(s->info.ci.caps & IRPC_CAP_STREAMS)) {
+        status = LIBUSB_ERROR_NOT_FOUND;
+    } else if (cl->seq > 0 || cl->streams || set <= 0) {
+        status = LIBUSB_ERROR_INVALID_PARAM;
+    } else {
+        // A new set replaces the streams of the old one.
+        if (set != s->stripe_set) {
+            streams_reset(s);
+            s->stripe_set = set;
+        }
+        for (d = s->streams; d; d = d->stream_next)
+            n++;
+        if (n >= IRPC_MAX_STREAMS)
+            status = LIBUSB_ERROR_OVERFLOW;
+    }
+    
+    if (status == 0) {
+        cl->owner = s;
+        cl->stream_next = s->streams;
+        s->streams = cl;
+    }
+    
+    if (client_attach_reply(cl, status) == 0)
+        backend_kick(cl);
+}
+
+/* Submits the stripes whose turn came, in turn. */
+static int
+streams_flush(struct irpc_client *s)
+{
+    struct irpc_stripe *sp;
+    void *img;
+    int i;
+    
+    while ((sp = s->stripes) && sp->seq == s->stripe_next) {
+        s->stripes = sp->next;
+        s->stripe_next++;
+        for (i = 0; i < sp->n; i++) {
+            // The jobs take the images over.
+            img = sp->img[i];
+            sp->img[i] = NULL;
+            if (client_submit_image(sp->cl,
+                                    sp->func[i],
+                                    0,
+                                    img,
+                                    sp->sz[i]) != 0) {
+                stripe_free(sp);
+                return -1;
+            }
+        }
+        stripe_free(sp);
+    }
+    
+    return 0;
+}
+
+/* A request of the data stream cl. */
+static int
+client_stripe(struct irpc_client *cl, void *img, size_t sz)
+{
+    struct irpc_client *s = cl->owner;
+    struct irpc_stripe *sp = cl->stripe, **p;
+    int seq, calls;
+    
+    // The session is busy, if not on its own connection.
+    s->last_active = cl->last_active;
+    
+    if (cl->func == IRPC_USB_STRIPE) {
+        if (sp ||
+            irpc_stripe_from_image(img, sz, &seq, &calls) != IRPC_SUCCESS ||
+            calls < 1 || calls > IRPC_MAX_STRIPE_CALLS || seq < s->stripe_next ||
+            !(sp = irpc_pool_get(&cl->pool, sizeof(struct irpc_stripe))))
+            goto fail;
+        memset(sp, 0, sizeof(struct irpc_stripe));
+        sp->cl = cl;
+        sp->seq = seq;
+        sp->ncalls = calls;
+        cl->stripe = sp;
+        return 0;
+    }
+    
+    // Data streams carry transfers (and the batch they make up) only.
+    if (!sp || (cl->func != IRPC_USB_BULK_TRANSFER &&
+                cl->func != IRPC_USB_BATCH))
+        goto fail;
+    
+    if (sz > 0) {
+        if (!(sp->img[sp->n] = irpc_pool_get(&cl->pool, sz)))
+            goto fail;
+        memcpy(sp->img[sp->n], img, sz);
+    }
+    sp->func[sp->n] = cl->func;
+    sp->sz[sp->n] = sz;
+    sp->n++;
+    client_charge(cl, sz);
+    client_throttle(cl);
+    if (sp->n < sp->ncalls)
+        return 0;
+    
+    cl->stripe = NULL;
+    for (p = &s->stripes; *p && (*p)->seq < sp->seq; p = &(*p)->next)
+        ;
+    if (*p && (*p)->seq == sp->seq) {
+        stripe_free(sp);
+        goto fail;
+    }
+    sp->next = *p;
+    *p = sp;
+    
+    if (streams_flush(s) == 0)
+        return 0;
+    
+fail:
+    fprintf(stderr, "Error! Invalid stripe from a data stream.\n");
+    streams_reset(s);
+    
+    return 0;
+}
+
+// -----------------------------------------------------------------------------
+#pragma mark Server Handoff
+// -----------------------------------------------------------------------------
+
+/*
+ * A new server started with the -H path of the running one takes over
+ * without dropping a connection or closing a device.  It connects to
+ * the handoff socket, the old server stops reading requests and waits
+ * for the running ones, at most IRPC_HANDOFF_TIMEOUT seconds, or else
+ * serves on.  Then it passes its listeners and every session with its
+ * socket and usbfs fd (see irpc_server_export()) as SCM_RIGHTS
+ * messages, along with the queued and kept replies and a partly read
+ * request.  Once the new server has taken all of them over, the old
+ * one exits and leaves the sessions alone.
+ */
+
+#define IRPC_HANDOFF_VERSION    1
+#define IRPC_HANDOFF_FMT        "ii"        /* Version, number of sessions */
+#define IRPC_HANDOFF_SESSION_FMT "S(iiiiiiiiiiiiii)IIUUBA(iB)A(iB)"
+
+/* Fds passed with a session. */
+#define HANDOFF_SOCK            (1 << 0)
+#define HANDOFF_USBFS           (1 << 1)
+
+/* Session state the new server needs, see IRPC_HANDOFF_SESSION_FMT. */
+struct handoff_session {
+    int fds;                                /* HANDOFF_* */
+    int seq;
+    int replies;
+    int have_func;
+    int func;
+    int outq_off;
+    int version;
+    int caps;
+    int max_payload;
+    int batch_left;
+    int batch_flags;
+    int result;
+    int has_ctx;
+    int session_data;                       /* Opened device, -1: none */
+};
+
+static int handoff_sock = -1;               /* Listens for a new server */
+static int handoff_conn = -1;               /* New server, we drain meanwhile */
+static time_t handoff_until;
+static int handoff_done = 0;                /* The sessions are gone */
+
+/* A message is the length of the image, its fds and the image. */
+static int
+handoff_send(int sock, void *img, size_t sz, int *fds, int nfds)
+{
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    struct iovec iov;
+    char cbuf[CMSG_SPACE(2 * sizeof(int))];
+    uint32_t len = sz;
+    size_t off = 0;
+    ssize_t n;
+    
+    bzero(&msg, sizeof msg);
+    bzero(cbuf, sizeof cbuf);
+    
+    iov.iov_base = &len;
+    iov.iov_len = sizeof len;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    
+    if (nfds > 0) {
+        msg.msg_control = cbuf;
+        msg.msg_controllen = CMSG_SPACE(nfds * sizeof(int));
+        cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(nfds * sizeof(int));
+        memcpy(CMSG_DATA(cmsg), fds, nfds * sizeof(int));
+    }
+    
+    if (sendmsg(sock, &msg, MSG_NOSIGNAL) != sizeof len)
+        return -1;
+    
+    while (off < sz) {
+        if ((n = send(sock, (char *)img + off, sz - off, MSG_NOSIGNAL)) < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        off += n;
+    }
+    
+    return 0;
+}
+
+static int
+handoff_recv(int sock, void **img, size_t *sz, int *fds, int *nfds)
+{
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    struct iovec iov;
+    char cbuf[CMSG_SPACE(2 * sizeof(int))];
+    uint32_t len;
+    size_t off = 0;
+    ssize_t n;
+    
+    bzero(&msg, sizeof msg);
+    
+    iov.iov_base = &len;
+    iov.iov_len = sizeof len;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cbuf;
+    msg.msg_controllen = sizeof cbuf;
+    
+    *nfds = 0;
+    if (recvmsg(sock, &msg, MSG_WAITALL | MSG_CMSG_CLOEXEC) != sizeof len)
+        return -1;
+    
+    for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+            continue;
+        *nfds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        memcpy(fds, CMSG_DATA(cmsg), *nfds * sizeof(int));
+    }
+    
+    if ((msg.msg_flags & MSG_CTRUNC) || !(*img = malloc(len)))
+        return -1;
+    
+    while (off < len) {
+        if ((n = recv(sock, (char *)*img + off, len - off, MSG_WAITALL)) <= 0) {
+            if (n < 0 && errno == EINTR)
+                continue;
+            free(*img);
+            return -1;
+        }
+        off += n;
+    }
+    *sz = len;
+    
+    return 0;
+}
+
+static int
+handoff_give_session(int sock, struct irpc_client *cl)
+{
+    struct irpc_connection_info *ci = &cl->info.ci;
+    struct handoff_session hs;
+    struct irpc_packet *pk;
+    struct irpc_reply *r;
+    unsigned long long claimed;
+    int64_t last_active = cl->last_active, detached = cl->detached;
+    tpl_bin partial, bin;
+    tpl_node *tn;
+    void *img = NULL;
+    char *held = NULL;
+    size_t sz = 0, off = 0;
+    int fds[2], nfds = 0, fd, num, rc;
+    
+    bzero(&hs, sizeof hs);
+    
+    if (irpc_server_export(ci, &hs.session_data, &claimed, &fd) != 0)
+        return -1;
+    
+    if (ci->client_sock != -1) {
+        hs.fds |= HANDOFF_SOCK;
+        fds[nfds++] = ci->client_sock;
+    }
+    if (fd != -1) {
+        hs.fds |= HANDOFF_USBFS;
+        fds[nfds++] = fd;
+    }
+    
+    hs.seq = cl->seq;
+    hs.replies = cl->replies;
+    hs.have_func = cl->have_func;
+    hs.func = cl->func;
+    hs.outq_off = cl->outq_off;
+    hs.version = ci->version;
+    hs.caps = ci->caps;
+    hs.max_payload = ci->max_payload;
+    hs.batch_left = ci->batch_left;
+    hs.batch_flags = ci->batch_flags;
+    hs.result = ci->result;
+    hs.has_ctx = ci->ctx != NULL;
+    
+    partial.addr = cl->gs ? cl->gs->img : NULL;
+    partial.sz = cl->gs ? cl->gs->len : 0;
+    
+    // Packets held back go ahead of the partial one.
+    if (cl->held) {
+        for (pk = cl->held; pk; pk = pk->next)
+            partial.sz += pk->len;
+        if (!(held = malloc(partial.sz)))
+            return -1;
+        for (pk = cl->held; pk; pk = pk->next) {
+            memcpy(held + off, pk->img, pk->len);
+            off += pk->len;
+        }
+        if (cl->gs)
+            memcpy(held + off, cl->gs->img, cl->gs->len);
+        partial.addr = held;
+    }
+    
+    tn = tpl_map(IRPC_HANDOFF_SESSION_FMT, &hs, &last_active, &detached,
+                 &ci->token, &claimed, &partial, &num, &bin, &num, &bin);
+    tpl_pack(tn, 0);
+    for (r = cl->outq; r; r = r->next) {
+        num = r->num;
+        bin.addr = r->buf;
+        bin.sz = r->len;
+        tpl_pack(tn, 1);
+    }
+    for (r = cl->sent; r; r = r->next) {
+        num = r->num;
+        bin.addr = r->buf;
+        bin.sz = r->len;
+        tpl_pack(tn, 2);
+    }
+    rc = tpl_dump(tn, TPL_MEM, &img, &sz);
+    tpl_free(tn);
+    free(held);
+    
+    if (rc == 0)
+        rc = handoff_send(sock, img, sz, fds, nfds);
+    free(img);
+    
+    return rc;
+}
+
+/* Appends a handed over reply to a reply list. */
+static int
+handoff_take_reply(struct irpc_client *cl,
+                   struct irpc_reply **head,
+                   struct irpc_reply **tail,
+                   int num,
+                   tpl_bin *bin)
+{
+    struct irpc_reply *r;
+    
+    if (!(r = calloc(1, sizeof(struct irpc_reply)))) {
+        free(bin->addr);
+        return -1;
+    }
+    
+    r->cl = cl;
+    r->buf = bin->addr;
+    r->len = bin->sz;
+    r->num = num;
+    
+    if (*tail)
+        (*tail)->next = r;
+    else
+        *head = r;
+    *tail = r;
+    
+    return 0;
+}
+
+/*
+ * The rest of a partly sent reply goes alone, so backends need not
+ * know about outq_off.  The whole reply is kept for a resume.
+ */
+static int
+handoff_split_reply(struct irpc_client *cl, int off)
+{
+    struct irpc_reply *r = cl->outq, *rest;
+    
+    if (!(rest = calloc(1, sizeof(struct irpc_reply))))
+        return -1;
+    if (!(rest->buf = malloc(r->len - off))) {
+        free(rest);
+        return -1;
+    }
+    
+    memcpy(rest->buf, r->buf + off, r->len - off);
+    rest->len = r->len - off;
+    rest->cl = cl;
+    rest->next = r->next;
+    if (cl->outq_tail == r)
+        cl->outq_tail = rest;
+    cl->outq = rest;
+    client_charge(cl, rest->len);
+    
+    client_sent(cl, r);
+    
+    return 0;
+}
+
+static int
+handoff_take_session(void *img, size_t sz, int *fds, int nfds)
+{
+    struct irpc_connection_info *ci;
+    struct irpc_client *cl;
+    struct handoff_session hs;
+    unsigned long long claimed, token;
+    int64_t last_active, detached;
+    tpl_bin partial, bin;
+    tpl_node *tn;
+    int num, usbfs = -1, i = 0, rc = 0;
+    
+    if (!(cl = calloc(1, sizeof(struct irpc_client)))) {
+        while (nfds > 0)
+            close(fds[--nfds]);
+        return -1;
+    }
+    ci = &cl->info.ci;
+    
+    cl->next = clients;
+    if (clients)
+        clients->prev = cl;
+    clients = cl;
+    nclients++;
+    
+    ci->client_sock = -1;
+    ci->resumable = 1;
+    ci->credit = (int)client_budget;
+    ci->send_reply = job_send_reply;
+    ci->send_reply_fd = job_send_reply_fd;
+    ci->async_begin = job_async_begin;
+    ci->async_end = job_async_end;
+    
+    bzero(&partial, sizeof partial);
+    tn = tpl_map(IRPC_HANDOFF_SESSION_FMT, &hs, &last_active, &detached,
+                 &token, &claimed, &partial, &num, &bin, &num, &bin);
+    if (tpl_load(tn, TPL_MEM, img, sz) != 0 || tpl_unpack(tn, 0) <= 0) {
+        tpl_free(tn);
+        while (nfds > 0)
+            close(fds[--nfds]);
+        client_close(cl);
+        return -1;
+    }
+    
+    // The fds follow the order of HANDOFF_*.
+    if ((hs.fds & HANDOFF_SOCK) && i < nfds)
+        ci->client_sock = fds[i++];
+    if ((hs.fds & HANDOFF_USBFS) && i < nfds)
+        usbfs = fds[i++];
+    if (i != nfds || i != __builtin_popcount(hs.fds))
+        rc = -1;
+    
+    cl->seq = hs.seq;
+    cl->replies = hs.replies;
+    cl->have_func = hs.have_func;
+    cl->func = hs.func;
+    cl->last_active = last_active;
+    cl->detached = detached;
+    ci->version = hs.version;
+    ci->caps = hs.caps;
+    ci->max_payload = hs.max_payload;
+    ci->batch_left = hs.batch_left;
+    ci->batch_flags = hs.batch_flags;
+    ci->result = hs.result;
+    ci->token = token;
+    
+    if (partial.sz > 0 && (cl->gs = malloc(sizeof(tpl_gather_t)))) {
+        cl->gs->img = partial.addr;
+        cl->gs->len = partial.sz;
+        cl->gs->size = partial.sz;
+    } else if (partial.sz > 0) {
+        free(partial.addr);
+        rc = -1;
+    }
+    
+    while (tpl_unpack(tn, 1) > 0) {
+        if (handoff_take_reply(cl, &cl->outq, &cl->outq_tail, num, &bin) != 0)
+            rc = -1;
+        else
+            client_charge(cl, bin.sz);
+    }
+    while (tpl_unpack(tn, 2) > 0) {
+        if (handoff_take_reply(cl, &cl->sent, &cl->sent_tail, num, &bin) != 0)
+            rc = -1;
+        else
+            cl->nsent++;
+    }
+    tpl_free(tn);
+    
+    if (cl->outq && hs.outq_off > 0 && handoff_split_reply(cl, hs.outq_off) != 0)
+        rc = -1;
+    
+    if (ci->client_sock != -1)
+        set_nonblocking(ci->client_sock);
+    
+    // Attaches to the shared context and adopts the device.
+    if (hs.has_ctx) {
+        if (irpc_server_import(ci, hs.session_data, claimed, usbfs) != 0)
+            rc = -1;
+        usbfs = -1;
+        if (ci->ctx && irpc_events_add(usb_events, ci->ctx) == 0)
+            cl->ev_ctx = ci->ctx;
+    }
+    if (usbfs != -1)
+        close(usbfs);
+    
+    return rc;
+}
+
+/*
+ * New server: takes the listeners and sessions over from the server
+ * listening on path.  Returns 0 if there is none, 1 once taken over
+ * and -1 on failures, the old server serves on then.
+ */
+static int
+handoff_take(const char *path, int *sock, int *usock)
+{
+    struct sockaddr_un addr;
+    int conn, fds[2], nfds, version, n, i;
+    void *img;
+    size_t sz;
+    tpl_node *tn;
+    char ack = 0;
+    
+    if (strlen(path) >= sizeof(addr.sun_path) ||
+        (conn = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) == -1)
+        return -1;
+    
+    bzero(&addr, sizeof addr);
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    
+    if (connect(conn, (struct sockaddr *)&addr, sizeof addr) != 0) {
+        close(conn);
+        return 0;
+    }
+    
+    fprintf(stderr, "irpc_server: taking over from the running server\n");
+    
+    // The old server answers once its requests are done.
+    if (handoff_recv(conn, &img, &sz, fds, &nfds) != 0) {
+        close(conn);
+        return -1;
+    }
+    
+    tn = tpl_map(IRPC_HANDOFF_FMT, &version, &n);
+    if (tpl_load(tn, TPL_MEM | TPL_UFREE, img, sz) != 0) {
+        free(img);
+        n = -1;
+    } else if (tpl_unpack(tn, 0) <= 0 || version != IRPC_HANDOFF_VERSION) {
+        n = -1;
+    }
+    tpl_free(tn);
+    
+    if (n < 0 || nfds < 1) {
+        while (nfds > 0)
+            close(fds[--nfds]);
+        close(conn);
+        return -1;
+    }
+    *sock = fds[0];
+    *usock = nfds > 1 ? fds[1] : -1;
+    
+    for (i = 0; i < n; i++) {
+        if (handoff_recv(conn, &img, &sz, fds, &nfds) != 0)
+            break;
+        if (handoff_take_session(img, sz, fds, nfds) != 0) {
+            free(img);
+            break;
+        }
+        free(img);
+    }
+    
+    // Without the acknowledgement the old server keeps everything.
+    if (i < n || write(conn, &ack, 1) != 1) {
+        close(conn);
+        return -1;
+    }
+    
+    close(conn);
+    
+    return 1;
+}
+
+/* A new server connected, stop reading requests. */
+static int
+handoff_begin(int conn)
+{
+    struct ucred peer;
+    socklen_t len = sizeof peer;
+    
+    // Only a server running as the same user takes the sessions.
+    if (handoff_conn != -1 ||
+        getsockopt(conn, SOL_SOCKET, SO_PEERCRED, &peer, &len) != 0 ||
+        peer.uid != geteuid()) {
+        close(conn);
+        return -1;
+    }
+    
+    fprintf(stderr, "irpc_server: handing over to a new server\n");
+    
+    handoff_conn = conn;
+    handoff_until = time(NULL) + IRPC_HANDOFF_TIMEOUT;
+    
+    return 0;
+}
+
+/* All requests are done and every reply sent or queued. */
+static int
+handoff_ready(void)
+{
+    struct irpc_client *cl;
+    
+    for (cl = clients; cl; cl = cl->next)
+        if (cl->jobs > 0 || cl->closing || cl->inflight > 0)
+            return 0;
+    
+    return 1;
+}
+
+static int
+handoff_give(int sock, int usock)
+{
+    struct irpc_client *cl;
+    struct pollfd pfd;
+    int version = IRPC_HANDOFF_VERSION, n = 0;
+    int fds[2] = { sock, usock };
+    void *img = NULL;
+    size_t sz = 0;
+    tpl_node *tn;
+    char ack;
+    
+    // Data streams are not handed over, the client falls back.
+    for (cl = clients; cl; cl = cl->next)
+        if (!cl->owner)
+            n++;
+    
+    tn = tpl_map(IRPC_HANDOFF_FMT, &version, &n);
+    tpl_pack(tn, 0);
+    if (tpl_dump(tn, TPL_MEM, &img, &sz) != 0 ||
+        handoff_send(handoff_conn, img, sz, fds, usock != -1 ? 2 : 1) != 0) {
+        tpl_free(tn);
+        free(img);
+        return -1;
+    }
+    tpl_free(tn);
+    free(img);
+    
+    for (cl = clients; cl; cl = cl->next)
+        if (!cl->owner && handoff_give_session(handoff_conn, cl) != 0)
+            return -1;
+    
+    pfd.fd = handoff_conn;
+    pfd.events = POLLIN;
+    
+    if (poll(&pfd, 1, IRPC_HANDOFF_TIMEOUT * 1000) != 1 ||
+        read(handoff_conn, &ack, 1) != 1)
+        return -1;
+    
+    return 0;
+}
+
+/*
+ * Called by a draining event loop.  Returns 1 once the sessions are
+ * handed over, -1 if the handoff failed and the loop has to read
+ * requests again, 0 while there are requests left.
+ */
+static int
+handoff_poll(int sock, int usock)
+{
+    if (!handoff_ready()) {
+        if (time(NULL) < handoff_until)
+            return 0;
+        fprintf(stderr, "Error! Requests still running, handoff given up.\n");
+    } else if (handoff_give(sock, usock) == 0) {
+        handoff_done = 1;
+        return 1;
+    } else {
+        fprintf(stderr, "Error! Handoff failed, serving on.\n");
+    }
+    
+    close(handoff_conn);
+    handoff_conn = -1;
+    
+    return -1;
+}
+
+// -----------------------------------------------------------------------------
+#pragma mark Event Loop
+// -----------------------------------------------------------------------------
+
+/*
+ * A request is the function packet followed by irpc_func_nargs()
+ * argument packets.
+ */
+static int
+client_packet(struct irpc_client *cl, void *img, size_t sz)
+{
+    if (cl->closing)
+        return 0;
+    
+    if (cl->have_func) {
+        cl->have_func = 0;
+        return client_dispatch(cl, img, sz);
+    }
+    
+    if (irpc_func_from_image(img, sz, &cl->func) == IRPC_FAILURE ||
+        irpc_func_nargs(cl->func) < 0) {
+        fprintf(stderr, "Error! Invalid function call from client.\n");
+        cl->closing = 1;
+        return 0;
+    }
+    
+    if (irpc_func_nargs(cl->func) > 0) {
+        cl->have_func = 1;
+        return 0;
+    }
+    
+    return client_dispatch(cl, NULL, 0);
+}
+
+/*
+ * Dispatches the held packets until the client is over budget again.
+ * Returns -1 if the connection went to another client, see
+ * client_resume(); the packets after that are dropped.
+ */
+static int
+client_feed(struct irpc_client *cl)
+{
+    struct irpc_packet *pk;
+    int rc;
+    
+    while ((pk = cl->held) && !cl->throttled && !cl->closing) {
+        if (!(cl->held = pk->next))
+            cl->held_tail = NULL;
+        client_charge(cl, -(long)(sizeof(struct irpc_packet) + pk->len));
+        rc = client_packet(cl, pk->img, pk->len);
+        free(pk);
+        if (rc < 0) {
+            client_drop_held(cl);
+            return -1;
+        }
+    }
+    
+    return 0;
+}
+
+/* Invoked by tpl_gather() for every complete packet. */
+static int
+client_gather_cb(void *img, size_t sz, void *data)
+{
+    struct irpc_client *cl = data;
+    
+    if (!cl->throttled && client_feed(cl) != 0)
+        return -1;
+    
+    if (cl->throttled || cl->held)
+        return client_hold(cl, img, sz);
+    
+    return client_packet(cl, img, sz);
+}
+
+/*
+ * The partial packet of a session taken over may start with complete
+ * ones the old server held back, see handoff_give_session().
+ */
+static void
+clients_regather(void)
+{
+    struct irpc_client *cl;
+    tpl_gather_t *gs;
+    
+    for (cl = clients; cl; cl = cl->next) {
+        if (!(gs = cl->gs) || gs->len == 0)
+            continue;
+        cl->gs = NULL;
+        if (tpl_gather(TPL_GATHER_MEM | TPL_GROW,
+                       gs->img,
+                       gs->len,
+                       &cl->gs,
+                       client_gather_cb,
+                       cl) < 0)
+            cl->closing = 1;
+        free(gs->img);
+        free(gs);
+    }
+}
+
+/*
+ * Write queued replies, several per sendmsg().  What does not fit
+ * into the socket buffer is sent on EPOLLOUT.  Returns -1 on errors.
+ */
+static int
+client_flush(struct irpc_client *cl)
+{
+    struct iovec iov[IRPC_MAX_IOV];
+    struct msghdr msg;
+    struct irpc_reply *r;
+    ssize_t n;
+    int cnt;
+    
+    // Detached, the replies wait for a resume.
+    if (cl->info.ci.client_sock == -1)
+        return 0;
+    
+    while (cl->outq) {
+        cnt = 0;
+        for (r = cl->outq; r && cnt < IRPC_MAX_IOV && !r->passes_fd;
+             r = r->next) {
+            iov[cnt].iov_base = r->buf + (cnt == 0 ? cl->outq_off : 0);
+            iov[cnt].iov_len = r->len - (cnt == 0 ? cl->outq_off : 0);
+            cnt++;
+        }
+        
+        // A passed fd goes by a sendmsg() of its own.
+        if (cnt == 0) {
+            msg = ((struct irpc_fd_msg *)cl->outq->buf)->msg;
+        } else {
+            bzero(&msg, sizeof msg);
+            msg.msg_iov = iov;
+            msg.msg_iovlen = cnt;
+        }
+        
+        if ((n = sendmsg(cl->info.ci.client_sock, &msg, MSG_NOSIGNAL)) < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+            return -1;
+        }
+        
+        while ((r = cl->outq) && (size_t)n >= r->len - cl->outq_off) {
+            n -= r->len - cl->outq_off;
+            cl->outq_off = 0;
+            cl->outq = r->next;
+            client_sent(cl, r);
+        }
+        if (!cl->outq)
+            cl->outq_tail = NULL;
+        else
+            cl->outq_off += n;
+    }
+    
+    return 0;
+}
+
+/* Stop reading from the client and free it once its jobs are done. */
+static void
+client_release(struct irpc_client *cl)
+{
+    cl->closing = 1;
+    
+    if (!cl->shut) {
+        cl->shut = 1;
+        if (cl->info.ci.client_sock != -1) {
+            epoll_ctl(epoll_fd, EPOLL_CTL_DEL, cl->info.ci.client_sock, NULL);
+            // Last chance for replies sent before the client's exit.
+            (void)client_flush(cl);
+        }
+    }
+    
+    if (client_retire(cl))
+        client_close(cl);
+}
+
+static void
+client_detach(struct irpc_client *cl)
+{
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, cl->info.ci.client_sock, NULL);
+    close(cl->info.ci.client_sock);
+    cl->info.ci.client_sock = -1;
+    client_orphan(cl);
+}
+
+static void
+client_adopt(struct irpc_client *cl, struct irpc_client *from)
+{
+    struct epoll_event ev;
+    
+    cl->info.ci.client_sock = from->info.ci.client_sock;
+    from->info.ci.client_sock = -1;
+    
+    bzero(&ev, sizeof ev);
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    ev.data.ptr = cl;
+    epoll_ctl(epoll_fd, EPOLL_CTL_MOD, cl->info.ci.client_sock, &ev);
+    
+    (void)client_flush(cl);
+}
+
+/* Errors show up as events on the socket. */
+static void
+client_kick(struct irpc_client *cl)
+{
+    (void)client_flush(cl);
+}
+
+/* The connection failed, a resumable session waits for the client. */
+static void
+client_lost(struct irpc_client *cl)
+{
+    if (cl->detached)
+        return;
+    if (cl->info.ci.token && !cl->closing)
+        client_detach(cl);
+    else
+        client_release(cl);
+}
+
+/* Reads until the socket is drained or the client over budget. */
+static void
+client_read(struct irpc_client *cl)
+{
+    char buf[IRPC_READ_BUFSZ];
+    ssize_t n;
+    int rc = 1;
+    
+    cl->last_active = time(NULL);
+    
+    while (!cl->throttled && !cl->closing) {
+        if ((n = read(cl->info.ci.client_sock, buf, sizeof buf)) == -1) {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                rc = -1;
+            break;
+        }
+        if (n == 0) {
+            rc = 0;
+            break;
+        }
+        if (tpl_gather(TPL_GATHER_MEM | TPL_GROW,
+                       buf,
+                       (size_t)n,
+                       &cl->gs,
+                       client_gather_cb,
+                       cl) < 0)
+            cl->closing = 1;
+    }
+    
+    // 1: drained or throttled, 0: EOF, < 0: error.
+    if (cl->closing)
+        client_release(cl);
+    else if (rc <= 0)
+        client_lost(cl);
+}
+
+/* Edge triggered, what arrived meanwhile is read right away. */
+static void
+client_unthrottle(struct irpc_client *cl)
+{
+    if (cl->info.ci.client_sock == -1)
+        return;
+    
+    // Draining, the requests still to be read wait for the new server.
+    if (client_feed(cl) != 0 || cl->closing || handoff_conn == -1)
+        client_read(cl);
+}
+
+static void
+jobs_complete(void)
+{
+    struct server_job *sj;
+    struct irpc_client *cl, *owner;
+    uint64_t n;
+    int lost;
+    
+    // A single read resets the counter.
+    (void)read(done_efd, &n, sizeof n);
+    jobs_rearm();
+    
+    while ((sj = jobs_next())) {
+        cl = sj->cl;
+        cl->jobs--;
+        if ((owner = sj->owner))
+            owner->jobs--;
+        
+        client_charge(cl, -(long)(sj->sz + IRPC_REPLY_RESERVE));
+        lost = client_take_replies(cl, sj) > 0 && client_flush(cl) != 0;
+        
+        irpc_pool_put(&cl->pool, sj->img);
+        irpc_pool_put(&cl->pool, sj);
+        
+        if (lost)
+            client_lost(cl);
+        else if (cl->closing)
+            client_release(cl);
+        if (owner && owner->closing)
+            client_release(owner);
+    }
+}
+
+static void
+accept_clients(int epfd, int sock)
+{
+    struct epoll_event ev;
+    struct irpc_client *cl;
+    int csock;
+    
+    while ((csock = accept(sock, NULL, NULL)) != -1) {
+        cl = calloc(1, sizeof(struct irpc_client));
+        if (!cl) {
+            close(csock);
+            continue;
+        }
+        
+        set_nonblocking(csock);
+        set_nodelay(csock);
+        
+        cl->info.ci.client_sock = csock;
+        cl->info.ci.resumable = 1;
+        cl->info.ci.credit = (int)client_budget;
+        cl->info.ci.send_reply = job_send_reply;
+        cl->info.ci.send_reply_fd = job_send_reply_fd;
+        cl->info.ci.async_begin = job_async_begin;
+        cl->info.ci.async_end = job_async_end;
+        cl->last_active = time(NULL);
+        
+        bzero(&ev, sizeof ev);
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        ev.data.ptr = cl;
+        
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, csock, &ev) != 0) {
+            close(csock);
+            free(cl);
+            continue;
+        }
+        
+        cl->next = clients;
+        if (clients)
+            clients->prev = cl;
+        clients = cl;
+        nclients++;
+    }
+    
+    if (errno != EAGAIN && errno != EWOULDBLOCK)
+        fprintf(stderr, "Error! Failed to accept an incoming connection.\n");
+}
+
+static void
+drop_idle_clients(void (*drop)(struct irpc_client *))
+{
+    struct irpc_client *cl = clients, *next;
+    time_t now = time(NULL);
+    
+    while (cl) {
+        next = cl->next;
+        if (cl->detached ? now - cl->detached > IRPC_RESUME_GRACE
+                         : now - cl->last_active > IRPC_IDLE_TIMEOUT) {
+            // The session ends with the client.
+            cl->info.ci.token = 0;
+            drop(cl);
+        }
+        cl = next;
+    }
+}
+
+/* Client listeners have no data, the handoff listener &handoff_sock. */
+static int
+add_listener(int epfd, int sock, void *data)
+{
+    struct epoll_event ev;
+    
+    set_nonblocking(sock);
+    
+    bzero(&ev, sizeof ev);
+    ev.events = EPOLLIN;
+    ev.data.ptr = data;
+    
+    return epoll_ctl(epfd, EPOLL_CTL_ADD, sock, &ev);
+}
+
+/* Sessions taken over from another server. */
+static int
+add_clients(int epfd)
+{
+    struct epoll_event ev;
+    struct irpc_client *cl;
+    
+    for (cl = clients; cl; cl = cl->next) {
+        if (cl->info.ci.client_sock == -1)
+            continue;
+        
+        bzero(&ev, sizeof ev);
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        ev.data.ptr = cl;
+        
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, cl->info.ci.client_sock, &ev) != 0)
+            return -1;
+    }
+    
+    return 0;
+}
+
+/* The handoff failed, read what arrived while draining. */
+static void
+client_read_all(void)
+{
+    struct irpc_client *cl = clients, *next;
+    
+    while (cl) {
+        next = cl->next;
+        if (cl->info.ci.client_sock != -1 && !cl->closing)
+            client_read(cl);
+        cl = next;
+    }
+}
+
+static int
+add_done_efd(int epfd)
+{
+    struct epoll_event ev;
+    
+    bzero(&ev, sizeof ev);
+    ev.events = EPOLLIN;
+    ev.data.ptr = &done_efd;
+    
+    return epoll_ctl(epfd, EPOLL_CTL_ADD, done_efd, &ev);
+}
+
+static void
+server_loop(int sock, int usock)
+{
+    struct epoll_event events[IRPC_MAX_EVENTS];
+    time_t last_sweep = time(NULL);
+    int epfd, n, i, done, conn, rc;
+    
+    if ((epfd = epoll_create(IRPC_MAX_EVENTS)) == -1) {
+        fprintf(stderr, "Error! epoll_create()\n");
+        return;
+    }
+    epoll_fd = epfd;
+    backend_detach = client_detach;
+    backend_adopt = client_adopt;
+    backend_kick = client_kick;
+    backend_throttle = NULL;                // client_read() checks
+    backend_unthrottle = client_unthrottle;
+    
+    if (add_done_efd(epfd) != 0 ||
+        add_listener(epfd, sock, NULL) != 0 ||
+        (usock != -1 && add_listener(epfd, usock, NULL) != 0) ||
+        (handoff_sock != -1 && add_listener(epfd, handoff_sock, &handoff_sock) != 0) ||
+        add_clients(epfd) != 0) {
+        fprintf(stderr, "Error! epoll_ctl()\n");
+        close(epfd);
+        return;
+    }
+    
+    while (1) {
+        // A drain checks its deadline every second.
+        n = epoll_wait(epfd, events, IRPC_MAX_EVENTS,
+                       handoff_conn != -1 ? 1000 : IRPC_SWEEP_INTERVAL * 1000);
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            fprintf(stderr, "Error! epoll_wait()\n");
+            break;
+        }
+        
+        done = 0;
+        
+        for (i = 0; i < n; i++) {
+            struct irpc_client *cl = events[i].data.ptr;
+            
+            if (!cl) {
+                // Listening sockets are non-blocking, try both.
+                accept_clients(epfd, sock);
+                if (usock != -1)
+                    accept_clients(epfd, usock);
+                continue;
+            }
+            
+            // Completions may free clients, handle them after the batch.
+            if (events[i].data.ptr == &done_efd) {
+                done = 1;
+                continue;
+            }
+            
+            if (events[i].data.ptr == &handoff_sock) {
+                if ((conn = accept(handoff_sock, NULL, NULL)) != -1)
+                    handoff_begin(conn);
+                continue;
+            }
+            
+            if ((events[i].events & EPOLLOUT) && client_flush(cl) != 0) {
+                client_lost(cl);
+                continue;
+            }
+            
+            // Reading also detects EOF and errors.  Draining, the
+            // requests wait for the new server.
+            if ((events[i].events & ~EPOLLOUT) && handoff_conn == -1)
+                client_read(cl);
+        }
+        
+        if (done)
+            jobs_complete();
+        
+        if (throttled)
+            clients_unthrottle();
+        
+        if (handoff_conn != -1 && (rc = handoff_poll(sock, usock)) != 0) {
+            if (rc > 0)
+                break;
+            client_read_all();
+        }
+        
+        if (time(NULL) - last_sweep >= IRPC_SWEEP_INTERVAL) {
+            drop_idle_clients(client_release);
+            last_sweep = time(NULL);
+        }
+    }
+    
+    close(epfd);
+}
+
+#ifdef IRPC_HAVE_IO_URING
+// -----------------------------------------------------------------------------
+#pragma mark io_uring Backend
+// -----------------------------------------------------------------------------
+
+/*
+ * All sockets are driven from one ring: a multishot accept per
+ * listener, a multishot recv per client filling buffers from a shared
+ * provided buffer ring, and replies submitted as chains of linked
+ * sends.  Everything produced while handling a batch of completions is
+ * submitted together with the wait for the next batch, so under load
+ * each io_uring_enter() serves many clients and RPCs.
+ */
+
+#define IRPC_URING_ENTRIES      256
+#define IRPC_URING_NBUFS        256     /* Power of two */
+#define IRPC_URING_BUFSZ        8192
+#define IRPC_URING_BGID         0
+#define IRPC_URING_MAX_CHAIN    16      /* Max linked sends per client */
+
+/* Tags in the low bits of the sqe user_data. */
+#define URING_ACCEPT            0
+#define URING_RECV              1
+#define URING_SEND              2
+#define URING_TIMEOUT           3
+#define URING_DONE              4
+#define URING_CANCEL            5
+#define URING_HANDOFF           6
+#define URING_PROBE             7
+#define URING_TAG_MASK          7
+
+static struct irpc_uring ring;
+static struct irpc_uring_bufs ring_bufs;
+static struct irpc_client *dirty_clients = NULL;
+static struct __kernel_timespec sweep_ts = { IRPC_SWEEP_INTERVAL, 0 };
+static struct __kernel_timespec handoff_ts = { IRPC_HANDOFF_TIMEOUT, 0 };
+static uint64_t done_val;
+
+static void
+uring_prep_accept(int sock)
+{
+    struct io_uring_sqe *sqe = irpc_uring_get_sqe(&ring);
+    
+    if (!sqe)
+        return;
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = sock;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->user_data = ((unsigned long long)sock << 3) | URING_ACCEPT;
+}
+
+static void
+uring_prep_recv(struct irpc_client *cl)
+{
+    struct io_uring_sqe *sqe = irpc_uring_get_sqe(&ring);
+    
+    if (!sqe)
+        return;
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = cl->info.ci.client_sock;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = IRPC_URING_BGID;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->user_data = (unsigned long long)(uintptr_t)cl | URING_RECV;
+    cl->inflight++;
+}
+
+static void
+uring_prep_timeout(void)
+{
+    struct io_uring_sqe *sqe = irpc_uring_get_sqe(&ring);
+    
+    if (!sqe)
+        return;
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->addr = (unsigned long long)(uintptr_t)&sweep_ts;
+    sqe->len = 1;
+    sqe->user_data = URING_TIMEOUT;
+}
+
+static void
+uring_prep_done(void)
+{
+    struct io_uring_sqe *sqe = irpc_uring_get_sqe(&ring);
+    
+    if (!sqe)
+        return;
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = done_efd;
+    sqe->addr = (unsigned long long)(uintptr_t)&done_val;
+    sqe->len = sizeof done_val;
+    sqe->user_data = URING_DONE;
+}
+
+/* Free the client once neither the ring nor a job refers to it. */
+static void
+uring_client_put(struct irpc_client *cl)
+{
+    // A lost connection is closed once the ring is done with it.
+    if (cl->detached && cl->inflight == 0 && cl->info.ci.client_sock != -1) {
+        close(cl->info.ci.client_sock);
+        cl->info.ci.client_sock = -1;
+    }
+    
+    if (!cl->closing || cl->inflight > 0 || cl->dirty || !client_retire(cl))
+        return;
+    
+    client_close(cl);
+}
+
+static void
+uring_client_end(struct irpc_client *cl)
+{
+    cl->closing = 1;
+    if (!cl->shut) {
+        cl->shut = 1;
+        if (cl->info.ci.client_sock != -1)
+            shutdown(cl->info.ci.client_sock, SHUT_RD);
+    }
+}
+
+/*
+ * Terminates the multishot recv, the client is freed once its last
+ * completion arrived.  Queued replies are still sent.
+ */
+static void
+uring_client_shutdown(struct irpc_client *cl)
+{
+    uring_client_end(cl);
+    uring_client_put(cl);
+}
+
+/* Ends the requests on the connection, a resume waits for their end. */
+static void
+uring_client_detach(struct irpc_client *cl)
+{
+    shutdown(cl->info.ci.client_sock, SHUT_RDWR);
+    client_orphan(cl);
+}
+
+/* The connection failed, a resumable session waits for the client. */
+static void
+uring_client_lost(struct irpc_client *cl)
+{
+    if (cl->detached)
+        return;
+    if (cl->info.ci.token && !cl->closing)
+        uring_client_detach(cl);
+    else
+        uring_client_end(cl);
+}
+
+static void
+uring_mark_dirty(struct irpc_client *cl)
+{
+    if (cl->dirty)
+        return;
+    cl->dirty = 1;
+    cl->dirty_next = dirty_clients;
+    dirty_clients = cl;
+}
+
+/*
+ * Submit the queued replies of a client as one chain of linked sends.
+ * The next chain is only started once this one completed, so replies
+ * never overtake each other.
+ */
+static void
+uring_flush_client(struct irpc_client *cl)
+{
+    struct io_uring_sqe *sqe;
+    struct irpc_reply *us;
+    int n = 0, i;
+    
+    if (cl->sends_inflight > 0 || !cl->outq || cl->detached)
+        return;
+    
+    for (us = cl->outq; us && n < IRPC_URING_MAX_CHAIN; us = us->next)
+        n++;
+    
+    // A chain must not be split by an implicit submit.
+    if (irpc_uring_sq_space(&ring) < (unsigned)n)
+        irpc_uring_submit_and_wait(&ring, 0);
+    
+    for (i = 0; i < n; i++) {
+        us = cl->outq;
+        if (!(sqe = irpc_uring_get_sqe(&ring)))
+            break;
+        cl->outq = us->next;
+        if (!cl->outq)
+            cl->outq_tail = NULL;
+        
+        sqe->fd = cl->info.ci.client_sock;
+        if (us->passes_fd) {
+            sqe->opcode = IORING_OP_SENDMSG;
+            sqe->addr = (unsigned long long)(uintptr_t)
+                        &((struct irpc_fd_msg *)us->buf)->msg;
+            sqe->len = 1;
+        } else {
+            sqe->opcode = IORING_OP_SEND;
+            sqe->addr = (unsigned long long)(uintptr_t)us->buf;
+            sqe->len = us->len;
+        }
+        sqe->msg_flags = MSG_WAITALL | MSG_NOSIGNAL;
+        sqe->user_data = (unsigned long long)(uintptr_t)us | URING_SEND;
+        if (i < n - 1)
+            sqe->flags = IOSQE_IO_LINK;
+        
+        cl->sends_inflight++;
+        cl->inflight++;
+    }
+}
+
+static void
+uring_flush_dirty(void)
+{
+    struct irpc_client *cl;
+    
+    while ((cl = dirty_clients)) {
+        dirty_clients = cl->dirty_next;
+        cl->dirty = 0;
+        uring_flush_client(cl);
+        uring_client_put(cl);
+    }
+}
+
+/*
+ * The recv of from must stop before the one of cl takes over the
+ * socket.  Both are submitted ahead of the resume reply, and the
+ * client sends nothing before it got that.
+ */
+static void
+uring_client_adopt(struct irpc_client *cl, struct irpc_client *from)
+{
+    struct io_uring_sqe *sqe = irpc_uring_get_sqe(&ring);
+    
+    if (sqe) {
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->addr = (unsigned long long)(uintptr_t)from | URING_RECV;
+        sqe->user_data = URING_CANCEL;
+    }
+    
+    cl->info.ci.client_sock = from->info.ci.client_sock;
+    from->info.ci.client_sock = -1;
+    
+    if (handoff_conn == -1 && !cl->throttled)
+        uring_prep_recv(cl);
+    uring_mark_dirty(cl);
+}
+
+/* Stops the recv of a client over budget. */
+static void
+uring_client_throttle(struct irpc_client *cl)
+{
+    struct io_uring_sqe *sqe;
+    
+    if (cl->inflight == cl->sends_inflight)
+        return;
+    if (!(sqe = irpc_uring_get_sqe(&ring))) {
+        irpc_uring_submit_and_wait(&ring, 0);
+        if (!(sqe = irpc_uring_get_sqe(&ring)))
+            return;
+    }
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = (unsigned long long)(uintptr_t)cl | URING_RECV;
+    sqe->user_data = URING_CANCEL;
+}
+
+/* A recv still being cancelled is armed again once it ended. */
+static void
+uring_client_unthrottle(struct irpc_client *cl)
+{
+    if (cl->info.ci.client_sock == -1 || cl->detached)
+        return;
+    
+    if (client_feed(cl) != 0 || cl->closing) {
+        uring_client_shutdown(cl);
+        return;
+    }
+    
+    if (!cl->throttled && handoff_conn == -1 &&
+        cl->inflight == cl->sends_inflight)
+        uring_prep_recv(cl);
+}
+
+/* Stops the recv of every client for a handoff. */
+static void
+uring_drain(void)
+{
+    struct io_uring_sqe *sqe;
+    struct irpc_client *cl;
+    
+    // Wakes the loop for the deadline of the drain.
+    if ((sqe = irpc_uring_get_sqe(&ring))) {
+        sqe->opcode = IORING_OP_TIMEOUT;
+        sqe->addr = (unsigned long long)(uintptr_t)&handoff_ts;
+        sqe->len = 1;
+        sqe->user_data = URING_HANDOFF;
+    }
+    
+    for (cl = clients; cl; cl = cl->next) {
+        if (cl->inflight == cl->sends_inflight)
+            continue;
+        if (!(sqe = irpc_uring_get_sqe(&ring))) {
+            irpc_uring_submit_and_wait(&ring, 0);
+            if (!(sqe = irpc_uring_get_sqe(&ring)))
+                return;
+        }
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->addr = (unsigned long long)(uintptr_t)cl | URING_RECV;
+        sqe->user_data = URING_CANCEL;
+    }
+}
+
+/* Starts the recv of every client, e.g. after a failed handoff. */
+static void
+uring_undrain(void)
+{
+    struct irpc_client *cl;
+    
+    for (cl = clients; cl; cl = cl->next) {
+        if (cl->info.ci.client_sock == -1 || cl->detached || cl->closing)
+            continue;
+        if (irpc_uring_sq_space(&ring) == 0)
+            irpc_uring_submit_and_wait(&ring, 0);
+        if (cl->inflight == cl->sends_inflight && !cl->throttled)
+            uring_prep_recv(cl);
+        if (cl->outq)
+            uring_mark_dirty(cl);
+    }
+}
+
+static void
+uring_handle_accept(int sock, int res, unsigned flags)
+{
+    struct irpc_client *cl;
+    
+    if (!(flags & IORING_CQE_F_MORE))
+        uring_prep_accept(sock);
+    
+    if (res < 0)
+        return;
+    
+    if (sock == handoff_sock) {
+        if (handoff_begin(res) == 0)
+            uring_drain();
+        return;
+    }
+    
+    if (!(cl = calloc(1, sizeof(struct irpc_client)))) {
+        close(res);
+        return;
+    }
+    
+    set_nodelay(res);
+    cl->info.ci.client_sock = res;
+    cl->info.ci.resumable = 1;
+    cl->info.ci.credit = (int)client_budget;
+    cl->info.ci.send_reply = job_send_reply;
+    cl->info.ci.send_reply_fd = job_send_reply_fd;
+    cl->info.ci.async_begin = job_async_begin;
+    cl->info.ci.async_end = job_async_end;
+    cl->last_active = time(NULL);
+    
+    cl->next = clients;
+    if (clients)
+        clients->prev = cl;
+    clients = cl;
+    nclients++;
+    
+    // Draining, the new server reads its requests.
+    if (handoff_conn == -1)
+        uring_prep_recv(cl);
+}
+
+static void
+uring_handle_recv(struct irpc_client *cl, int res, unsigned flags)
+{
+    unsigned bid;
+    
+    if (!(flags & IORING_CQE_F_MORE))
+        cl->inflight--;
+    
+    if (res > 0 && (flags & IORING_CQE_F_BUFFER)) {
+        bid = flags >> IORING_CQE_BUFFER_SHIFT;
+        cl->last_active = time(NULL);
+        if (!cl->closing && !cl->detached &&
+            tpl_gather(TPL_GATHER_MEM | TPL_GROW,
+                       irpc_uring_buf(&ring_bufs, bid),
+                       (size_t)res,
+                       &cl->gs,
+                       client_gather_cb,
+                       cl) < 0)
+            cl->closing = 1;
+        irpc_uring_buf_recycle(&ring_bufs, bid);
+    } else if (res == -ECANCELED) {
+        // Stopped for a handoff, a client over budget or a resume.
+    } else if (res != -ENOBUFS) {
+        // EOF or error.
+        uring_client_lost(cl);
+    }
+    
+    if (cl->closing) {
+        uring_client_shutdown(cl);
+        return;
+    }
+    if (cl->detached) {
+        uring_client_put(cl);
+        return;
+    }
+    
+    // Multishot recv ended, e.g. ran out of buffers, re-arm it.
+    if (!(flags & IORING_CQE_F_MORE) && handoff_conn == -1 && !cl->throttled)
+        uring_prep_recv(cl);
+}
+
+static void
+uring_handle_send(struct irpc_reply *us, int res)
+{
+    struct irpc_client *cl = us->cl;
+    
+    cl->inflight--;
+    cl->sends_inflight--;
+    
+    // MSG_WAITALL sends are only short on errors.
+    if (res < 0 || (size_t)res != us->len)
+        uring_client_lost(cl);
+    else if (cl->sends_inflight == 0 && cl->outq)
+        uring_mark_dirty(cl);
+    
+    client_sent(cl, us);
+    
+    uring_client_put(cl);
+}
+
+static void
+uring_handle_done(void)
+{
+    struct server_job *sj;
+    struct irpc_client *cl, *owner;
+    
+    uring_prep_done();
+    jobs_rearm();
+    
+    while ((sj = jobs_next())) {
+        cl = sj->cl;
+        cl->jobs--;
+        if ((owner = sj->owner))
+            owner->jobs--;
+        client_charge(cl, -(long)(sj->sz + IRPC_REPLY_RESERVE));
+        
+        if (client_take_replies(cl, sj) > 0)
+            uring_mark_dirty(cl);
+        
+        irpc_pool_put(&cl->pool, sj->img);
+        irpc_pool_put(&cl->pool, sj);
+        
+        uring_client_put(cl);
+        if (owner)
+            uring_client_put(owner);
+    }
+}
+
+/*
+ * Rings and provided buffers predate multishot recv (6.0), older
+ * kernels fail its first completion with -EINVAL.  Tries it on a
+ * socketpair, the epoll loop serves the clients unless it works.
+ */
+static int
+uring_probe_recv(void)
+{
+    struct io_uring_sqe *sqe;
+    struct io_uring_cqe *cqe;
+    int sv[2];
+    int ok = 0, more = 1;
+    
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0)
+        return -1;
+    
+    // One buffer, then EOF ends the multishot recv.
+    if (write(sv[1], "p", 1) != 1 || shutdown(sv[1], SHUT_WR) != 0 ||
+        !(sqe = irpc_uring_get_sqe(&ring))) {
+        close(sv[0]);
+        close(sv[1]);
+        return -1;
+    }
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = sv[0];
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = IRPC_URING_BGID;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->user_data = URING_PROBE;
+    
+    while (more) {
+        if (irpc_uring_submit_and_wait(&ring, 1) < 0)
+            break;
+        while ((cqe = irpc_uring_peek_cqe(&ring))) {
+            if (cqe->res > 0 && (cqe->flags & IORING_CQE_F_BUFFER)) {
+                ok = 1;
+                irpc_uring_buf_recycle(&ring_bufs,
+                                       cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+            }
+            if (!(cqe->flags & IORING_CQE_F_MORE))
+                more = 0;
+            irpc_uring_cqe_seen(&ring);
+        }
+    }
+    
+    close(sv[0]);
+    close(sv[1]);
+    
+    return ok && !more ? 0 : -1;
+}
+
+static int
+server_loop_uring(int sock, int usock)
+{
+    struct io_uring_cqe *cqe;
+    unsigned long long data;
+    unsigned flags;
+    int res;
+    
+    if (irpc_uring_init(&ring, IRPC_URING_ENTRIES) != 0)
+        return -1;
+    
+    if (irpc_uring_bufs_init(&ring, &ring_bufs, IRPC_URING_BGID,
+                             IRPC_URING_NBUFS, IRPC_URING_BUFSZ) != 0) {
+        irpc_uring_exit(&ring);
+        return -1;
+    }
+    
+    if (uring_probe_recv() != 0) {
+        irpc_uring_bufs_exit(&ring, &ring_bufs);
+        irpc_uring_exit(&ring);
+        return -1;
+    }
+    
+    backend_detach = uring_client_detach;
+    backend_adopt = uring_client_adopt;
+    backend_kick = uring_mark_dirty;
+    backend_throttle = uring_client_throttle;
+    backend_unthrottle = uring_client_unthrottle;
+    
+    uring_prep_accept(sock);
+    if (usock != -1)
+        uring_prep_accept(usock);
+    if (handoff_sock != -1)
+        uring_prep_accept(handoff_sock);
+    uring_prep_timeout();
+    uring_prep_done();
+    
+    // Sessions taken over from another server.
+    uring_undrain();
+    
+    while (1) {
+        uring_flush_dirty();
+        
+        if (irpc_uring_submit_and_wait(&ring, 1) < 0) {
+            fprintf(stderr, "Error! io_uring_enter()\n");
+            break;
+        }
+        
+        while ((cqe = irpc_uring_peek_cqe(&ring))) {
+            data = cqe->user_data;
+            res = cqe->res;
+            flags = cqe->flags;
+            irpc_uring_cqe_seen(&ring);
+            
+            switch (data & URING_TAG_MASK) {
+                case URING_ACCEPT:
+                    uring_handle_accept((int)(data >> 3), res, flags);
+                    break;
+                case URING_RECV:
+                    uring_handle_recv((struct irpc_client *)(uintptr_t)(data & ~URING_TAG_MASK), res, flags);
+                    break;
+                case URING_SEND:
+                    uring_handle_send((struct irpc_reply *)(uintptr_t)(data & ~URING_TAG_MASK), res);
+                    break;
+                case URING_TIMEOUT:
+                    drop_idle_clients(uring_client_shutdown);
+                    uring_prep_timeout();
+                    break;
+                case URING_DONE:
+                    uring_handle_done();
+                    break;
+                case URING_CANCEL:
+                case URING_HANDOFF:
+                case URING_PROBE:
+                    break;
+            }
+        }
+        
+        if (throttled)
+            clients_unthrottle();
+        
+        if (handoff_conn != -1 && (res = handoff_poll(sock, usock)) != 0) {
+            if (res > 0)
+                break;
+            uring_undrain();
+        }
+    }
+    
+    irpc_uring_bufs_exit(&ring, &ring_bufs);
+    irpc_uring_exit(&ring);
+    
+    return 0;
+}
+#else
+static int
+server_loop_uring(int sock, int usock)
+{
+    return -1;
+}
+#endif /* IRPC_HAVE_IO_URING */
+
+
+/* A budget given in KiB in bytes, 0 (a usage error) unless valid. */
+static size_t
+parse_budget(const char *arg)
+{
+    unsigned long kib;
+    char *end;
+    
+    // strtoul() would take signs and leading blanks.
+    if (arg[0] < '0' || arg[0] > '9')
+        return 0;
+    
+    errno = 0;
+    kib = strtoul(arg, &end, 10);
+    if (errno != 0 || *end != '\0' || kib > SIZE_MAX / 1024)
+        return 0;
+    
+    return kib * 1024;
+}
+
+int main(int argc, char *argv[])
+{   
+    int sock = -1, usock = -1, port;
+    int use_uring = 0, nworkers = IRPC_WORKERS;
+    const char *handoff_path = NULL;
+    int taken = 0;
+    int opt;
+    
+    while ((opt = getopt(argc, argv, "uw:H:m:M:")) != -1) {
+        switch (opt) {
+            case 'u':
+                use_uring = 1;
+                break;
+            case 'H':
+                handoff_path = optarg;
+                break;
+            case 'w':
+                nworkers = atoi(optarg);
+                break;
+            case 'm':
+                client_budget = parse_budget(optarg);
+                break;
+            case 'M':
+                global_budget = parse_budget(optarg);
+                break;
+            default:
+                argc = 0;
+                break;
+        }
+    }
+    argc -= optind - 1;
+    argv += optind - 1;
+    
+    // The budget is granted to clients as an int.
+    if (argc < 2 || nworkers < 1 || client_budget == 0 ||
+        client_budget > INT_MAX || global_budget == 0) {
+        printf("irpc_server: [-u] [-w workers] [-m KiB] [-M KiB] [-H handoff_path] port [unix_socket_path]\n");
+        printf("  -u  use the io_uring backend if the kernel supports it\n");
+        printf("  -w  number of worker threads (default %d)\n", IRPC_WORKERS);
+        printf("  -m  memory budget of a client in KiB (default %d)\n", IRPC_CLIENT_BUDGET);
+        printf("  -M  memory budget of all clients in KiB (default %d)\n", IRPC_GLOBAL_BUDGET);
+        printf("  -H  take over from the server at handoff_path, if any,\n");
+        printf("      and hand over to the next one started with it\n");
+        return 1;
+    }
+    
+    // A client vanishing mid-reply must not take the server down.
+    signal(SIGPIPE, SIG_IGN);
+    
+    if ((done_efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1 ||
+        irpc_ring_init(&done_ring, IRPC_DONE_RING) != 0 ||
+        !(usb_events = irpc_events_new()) ||
+        !(sched = irpc_sched_new(nworkers))) {
+        fprintf(stderr, "Error! Failed to start the worker threads.\n");
+        return 1;
+    }
+    
+    // Sessions attach to this context, it stays warm between them.
+    if (irpc_server_init() != 0)
+        fprintf(stderr, "irpc_server: libusb_init failed, retrying on IRPC_USB_INIT\n");
+    
+    // Binding again would take the unix socket from the running server.
+    if (handoff_path && (taken = handoff_take(handoff_path, &sock, &usock)) < 0) {
+        fprintf(stderr, "Error! Failed to take over from the running server.\n");
+        return 1;
+    }
+    if (taken)
+        clients_regather();
+    
+    if (sock == -1) {
+        sscanf(argv[1], "%d", &port);
+        sock = init_connection_or_die(port);
+        
+        if (argc > 2)
+            usock = init_unix_connection_or_die(argv[2], 0660);
+    }
+    
+    if (handoff_path) {
+        // The sessions and devices of all clients pass through it.
+        handoff_sock = init_unix_connection_or_die(handoff_path, 0600);
+    }
+    
+    if (use_uring && server_loop_uring(sock, usock) != 0) {
+        fprintf(stderr, "irpc_server: io_uring unavailable, using epoll\n");
+        use_uring = 0;
+    }
+    
+    if (!use_uring)
+        server_loop(sock, usock);
+    
+    // The new server owns the sockets and devices now.
+    if (handoff_done)
+        return 0;
+    
+    close(sock);
+    if (usock != -1) {
+        close(usock);
+        unlink(argv[2]);
+    }
+    if (handoff_sock != -1) {
+        close(handoff_sock);
+        unlink(handoff_path);
+    }
+    
+    irpc_sched_free(sched);
+    irpc_events_free(usb_events);
+    irpc_server_exit();
+    irpc_ring_exit(&done_ring);
+    close(done_efd);
     
     return 0;
 }
@@ -0,0 +1,299 @@
+/**
+ * libirpc - irpc_uring.c
+ * Copyright (C) 2010 Manuel Gebele
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+#include "irpc_uring.h"
+
+#ifdef IRPC_HAVE_IO_URING
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#define irpc_load_acquire(p)        __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define irpc_store_release(p, v)    __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+
+static int
+sys_io_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+    return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int
+sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int
+sys_io_uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args)
+{
+    return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+int
+irpc_uring_init(struct irpc_uring *ring, unsigned entries)
+{
+    struct io_uring_params p;
+    char *sq, *cq;
+    
+    bzero(ring, sizeof(struct irpc_uring));
+    bzero(&p, sizeof p);
+    
+    ring->fd = sys_io_uring_setup(entries, &p);
+    if (ring->fd < 0)
+        return -1;
+    
+    ring->sq_ring_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ring->cq_ring_sz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_ring_sz > ring->sq_ring_sz)
+            ring->sq_ring_sz = ring->cq_ring_sz;
+        ring->cq_ring_sz = ring->sq_ring_sz;
+    }
+    
+    ring->sq_ring = mmap(NULL, ring->sq_ring_sz, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ring == MAP_FAILED)
+        goto fail;
+    
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cq_ring = ring->sq_ring;
+    } else {
+        ring->cq_ring = mmap(NULL, ring->cq_ring_sz, PROT_READ | PROT_WRITE,
+                             MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+        if (ring->cq_ring == MAP_FAILED) {
+            munmap(ring->sq_ring, ring->sq_ring_sz);
+            goto fail;
+        }
+    }
+    
+    ring->sqes_sz = p.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_sz, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        if (ring->cq_ring != ring->sq_ring)
+            munmap(ring->cq_ring, ring->cq_ring_sz);
+        munmap(ring->sq_ring, ring->sq_ring_sz);
+        goto fail;
+    }
+    
+    sq = ring->sq_ring;
+    cq = ring->cq_ring;
+    ring->sq_head = (unsigned *)(sq + p.sq_off.head);
+    ring->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    ring->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)(sq + p.sq_off.array);
+    ring->cq_head = (unsigned *)(cq + p.cq_off.head);
+    ring->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    ring->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    
+    ring->sqe_tail = ring->sqe_submitted = *ring->sq_tail;
+    
+    return 0;
+    
+fail:
+    close(ring->fd);
+    ring->fd = -1;
+    return -1;
+}
+
+void
+irpc_uring_exit(struct irpc_uring *ring)
+{
+    munmap(ring->sqes, ring->sqes_sz);
+    if (ring->cq_ring != ring->sq_ring)
+        munmap(ring->cq_ring, ring->cq_ring_sz);
+    munmap(ring->sq_ring, ring->sq_ring_sz);
+    close(ring->fd);
+}
+
+/* Publish all handed out sqes to the kernel. */
+static unsigned
+irpc_uring_flush(struct irpc_uring *ring)
+{
+    unsigned mask = *ring->sq_mask;
+    unsigned n = ring->sqe_tail - ring->sqe_submitted;
+    unsigned tail = *ring->sq_tail;
+    
+    while (ring->sqe_submitted != ring->sqe_tail) {
+        ring->sq_array[tail & mask] = ring->sqe_submitted & mask;
+        tail++;
+        ring->sqe_submitted++;
+    }
+    irpc_store_release(ring->sq_tail, tail);
+    
+    return n;
+}
+
+/*
+ * Hand out the next free sqe, cleared.  If the submission queue is
+ * full everything queued so far is submitted first.
+ */
+struct io_uring_sqe *
+irpc_uring_get_sqe(struct irpc_uring *ring)
+{
+    struct io_uring_sqe *sqe;
+    unsigned mask = *ring->sq_mask;
+    
+    if (ring->sqe_tail - irpc_load_acquire(ring->sq_head) > mask) {
+        if (irpc_uring_submit_and_wait(ring, 0) < 0)
+            return NULL;
+        if (ring->sqe_tail - irpc_load_acquire(ring->sq_head) > mask)
+            return NULL;
+    }
+    
+    sqe = &ring->sqes[ring->sqe_tail & mask];
+    ring->sqe_tail++;
+    bzero(sqe, sizeof(struct io_uring_sqe));
+    
+    return sqe;
+}
+
+/* Number of sqes which can be handed out without an implicit submit. */
+unsigned
+irpc_uring_sq_space(struct irpc_uring *ring)
+{
+    return *ring->sq_mask + 1 - (ring->sqe_tail - irpc_load_acquire(ring->sq_head));
+}
+
+/*
+ * Submit everything queued and wait for at least wait_nr completions,
+ * all with a single io_uring_enter().
+ */
+int
+irpc_uring_submit_and_wait(struct irpc_uring *ring, unsigned wait_nr)
+{
+    unsigned n = irpc_uring_flush(ring);
+    unsigned flags = wait_nr ? IORING_ENTER_GETEVENTS : 0;
+    int rc;
+    
+    if (n == 0 && wait_nr == 0)
+        return 0;
+    
+    do {
+        rc = sys_io_uring_enter(ring->fd, n, wait_nr, flags);
+    } while (rc == -1 && errno == EINTR);
+    
+    return rc;
+}
+
+struct io_uring_cqe *
+irpc_uring_peek_cqe(struct irpc_uring *ring)
+{
+    unsigned head = *ring->cq_head;
+    
+    if (head == irpc_load_acquire(ring->cq_tail))
+        return NULL;
+    
+    return &ring->cqes[head & *ring->cq_mask];
+}
+
+void
+irpc_uring_cqe_seen(struct irpc_uring *ring)
+{
+    irpc_store_release(ring->cq_head, *ring->cq_head + 1);
+}
+
+int
+irpc_uring_bufs_init(struct irpc_uring *ring,
+                     struct irpc_uring_bufs *bufs,
+                     unsigned bgid,
+                     unsigned nbufs,
+                     unsigned bufsz)
+{
+    struct io_uring_buf_reg reg;
+    unsigned i;
+    
+    bzero(bufs, sizeof(struct irpc_uring_bufs));
+    
+    // The kernel requires a power of two number of ring entries.
+    if (nbufs == 0 || (nbufs & (nbufs - 1)) != 0)
+        return -1;
+    
+    bufs->br_sz = nbufs * sizeof(struct io_uring_buf);
+    bufs->br = mmap(NULL, bufs->br_sz, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (bufs->br == MAP_FAILED)
+        return -1;
+    
+    if (!(bufs->base = malloc((size_t)nbufs * bufsz))) {
+        munmap(bufs->br, bufs->br_sz);
+        return -1;
+    }
+    
+    bufs->nbufs = nbufs;
+    bufs->bufsz = bufsz;
+    bufs->bgid = bgid;
+    
+    bzero(&reg, sizeof reg);
+    reg.ring_addr = (unsigned long)bufs->br;
+    reg.ring_entries = nbufs;
+    reg.bgid = bgid;
+    
+    if (sys_io_uring_register(ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) != 0) {
+        free(bufs->base);
+        munmap(bufs->br, bufs->br_sz);
+        return -1;
+    }
+    
+    for (i = 0; i < nbufs; i++)
+        irpc_uring_buf_recycle(bufs, i);
+    
+    return 0;
+}
+
+void
+irpc_uring_bufs_exit(struct irpc_uring *ring, struct irpc_uring_bufs *bufs)
+{
+    struct io_uring_buf_reg reg;
+    
+    bzero(&reg, sizeof reg);
+    reg.bgid = bufs->bgid;
+    sys_io_uring_register(ring->fd, IORING_UNREGISTER_PBUF_RING, &reg, 1);
+    
+    free(bufs->base);
+    munmap(bufs->br, bufs->br_sz);
+}
+
+char *
+irpc_uring_buf(struct irpc_uring_bufs *bufs, unsigned bid)
+{
+    return bufs->base + (size_t)bid * bufs->bufsz;
+}
+
+/* Give buffer bid back to the kernel. */
+void
+irpc_uring_buf_recycle(struct irpc_uring_bufs *bufs, unsigned bid)
+{
+    struct io_uring_buf *buf;
+    
+    buf = &bufs->br->bufs[bufs->tail & (bufs->nbufs - 1)];
+    buf->addr = (unsigned long)irpc_uring_buf(bufs, bid);
+    buf->len = bufs->bufsz;
+    buf->bid = bid;
+    
+    bufs->tail++;
+    irpc_store_release(&bufs->br->tail, bufs->tail);
+}
+
+#endif /* IRPC_HAVE_IO_URING */
@@ -0,0 +1,103 @@
+/**
+ * libirpc - irpc_uring.h
+ * Copyright (C) 2010 Manuel Gebele
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+#ifndef IRPC_URING_H
+#define IRPC_URING_H
+
+/*
+ * Minimal io_uring wrapper on top of the raw kernel interface, just
+ * enough for the server's network I/O: multishot accept and recv with
+ * a provided buffer ring, and (linked) sends.
+ */
+
+#ifdef __linux__
+#include <linux/io_uring.h>
+#endif
+
+/* Multishot recv (and with it provided buffer rings) came last. */
+#if defined(IORING_RECV_MULTISHOT) && defined(IORING_ACCEPT_MULTISHOT)
+#define IRPC_HAVE_IO_URING 1
+#endif
+
+#ifdef IRPC_HAVE_IO_URING
+
+#include <stddef.h>
+
+struct irpc_uring {
+    int fd;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    unsigned sqe_tail;                      /* Next sqe to hand out */
+    unsigned sqe_submitted;                 /* Already published to kernel */
+    void *sq_ring, *cq_ring;
+    size_t sq_ring_sz, cq_ring_sz, sqes_sz;
+};
+
+/* Provided buffer ring for buffer selecting recv. */
+struct irpc_uring_bufs {
+    struct io_uring_buf_ring *br;
+    char *base;
+    unsigned nbufs;
+    unsigned bufsz;
+    unsigned bgid;
+    unsigned short tail;                    /* Local copy of br->tail */
+    size_t br_sz;
+};
+
+int
+irpc_uring_init(struct irpc_uring *ring, unsigned entries);
+
+void
+irpc_uring_exit(struct irpc_uring *ring);
+
+struct io_uring_sqe *
+irpc_uring_get_sqe(struct irpc_uring *ring);
+
+unsigned
+irpc_uring_sq_space(struct irpc_uring *ring);
+
+int
+irpc_uring_submit_and_wait(struct irpc_uring *ring, unsigned wait_nr);
+
+struct io_uring_cqe *
+irpc_uring_peek_cqe(struct irpc_uring *ring);
+
+void
+irpc_uring_cqe_seen(struct irpc_uring *ring);
+
+int
+irpc_uring_bufs_init(struct irpc_uring *ring,
+                     struct irpc_uring_bufs *bufs,
+                     unsigned bgid,
+                     unsigned nbufs,
+                     unsigned bufsz);
+
+void
+irpc_uring_bufs_exit(struct irpc_uring *ring, struct irpc_uring_bufs *bufs);
+
+char *
+irpc_uring_buf(struct irpc_uring_bufs *bufs, unsigned bid);
+
+void
+irpc_uring_buf_recycle(struct irpc_uring_bufs *bufs, unsigned bid);
+
+#endif /* IRPC_HAVE_IO_URING */
+
+#endif /* IRPC_URING_H */
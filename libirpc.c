@@ -19,16 +19,28 @@
 #include "libirpc.h"
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
 #include <libusb-1.0/libusb.h>
 #include "libusbi.h"
 #include "tpl.h"
+#include "irpc_lz.h"
 
-// TODO: Add context handler for multiple clients.
-static libusb_context *irpc_ctx = NULL;
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include "os/linux_usbfs.h"
+#endif
+
+/* Defined by tpl.c, which leaves declaring it to its users. */
+extern tpl_hook_t tpl_hook;
 
-// TODO: Add device handler for multiple clients.
-static struct libusb_device_handle *irpc_handle = NULL; 
 
 static int dbgmsg = 1;
 
@@ -52,32 +64,1743 @@ printf(fmt, ##arg);      \
 #define IRPC_CTRL_TRANSFER_FMT      "S($(iiii))iiiiii"
 #define IRPC_CTRL_STR_INT_INT_FMT   "iic#"
 #define IRPC_BULK_TRANSFER_FMT      "S($(iiii))ciii"
+#define IRPC_BULK_FRAME_FMT         "S($(iiii))ciiiiB"      // codec, OUT data
+#define IRPC_BULK_FRAME_RET_FMT     "iiiB"                  // codec, IN data
 #define IRPC_CLEAR_HALT_FMT         "S($(iiii))c"
 #define IRPC_STRING_DESC_FMT        "S($(iiii))ii"
+#define IRPC_SESSION_FMT            "iiiiiiii#"
+#define IRPC_SESSION_RET_FMT        "iiiiiiS(iiii)#i#"
+#define IRPC_BATCH_FMT              "ii"
+#define IRPC_RESUME_FMT             "Ui"
+#define IRPC_RESUME_RET_FMT         "iiU"
+#define IRPC_ATTACH_FMT             "Ui"
+#define IRPC_STRIPE_FMT             "ii"
+
+#define IRPC_WRITE_TIMEOUT          5000    // ms a reply may wait for POLLOUT
+#define IRPC_DEVCACHE_TTL           500     // ms a device enumeration is reused
+#define IRPC_SESSION_TIMEOUT        2000    // ms to wait for a session open reply
+#define IRPC_RESUME_ATTEMPTS        3       // Reconnects per lost connection
+#define IRPC_STREAM_MAX_CHUNKS      256     // Max chunks of a bulk stream in flight
+#define IRPC_STREAM_INIT_CHUNKS     4       // In flight before a round trip is measured
+#define IRPC_STREAM_MIN_CHUNK       256     // Smallest chunk a stream is tuned to
+#define IRPC_STREAM_CHUNK_ALIGN     64      // Chunks are whole max size packets
+#define IRPC_PING_SAMPLES           3       // Pings taking the first round trip
+
+// Capabilities this library implements on the client side.
+#define IRPC_CLIENT_CAPS            (IRPC_CAP_ASYNC | IRPC_CAP_DELEGATE | \
+                                     IRPC_CAP_COMPRESS | IRPC_CAP_BATCH | \
+                                     IRPC_CAP_DEADLINE | \
+                                     IRPC_CAP_RESUME | IRPC_CAP_CREDIT | \
+                                     IRPC_CAP_STREAMS | IRPC_CAP_PING)
 
 // -----------------------------------------------------------------------------
 #pragma mark Function Call Identification
 // -----------------------------------------------------------------------------
 
-void
-irpc_send_func(irpc_func_t func, int sock)
+/*
+ * Write all of buf, also on a non-blocking socket.  A client which
+ * does not drain its socket within IRPC_WRITE_TIMEOUT gets an error.
+ */
+static int
+irpc_write_all(int sock, const char *buf, size_t len)
+{
+    struct pollfd pfd;
+    ssize_t rc;
+    
+    while (len > 0) {
+        rc = write(sock, buf, len);
+        if (rc > 0) {
+            buf += rc;
+            len -= rc;
+            continue;
+        }
+        if (rc == -1 && errno == EINTR)
+            continue;
+        if (rc == -1 && errno == EAGAIN) {
+            pfd.fd = sock;
+            pfd.events = POLLOUT;
+            if (poll(&pfd, 1, IRPC_WRITE_TIMEOUT) <= 0)
+                return -1;
+            continue;
+        }
+        return -1;
+    }
+    
+    return 0;
+}
+
+/* Function and argument packet in one write, so they travel together. */
+static int
+irpc_send_call(irpc_func_t func, tpl_node *args, int sock)
+{
+    tpl_node *tn = tpl_map(IRPC_INT_FMT, &func);
+    void *buf = NULL;
+    size_t len = 0, size = 0;
+    int retval = -1;
+    
+    tpl_pack(tn, 0);
+    if (tpl_dump(tn, TPL_MEM|TPL_GROW, &buf, &len, &size) == 0 &&
+        tpl_dump(args, TPL_MEM|TPL_GROW, &buf, &len, &size) == 0)
+        retval = irpc_write_all(sock, buf, len);
+    
+    free(buf);
+    tpl_free(tn);
+    
+    return retval;
+}
+
+long long
+irpc_clock_ms(void)
+{
+    struct timespec now;
+    
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    
+    return (long long)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+static long long
+irpc_clock_us(void)
+{
+    struct timespec now;
+    
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    
+    return (long long)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+static int
+irpc_resume(struct irpc_connection_info *ci);
+
+/*
+ * Client side packet I/O.  irpc_call() corks the packets of a call in
+ * the batch buffer and writes them at once, before reading the reply.
+ * While irpc_call_batch() collects a batch, requests go to the batch
+ * buffer and no replies are read; while it reads the replies, requests
+ * are not written again.
+ */
+
+/* Lend the batch buffer to a connection for one phase. */
+static void
+irpc_batch_enter(struct irpc_connection_info *ci,
+                 int phase,
+                 void *buf,
+                 size_t len,
+                 size_t size)
+{
+    ci->batch = phase;
+    ci->batch_buf = buf;
+    ci->batch_len = len;
+    ci->batch_size = size;
+    ci->batch_sent = 0;
+}
+
+static void
+irpc_batch_leave(struct irpc_connection_info *ci,
+                 void **buf,
+                 size_t *len,
+                 size_t *size)
+{
+    *buf = ci->batch_buf;
+    *len = ci->batch_len;
+    *size = ci->batch_size;
+    irpc_batch_enter(ci, 0, NULL, 0, 0);
+}
+
+static int
+irpc_dump_request(tpl_node *tn, struct irpc_connection_info *ci)
+{
+    if (ci->batch == IRPC_BATCH_REPLY)
+        return 0;
+    if (ci->batch != IRPC_BATCH_COLLECT && ci->batch != IRPC_BATCH_CORK)
+        return tpl_dump(tn, TPL_FD, ci->server_sock);
+    
+    // Serialized in place at the end of the batch.
+    return tpl_dump(tn, TPL_MEM|TPL_GROW,
+                    &ci->batch_buf, &ci->batch_len, &ci->batch_size);
+}
+
+/* The call stays corked until its reply, a resume may write it again. */
+static int
+irpc_flush_requests(struct irpc_connection_info *ci)
+{
+    if (ci->batch != IRPC_BATCH_CORK || ci->batch_sent == ci->batch_len)
+        return 0;
+    
+    if (irpc_write_all(ci->server_sock,
+                       (char *)ci->batch_buf + ci->batch_sent,
+                       ci->batch_len - ci->batch_sent) != 0)
+        return irpc_resume(ci);
+    ci->batch_sent = ci->batch_len;
+    
+    return 0;
+}
+
+static void
+irpc_dump_func(irpc_func_t func, struct irpc_connection_info *ci)
 {
     tpl_node *tn = tpl_map(IRPC_INT_FMT, &func);
     tpl_pack(tn, 0);
-    tpl_dump(tn, TPL_FD, sock);
-    tpl_free(tn);	
+    irpc_dump_request(tn, ci);
+    tpl_free(tn);
+    
+    // Requests are numbered alike on both sides, for IRPC_USB_CANCEL.
+    if (func != IRPC_USB_CANCEL && ci->batch != IRPC_BATCH_REPLY)
+        ci->seq++;
+}
+
+static pthread_once_t irpc_limits_once = PTHREAD_ONCE_INIT;
+
+static void
+irpc_limits_init(void)
+{
+    // The length in a packet's preamble is the peer's word only, no
+    // peer makes us allocate more than a packet.
+    tpl_hook.gather_max = IRPC_MAX_PACKET;
+}
+
+/* Process wide settings of tpl, set up once by the client or server. */
+static void
+irpc_limits(void)
+{
+    pthread_once(&irpc_limits_once, irpc_limits_init);
+}
+
+static int
+irpc_load_reply(tpl_node *tn, struct irpc_connection_info *ci)
+{
+    struct pollfd pfd = { -1, POLLIN, 0 };
+    long long left;
+    int attempts = 0;
+    int rc;
+    
+    if (ci->batch == IRPC_BATCH_COLLECT)
+        return -1;
+    if (irpc_flush_requests(ci) != 0)
+        return -1;
+    
+    // Past the deadline the transfer is cancelled, its reply follows.
+    if (ci->expires) {
+        pfd.fd = ci->server_sock;
+        left = ci->expires - irpc_clock_ms();
+        if (left <= 0 || poll(&pfd, 1, (int)left) == 0)
+            (void)irpc_cancel(ci);
+        ci->expires = 0;
+    }
+    
+    // Unpacked as it arrives, the data lands in the caller's buffers.
+    // Binary fields are views into recv_buf, valid until the next reply.
+    // After a resume the server sends the replies not received again.
+    while ((rc = tpl_load(tn,
+                          TPL_FD | TPL_STREAM | TPL_GROW | TPL_BORROW,
+                          ci->server_sock,
+                          &ci->recv_buf,
+                          &ci->recv_size)) == -2)
+        if (++attempts > IRPC_RESUME_ATTEMPTS || irpc_resume(ci) != 0)
+            return -1;
+    ci->replies++;
+    
+    return rc;
+}
+
+void
+irpc_send_func(irpc_func_t func, struct irpc_connection_info *ci)
+{
+    tpl_node *tn = NULL;
+    int deadline = ci->deadline;
+    
+    // Transfers carry the caller's time budget to servers knowing it.
+    if (deadline > 0 && (ci->caps & IRPC_CAP_DEADLINE) &&
+        (func == IRPC_USB_CONTROL_TRANSFER || func == IRPC_USB_BULK_TRANSFER)) {
+        irpc_dump_func(IRPC_USB_DEADLINE, ci);
+        tn = tpl_map(IRPC_INT_FMT, &deadline);
+        tpl_pack(tn, 0);
+        irpc_dump_request(tn, ci);
+        tpl_free(tn);
+        if (ci->batch == IRPC_BATCH_CORK || ci->batch == 0)
+            ci->expires = irpc_clock_ms() + deadline;
+    }
+    
+    irpc_dump_func(func, ci);
+}
+
+irpc_retval_t
+irpc_cancel(struct irpc_connection_info *ci)
+{
+    tpl_node *tn = NULL;
+    irpc_func_t func = IRPC_USB_CANCEL;
+    int seq = ci->seq;
+    int retval;
+    
+    if (!(ci->caps & IRPC_CAP_DEADLINE))
+        return IRPC_FAILURE;
+    
+    // Written right away, whatever the call is doing.
+    tn = tpl_map(IRPC_INT_FMT, &seq);
+    tpl_pack(tn, 0);
+    retval = irpc_send_call(func, tn, ci->server_sock);
+    tpl_free(tn);
+    
+    return retval == 0 ? IRPC_SUCCESS : IRPC_FAILURE;
 }
 
 irpc_func_t
 irpc_read_func(int sock)
 {
-    irpc_func_t func;
-    tpl_node *tn = tpl_map(IRPC_INT_FMT, &func);
-    tpl_load(tn, TPL_FD, sock);
-    tpl_unpack(tn, 0);
-    tpl_free(tn);
+    irpc_func_t func;
+    tpl_node *tn = tpl_map(IRPC_INT_FMT, &func);
+    tpl_load(tn, TPL_FD, sock);
+    tpl_unpack(tn, 0);
+    tpl_free(tn);
+    
+    return func;
+}
+
+// -----------------------------------------------------------------------------
+#pragma mark Shared Context
+// -----------------------------------------------------------------------------
+
+/*
+ * All sessions of a server share one libusb context, so IRPC_USB_INIT
+ * and IRPC_USB_EXIT only attach to and detach from it.  The context is
+ * refcounted; irpc_server_init() takes a reference for the lifetime of
+ * the server, which also keeps the device cache below warm.
+ *
+ * The cache holds the last enumeration for IRPC_DEVCACHE_TTL ms.  A
+ * lookup for a device which is not in it re-enumerates once, so new
+ * devices are found right away.
+ */
+
+static struct {
+    pthread_mutex_t lock;
+    libusb_context *ctx;
+    int refs;
+    libusb_device **devs;                   /* Cached enumeration */
+    ssize_t ndevs;
+    struct timespec stamp;                  /* Time of the enumeration */
+} irpc_shared = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .ctx = NULL,
+    .refs = 0,
+    .devs = NULL,
+    .ndevs = 0,
+    .stamp = { 0, 0 },
+};
+
+/* Called with irpc_shared.lock held. */
+static void
+irpc_devcache_refresh(void)
+{
+    libusb_device **list = NULL;
+    ssize_t cnt = libusb_get_device_list(irpc_shared.ctx, &list);
+    
+    if (cnt < 0)
+        return;
+    
+    if (irpc_shared.devs)
+        libusb_free_device_list(irpc_shared.devs, 1);
+    irpc_shared.devs = list;
+    irpc_shared.ndevs = cnt;
+    clock_gettime(CLOCK_MONOTONIC, &irpc_shared.stamp);
+}
+
+/* Called with irpc_shared.lock held. */
+static void
+irpc_devcache_update(void)
+{
+    struct timespec now;
+    long ms;
+    
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    ms = (now.tv_sec - irpc_shared.stamp.tv_sec) * 1000 +
+         (now.tv_nsec - irpc_shared.stamp.tv_nsec) / 1000000;
+    
+    if (!irpc_shared.devs || ms >= IRPC_DEVCACHE_TTL)
+        irpc_devcache_refresh();
+}
+
+/* Called with irpc_shared.lock held. */
+static void
+irpc_devcache_drop(void)
+{
+    if (irpc_shared.devs)
+        libusb_free_device_list(irpc_shared.devs, 1);
+    irpc_shared.devs = NULL;
+    irpc_shared.ndevs = 0;
+}
+
+static int
+irpc_context_attach(struct irpc_connection_info *ci)
+{
+    int retval = 0;
+    
+    if (ci->ctx)
+        return 0;
+    
+    pthread_mutex_lock(&irpc_shared.lock);
+    if (!irpc_shared.ctx) {
+        if ((retval = libusb_init(&irpc_shared.ctx)) != 0) {
+            irpc_shared.ctx = NULL;
+            pthread_mutex_unlock(&irpc_shared.lock);
+            return retval;
+        }
+        irpc_devcache_refresh();
+    }
+    irpc_shared.refs++;
+    ci->ctx = irpc_shared.ctx;
+    pthread_mutex_unlock(&irpc_shared.lock);
+    
+    return 0;
+}
+
+static void
+irpc_context_detach(struct irpc_connection_info *ci)
+{
+    if (!ci->ctx)
+        return;
+    ci->ctx = NULL;
+    
+    pthread_mutex_lock(&irpc_shared.lock);
+    if (--irpc_shared.refs == 0) {
+        irpc_devcache_drop();
+        libusb_exit(irpc_shared.ctx);
+        irpc_shared.ctx = NULL;
+    }
+    pthread_mutex_unlock(&irpc_shared.lock);
+}
+
+/*
+ * Referenced device with the given session id, or (session_data < 0)
+ * the first one matching vendor_id:product_id.  NULL if there is none.
+ */
+static libusb_device *
+irpc_devcache_find(int session_data, int vendor_id, int product_id)
+{
+    struct libusb_device_descriptor desc;
+    libusb_device *f = NULL;
+    int i, pass;
+    
+    pthread_mutex_lock(&irpc_shared.lock);
+    irpc_devcache_update();
+    for (pass = 0; pass < 2 && !f; pass++) {
+        if (pass == 1)
+            irpc_devcache_refresh();
+        for (i = 0; i < irpc_shared.ndevs; i++) {
+            libusb_device *dev = irpc_shared.devs[i];
+            if (session_data >= 0) {
+                if (dev->session_data != (unsigned long)session_data)
+                    continue;
+            } else if (libusb_get_device_descriptor(dev, &desc) != 0 ||
+                       desc.idVendor != vendor_id ||
+                       desc.idProduct != product_id) {
+                continue;
+            }
+            f = libusb_ref_device(dev);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&irpc_shared.lock);
+    
+    return f;
+}
+
+static int
+irpc_session_match(const struct irpc_session *filter,
+                   const struct libusb_device_descriptor *desc)
+{
+    int i;
+    
+    if (filter->vendor_id && filter->vendor_id != desc->idVendor)
+        return 0;
+    if (filter->n_products == 0)
+        return 1;
+    for (i = 0; i < filter->n_products && i < IRPC_MAX_FILTER; i++) {
+        if (filter->products[i] == desc->idProduct)
+            return 1;
+    }
+    
+    return 0;
+}
+
+/*
+ * Cached devices matching filter (NULL matches all).  With ids set it
+ * receives idVendor << 16 | idProduct of every listed device.
+ */
+static void
+irpc_devcache_list(struct irpc_device_list *devlist,
+                   const struct irpc_session *filter,
+                   int *ids)
+{
+    struct libusb_device_descriptor desc;
+    int i;
+    
+    pthread_mutex_lock(&irpc_shared.lock);
+    irpc_devcache_update();
+    for (i = 0; i < irpc_shared.ndevs && devlist->n_devs < IRPC_MAX_DEVS; i++) {
+        libusb_device *dev = irpc_shared.devs[i];
+        irpc_device *idev = &devlist->devs[devlist->n_devs];
+        
+        if ((filter || ids) && libusb_get_device_descriptor(dev, &desc) != 0)
+            continue;
+        if (filter && !irpc_session_match(filter, &desc))
+            continue;
+        if (ids)
+            ids[devlist->n_devs] = (desc.idVendor << 16) | desc.idProduct;
+        
+        idev->bus_number = dev->bus_number;
+        idev->device_address = dev->device_address;
+        idev->num_configurations = dev->num_configurations;
+        idev->session_data = dev->session_data;
+        devlist->n_devs++;
+    }
+    pthread_mutex_unlock(&irpc_shared.lock);
+}
+
+int
+irpc_server_init(void)
+{
+    struct irpc_connection_info ci;
+    
+    bzero(&ci, sizeof ci);
+    
+    irpc_limits();
+    
+    return irpc_context_attach(&ci);
+}
+
+void
+irpc_server_exit(void)
+{
+    struct irpc_connection_info ci;
+    
+    bzero(&ci, sizeof ci);
+    ci.ctx = irpc_shared.ctx;
+    
+    irpc_context_detach(&ci);
+}
+
+// -----------------------------------------------------------------------------
+#pragma mark Server I/O
+// -----------------------------------------------------------------------------
+
+/*
+ * Number of request packets following the function packet, indexed by
+ * irpc_func_t.  Event driven servers use this to know when a request
+ * has been gathered completely.
+ */
+static const int irpc_func_nargs_tbl[] = {
+    0,  /* IRPC_USB_INIT */
+    0,  /* IRPC_USB_EXIT */
+    0,  /* IRPC_USB_GET_DEVICE_LIST */
+    1,  /* IRPC_USB_GET_DEVICE_DESCRIPTOR */
+    1,  /* IRPC_USB_OPEN_DEVICE_WITH_VID_PID */
+    0,  /* IRPC_USB_CLOSE */
+    1,  /* IRPC_USB_OPEN */
+    1,  /* IRPC_USB_CLAIM_INTERFACE */
+    1,  /* IRPC_USB_RELEASE_INTERFACE */
+    1,  /* IRPC_USB_GET_CONFIGURATION */
+    1,  /* IRPC_USB_SET_CONFIGURATION */
+    1,  /* IRPC_USB_SET_INTERFACE_ALT_SETTING */
+    1,  /* IRPC_USB_RESET_DEVICE */
+    1,  /* IRPC_USB_CONTROL_TRANSFER */
+    1,  /* IRPC_USB_BULK_TRANSFER */
+    1,  /* IRPC_USB_CLEAR_HALT */
+    1,  /* IRPC_USB_GET_STRING_DESCRIPTOR_ASCII */
+    1,  /* IRPC_USB_DELEGATE */
+    1,  /* IRPC_USB_SESSION_OPEN */
+    1,  /* IRPC_USB_BATCH */
+    1,  /* IRPC_USB_DEADLINE */
+    1,  /* IRPC_USB_CANCEL */
+    1,  /* IRPC_USB_RESUME */
+    0,  /* IRPC_USB_CREDIT */
+    1,  /* IRPC_USB_STREAM_ATTACH */
+    1,  /* IRPC_USB_STRIPE */
+    0,  /* IRPC_USB_PING */
+};
+
+int
+irpc_func_nargs(irpc_func_t func)
+{
+    int n = sizeof(irpc_func_nargs_tbl) / sizeof(irpc_func_nargs_tbl[0]);
+    
+    if ((int)func < 0 || (int)func >= n)
+        return -1;
+    
+    return irpc_func_nargs_tbl[func];
+}
+
+irpc_retval_t
+irpc_func_from_image(void *img, size_t sz, irpc_func_t *func)
+{
+    irpc_retval_t retval = IRPC_SUCCESS;
+    tpl_node *tn = tpl_map(IRPC_INT_FMT, func);
+    
+    if (tpl_load(tn, TPL_MEM, img, sz) != 0 || tpl_unpack(tn, 0) <= 0)
+        retval = IRPC_FAILURE;
+    tpl_free(tn);
+    
+    return retval;
+}
+
+/*
+ * Release the libusb state of a connection.  Also used by servers when
+ * a client goes away without IRPC_USB_EXIT.
+ */
+void
+irpc_server_cleanup(struct irpc_connection_info *ci)
+{
+    if (ci->handle) {
+        libusb_close(ci->handle);
+        ci->handle = NULL;
+    }
+    irpc_context_detach(ci);
+    ci->version = 0;
+    ci->caps = 0;
+    ci->max_payload = 0;
+    free(ci->recv_buf);
+    ci->recv_buf = NULL;
+    ci->recv_size = 0;
+}
+
+/*
+ * Identifies the device opened by a connection, -1 if there is none.
+ * Connections with the same key operate on the same physical device.
+ */
+int
+irpc_device_key(struct irpc_connection_info *ci)
+{
+    if (!ci->handle)
+        return -1;
+    
+    return (ci->handle->dev->bus_number << 8) | ci->handle->dev->device_address;
+}
+
+/*
+ * Load a request packet.  If the server has already gathered the
+ * packet (ci->req_img) it is taken from memory, otherwise it is read
+ * from the client socket.  Binary fields are views into the packet,
+ * valid until tpl_free(tn), and not to be freed.
+ */
+static int
+irpc_load_request(tpl_node *tn, struct irpc_connection_info *ci)
+{
+    if (ci->req_img)
+        return tpl_load(tn, TPL_MEM | TPL_BORROW, ci->req_img, ci->req_sz);
+    
+    return tpl_load(tn,
+                    TPL_FD | TPL_GROW | TPL_BORROW,
+                    ci->client_sock,
+                    &ci->recv_buf,
+                    &ci->recv_size);
+}
+
+static int
+irpc_dump_direct(tpl_node *tn, int sock)
+{
+    void *buf = NULL;
+    size_t sz = 0;
+    int rc;
+    
+    if (tpl_dump(tn, TPL_MEM, &buf, &sz) != 0)
+        return -1;
+    
+    rc = irpc_write_all(sock, buf, sz);
+    free(buf);
+    
+    return rc;
+}
+
+static int
+irpc_dump_reply(tpl_node *tn, struct irpc_connection_info *ci)
+{
+    void *buf = NULL;
+    size_t sz = 0;
+    
+    if (!ci->send_reply)
+        return irpc_dump_direct(tn, ci->client_sock);
+    
+    if (tpl_dump(tn, TPL_MEM, &buf, &sz) != 0)
+        return -1;
+    
+    return ci->send_reply(ci, buf, sz);
+}
+
+// -----------------------------------------------------------------------------
+#pragma mark usbfs Delegation
+// -----------------------------------------------------------------------------
+
+/*
+ * A client sharing the host with the server may take over the usbfs
+ * file descriptor of the opened device.  The server still opens and
+ * closes the device (and thereby performs the access control), but
+ * the data path (control, bulk and clear halt) is driven by the client
+ * directly via usbfs ioctls, bypassing the network round-trip.
+ */
+
+static int
+irpc_send_fd(int sock, int fd)
+{
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    struct iovec iov;
+    char cbuf[CMSG_SPACE(sizeof(int))];
+    char dummy = 0;
+    
+    bzero(&msg, sizeof(struct msghdr));
+    bzero(cbuf, sizeof cbuf);
+    
+    // At least one byte of real data is needed to carry the ancillary data.
+    iov.iov_base = &dummy;
+    iov.iov_len = 1;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cbuf;
+    msg.msg_controllen = sizeof cbuf;
+    
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+    
+    return sendmsg(sock, &msg, 0) == 1 ? 0 : -1;
+}
+
+/*
+ * Like irpc_dump_reply(), fd is passed to the client after the reply.
+ * Fails without sending anything if the backend cannot pass fds.
+ */
+static int
+irpc_dump_reply_fd(tpl_node *tn, struct irpc_connection_info *ci, int fd)
+{
+    void *buf = NULL;
+    size_t sz = 0;
+    
+    if (!ci->send_reply) {
+        if (irpc_dump_direct(tn, ci->client_sock) != 0)
+            return -1;
+        if (irpc_send_fd(ci->client_sock, fd) != 0)
+            dbgmsg("irpc_dump_reply_fd: failed to pass fd\n");
+        return 0;
+    }
+    
+    if (!ci->send_reply_fd || tpl_dump(tn, TPL_MEM, &buf, &sz) != 0)
+        return -1;
+    
+    return ci->send_reply_fd(ci, buf, sz, fd);
+}
+
+static int
+irpc_recv_fd(int sock)
+{
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    struct iovec iov;
+    char cbuf[CMSG_SPACE(sizeof(int))];
+    char dummy;
+    int fd = -1;
+    
+    bzero(&msg, sizeof(struct msghdr));
+    
+    iov.iov_base = &dummy;
+    iov.iov_len = 1;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cbuf;
+    msg.msg_controllen = sizeof cbuf;
+    
+    if (recvmsg(sock, &msg, 0) != 1)
+        return -1;
+    
+    cmsg = CMSG_FIRSTHDR(&msg);
+    if (!cmsg ||
+        cmsg->cmsg_level != SOL_SOCKET ||
+        cmsg->cmsg_type != SCM_RIGHTS)
+        return -1;
+    
+    memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+    
+    return fd;
+}
+
+#ifdef __linux__
+static int
+irpc_usbfs_error(int err)
+{
+    switch (err) {
+        case ETIMEDOUT:
+            return LIBUSB_ERROR_TIMEOUT;
+        case EPIPE:
+            return LIBUSB_ERROR_PIPE;
+        case EOVERFLOW:
+            return LIBUSB_ERROR_OVERFLOW;
+        case ENODEV:
+            return LIBUSB_ERROR_NO_DEVICE;
+        case ENOENT:
+            return LIBUSB_ERROR_NOT_FOUND;
+        default:
+            return LIBUSB_ERROR_IO;
+    }
+}
+
+static int
+irpc_usbfs_control_transfer(struct irpc_connection_info *ci,
+                            int req_type,
+                            int req,
+                            int val,
+                            int idx,
+                            char data[],
+                            int length,
+                            int timeout,
+                            int *status)
+{
+    struct usbfs_ctrltransfer ctrl;
+    int r;
+    
+    ctrl.bmRequestType = req_type;
+    ctrl.bRequest = req;
+    ctrl.wValue = val;
+    ctrl.wIndex = idx;
+    ctrl.wLength = length;
+    ctrl.timeout = timeout;
+    ctrl.data = data;
+    
+    r = ioctl(ci->usbfs_fd, IOCTL_USBFS_CONTROL, &ctrl);
+    if (r < 0)
+        return irpc_usbfs_error(errno);
+    
+    // Same convenience status as irpc_send_usb_control_transfer().
+    if (r >= 5)
+        *status = (int)data[4];
+    
+    return r;
+}
+
+static int
+irpc_usbfs_bulk_transfer(struct irpc_connection_info *ci,
+                         char endpoint,
+                         char data[],
+                         int length,
+                         int *transfered,
+                         int timeout)
+{
+    struct usbfs_bulktransfer bulk;
+    int r;
+    
+    bulk.ep = (unsigned char)endpoint;
+    bulk.len = length;
+    bulk.timeout = timeout;
+    bulk.data = data;
+    
+    r = ioctl(ci->usbfs_fd, IOCTL_USBFS_BULK, &bulk);
+    if (r < 0) {
+        *transfered = 0;
+        return irpc_usbfs_error(errno);
+    }
+    *transfered = r;
+    
+    return LIBUSB_SUCCESS;
+}
+
+static int
+irpc_usbfs_clear_halt(struct irpc_connection_info *ci,
+                      char endpoint)
+{
+    unsigned int ep = (unsigned char)endpoint;
+    
+    if (ioctl(ci->usbfs_fd, IOCTL_USBFS_CLEAR_HALT, &ep) < 0)
+        return irpc_usbfs_error(errno);
+    
+    return LIBUSB_SUCCESS;
+}
+#endif
+
+static void
+irpc_usbfs_release(struct irpc_connection_info *ci)
+{
+    if (!ci->delegated)
+        return;
+    close(ci->usbfs_fd);
+    ci->usbfs_fd = -1;
+    ci->delegated = 0;
+}
+
+irpc_retval_t
+irpc_recv_usb_delegate(struct irpc_connection_info *ci,
+                       irpc_device_handle *handle)
+{
+    tpl_node *tn = NULL;
+    irpc_retval_t retval = IRPC_FAILURE;
+    irpc_func_t func = IRPC_USB_DELEGATE;
+    int sock = ci->server_sock;
+    int fd;
+    
+    irpc_send_func(func, ci);
+    
+    // Send irpc_device_handle to server.
+    tn = tpl_map(IRPC_DEV_HANDLE_FMT, handle);
+    tpl_pack(tn, 0);
+    irpc_dump_request(tn, ci);
+    tpl_free(tn);
+    
+    // Read usb_delegate packet.
+    tn = tpl_map(IRPC_INT_FMT, &retval);
+    if (irpc_load_reply(tn, ci) == 0)
+        tpl_unpack(tn, 0);
+    tpl_free(tn);
+    
+    if (retval == IRPC_FAILURE)
+        return retval;
+    
+    // The usbfs fd follows the reply as SCM_RIGHTS ancillary data.
+    if ((fd = irpc_recv_fd(sock)) < 0)
+        return IRPC_FAILURE;
+    
+    irpc_usbfs_release(ci);
+    ci->usbfs_fd = fd;
+    ci->delegated = 1;
+    
+    return retval;
+}
+
+void
+irpc_send_usb_delegate(struct irpc_connection_info *ci)
+{
+    tpl_node *tn = NULL;
+    irpc_retval_t retval = IRPC_FAILURE;
+    irpc_device_handle handle;
+    struct sockaddr_storage addr;
+    socklen_t addrlen = sizeof addr;
+    int sock = ci->client_sock;
+    int fd = -1;
+    
+    // Read irpc_device_handle from client.
+    tn = tpl_map(IRPC_DEV_HANDLE_FMT, &handle);
+    irpc_load_request(tn, ci);
+    tpl_unpack(tn, 0);
+    tpl_free(tn);
+    
+#ifdef __linux__
+    // Delegate only to peers on this host and only an opened device.
+    if (ci->handle &&
+        getsockname(sock, (struct sockaddr *)&addr, &addrlen) == 0 &&
+        addr.ss_family == AF_UNIX) {
+        fd = ((struct linux_device_handle_priv *)ci->handle->os_priv)->fd;
+        retval = IRPC_SUCCESS;
+    }
+#endif
+    
+    // Send usb_delegate packet, the fd follows it.
+    tn = tpl_map(IRPC_INT_FMT, &retval);
+    tpl_pack(tn, 0);
+    if (retval == IRPC_SUCCESS) {
+        if (irpc_dump_reply_fd(tn, ci, fd) == 0) {
+            tpl_free(tn);
+            return;
+        }
+        // The client must not wait for an fd which never comes.
+        dbgmsg("irpc_send_usb_delegate: failed to pass usbfs fd\n");
+        tpl_free(tn);
+        retval = IRPC_FAILURE;
+        tn = tpl_map(IRPC_INT_FMT, &retval);
+        tpl_pack(tn, 0);
+    }
+    irpc_dump_reply(tn, ci);
+    tpl_free(tn);
+}
+
+irpc_retval_t
+irpc_usb_delegate(struct irpc_connection_info *ci,
+                  irpc_context_t ctx,
+                  irpc_device_handle *handle)
+{
+    irpc_retval_t retval = IRPC_SUCCESS;
+    
+    if (ctx == IRPC_CONTEXT_SERVER)
+        (void)irpc_send_usb_delegate(ci);
+    else
+        retval = irpc_recv_usb_delegate(ci, handle);
+    
+    return retval;
+}
+
+// -----------------------------------------------------------------------------
+#pragma mark Server Handoff
+// -----------------------------------------------------------------------------
+
+/*
+ * A server handing its sessions over to a new server process passes
+ * the usbfs fd of every opened device along.  The new process opens
+ * the device and swaps the passed fd in, so the device file is never
+ * closed: claimed interfaces, the configuration and alternate settings
+ * survive the handoff.
+ */
+
+int
+irpc_server_export(struct irpc_connection_info *ci,
+                   int *session_data,
+                   unsigned long long *claimed,
+                   int *fd)
+{
+    *session_data = -1;
+    *claimed = 0;
+    *fd = -1;
+    
+    if (!ci->handle)
+        return 0;
+    
+#ifdef __linux__
+    *session_data = ci->handle->dev->session_data;
+    *claimed = ci->handle->claimed_interfaces;
+    *fd = ((struct linux_device_handle_priv *)ci->handle->os_priv)->fd;
+    
+    return 0;
+#else
+    return -1;
+#endif
+}
+
+int
+irpc_server_import(struct irpc_connection_info *ci,
+                   int session_data,
+                   unsigned long long claimed,
+                   int fd)
+{
+#ifdef __linux__
+    struct linux_device_handle_priv *hpriv;
+    libusb_device *f;
+#endif
+    
+    if (irpc_context_attach(ci) != 0) {
+        if (fd != -1)
+            close(fd);
+        return -1;
+    }
+    
+    if (fd == -1)
+        return 0;
+    
+#ifdef __linux__
+    if (!(f = irpc_devcache_find(session_data, 0, 0)))
+        goto fail;
+    
+    if (libusb_open(f, &ci->handle) != 0) {
+        ci->handle = NULL;
+        libusb_unref_device(f);
+        goto fail;
+    }
+    libusb_unref_device(f);
+    
+    // Keep the fd number libusb polls, but make it the passed file.
+    hpriv = (struct linux_device_handle_priv *)ci->handle->os_priv;
+    if (dup2(fd, hpriv->fd) == -1) {
+        libusb_close(ci->handle);
+        ci->handle = NULL;
+        goto fail;
+    }
+    close(fd);
+    ci->handle->claimed_interfaces = claimed;
+    
+    return 0;
+    
+fail:
+#endif
+    close(fd);
+    
+    return -1;
+}
+
+// -----------------------------------------------------------------------------
+#pragma mark Session Open
+// -----------------------------------------------------------------------------
+
+irpc_retval_t
+irpc_recv_usb_resume(struct irpc_connection_info *ci);
+
+irpc_retval_t
+irpc_recv_usb_credit(struct irpc_connection_info *ci);
+
+/*
+ * IRPC_USB_SESSION_OPEN does the work of IRPC_USB_INIT and, if asked
+ * for, IRPC_USB_GET_DEVICE_LIST in one round trip.  The request carries
+ * the client's protocol version range, capabilities and max payload
+ * plus an optional vendor/product filter; the reply what both sides
+ * agreed on, the init status and the matching devices with their ids,
+ * which spares the usual descriptor call per device.
+ *
+ * Servers predating the call drop the connection (or never answer);
+ * the client then reports a version of 0 and may fall back to
+ * IRPC_USB_INIT.  A late reply would pass for the one of the next
+ * call, so the connection is replaced first: by ci.reconnect, or
+ * server_sock is -1 and the caller connects again.
+ */
+
+/* Capabilities this server offers the connection. */
+static int
+irpc_server_caps(struct irpc_connection_info *ci)
+{
+    struct sockaddr_storage addr;
+    socklen_t addrlen = sizeof addr;
+    int caps = IRPC_CAP_BATCH | IRPC_CAP_DEADLINE | IRPC_CAP_PING;
+    int local;
+    
+    local = getsockname(ci->client_sock, (struct sockaddr *)&addr, &addrlen) == 0 &&
+            addr.ss_family == AF_UNIX;
+    
+    if (ci->async_begin)
+        caps |= IRPC_CAP_ASYNC;
+#ifdef __linux__
+    if (local)
+        caps |= IRPC_CAP_DELEGATE;
+#endif
+    // Local connections do not drop, and passed fds cannot be replayed.
+    // Data streams join a session by its token.
+    if (ci->resumable && !local)
+        caps |= IRPC_CAP_RESUME | IRPC_CAP_STREAMS;
+    if (ci->credit > 0)
+        caps |= IRPC_CAP_CREDIT;
+    // Compressing only pays on a network.
+    if (!local)
+        caps |= IRPC_CAP_COMPRESS;
+    
+    return caps;
+}
+
+irpc_retval_t
+irpc_recv_usb_session_open(struct irpc_connection_info *ci,
+                           struct irpc_session *session,
+                           struct irpc_device_list *devlist)
+{
+    tpl_node *tn = NULL;
+    irpc_func_t func = IRPC_USB_SESSION_OPEN;
+    struct pollfd pfd = { ci->server_sock, POLLIN, 0 };
+    int version = IRPC_PROTOCOL_VERSION;
+    int min_version = IRPC_PROTOCOL_MIN_VERSION;
+    int caps = IRPC_CLIENT_CAPS;
+    int max_payload = IRPC_MAX_DATA;
+    
+    irpc_limits();
+    
+    // Announce everything unless the caller restricts it.
+    if (session->caps)
+        caps &= session->caps;
+    if (session->max_payload > 0 && session->max_payload < max_payload)
+        max_payload = session->max_payload;
+    
+    tn = tpl_map(IRPC_SESSION_FMT,
+                 &version,
+                 &min_version,
+                 &caps,
+                 &max_payload,
+                 &session->flags,
+                 &session->vendor_id,
+                 &session->n_products,
+                 session->products,
+                 IRPC_MAX_FILTER);
+    irpc_send_func(func, ci);
+    tpl_pack(tn, 0);
+    irpc_dump_request(tn, ci);
+    tpl_free(tn);
+    if (irpc_flush_requests(ci) != 0)
+        return IRPC_FAILURE;
+    
+    // Read usb_session_open packet.
+    bzero(devlist, sizeof(struct irpc_device_list));
+    session->version = 0;
+    session->status = IRPC_FAILURE;
+    tn = tpl_map(IRPC_SESSION_RET_FMT,
+                 &session->version,
+                 &session->min_version,
+                 &session->caps,
+                 &session->max_payload,
+                 &session->status,
+                 &devlist->n_devs,
+                 devlist->devs,
+                 IRPC_MAX_DEVS,
+                 session->ids,
+                 IRPC_MAX_DEVS);
+    if (poll(&pfd, 1, IRPC_SESSION_TIMEOUT) != 1 ||
+        irpc_load_reply(tn, ci) != 0 || tpl_unpack(tn, 0) <= 0) {
+        session->version = 0;
+        session->status = IRPC_FAILURE;
+    }
+    tpl_free(tn);
+    
+    // The fallback starts on a new connection.
+    if (session->version == 0) {
+        close(ci->server_sock);
+        ci->server_sock = ci->reconnect ? ci->reconnect(ci) : -1;
+        return IRPC_FAILURE;
+    }
+    
+    if (session->status != 0)
+        return IRPC_FAILURE;
+    
+    ci->version = session->version;
+    ci->caps = session->caps;
+    ci->max_payload = session->max_payload;
+    ci->credit = 0;
+    
+    if (ci->caps & IRPC_CAP_CREDIT)
+        (void)irpc_recv_usb_credit(ci);
+    
+    // Callers able to reconnect get a resumable session.
+    if ((ci->caps & IRPC_CAP_RESUME) && ci->reconnect)
+        (void)irpc_recv_usb_resume(ci);
+    
+    return IRPC_SUCCESS;
+}
+
+void
+irpc_send_usb_session_open(struct irpc_connection_info *ci)
+{
+    tpl_node *tn = NULL;
+    struct irpc_session session;
+    struct irpc_device_list devlist;
+    
+    bzero(&session, sizeof(struct irpc_session));
+    bzero(&devlist, sizeof(struct irpc_device_list));
+    
+    // Read usb_session_open request from client.
+    tn = tpl_map(IRPC_SESSION_FMT,
+                 &session.version,
+                 &session.min_version,
+                 &session.caps,
+                 &session.max_payload,
+                 &session.flags,
+                 &session.vendor_id,
+                 &session.n_products,
+                 session.products,
+                 IRPC_MAX_FILTER);
+    irpc_load_request(tn, ci);
+    tpl_unpack(tn, 0);
+    tpl_free(tn);
+    
+    // Agree on the highest version and the features both sides have.
+    if (session.version > IRPC_PROTOCOL_VERSION)
+        session.version = IRPC_PROTOCOL_VERSION;
+    if (session.version < session.min_version ||
+        session.version < IRPC_PROTOCOL_MIN_VERSION) {
+        session.version = 0;
+        session.status = LIBUSB_ERROR_NOT_SUPPORTED;
+    } else {
+        session.status = irpc_context_attach(ci);
+    }
+    session.min_version = IRPC_PROTOCOL_MIN_VERSION;
+    session.caps &= irpc_server_caps(ci);
+    if (session.max_payload <= 0 || session.max_payload > IRPC_MAX_DATA)
+        session.max_payload = IRPC_MAX_DATA;
+    
+    if (session.status == 0) {
+        ci->version = session.version;
+        ci->caps = session.caps;
+        ci->max_payload = session.max_payload;
+        if (session.flags & IRPC_SESSION_ENUMERATE)
+            irpc_devcache_list(&devlist, &session, session.ids);
+    }
+    
+    // Send usb_session_open packet.
+    tn = tpl_map(IRPC_SESSION_RET_FMT,
+                 &session.version,
+                 &session.min_version,
+                 &session.caps,
+                 &session.max_payload,
+                 &session.status,
+                 &devlist.n_devs,
+                 devlist.devs,
+                 IRPC_MAX_DEVS,
+                 session.ids,
+                 IRPC_MAX_DEVS);
+    tpl_pack(tn, 0);
+    irpc_dump_reply(tn, ci);
+    tpl_free(tn);
+}
+
+irpc_retval_t
+irpc_usb_session_open(struct irpc_connection_info *ci,
+                      irpc_context_t ctx,
+                      struct irpc_session *session,
+                      struct irpc_device_list *devlist)
+{
+    irpc_retval_t retval = IRPC_SUCCESS;
+    
+    if (ctx == IRPC_CONTEXT_SERVER)
+        (void)irpc_send_usb_session_open(ci);
+    else
+        retval = irpc_recv_usb_session_open(ci, session, devlist);
+    
+    return retval;
+}
+
+// -----------------------------------------------------------------------------
+#pragma mark Session Resume
+// -----------------------------------------------------------------------------
+
+/*
+ * A session holding a token survives its connection: the server keeps
+ * the libusb context, the opened device and its claimed interfaces
+ * for a grace period, and keeps the last replies it sent.  Clients ask
+ * for a token with IRPC_USB_RESUME (token 0) once the session is open.
+ *
+ * When the connection fails the client reconnects through ci.reconnect
+ * and sends IRPC_USB_RESUME with the token and the number of replies
+ * it received, ahead of any other request.  The server moves the
+ * session to the new connection and answers with the number of
+ * requests it got, followed by the replies the client has not seen.
+ * A corked call which did not reach the server is written again.
+ * Posted calls and batches lost on the way end the session.
+ */
+
+irpc_retval_t
+irpc_recv_usb_resume(struct irpc_connection_info *ci)
+{
+    tpl_node *tn = NULL;
+    irpc_func_t func = IRPC_USB_RESUME;
+    unsigned long long token = 0;
+    int replies = 0;
+    int status = IRPC_FAILURE;
+    int seq = 0;
+    
+    irpc_send_func(func, ci);
+    
+    // Send usb_resume request to server, token 0 asks for one.
+    tn = tpl_map(IRPC_RESUME_FMT, &token, &replies);
+    tpl_pack(tn, 0);
+    irpc_dump_request(tn, ci);
+    tpl_free(tn);
+    
+    // Read usb_resume packet.
+    tn = tpl_map(IRPC_RESUME_RET_FMT, &status, &seq, &token);
+    if (irpc_load_reply(tn, ci) == 0)
+        tpl_unpack(tn, 0);
+    else
+        status = IRPC_FAILURE;
+    tpl_free(tn);
+    
+    if (status != 0 || !token)
+        return IRPC_FAILURE;
+    ci->token = token;
+    
+    return IRPC_SUCCESS;
+}
+
+/* Server: hands out the token the I/O backend assigned, if any. */
+void
+irpc_send_usb_resume(struct irpc_connection_info *ci)
+{
+    tpl_node *tn = NULL;
+    unsigned long long token = 0;
+    int replies = 0;
+    int status;
+    
+    // Read usb_resume request from client.
+    tn = tpl_map(IRPC_RESUME_FMT, &token, &replies);
+    irpc_load_request(tn, ci);
+    tpl_unpack(tn, 0);
+    tpl_free(tn);
+    
+    // Resumes are up to the backend, they never get here.
+    if (token)
+        status = LIBUSB_ERROR_NOT_FOUND;
+    else if (!ci->token)
+        status = LIBUSB_ERROR_NOT_SUPPORTED;
+    else
+        status = 0;
+    
+    // Send usb_resume packet.
+    token = ci->token;
+    tn = tpl_map(IRPC_RESUME_RET_FMT, &status, &ci->seq, &token);
+    tpl_pack(tn, 0);
+    irpc_dump_reply(tn, ci);
+    tpl_free(tn);
+}
+
+irpc_retval_t
+irpc_resume_from_image(void *img,
+                       size_t sz,
+                       unsigned long long *token,
+                       int *replies)
+{
+    irpc_retval_t retval = IRPC_SUCCESS;
+    tpl_node *tn = tpl_map(IRPC_RESUME_FMT, token, replies);
+    
+    if (!img || tpl_load(tn, TPL_MEM, img, sz) != 0 || tpl_unpack(tn, 0) <= 0)
+        retval = IRPC_FAILURE;
+    tpl_free(tn);
+    
+    return retval;
+}
+
+int
+irpc_resume_reply(int status,
+                  int seq,
+                  unsigned long long token,
+                  void **buf,
+                  size_t *sz)
+{
+    tpl_node *tn = tpl_map(IRPC_RESUME_RET_FMT, &status, &seq, &token);
+    int rc;
+    
+    *buf = NULL;
+    tpl_pack(tn, 0);
+    rc = tpl_dump(tn, TPL_MEM, buf, sz);
+    tpl_free(tn);
+    
+    return rc;
+}
+
+/*
+ * Client: moves the session to a new connection after a failed read
+ * or write.  Returns 0 if the call in progress may go on reading its
+ * reply.  On failure the session is gone for good.
+ */
+static int
+irpc_resume(struct irpc_connection_info *ci)
+{
+    tpl_node *tn = NULL;
+    struct pollfd pfd;
+    unsigned long long token = ci->token, reply_token;
+    int replies = ci->replies;
+    int status = LIBUSB_ERROR_IO;
+    int seq = 0;
+    int attempt, sock, rc;
+    
+    if (!token || !ci->reconnect)
+        return -1;
+    
+    for (attempt = 0; attempt < IRPC_RESUME_ATTEMPTS; attempt++) {
+        close(ci->server_sock);
+        if ((ci->server_sock = sock = ci->reconnect(ci)) < 0)
+            break;
+        
+        tn = tpl_map(IRPC_RESUME_FMT, &token, &replies);
+        tpl_pack(tn, 0);
+        rc = irpc_send_call(IRPC_USB_RESUME, tn, sock);
+        tpl_free(tn);
+        
+        pfd.fd = sock;
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+        status = LIBUSB_ERROR_IO;
+        tn = tpl_map(IRPC_RESUME_RET_FMT, &status, &seq, &reply_token);
+        if (rc != 0 || poll(&pfd, 1, IRPC_SESSION_TIMEOUT) != 1 ||
+            tpl_load(tn, TPL_FD, sock) != 0 || tpl_unpack(tn, 0) <= 0)
+            status = LIBUSB_ERROR_IO;
+        tpl_free(tn);
+        
+        // Busy: the server is still letting go of the old connection.
+        if (status != LIBUSB_ERROR_IO && status != LIBUSB_ERROR_BUSY)
+            break;
+    }
+    
+    if (status != 0)
+        goto lost;
+    
+    // The server got every request, the replies are on their way.
+    if (seq == ci->seq) {
+        ci->batch_sent = ci->batch_len;
+        return 0;
+    }
+    
+    // Only (the start of) the corked call may be missing.
+    if (ci->batch != IRPC_BATCH_CORK || seq < ci->cork_seq || seq > ci->seq)
+        goto lost;
+    
+    ci->seq = seq + ci->seq - ci->cork_seq;
+    ci->cork_seq = seq;
+    if (irpc_write_all(ci->server_sock, ci->batch_buf, ci->batch_len) != 0)
+        goto lost;
+    ci->batch_sent = ci->batch_len;
+    
+    return 0;
+    
+lost:
+    ci->token = 0;
+    return -1;
+}
+
+// -----------------------------------------------------------------------------
+#pragma mark Flow Control
+// -----------------------------------------------------------------------------
+
+/*
+ * A server holds the requests of a client until they ran and its
+ * replies until they are sent, within a memory budget per client (and
+ * one for all clients).  A client over budget is not read from until
+ * the memory is freed again, so a pipelining client stalls on a full
+ * socket unless it reads replies meanwhile.
+ *
+ * Servers with IRPC_CAP_CREDIT tell the client its budget with
+ * IRPC_USB_CREDIT once the session is open.  Posted and batched calls
+ * then stay within it: each call in flight is charged its request plus
+ * IRPC_REPLY_RESERVE, and replies are read before more calls go out.
+ */
+
+irpc_retval_t
+irpc_recv_usb_credit(struct irpc_connection_info *ci)
+{
+    tpl_node *tn = NULL;
+    irpc_func_t func = IRPC_USB_CREDIT;
+    int credit = 0;
+    
+    irpc_send_func(func, ci);
+    
+    // Read usb_credit packet.
+    tn = tpl_map(IRPC_INT_FMT, &credit);
+    if (irpc_load_reply(tn, ci) == 0)
+        tpl_unpack(tn, 0);
+    tpl_free(tn);
+    
+    // One call at a time always fits, however small the credit.
+    ci->credit = credit > 0 ? credit : 0;
+    
+    return ci->credit > 0 ? IRPC_SUCCESS : IRPC_FAILURE;
+}
+
+void
+irpc_send_usb_credit(struct irpc_connection_info *ci)
+{
+    tpl_node *tn = NULL;
+    int credit = ci->credit;
+    
+    // Send usb_credit packet.
+    tn = tpl_map(IRPC_INT_FMT, &credit);
+    tpl_pack(tn, 0);
+    irpc_dump_reply(tn, ci);
+    tpl_free(tn);
+}
+
+/* What a call in flight with a request of len bytes is charged. */
+static int
+irpc_call_cost(size_t len)
+{
+    return (int)len + IRPC_REPLY_RESERVE;
+}
+
+// -----------------------------------------------------------------------------
+#pragma mark Ping
+// -----------------------------------------------------------------------------
+
+/*
+ * IRPC_USB_PING runs no libusb call, its reply takes the round trip
+ * of the network and the server alone.  Clients keep the shortest one
+ * in ci.rtt; irpc_bulk_stream() pings once if it has none yet.
+ */
+
+irpc_retval_t
+irpc_recv_usb_ping(struct irpc_connection_info *ci)
+{
+    tpl_node *tn = NULL;
+    irpc_func_t func = IRPC_USB_PING;
+    long long start = irpc_clock_us();
+    long long rtt;
+    int status = IRPC_FAILURE;
+    
+    irpc_send_func(func, ci);
+    
+    // Read usb_ping packet.
+    tn = tpl_map(IRPC_INT_FMT, &status);
+    if (irpc_load_reply(tn, ci) == 0)
+        tpl_unpack(tn, 0);
+    tpl_free(tn);
+    
+    if (status != 0)
+        return IRPC_FAILURE;
+    
+    rtt = irpc_clock_us() - start;
+    if (rtt < 1)
+        rtt = 1;
+    if (ci->rtt == 0 || rtt < ci->rtt)
+        ci->rtt = rtt;
+    
+    return IRPC_SUCCESS;
+}
+
+void
+irpc_send_usb_ping(struct irpc_connection_info *ci)
+{
+    tpl_node *tn = NULL;
+    int status = 0;
+    
+    ci->result = status;
+    // Send usb_ping packet.
+    tn = tpl_map(IRPC_INT_FMT, &status);
+    tpl_pack(tn, 0);
+    irpc_dump_reply(tn, ci);
+    tpl_free(tn);
+}
+
+// -----------------------------------------------------------------------------
+#pragma mark Data Streams
+// -----------------------------------------------------------------------------
+
+/*
+ * One connection carries no more than its congestion window allows.
+ * irpc_streams_open() adds data streams to a session: more connections,
+ * each joining it with IRPC_USB_STREAM_ATTACH and the session's token.
+ * irpc_bulk_stream() then deals its chunks out to them, each preceded
+ * by IRPC_USB_STRIPE with its number within the set of streams and the
+ * number of calls making it up.  The server runs the stripes in order
+ * on the session, whichever stream they came by, and answers each on
+ * the stream it came by.
+ *
+ * Streams are not resumed: when one fails the client closes all of
+ * them, so does the server, and the session's connection carries the
+ * transfers again.
+ */
+
+static void
+irpc_recv_usb_stripe(struct irpc_connection_info *ci, int seq, int calls)
+{
+    tpl_node *tn = NULL;
+    irpc_func_t func = IRPC_USB_STRIPE;
+    
+    irpc_send_func(func, ci);
+    
+    // Send stripe number and calls to server, there is no reply.
+    tn = tpl_map(IRPC_STRIPE_FMT, &seq, &calls);
+    tpl_pack(tn, 0);
+    irpc_dump_request(tn, ci);
+    tpl_free(tn);
+}
+
+/* Server: stripes are up to the backend, the calls just run. */
+void
+irpc_send_usb_stripe(struct irpc_connection_info *ci)
+{
+    tpl_node *tn = NULL;
+    int seq = 0, calls = 0;
+    
+    // Read stripe number and calls from client.
+    tn = tpl_map(IRPC_STRIPE_FMT, &seq, &calls);
+    irpc_load_request(tn, ci);
+    tpl_unpack(tn, 0);
+    tpl_free(tn);
+}
+
+/* Server: attaches are up to the backend, they never get here. */
+void
+irpc_send_usb_stream_attach(struct irpc_connection_info *ci)
+{
+    tpl_node *tn = NULL;
+    unsigned long long token = 0;
+    int status = LIBUSB_ERROR_NOT_SUPPORTED;
+    int set = 0;
+    
+    // Read usb_stream_attach request from client.
+    tn = tpl_map(IRPC_ATTACH_FMT, &token, &set);
+    irpc_load_request(tn, ci);
+    tpl_unpack(tn, 0);
+    tpl_free(tn);
+    
+    // Send usb_stream_attach packet.
+    tn = tpl_map(IRPC_INT_FMT, &status);
+    tpl_pack(tn, 0);
+    irpc_dump_reply(tn, ci);
+    tpl_free(tn);
+}
+
+irpc_retval_t
+irpc_attach_from_image(void *img,
+                       size_t sz,
+                       unsigned long long *token,
+                       int *set)
+{
+    irpc_retval_t retval = IRPC_SUCCESS;
+    tpl_node *tn = tpl_map(IRPC_ATTACH_FMT, token, set);
+    
+    if (!img || tpl_load(tn, TPL_MEM, img, sz) != 0 || tpl_unpack(tn, 0) <= 0)
+        retval = IRPC_FAILURE;
+    tpl_free(tn);
+    
+    return retval;
+}
+
+int
+irpc_attach_reply(int status, void **buf, size_t *sz)
+{
+    tpl_node *tn = tpl_map(IRPC_INT_FMT, &status);
+    int rc;
+    
+    *buf = NULL;
+    tpl_pack(tn, 0);
+    rc = tpl_dump(tn, TPL_MEM, buf, sz);
+    tpl_free(tn);
+    
+    return rc;
+}
+
+irpc_retval_t
+irpc_stripe_from_image(void *img, size_t sz, int *seq, int *calls)
+{
+    irpc_retval_t retval = IRPC_SUCCESS;
+    tpl_node *tn = tpl_map(IRPC_STRIPE_FMT, seq, calls);
+    
+    if (!img || tpl_load(tn, TPL_MEM, img, sz) != 0 || tpl_unpack(tn, 0) <= 0)
+        retval = IRPC_FAILURE;
+    tpl_free(tn);
+    
+    return retval;
+}
+
+static void
+irpc_streams_close(struct irpc_connection_info *ci)
+{
+    while (ci->nstreams > 0)
+        close(ci->streams[--ci->nstreams]);
+}
+
+irpc_retval_t
+irpc_streams_open(struct irpc_connection_info *ci, int n)
+{
+    tpl_node *tn = NULL;
+    struct pollfd pfd;
+    unsigned long long token = ci->token;
+    int status, set, sock, rc;
+    
+    irpc_streams_close(ci);
+    if (n <= 0)
+        return IRPC_SUCCESS;
+    if (n > IRPC_MAX_STREAMS || !token || !ci->reconnect ||
+        !(ci->caps & IRPC_CAP_STREAMS))
+        return IRPC_FAILURE;
+    
+    // A new set makes the server forget the streams of the old one.
+    set = ++ci->stream_set;
+    ci->stripe_seq = 0;
+    
+    while (ci->nstreams < n) {
+        if ((sock = ci->reconnect(ci)) < 0)
+            break;
+        
+        tn = tpl_map(IRPC_ATTACH_FMT, &token, &set);
+        tpl_pack(tn, 0);
+        rc = irpc_send_call(IRPC_USB_STREAM_ATTACH, tn, sock);
+        tpl_free(tn);
+        
+        pfd.fd = sock;
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+        status = LIBUSB_ERROR_IO;
+        tn = tpl_map(IRPC_INT_FMT, &status);
+        if (rc != 0 || poll(&pfd, 1, IRPC_SESSION_TIMEOUT) != 1 ||
+            tpl_load(tn, TPL_FD, sock) != 0 || tpl_unpack(tn, 0) <= 0)
+            status = LIBUSB_ERROR_IO;
+        tpl_free(tn);
+        
+        if (status != 0) {
+            close(sock);
+            break;
+        }
+        ci->streams[ci->nstreams++] = sock;
+    }
     
-    return func;
+    if (ci->nstreams == n)
+        return IRPC_SUCCESS;
+    
+    irpc_streams_close(ci);
+    
+    return IRPC_FAILURE;
 }
 
 // -----------------------------------------------------------------------------
@@ -90,14 +1813,14 @@ irpc_recv_usb_init(struct irpc_connection_info *ci)
     tpl_node *tn = NULL;
     irpc_retval_t retval = IRPC_FAILURE; 
     irpc_func_t func = IRPC_USB_INIT;
-    int sock = ci->server_sock;
     
-    irpc_send_func(func, sock);
+    irpc_limits();
+    irpc_send_func(func, ci);
     
     // Read usb_init packet.
     tn = tpl_map(IRPC_INT_FMT, &retval);
-    tpl_load(tn, TPL_FD, sock);
-    tpl_unpack(tn, 0);
+    if (irpc_load_reply(tn, ci) == 0)
+        tpl_unpack(tn, 0);
     tpl_free(tn);
     
     return retval;
@@ -107,13 +1830,13 @@ void
 irpc_send_usb_init(struct irpc_connection_info *ci)
 {
     tpl_node *tn = NULL;
-    int sock = ci->client_sock;
-    irpc_retval_t retval = libusb_init(&irpc_ctx);
+    irpc_retval_t retval = irpc_context_attach(ci);
     
+    ci->result = retval;
     // Send usb_init packet.
     tn = tpl_map(IRPC_INT_FMT, &retval);
     tpl_pack(tn, 0);
-    tpl_dump(tn, TPL_FD, sock);
+    irpc_dump_reply(tn, ci);
     tpl_free(tn);
 }
 
@@ -140,14 +1863,19 @@ irpc_usb_exit(struct irpc_connection_info *ci,
               irpc_context_t ctx)
 {    
     if (ctx == IRPC_CONTEXT_SERVER) {
-        libusb_exit(irpc_ctx);
+        irpc_server_cleanup(ci);
         return;
     }
     irpc_func_t func = IRPC_USB_EXIT;
-    int sock = ci->server_sock;
     
-    irpc_send_func(func, sock);
-    irpc_ctx = NULL;
+    irpc_usbfs_release(ci);
+    irpc_streams_close(ci);
+    
+    irpc_send_func(func, ci);
+    
+    free(ci->recv_buf);
+    ci->recv_buf = NULL;
+    ci->recv_size = 0;
 }
 
 // -----------------------------------------------------------------------------
@@ -160,17 +1888,16 @@ irpc_recv_usb_get_device_list(struct irpc_connection_info *ci,
 {
     tpl_node *tn = NULL;
     irpc_func_t func = IRPC_USB_GET_DEVICE_LIST;
-    int sock = ci->server_sock;
     
-    irpc_send_func(func, sock);
+    irpc_send_func(func, ci);
     
     // Read usb_get_device_list packet.
     tn = tpl_map(IRPC_DEVLIST_FMT,
                  &devlist->n_devs,
                  devlist->devs,
                  IRPC_MAX_DEVS);
-    tpl_load(tn, TPL_FD, sock);
-    tpl_unpack(tn, 0);
+    if (irpc_load_reply(tn, ci) == 0)
+        tpl_unpack(tn, 0);
     tpl_free(tn);
 }
 
@@ -178,23 +1905,12 @@ void
 irpc_send_usb_get_device_list(struct irpc_connection_info *ci)
 {
     tpl_node *tn = NULL;
-    libusb_device **list = NULL;
     struct irpc_device_list devlist;
-    int sock = ci->client_sock;
     
     bzero(&devlist, sizeof(struct irpc_device_list));
     
-    int i;
-    ssize_t cnt = libusb_get_device_list(irpc_ctx, &list);
-    for (i = 0; i < cnt && i < IRPC_MAX_DEVS; i++) {
-        libusb_device *dev = *(list + i);
-        irpc_device *idev = &devlist.devs[i];
-        idev->bus_number = dev->bus_number;
-        idev->device_address = dev->device_address;
-        idev->num_configurations = dev->num_configurations;
-        idev->session_data = dev->session_data;
-        devlist.n_devs++;
-    }
+    if (ci->ctx)
+        irpc_devcache_list(&devlist, NULL, NULL);
     
     // Send usb_get_device_list packet.
     tn = tpl_map(IRPC_DEVLIST_FMT,
@@ -202,10 +1918,8 @@ irpc_send_usb_get_device_list(struct irpc_connection_info *ci)
                  devlist.devs,
                  IRPC_MAX_DEVS);
     tpl_pack(tn, 0);
-    tpl_dump(tn, TPL_FD, sock);
+    irpc_dump_reply(tn, ci);
     tpl_free(tn);
-    
-    libusb_free_device_list(list, 1);
 }
 
 void
@@ -230,21 +1944,20 @@ irpc_recv_usb_get_device_descriptor(struct irpc_connection_info *ci,
 {
     tpl_node *tn = NULL;
     irpc_func_t func = IRPC_USB_GET_DEVICE_DESCRIPTOR;
-    irpc_retval_t retval;
-    int sock = ci->server_sock;
+    irpc_retval_t retval = IRPC_FAILURE;
     
-    irpc_send_func(func, sock);
+    irpc_send_func(func, ci);
     
     // Send irpc_device to server.
     tn = tpl_map(IRPC_DEV_FMT, idev);
     tpl_pack(tn, 0);
-    tpl_dump(tn, TPL_FD, sock);
+    irpc_dump_request(tn, ci);
     tpl_free(tn);
     
     // Read libusb_get_device_descriptor packet.
     tn = tpl_map(IRPC_DESC_FMT, desc, &retval);
-    tpl_load(tn, TPL_FD, sock);
-    tpl_unpack(tn, 0);
+    if (irpc_load_reply(tn, ci) == 0)
+        tpl_unpack(tn, 0);
     tpl_free(tn);
     
     return retval;
@@ -256,41 +1969,30 @@ irpc_send_usb_get_device_descriptor(struct irpc_connection_info *ci)
     tpl_node *tn = NULL;
     irpc_retval_t retval = IRPC_SUCCESS;
     libusb_device *f = NULL;
-    libusb_device **list = NULL;
     irpc_device idev;
     struct irpc_device_descriptor idesc;
     struct libusb_device_descriptor desc;
-    int sock = ci->client_sock;
     
     bzero(&idesc, sizeof(struct irpc_device_descriptor));
     
     // Read irpc_device from client.
     tn = tpl_map(IRPC_DEV_FMT, &idev);
-    tpl_load(tn, TPL_FD, sock);
+    irpc_load_request(tn, ci);
     tpl_unpack(tn, 0);
     tpl_free(tn);
     
     // Find corresponding usb_device.
-    int i;
-    ssize_t cnt = libusb_get_device_list(irpc_ctx, &list);
-    for (i = 0; i < cnt; i++) {
-        libusb_device *dev = list[i];
-        if (dev->session_data == idev.session_data) {
-            f = dev;
-            break;
-        }
-    }
-    
-    if (!f) {
+    if (!ci->ctx || !(f = irpc_devcache_find(idev.session_data, 0, 0))) {
         retval = IRPC_FAILURE;
         goto send;
     }
     
     if (libusb_get_device_descriptor(f, &desc) < 0) {
+        libusb_unref_device(f);
         retval = IRPC_FAILURE;
         goto send;
     }
-    libusb_free_device_list(list, 1);
+    libusb_unref_device(f);
     
     // Success, build descriptor
     idesc.bLength = desc.bLength;
@@ -309,10 +2011,11 @@ irpc_send_usb_get_device_descriptor(struct irpc_connection_info *ci)
     idesc.bNumConfigurations = desc.bNumConfigurations;
     
 send:
+    ci->result = retval;
     // Send libusb_get_device_descriptor packet.
     tn = tpl_map(IRPC_DESC_FMT, &idesc, &retval);
     tpl_pack(tn, 0);
-    tpl_dump(tn, TPL_FD, sock);
+    irpc_dump_reply(tn, ci);
     tpl_free(tn);  
 }
 
@@ -344,20 +2047,19 @@ irpc_recv_usb_open_device_with_vid_pid(struct irpc_connection_info *ci,
 {
     tpl_node *tn = NULL;
     irpc_func_t func = IRPC_USB_OPEN_DEVICE_WITH_VID_PID;
-    int sock = ci->server_sock;
     
-    irpc_send_func(func, sock);
+    irpc_send_func(func, ci);
     
     // Send vendor and product id to server.
     tn = tpl_map(IRPC_PRID_VEID_FMT, &vendor_id, &product_id);
     tpl_pack(tn, 0);
-    tpl_dump(tn, TPL_FD, sock);
+    irpc_dump_request(tn, ci);
     tpl_free(tn);
     
     // Read libusb_open_device_with_vid_pid packet.
     tn = tpl_map(IRPC_DEV_HANDLE_FMT, handle);
-    tpl_load(tn, TPL_FD, sock);
-    tpl_unpack(tn, 0);
+    if (irpc_load_reply(tn, ci) == 0)
+        tpl_unpack(tn, 0);
     tpl_free(tn);
 }
 
@@ -366,8 +2068,8 @@ irpc_send_usb_open_device_with_vid_pid(struct irpc_connection_info *ci)
 {
     tpl_node *tn = NULL;
     irpc_device_handle ihandle;
+    libusb_device *f = NULL;
     int vendor_id, product_id;
-    int sock = ci->client_sock;
     
     bzero(&ihandle, sizeof(irpc_device_handle));
     
@@ -375,30 +2077,35 @@ irpc_send_usb_open_device_with_vid_pid(struct irpc_connection_info *ci)
     tn = tpl_map(IRPC_PRID_VEID_FMT,
                  &vendor_id,
                  &product_id);
-    tpl_load(tn, TPL_FD, sock);
+    irpc_load_request(tn, ci);
     tpl_unpack(tn, 0);
     tpl_free(tn);
     
     // Close an already opened handle.
-    if (irpc_handle) {
-        libusb_close(irpc_handle);
-        irpc_handle = NULL;
+    if (ci->handle) {
+        libusb_close(ci->handle);
+        ci->handle = NULL;
     }
     
-    irpc_handle = libusb_open_device_with_vid_pid(irpc_ctx, vendor_id, product_id);
-    if (!irpc_handle)
+    // Like libusb_open_device_with_vid_pid(), minus the enumeration.
+    if (!ci->ctx || !(f = irpc_devcache_find(-1, vendor_id, product_id)))
+        goto send;
+    if (libusb_open(f, &ci->handle) != 0)
+        ci->handle = NULL;
+    libusb_unref_device(f);
+    if (!ci->handle)
         goto send;
     
-    ihandle.dev.bus_number = irpc_handle->dev->bus_number;
-    ihandle.dev.device_address = irpc_handle->dev->device_address;
-    ihandle.dev.num_configurations = irpc_handle->dev->num_configurations;
-    ihandle.dev.session_data = irpc_handle->dev->session_data;
+    ihandle.dev.bus_number = ci->handle->dev->bus_number;
+    ihandle.dev.device_address = ci->handle->dev->device_address;
+    ihandle.dev.num_configurations = ci->handle->dev->num_configurations;
+    ihandle.dev.session_data = ci->handle->dev->session_data;
     
 send:
     // Send libusb_open_device_with_vid_pid packet.
     tn = tpl_map(IRPC_DEV_HANDLE_FMT, &ihandle);
     tpl_pack(tn, 0);
-    tpl_dump(tn, TPL_FD, sock);
+    irpc_dump_reply(tn, ci);
     tpl_free(tn);
 }
 
@@ -430,17 +2137,19 @@ irpc_recv_usb_close(struct irpc_connection_info *ci,
      * structure in order to determine the correct handle.
      */
     irpc_func_t func = IRPC_USB_CLOSE;
-    int sock = ci->server_sock;
     
-    irpc_send_func(func, sock);
+    // The server owns the device lifecycle, drop our usbfs fd too.
+    irpc_usbfs_release(ci);
+    
+    irpc_send_func(func, ci);
 }
 
 void
-irpc_send_usb_close(struct irpc_connection_info *info)
+irpc_send_usb_close(struct irpc_connection_info *ci)
 {
-    if (!irpc_handle) return;
-    libusb_close(irpc_handle);
-    irpc_handle = NULL;
+    if (!ci->handle) return;
+    libusb_close(ci->handle);
+    ci->handle = NULL;
 }
 
 void
@@ -464,22 +2173,21 @@ irpc_recv_usb_open(struct irpc_connection_info *ci,
                    irpc_device *dev)
 {
     tpl_node *tn = NULL;
-    irpc_retval_t retval;
+    irpc_retval_t retval = IRPC_FAILURE;
     irpc_func_t func = IRPC_USB_OPEN;
-    int sock = ci->server_sock;
     
-    irpc_send_func(func, sock);
+    irpc_send_func(func, ci);
     
     // Send irpc_device to server.
     tn = tpl_map(IRPC_DEV_FMT, dev);
     tpl_pack(tn, 0);
-    tpl_dump(tn, TPL_FD, sock);
+    irpc_dump_request(tn, ci);
     tpl_free(tn);
     
     // Read libusb_open packet.
     tn = tpl_map(IRPC_DEV_HANDLE_RET_FMT, handle, &retval);
-    tpl_load(tn, TPL_FD, sock);
-    tpl_unpack(tn, 0);
+    if (irpc_load_reply(tn, ci) == 0)
+        tpl_unpack(tn, 0);
     tpl_free(tn);
     
     return retval;
@@ -492,53 +2200,46 @@ irpc_send_usb_open(struct irpc_connection_info *ci)
     irpc_retval_t retval = IRPC_SUCCESS;
     irpc_device idev;
     libusb_device *f = NULL;
-    libusb_device **list = NULL;
     irpc_device_handle ihandle;
-    int sock = ci->client_sock;
+    
+    bzero(&ihandle, sizeof(irpc_device_handle));
     
     // Read irpc_device from client.
     tn = tpl_map(IRPC_DEV_FMT, &idev);
-    tpl_load(tn, TPL_FD, sock);
+    irpc_load_request(tn, ci);
     tpl_unpack(tn, 0);
     tpl_free(tn);
     
-    int i;
-    ssize_t cnt = libusb_get_device_list(irpc_ctx, &list);
-    for (i = 0; i < cnt; i++) {
-        libusb_device *dev = list[i];
-        if (dev->session_data == idev.session_data) {
-            f = dev;
-            break;
-        }
-    }
-    
-    if (!f) {
+    if (!ci->ctx || !(f = irpc_devcache_find(idev.session_data, 0, 0))) {
         retval = IRPC_FAILURE;
         goto send;
     }
     
     // Close an already opened handle.
-    if (irpc_handle) {
-        libusb_close(irpc_handle);
-        irpc_handle = NULL;
+    if (ci->handle) {
+        libusb_close(ci->handle);
+        ci->handle = NULL;
     }
     
-    if (libusb_open(f, &irpc_handle) != 0) {
+    if (libusb_open(f, &ci->handle) != 0) {
+        ci->handle = NULL;
+        libusb_unref_device(f);
         retval = IRPC_FAILURE;
         goto send;
     }
-    libusb_free_device_list(list, 1);
+    libusb_unref_device(f);
     
-    ihandle.dev.bus_number = irpc_handle->dev->bus_number;
-    ihandle.dev.device_address = irpc_handle->dev->device_address;
-    ihandle.dev.num_configurations = irpc_handle->dev->num_configurations;
-    ihandle.dev.session_data = irpc_handle->dev->session_data;
+    ihandle.dev.bus_number = ci->handle->dev->bus_number;
+    ihandle.dev.device_address = ci->handle->dev->device_address;
+    ihandle.dev.num_configurations = ci->handle->dev->num_configurations;
+    ihandle.dev.session_data = ci->handle->dev->session_data;
     
 send:
+    ci->result = retval;
     // Send libusb_open packet.
     tn = tpl_map(IRPC_DEV_HANDLE_RET_FMT, &ihandle, &retval);
     tpl_pack(tn, 0);
-    tpl_dump(tn, TPL_FD, sock);
+    irpc_dump_reply(tn, ci);
     tpl_free(tn);
 }
 
@@ -568,22 +2269,21 @@ irpc_recv_usb_claim_interface(struct irpc_connection_info *ci,
                               int intf)
 {
     tpl_node *tn = NULL;
-    irpc_retval_t retval;
+    irpc_retval_t retval = IRPC_FAILURE;
     irpc_func_t func = IRPC_USB_CLAIM_INTERFACE;
-    int sock = ci->server_sock;
     
-    irpc_send_func(func, sock);
+    irpc_send_func(func, ci);
     
     // Send irpc_device_handle and interface to server.
     tn = tpl_map(IRPC_DEV_HANDLE_INT_FMT, handle, &intf);
     tpl_pack(tn, 0);
-    tpl_dump(tn, TPL_FD, sock);
+    irpc_dump_request(tn, ci);
     tpl_free(tn);
     
     // Read libusb_claim_interface packet.
     tn = tpl_map(IRPC_INT_FMT, &retval);
-    tpl_load(tn, TPL_FD, sock);
-    tpl_unpack(tn, 0);
+    if (irpc_load_reply(tn, ci) == 0)
+        tpl_unpack(tn, 0);
     tpl_free(tn);
     
     return retval;
@@ -595,22 +2295,22 @@ irpc_send_usb_claim_interface(struct irpc_connection_info *ci)
     tpl_node *tn = NULL;
     irpc_retval_t retval = IRPC_SUCCESS;
     irpc_device_handle handle;
-    int sock = ci->client_sock;
     int intf;
     
     // Read irpc_device_handle and interface from client.
     tn = tpl_map(IRPC_DEV_HANDLE_INT_FMT, &handle, &intf);
-    tpl_load(tn, TPL_FD, sock);
+    irpc_load_request(tn, ci);
     tpl_unpack(tn, 0);
     tpl_free(tn);
     
-    if (libusb_claim_interface(irpc_handle, intf) != 0)
+    if (libusb_claim_interface(ci->handle, intf) != 0)
         retval = IRPC_FAILURE;
     
+    ci->result = retval;
     // Send libusb_claim_interface packet.
     tn = tpl_map(IRPC_INT_FMT, &retval);
     tpl_pack(tn, 0);
-    tpl_dump(tn, TPL_FD, sock);
+    irpc_dump_reply(tn, ci);
     tpl_free(tn);
 }
 
@@ -640,22 +2340,21 @@ irpc_recv_usb_release_interface(struct irpc_connection_info *ci,
                                 int intf)
 {
     tpl_node *tn = NULL;
-    irpc_retval_t retval;
+    irpc_retval_t retval = IRPC_FAILURE;
     irpc_func_t func = IRPC_USB_RELEASE_INTERFACE;
-    int sock = ci->server_sock;
     
-    irpc_send_func(func, sock);
+    irpc_send_func(func, ci);
     
     // Send irpc_device_handle and interface to server.
     tn = tpl_map(IRPC_DEV_HANDLE_INT_FMT, handle, &intf);
     tpl_pack(tn, 0);
-    tpl_dump(tn, TPL_FD, sock);
+    irpc_dump_request(tn, ci);
     tpl_free(tn);
     
     // Read libusb_release_interface packet.
     tn = tpl_map(IRPC_INT_FMT, &retval);
-    tpl_load(tn, TPL_FD, sock);
-    tpl_unpack(tn, 0);
+    if (irpc_load_reply(tn, ci) == 0)
+        tpl_unpack(tn, 0);
     tpl_free(tn);
     
     return retval;
@@ -667,22 +2366,22 @@ irpc_send_usb_release_interface(struct irpc_connection_info *ci)
     tpl_node *tn = NULL;
     irpc_retval_t retval = IRPC_SUCCESS;
     irpc_device_handle handle;
-    int sock = ci->client_sock;
     int intf;
     
     // Read irpc_device_handle and interface from client.
     tn = tpl_map(IRPC_DEV_HANDLE_INT_FMT, &handle, &intf);
-    tpl_load(tn, TPL_FD, sock);
+    irpc_load_request(tn, ci);
     tpl_unpack(tn, 0);
     tpl_free(tn);
     
-    if (libusb_release_interface(irpc_handle, intf) != 0)
+    if (libusb_release_interface(ci->handle, intf) != 0)
         retval = IRPC_FAILURE;
     
+    ci->result = retval;
     // Send libusb_release_interface packet.
     tn = tpl_map(IRPC_INT_FMT, &retval);
     tpl_pack(tn, 0);
-    tpl_dump(tn, TPL_FD, sock);
+    irpc_dump_reply(tn, ci);
     tpl_free(tn);
 }
 
@@ -712,22 +2411,21 @@ irpc_recv_usb_get_configuration(struct irpc_connection_info *ci,
                                 int config)
 {
     tpl_node *tn = NULL;
-    irpc_retval_t retval;
+    irpc_retval_t retval = IRPC_FAILURE;
     irpc_func_t func = IRPC_USB_GET_CONFIGURATION;
-    int sock = ci->server_sock;
     
-    irpc_send_func(func, sock);
+    irpc_send_func(func, ci);
     
     // Send irpc_device_handle and config to server.
     tn = tpl_map(IRPC_DEV_HANDLE_INT_FMT, handle, &config);
     tpl_pack(tn, 0);
-    tpl_dump(tn, TPL_FD, sock);
+    irpc_dump_request(tn, ci);
     tpl_free(tn);
     
     // Read libusb_get_configuration packet.
     tn = tpl_map(IRPC_INT_FMT, &retval);
-    tpl_load(tn, TPL_FD, sock);
-    tpl_unpack(tn, 0);
+    if (irpc_load_reply(tn, ci) == 0)
+        tpl_unpack(tn, 0);
     tpl_free(tn);
     
     return retval;
@@ -739,22 +2437,22 @@ irpc_send_usb_get_configuration(struct irpc_connection_info *ci)
     tpl_node *tn = NULL;
     irpc_retval_t retval = IRPC_SUCCESS;
     irpc_device_handle handle;
-    int sock = ci->client_sock;
     int config;
     
     // Read irpc_device_handle and config from client.
     tn = tpl_map(IRPC_DEV_HANDLE_INT_FMT, &handle, &config);
-    tpl_load(tn, TPL_FD, sock);
+    irpc_load_request(tn, ci);
     tpl_unpack(tn, 0);
     tpl_free(tn);
     
-    if (libusb_get_configuration(irpc_handle, &config) != 0)
+    if (libusb_get_configuration(ci->handle, &config) != 0)
         retval = IRPC_FAILURE;
     
+    ci->result = retval;
     // Send libusb_get_configuration packet.
     tn = tpl_map(IRPC_INT_FMT, &retval);
     tpl_pack(tn, 0);
-    tpl_dump(tn, TPL_FD, sock);
+    irpc_dump_reply(tn, ci);
     tpl_free(tn);
 }
 
@@ -784,22 +2482,21 @@ irpc_recv_usb_set_configuration(struct irpc_connection_info *ci,
                                 int config)
 {
     tpl_node *tn = NULL;
-    irpc_retval_t retval;
+    irpc_retval_t retval = IRPC_FAILURE;
     irpc_func_t func = IRPC_USB_SET_CONFIGURATION;
-    int sock = ci->server_sock;
     
-    irpc_send_func(func, sock);
+    irpc_send_func(func, ci);
     
     // Send irpc_device_handle and config to server.
     tn = tpl_map(IRPC_DEV_HANDLE_INT_FMT, handle, &config);
     tpl_pack(tn, 0);
-    tpl_dump(tn, TPL_FD, sock);
+    irpc_dump_request(tn, ci);
     tpl_free(tn);
     
     // Read libusb_set_configuration packet.
     tn = tpl_map(IRPC_INT_FMT, &retval);
-    tpl_load(tn, TPL_FD, sock);
-    tpl_unpack(tn, 0);
+    if (irpc_load_reply(tn, ci) == 0)
+        tpl_unpack(tn, 0);
     tpl_free(tn);
     
     return retval;
@@ -811,22 +2508,22 @@ irpc_send_usb_set_configuration(struct irpc_connection_info *ci)
     tpl_node *tn = NULL;
     irpc_retval_t retval = IRPC_SUCCESS;
     irpc_device_handle handle;
-    int sock = ci->client_sock;
     int config;
     
     // Read irpc_device_handle and config from client.
     tn = tpl_map(IRPC_DEV_HANDLE_INT_FMT, &handle, &config);
-    tpl_load(tn, TPL_FD, sock);
+    irpc_load_request(tn, ci);
     tpl_unpack(tn, 0);
     tpl_free(tn);
     
-    if (libusb_set_configuration(irpc_handle, config) != 0)
+    if (libusb_set_configuration(ci->handle, config) != 0)
         retval = IRPC_FAILURE;
     
+    ci->result = retval;
     // Send libusb_set_configuration packet.
     tn = tpl_map(IRPC_INT_FMT, &retval);
     tpl_pack(tn, 0);
-    tpl_dump(tn, TPL_FD, sock);
+    irpc_dump_reply(tn, ci);
     tpl_free(tn);
 }
 
@@ -857,11 +2554,10 @@ irpc_recv_usb_set_interface_alt_setting(struct irpc_connection_info *ci,
                                         int alt_setting)
 {
     tpl_node *tn = NULL;
-    irpc_retval_t retval;
+    irpc_retval_t retval = IRPC_FAILURE;
     irpc_func_t func = IRPC_USB_SET_INTERFACE_ALT_SETTING;
-    int sock = ci->server_sock;
     
-    irpc_send_func(func, sock);
+    irpc_send_func(func, ci);
     
     // Send irpc_device_handle, interface, and alt_setting to server.
     tn = tpl_map(IRPC_DEV_HANDLE_INT_INT_FMT,
@@ -869,13 +2565,13 @@ irpc_recv_usb_set_interface_alt_setting(struct irpc_connection_info *ci,
                  &intf,
                  &alt_setting);
     tpl_pack(tn, 0);
-    tpl_dump(tn, TPL_FD, sock);
+    irpc_dump_request(tn, ci);
     tpl_free(tn);
     
     // Read libusb_set_interface_alt_setting packet.
     tn = tpl_map(IRPC_INT_FMT, &retval);
-    tpl_load(tn, TPL_FD, sock);
-    tpl_unpack(tn, 0);
+    if (irpc_load_reply(tn, ci) == 0)
+        tpl_unpack(tn, 0);
     tpl_free(tn);
     
     return retval;
@@ -887,7 +2583,6 @@ irpc_send_usb_set_interface_alt_setting(struct irpc_connection_info *ci)
     tpl_node *tn = NULL;
     irpc_retval_t retval = IRPC_SUCCESS;
     irpc_device_handle handle;
-    int sock = ci->client_sock;
     int intf, alt_setting;
     
     // Read irpc_device_handle, interface, and alt_setting from client.
@@ -895,17 +2590,18 @@ irpc_send_usb_set_interface_alt_setting(struct irpc_connection_info *ci)
                  &handle,
                  &intf,
                  &alt_setting);
-    tpl_load(tn, TPL_FD, sock);
+    irpc_load_request(tn, ci);
     tpl_unpack(tn, 0);
     tpl_free(tn);
     
-    if (libusb_set_interface_alt_setting(irpc_handle, intf, alt_setting) != 0)
+    if (libusb_set_interface_alt_setting(ci->handle, intf, alt_setting) != 0)
         retval = IRPC_FAILURE;
     
+    ci->result = retval;
     // Send libusb_set_interface_alt_setting packet.
     tn = tpl_map(IRPC_INT_FMT, &retval);
     tpl_pack(tn, 0);
-    tpl_dump(tn, TPL_FD, sock);
+    irpc_dump_reply(tn, ci);
     tpl_free(tn);
 }
 
@@ -935,22 +2631,21 @@ irpc_recv_usb_reset_device(struct irpc_connection_info *ci,
                            irpc_device_handle *handle)
 {
     tpl_node *tn = NULL;
-    irpc_retval_t retval;
+    irpc_retval_t retval = IRPC_FAILURE;
     irpc_func_t func = IRPC_USB_RESET_DEVICE;
-    int sock = ci->server_sock;
     
-    irpc_send_func(func, sock);
+    irpc_send_func(func, ci);
     
     // Send irpc_device_handle to server.
     tn = tpl_map(IRPC_DEV_HANDLE_FMT, handle);
     tpl_pack(tn, 0);
-    tpl_dump(tn, TPL_FD, sock);
+    irpc_dump_request(tn, ci);
     tpl_free(tn);
     
     // Read libusb_reset_device packet.
     tn = tpl_map(IRPC_INT_FMT, &retval);
-    tpl_load(tn, TPL_FD, sock);
-    tpl_unpack(tn, 0);
+    if (irpc_load_reply(tn, ci) == 0)
+        tpl_unpack(tn, 0);
     tpl_free(tn);
     
     return retval;
@@ -962,21 +2657,21 @@ irpc_send_usb_reset_device(struct irpc_connection_info *ci)
     tpl_node *tn = NULL;
     irpc_retval_t retval = IRPC_SUCCESS;
     irpc_device_handle handle;
-    int sock = ci->client_sock;
     
     // Read irpc_device_handle from client.
     tn = tpl_map(IRPC_DEV_HANDLE_FMT, &handle);
-    tpl_load(tn, TPL_FD, sock);
+    irpc_load_request(tn, ci);
     tpl_unpack(tn, 0);
     tpl_free(tn);
     
-    if (libusb_reset_device(irpc_handle) != 0)
+    if (libusb_reset_device(ci->handle) != 0)
         retval = IRPC_FAILURE;
     
+    ci->result = retval;
     // Send libusb_reset_device packet.
     tn = tpl_map(IRPC_INT_FMT, &retval);
     tpl_pack(tn, 0);
-    tpl_dump(tn, TPL_FD, sock);
+    irpc_dump_reply(tn, ci);
     tpl_free(tn);
 }
 
@@ -995,6 +2690,265 @@ irpc_usb_reset_device(struct irpc_connection_info *ci,
     return retval;    
 }
 
+// -----------------------------------------------------------------------------
+#pragma mark Deadlines
+// -----------------------------------------------------------------------------
+
+/*
+ * IRPC_USB_DEADLINE precedes a transfer and gives its time budget in
+ * ms, counted from the arrival of the request; the server shortens the
+ * transfer's timeout to it and does not start the transfer once it has
+ * passed.  IRPC_USB_CANCEL names a request by its number (requests are
+ * counted alike on both sides) and cancels its transfer, whether in
+ * flight or not yet started.  Both only affect transfers; their
+ * replies keep their format and carry LIBUSB_ERROR_TIMEOUT or
+ * LIBUSB_ERROR_INTERRUPTED.
+ */
+
+// Guards cancel_seq, transfer and transfer_seq of all connections.
+static pthread_mutex_t irpc_cancel_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Timeout for the transfer of the current request, limited by its
+ * deadline.  Negative if the transfer must not start.
+ */
+static int
+irpc_transfer_timeout(struct irpc_connection_info *ci, int timeout)
+{
+    long long left;
+    int cancelled;
+    
+    pthread_mutex_lock(&irpc_cancel_lock);
+    cancelled = ci->cancel_seq && ci->cancel_seq == ci->seq;
+    pthread_mutex_unlock(&irpc_cancel_lock);
+    
+    if (cancelled)
+        return LIBUSB_ERROR_INTERRUPTED;
+    if (!ci->expires)
+        return timeout;
+    
+    left = ci->expires - irpc_clock_ms();
+    if (left <= 0)
+        return LIBUSB_ERROR_TIMEOUT;
+    if (timeout == 0 || timeout > left)
+        return (int)left;
+    
+    return timeout;
+}
+
+void
+irpc_send_usb_deadline(struct irpc_connection_info *ci)
+{
+    tpl_node *tn = NULL;
+    int deadline = 0;
+    
+    // Read the time budget from client, there is no reply.
+    tn = tpl_map(IRPC_INT_FMT, &deadline);
+    irpc_load_request(tn, ci);
+    tpl_unpack(tn, 0);
+    tpl_free(tn);
+    
+    ci->expires = 0;
+    if (deadline > 0)
+        ci->expires = (ci->received ? ci->received : irpc_clock_ms()) + deadline;
+}
+
+static void
+irpc_cancel_seq(struct irpc_connection_info *ci, int seq)
+{
+    pthread_mutex_lock(&irpc_cancel_lock);
+    ci->cancel_seq = seq;
+    if (ci->transfer && ci->transfer_seq == seq)
+        (void)libusb_cancel_transfer(ci->transfer);
+    pthread_mutex_unlock(&irpc_cancel_lock);
+}
+
+void
+irpc_send_usb_cancel(struct irpc_connection_info *ci)
+{
+    tpl_node *tn = NULL;
+    int seq = 0;
+    
+    // Read the request number from client, there is no reply.
+    tn = tpl_map(IRPC_INT_FMT, &seq);
+    irpc_load_request(tn, ci);
+    tpl_unpack(tn, 0);
+    tpl_free(tn);
+    
+    irpc_cancel_seq(ci, seq);
+}
+
+void
+irpc_server_cancel(struct irpc_connection_info *ci, void *img, size_t sz)
+{
+    tpl_node *tn = NULL;
+    int seq = 0;
+    
+    tn = tpl_map(IRPC_INT_FMT, &seq);
+    if (img && tpl_load(tn, TPL_MEM, img, sz) == 0 && tpl_unpack(tn, 0) > 0)
+        irpc_cancel_seq(ci, seq);
+    tpl_free(tn);
+}
+
+// -----------------------------------------------------------------------------
+#pragma mark Asynchronous Transfers
+// -----------------------------------------------------------------------------
+
+/*
+ * Servers which set ci->async_begin submit control and bulk transfers
+ * instead of running the synchronous libusb calls, which would each
+ * run a nested event loop on the worker.  The reply is sent from the
+ * transfer callback on the server's libusb event thread.
+ */
+
+static void
+irpc_reply_control_transfer(struct irpc_connection_info *ci,
+                            int retval,
+                            char *data);
+
+static void
+irpc_reply_bulk_transfer(struct irpc_connection_info *ci,
+                         int retval,
+                         char endpoint,
+                         int transfered,
+                         char *data);
+
+/* Same mapping as the synchronous libusb transfer functions. */
+static int
+irpc_transfer_error(enum libusb_transfer_status status)
+{
+    switch (status) {
+        case LIBUSB_TRANSFER_COMPLETED:
+            return 0;
+        case LIBUSB_TRANSFER_TIMED_OUT:
+            return LIBUSB_ERROR_TIMEOUT;
+        case LIBUSB_TRANSFER_STALL:
+            return LIBUSB_ERROR_PIPE;
+        case LIBUSB_TRANSFER_NO_DEVICE:
+            return LIBUSB_ERROR_NO_DEVICE;
+        case LIBUSB_TRANSFER_OVERFLOW:
+            return LIBUSB_ERROR_OVERFLOW;
+        case LIBUSB_TRANSFER_CANCELLED:
+            return LIBUSB_ERROR_INTERRUPTED;
+        default:
+            return LIBUSB_ERROR_IO;
+    }
+}
+
+static void LIBUSB_CALL
+irpc_transfer_cb(struct libusb_transfer *transfer)
+{
+    struct irpc_connection_info *ci = transfer->user_data;
+    int retval = irpc_transfer_error(transfer->status);
+    
+    pthread_mutex_lock(&irpc_cancel_lock);
+    ci->transfer = NULL;
+    pthread_mutex_unlock(&irpc_cancel_lock);
+    
+    if (transfer->type == LIBUSB_TRANSFER_TYPE_CONTROL) {
+        if (retval == 0)
+            retval = transfer->actual_length;
+        irpc_reply_control_transfer(ci, retval,
+                                    (char *)libusb_control_transfer_get_data(transfer));
+    } else {
+        irpc_reply_bulk_transfer(ci, retval, transfer->endpoint,
+                                 transfer->actual_length,
+                                 (char *)transfer->buffer);
+    }
+    
+    free(transfer->buffer);
+    libusb_free_transfer(transfer);
+    
+    ci->async_end(ci);
+}
+
+/* Submits the transfer, a failed submission is answered right away. */
+static int
+irpc_submit_transfer(struct irpc_connection_info *ci,
+                     struct libusb_transfer *transfer)
+{
+    int retval;
+    
+    ci->async_begin(ci);
+    
+    // A cancel may come in until the transfer is known.
+    pthread_mutex_lock(&irpc_cancel_lock);
+    if (ci->cancel_seq && ci->cancel_seq == ci->seq) {
+        retval = LIBUSB_ERROR_INTERRUPTED;
+    } else if ((retval = libusb_submit_transfer(transfer)) == 0) {
+        ci->transfer = transfer;
+        ci->transfer_seq = ci->seq;
+    }
+    pthread_mutex_unlock(&irpc_cancel_lock);
+    
+    if (retval != 0) {
+        if (transfer->type == LIBUSB_TRANSFER_TYPE_CONTROL)
+            irpc_reply_control_transfer(ci, retval,
+                                        (char *)libusb_control_transfer_get_data(transfer));
+        else
+            irpc_reply_bulk_transfer(ci, retval, transfer->endpoint, 0,
+                                     (char *)transfer->buffer);
+        free(transfer->buffer);
+        libusb_free_transfer(transfer);
+        ci->async_end(ci);
+    }
+    
+    return 0;
+}
+
+static int
+irpc_submit_control_transfer(struct irpc_connection_info *ci,
+                             int req_type,
+                             int req,
+                             int val,
+                             int idx,
+                             int length,
+                             int timeout)
+{
+    struct libusb_transfer *transfer;
+    unsigned char *buf;
+    
+    // The reply always carries IRPC_MAX_DATA bytes.
+    if (!(buf = calloc(1, LIBUSB_CONTROL_SETUP_SIZE + IRPC_MAX_DATA)))
+        return -1;
+    if (!(transfer = libusb_alloc_transfer(0))) {
+        free(buf);
+        return -1;
+    }
+    
+    libusb_fill_control_setup(buf, req_type, req, val, idx, length);
+    libusb_fill_control_transfer(transfer, ci->handle, buf,
+                                 irpc_transfer_cb, ci, timeout);
+    
+    return irpc_submit_transfer(ci, transfer);
+}
+
+static int
+irpc_submit_bulk_transfer(struct irpc_connection_info *ci,
+                          char endpoint,
+                          char *data,
+                          int length,
+                          int timeout)
+{
+    struct libusb_transfer *transfer;
+    unsigned char *buf;
+    
+    // The reply packs IRPC_MAX_DATA ints, see IRPC_STR_INT_INT_FMT.
+    if (!(buf = calloc(IRPC_MAX_DATA, sizeof(int))))
+        return -1;
+    if (!(transfer = libusb_alloc_transfer(0))) {
+        free(buf);
+        return -1;
+    }
+    
+    if (!(endpoint & 0x80))
+        memcpy(buf, data, length);
+    libusb_fill_bulk_transfer(transfer, ci->handle, endpoint, buf, length,
+                              irpc_transfer_cb, ci, timeout);
+    
+    return irpc_submit_transfer(ci, transfer);
+}
+
 // -----------------------------------------------------------------------------
 #pragma mark libusb_control_transfer
 // -----------------------------------------------------------------------------
@@ -1014,9 +2968,13 @@ irpc_recv_usb_control_transfer(struct irpc_connection_info *ci,
     tpl_node *tn = NULL;
     int retval;
     irpc_func_t func = IRPC_USB_CONTROL_TRANSFER;
-    int sock = ci->server_sock;
     
-    irpc_send_func(func, sock);
+#ifdef __linux__
+    if (ci->delegated)
+        return irpc_usbfs_control_transfer(ci, req_type, req, val, idx, data, length, timeout, status);
+#endif
+    
+    irpc_send_func(func, ci);
     
     tn = tpl_map(IRPC_CTRL_TRANSFER_FMT,
                  handle,
@@ -1027,27 +2985,47 @@ irpc_recv_usb_control_transfer(struct irpc_connection_info *ci,
                  &length,
                  &timeout);
     tpl_pack(tn, 0);
-    tpl_dump(tn, TPL_FD, sock);
+    irpc_dump_request(tn, ci);
     tpl_free(tn);    
     
     // Read libusb_control_transfer packet.
     tn = tpl_map(IRPC_CTRL_STR_INT_INT_FMT, &retval, status, data, IRPC_MAX_DATA);
-    tpl_load(tn, TPL_FD, sock);
-    tpl_unpack(tn, 0);
+    if (irpc_load_reply(tn, ci) == 0)
+        tpl_unpack(tn, 0);
     tpl_free(tn);
     
     return retval;
 }
 
+static void
+irpc_reply_control_transfer(struct irpc_connection_info *ci,
+                            int retval,
+                            char *data)
+{
+    tpl_node *tn = NULL;
+    int status = 0;
+    
+    if (retval >= 5)
+    {
+        status = (int)data[4];
+    }
+    
+    ci->result = retval;
+    // Send libusb_control_transfer packet.
+    tn = tpl_map(IRPC_CTRL_STR_INT_INT_FMT, &retval, &status, data, IRPC_MAX_DATA);
+    tpl_pack(tn, 0);
+    irpc_dump_reply(tn, ci);
+    tpl_free(tn);
+}
+
 void
 irpc_send_usb_control_transfer(struct irpc_connection_info *ci)
 {
     tpl_node *tn = NULL;
-    int retval, status = 0;
+    int retval;
     irpc_device_handle handle;
     int req_type, req, val, idx, length, timeout;
     char data[IRPC_MAX_DATA];
-    int sock = ci->client_sock;
     
     tn = tpl_map(IRPC_CTRL_TRANSFER_FMT,
                  &handle,
@@ -1057,11 +3035,24 @@ irpc_send_usb_control_transfer(struct irpc_connection_info *ci)
                  &idx,
                  &length,
                  &timeout);
-    tpl_load(tn, TPL_FD, sock);
+    irpc_load_request(tn, ci);
     tpl_unpack(tn, 0);
     tpl_free(tn);
     
-    retval = libusb_control_transfer(irpc_handle,
+    if (length < 0 || length > IRPC_MAX_DATA)
+        length = IRPC_MAX_DATA;
+    
+    if ((timeout = irpc_transfer_timeout(ci, timeout)) < 0) {
+        bzero(data, sizeof data);
+        irpc_reply_control_transfer(ci, timeout, data);
+        return;
+    }
+    
+    if (ci->async_begin &&
+        irpc_submit_control_transfer(ci, req_type, req, val, idx, length, timeout) == 0)
+        return;
+    
+    retval = libusb_control_transfer(ci->handle,
                                      req_type,
                                      req,
                                      val,
@@ -1069,17 +3060,7 @@ irpc_send_usb_control_transfer(struct irpc_connection_info *ci)
                                      data,
                                      length,
                                      timeout);
-    // FIXME: Works but its no convenience method.
-    if (retval >= 5)
-    {
-        status = (int)data[4];
-    }
-    
-    // Send libusb_control_transfer packet.
-    tn = tpl_map(IRPC_CTRL_STR_INT_INT_FMT, &retval, &status, &data, IRPC_MAX_DATA);
-    tpl_pack(tn, 0);
-    tpl_dump(tn, TPL_FD, sock);
-    tpl_free(tn);
+    irpc_reply_control_transfer(ci, retval, data);
 }
 
 irpc_retval_t
@@ -1105,6 +3086,90 @@ irpc_usb_control_transfer(struct irpc_connection_info *ci,
     return retval;       
 }
 
+// -----------------------------------------------------------------------------
+#pragma mark Payload Compression
+// -----------------------------------------------------------------------------
+
+/*
+ * Sessions with IRPC_CAP_COMPRESS carry bulk data in frames: the OUT
+ * data with the request, the IN data with the reply, each compressed
+ * with irpc_lz_compress() unless that saves nothing, then the frame
+ * stores it as it is.  The server unpacks OUT data right before the
+ * transfer is submitted.  Both sides count what they pack and unpack
+ * in ci.zstats.  Without the capability requests carry no OUT data
+ * and replies IRPC_MAX_DATA ints, whatever the transfer.
+ */
+
+#define IRPC_FRAME_STORED           0
+#define IRPC_FRAME_LZ               1
+
+/* Frames len bytes of data, zbuf takes len bytes at most. */
+static void
+irpc_frame_pack(struct irpc_connection_info *ci,
+                char *data,
+                int len,
+                int *codec,
+                char *zbuf,
+                tpl_bin *bin)
+{
+    long long start = irpc_clock_us();
+    int n = irpc_lz_compress(data, len, zbuf, len - 1);
+    
+    if (n > 0) {
+        *codec = IRPC_FRAME_LZ;
+        bin->addr = zbuf;
+        bin->sz = n;
+    } else {
+        *codec = IRPC_FRAME_STORED;
+        bin->addr = data;
+        bin->sz = len;
+        ci->zstats.stored++;
+    }
+    
+    ci->zstats.frames++;
+    ci->zstats.raw += len;
+    ci->zstats.wire += bin->sz;
+    ci->zstats.us += irpc_clock_us() - start;
+}
+
+/*
+ * Unpacks a frame, returns its length, -1 if it is invalid.  *out is
+ * where the data is: the frame itself if it was stored, else data.
+ */
+static int
+irpc_frame_unpack(struct irpc_connection_info *ci,
+                  int codec,
+                  tpl_bin *bin,
+                  char *data,
+                  int cap,
+                  char **out)
+{
+    long long start;
+    int n = -1;
+    
+    *out = data;
+    if (bin->sz == 0)
+        return 0;
+    
+    start = irpc_clock_us();
+    if (codec == IRPC_FRAME_STORED && bin->sz <= (uint32_t)cap) {
+        *out = bin->addr;
+        n = (int)bin->sz;
+        ci->zstats.stored++;
+    } else if (codec == IRPC_FRAME_LZ) {
+        n = irpc_lz_decompress(bin->addr, (int)bin->sz, data, cap);
+    }
+    if (n < 0)
+        return -1;
+    
+    ci->zstats.frames++;
+    ci->zstats.raw += n;
+    ci->zstats.wire += bin->sz;
+    ci->zstats.us += irpc_clock_us() - start;
+    
+    return n;
+}
+
 // -----------------------------------------------------------------------------
 #pragma mark libusb_bulk_transfer
 // -----------------------------------------------------------------------------
@@ -1119,62 +3184,164 @@ irpc_recv_usb_bulk_transfer(struct irpc_connection_info *ci,
                             int timeout)
 {
     tpl_node *tn = NULL;
-    int retval;
+    tpl_bin bin = { NULL, 0 };
+    char zbuf[IRPC_MAX_DATA];
+    char *in;
+    int retval = LIBUSB_ERROR_IO;
+    int framed = ci->caps & IRPC_CAP_COMPRESS;
+    int codec = IRPC_FRAME_STORED;
+    int n;
     irpc_func_t func = IRPC_USB_BULK_TRANSFER;
-    int sock = ci->server_sock;
     
-    irpc_send_func(func, sock);
-    
-    tn = tpl_map(IRPC_BULK_TRANSFER_FMT,
-                 handle,
-                 &endpoint,
-                 &length,
-                 transfered,
-                 &timeout);
+#ifdef __linux__
+    if (ci->delegated)
+        return irpc_usbfs_bulk_transfer(ci, endpoint, data, length, transfered, timeout);
+#endif
+    
+    irpc_send_func(func, ci);
+    
+    if (!framed) {
+        tn = tpl_map(IRPC_BULK_TRANSFER_FMT,
+                     handle,
+                     &endpoint,
+                     &length,
+                     transfered,
+                     &timeout);
+    } else {
+        // Not packed again when only the reply is read, see irpc_call_batch().
+        if (!(endpoint & 0x80) && length > 0 && length <= IRPC_MAX_DATA &&
+            ci->batch != IRPC_BATCH_REPLY)
+            irpc_frame_pack(ci, data, length, &codec, zbuf, &bin);
+        tn = tpl_map(IRPC_BULK_FRAME_FMT,
+                     handle,
+                     &endpoint,
+                     &length,
+                     transfered,
+                     &timeout,
+                     &codec,
+                     &bin);
+    }
     tpl_pack(tn, 0);
-    tpl_dump(tn, TPL_FD, sock);
+    irpc_dump_request(tn, ci);
     tpl_free(tn);
     
-    
     // Read libusb_bulk_transfer packet.
-    tn = tpl_map(IRPC_STR_INT_INT_FMT, &retval, &transfered, data, IRPC_MAX_DATA);
-    tpl_load(tn, TPL_FD, sock);
-    tpl_unpack(tn, 0);
+    if (!framed) {
+        tn = tpl_map(IRPC_STR_INT_INT_FMT, &retval, transfered, data, IRPC_MAX_DATA);
+        if (irpc_load_reply(tn, ci) == 0)
+            tpl_unpack(tn, 0);
+        tpl_free(tn);
+        return retval;
+    }
+    
+    bin.addr = NULL;
+    bin.sz = 0;
+    tn = tpl_map(IRPC_BULK_FRAME_RET_FMT, &retval, transfered, &codec, &bin);
+    if (irpc_load_reply(tn, ci) == 0)
+        tpl_unpack(tn, 0);
     tpl_free(tn);
     
+    n = irpc_frame_unpack(ci, codec, &bin, data, IRPC_MAX_DATA, &in);
+    if (n < 0 || (n > 0 && n != *transfered)) {
+        retval = LIBUSB_ERROR_IO;
+        *transfered = 0;
+    } else if (in != data) {
+        memcpy(data, in, n);
+    }
+    
     return retval;
 }
 
+static void
+irpc_reply_bulk_transfer(struct irpc_connection_info *ci,
+                         int retval,
+                         char endpoint,
+                         int transfered,
+                         char *data)
+{
+    tpl_node *tn = NULL;
+    tpl_bin bin = { NULL, 0 };
+    char zbuf[IRPC_MAX_DATA];
+    int codec = IRPC_FRAME_STORED;
+    
+    ci->result = retval;
+    // Send libusb_bulk_transfer packet.
+    if (!(ci->caps & IRPC_CAP_COMPRESS)) {
+        tn = tpl_map(IRPC_STR_INT_INT_FMT, &retval, &transfered, data, IRPC_MAX_DATA);
+    } else {
+        // Only IN data goes back.
+        if ((endpoint & 0x80) && transfered > 0 && transfered <= IRPC_MAX_DATA)
+            irpc_frame_pack(ci, data, transfered, &codec, zbuf, &bin);
+        tn = tpl_map(IRPC_BULK_FRAME_RET_FMT, &retval, &transfered, &codec, &bin);
+    }
+    tpl_pack(tn, 0);
+    irpc_dump_reply(tn, ci);
+    tpl_free(tn);
+}
+
 void
 irpc_send_usb_bulk_transfer(struct irpc_connection_info *ci)
 {
     tpl_node *tn = NULL;
-    irpc_retval_t retval = IRPC_SUCCESS;
+    tpl_bin bin = { NULL, 0 };
+    int retval = IRPC_SUCCESS;
     irpc_device_handle handle;
-    char endpoint, data[IRPC_MAX_DATA];;
+    char endpoint, data[IRPC_MAX_DATA];
+    char *out = data;
     int length, transfered, timeout;
-    int sock = ci->client_sock;
-    
-    tn = tpl_map(IRPC_BULK_TRANSFER_FMT,
-                 &handle,
-                 &endpoint,
-                 &length,
-                 &transfered,
-                 &timeout);
-    tpl_load(tn, TPL_FD, sock);
+    int framed = ci->caps & IRPC_CAP_COMPRESS;
+    int codec = IRPC_FRAME_STORED;
+    int n = 0;
+    
+    if (!framed)
+        tn = tpl_map(IRPC_BULK_TRANSFER_FMT,
+                     &handle,
+                     &endpoint,
+                     &length,
+                     &transfered,
+                     &timeout);
+    else
+        tn = tpl_map(IRPC_BULK_FRAME_FMT,
+                     &handle,
+                     &endpoint,
+                     &length,
+                     &transfered,
+                     &timeout,
+                     &codec,
+                     &bin);
+    irpc_load_request(tn, ci);
     tpl_unpack(tn, 0);
-    tpl_free(tn);
     
-    retval = libusb_bulk_transfer(irpc_handle,
-                                  endpoint,
-                                  data,
-                                  length,
-                                  &transfered,
-                                  timeout);
-    // Send libusb_bulk_transfer packet.
-    tn = tpl_map(IRPC_STR_INT_INT_FMT, &retval, &transfered, &data, IRPC_MAX_DATA);
-    tpl_pack(tn, 0);
-    tpl_dump(tn, TPL_FD, sock);
+    if (length < 0 || length > IRPC_MAX_DATA)
+        length = IRPC_MAX_DATA;
+    
+    // OUT data is unpacked right before it goes to the device, a stored
+    // frame goes there straight from the request.
+    if (framed) {
+        n = irpc_frame_unpack(ci, codec, &bin, data, IRPC_MAX_DATA, &out);
+        if (!(endpoint & 0x80) && n != length)
+            retval = LIBUSB_ERROR_INVALID_PARAM;
+    }
+    
+    if (retval == IRPC_SUCCESS &&
+        (timeout = irpc_transfer_timeout(ci, timeout)) < 0)
+        retval = timeout;
+    
+    if (retval != IRPC_SUCCESS) {
+        bzero(data, sizeof data);
+        irpc_reply_bulk_transfer(ci, retval, endpoint, 0, data);
+    } else if (!ci->async_begin ||
+               irpc_submit_bulk_transfer(ci, endpoint, out, length, timeout) != 0) {
+        retval = libusb_bulk_transfer(ci->handle,
+                                      endpoint,
+                                      out,
+                                      length,
+                                      &transfered,
+                                      timeout);
+        irpc_reply_bulk_transfer(ci, retval, endpoint, transfered, out);
+    }
+    
+    // Not before, out may point into the request.
     tpl_free(tn);
 }
 
@@ -1208,22 +3375,26 @@ irpc_recv_usb_clear_halt(struct irpc_connection_info *ci,
                          char endpoint)
 {
     tpl_node *tn = NULL;
-    irpc_retval_t retval;
+    irpc_retval_t retval = IRPC_FAILURE;
     irpc_func_t func = IRPC_USB_CLEAR_HALT;
-    int sock = ci->server_sock;
     
-    irpc_send_func(func, sock);
+#ifdef __linux__
+    if (ci->delegated)
+        return irpc_usbfs_clear_halt(ci, endpoint) == 0 ? IRPC_SUCCESS : IRPC_FAILURE;
+#endif
+    
+    irpc_send_func(func, ci);
     
     // Send irpc_device_handle, and endpoint to server.
     tn = tpl_map(IRPC_CLEAR_HALT_FMT, handle, &endpoint);
     tpl_pack(tn, 0);
-    tpl_dump(tn, TPL_FD, sock);
+    irpc_dump_request(tn, ci);
     tpl_free(tn);
     
     // Read libusb_clear_halt packet.
     tn = tpl_map(IRPC_INT_FMT, &retval);
-    tpl_load(tn, TPL_FD, sock);
-    tpl_unpack(tn, 0);
+    if (irpc_load_reply(tn, ci) == 0)
+        tpl_unpack(tn, 0);
     tpl_free(tn);
     
     return retval;
@@ -1236,21 +3407,21 @@ irpc_send_usb_clear_halt(struct irpc_connection_info *ci)
     irpc_retval_t retval = IRPC_SUCCESS;
     irpc_device_handle handle;
     char endpoint;
-    int sock = ci->client_sock;
     
     // Read irpc_device_handle, and endpoint to server.
     tn = tpl_map(IRPC_CLEAR_HALT_FMT, &handle, &endpoint);
-    tpl_load(tn, TPL_FD, sock);
+    irpc_load_request(tn, ci);
     tpl_unpack(tn, 0);
     tpl_free(tn);
     
-    if (libusb_clear_halt(irpc_handle, endpoint) != 0)
+    if (libusb_clear_halt(ci->handle, endpoint) != 0)
         retval = IRPC_FAILURE;
     
+    ci->result = retval;
     // Send libusb_clear_halt packet.
     tn = tpl_map(IRPC_INT_FMT, &retval);
     tpl_pack(tn, 0);
-    tpl_dump(tn, TPL_FD, sock);
+    irpc_dump_reply(tn, ci);
     tpl_free(tn);
 }
 
@@ -1284,21 +3455,20 @@ irpc_recv_usb_get_string_descriptor_ascii(struct irpc_connection_info *ci,
     tpl_node *tn = NULL;
     int retval;
     irpc_func_t func = IRPC_USB_GET_STRING_DESCRIPTOR_ASCII;
-    int sock = ci->server_sock;
     
-    irpc_send_func(func, sock);
+    irpc_send_func(func, ci);
     
     tn = tpl_map(IRPC_STRING_DESC_FMT, handle, &idx, &length);
     tpl_pack(tn, 0);
-    tpl_dump(tn, TPL_FD, sock);
+    irpc_dump_request(tn, ci);
     tpl_free(tn);
     
     tn = tpl_map(IRPC_STR_INT_FMT,
                  &retval,
                  data,
                  IRPC_MAX_DATA);
-    tpl_load(tn, TPL_FD, sock);
-    tpl_unpack(tn, 0);
+    if (irpc_load_reply(tn, ci) == 0)
+        tpl_unpack(tn, 0);
     tpl_free(tn);
     
     return retval;
@@ -1312,20 +3482,20 @@ irpc_send_usb_get_string_descriptor_ascii(struct irpc_connection_info *ci)
     irpc_device_handle handle;
     int length, idx;
     char data[IRPC_MAX_DATA];
-    int sock = ci->client_sock;
     
     // Read irpc_device_handle, and endpoint to server.
     tn = tpl_map(IRPC_STRING_DESC_FMT, &handle, &idx, &length);
-    tpl_load(tn, TPL_FD, sock);
+    irpc_load_request(tn, ci);
     tpl_unpack(tn, 0);
     tpl_free(tn);
     
-    retval = libusb_get_string_descriptor_ascii(irpc_handle, idx, data, length);
+    retval = libusb_get_string_descriptor_ascii(ci->handle, idx, data, length);
     
+    ci->result = retval;
     // Send libusb_clear_halt packet.
     tn = tpl_map(IRPC_STR_INT_FMT, &retval, &data, IRPC_MAX_DATA);
     tpl_pack(tn, 0);
-    tpl_dump(tn, TPL_FD, sock);
+    irpc_dump_reply(tn, ci);
     tpl_free(tn);
 }
 
@@ -1347,6 +3517,781 @@ irpc_usb_get_string_descriptor_ascii(struct irpc_connection_info *ci,
     return retval;
 }
 
+// -----------------------------------------------------------------------------
+#pragma mark Posted Calls
+// -----------------------------------------------------------------------------
+
+/*
+ * A posted call is written like a batch of one, its reply is left in
+ * the socket and read before the next synchronous call (or once
+ * IRPC_MAX_POSTED calls, or the server's credit, wait for it).  Only
+ * the result is kept.
+ */
+
+static int
+irpc_postable(irpc_func_t func, struct irpc_info *info)
+{
+    switch (func) {
+        case IRPC_USB_CONTROL_TRANSFER:
+            return !(info->req_type & 0x80);
+        case IRPC_USB_BULK_TRANSFER:
+            return !(info->endpoint & 0x80);
+        case IRPC_USB_CLAIM_INTERFACE:
+        case IRPC_USB_RELEASE_INTERFACE:
+        case IRPC_USB_SET_CONFIGURATION:
+        case IRPC_USB_SET_INTERFACE_ALT_SETTING:
+        case IRPC_USB_CLEAR_HALT:
+        case IRPC_USB_RESET_DEVICE:
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+static int
+irpc_posted_read(struct irpc_connection_info *ci, irpc_func_t func)
+{
+    tpl_node *tn = NULL;
+    tpl_bin bin = { NULL, 0 };
+    int data[IRPC_MAX_DATA];
+    int retval = IRPC_FAILURE;
+    int val, codec;
+    
+    if (func == IRPC_USB_CONTROL_TRANSFER)
+        tn = tpl_map(IRPC_CTRL_STR_INT_INT_FMT, &retval, &val, data, IRPC_MAX_DATA);
+    else if (func == IRPC_USB_BULK_TRANSFER && (ci->caps & IRPC_CAP_COMPRESS))
+        tn = tpl_map(IRPC_BULK_FRAME_RET_FMT, &retval, &val, &codec, &bin);
+    else if (func == IRPC_USB_BULK_TRANSFER)
+        tn = tpl_map(IRPC_STR_INT_INT_FMT, &retval, &val, data, IRPC_MAX_DATA);
+    else
+        tn = tpl_map(IRPC_INT_FMT, &retval);
+    if (irpc_load_reply(tn, ci) == 0)
+        tpl_unpack(tn, 0);
+    else
+        retval = IRPC_FAILURE;
+    tpl_free(tn);
+    
+    return retval;
+}
+
+/* Reads the reply of the oldest posted call. */
+static void
+irpc_posted_next(struct irpc_connection_info *ci)
+{
+    int func, retval;
+    
+    func = ci->posted[ci->posted_head];
+    ci->posted_total -= ci->posted_cost[ci->posted_head];
+    ci->posted_head = (ci->posted_head + 1) % IRPC_MAX_POSTED;
+    ci->posted_n--;
+    
+    if ((retval = irpc_posted_read(ci, func)) >= 0)
+        return;
+    if (ci->posted_cb)
+        ci->posted_cb(ci, func, retval);
+    else if (ci->posted_error == 0)
+        ci->posted_error = retval;
+}
+
+/* Reads the replies of all posted calls. */
+static void
+irpc_posted_drain(struct irpc_connection_info *ci)
+{
+    while (ci->posted_n > 0)
+        irpc_posted_next(ci);
+}
+
+irpc_retval_t
+irpc_posted_wait(struct irpc_connection_info *ci)
+{
+    int retval;
+    
+    irpc_posted_drain(ci);
+    retval = ci->posted_error;
+    ci->posted_error = 0;
+    
+    return retval;
+}
+
+irpc_retval_t
+irpc_call_posted(irpc_func_t func, struct irpc_info *info)
+{
+    struct irpc_connection_info *ci = &info->ci;
+    irpc_context_t ctx = IRPC_CONTEXT_CLIENT;
+    void *buf = NULL;
+    size_t len = 0, size = 0;
+    int retval, cost, slot;
+    
+    // Delegated transfers do not go through the server at all.
+    if (!irpc_postable(func, info) || ci->delegated || ci->batch)
+        return irpc_call(func, ctx, info);
+    
+    if (ci->posted_error && !ci->posted_cb)
+        return irpc_posted_wait(ci);
+    if (ci->posted_n == IRPC_MAX_POSTED)
+        irpc_posted_drain(ci);
+    
+    // Function and arguments in one write.
+    irpc_batch_enter(ci, IRPC_BATCH_COLLECT, NULL, 0, 0);
+    (void)irpc_call(func, ctx, info);
+    irpc_batch_leave(ci, &buf, &len, &size);
+    
+    // Make room within the credit before the server gets to see it.
+    cost = irpc_call_cost(len);
+    while (ci->credit > 0 && ci->posted_n > 0 &&
+           ci->posted_total + cost > ci->credit)
+        irpc_posted_next(ci);
+    
+    retval = irpc_write_all(ci->server_sock, buf, len);
+    free(buf);
+    if (retval != 0)
+        return IRPC_FAILURE;
+    
+    slot = (ci->posted_head + ci->posted_n) % IRPC_MAX_POSTED;
+    ci->posted[slot] = func;
+    ci->posted_cost[slot] = cost;
+    ci->posted_total += cost;
+    ci->posted_n++;
+    
+    return IRPC_SUCCESS;
+}
+
+// -----------------------------------------------------------------------------
+#pragma mark Batched Calls
+// -----------------------------------------------------------------------------
+
+/*
+ * irpc_call_batch() runs every call twice: first collecting the
+ * requests, which are then written at once, then reading the replies.
+ * With IRPC_BATCH_STOP_ON_ERROR the requests are preceded by
+ * IRPC_USB_BATCH, so that the server skips the calls after a failed one
+ * and answers each of them with a single IRPC_BATCH_SKIPPED packet.
+ * Servers without IRPC_CAP_BATCH get such batches one call at a time.
+ */
+
+static void
+irpc_recv_usb_batch(struct irpc_connection_info *ci, int count, int flags)
+{
+    tpl_node *tn = NULL;
+    irpc_func_t func = IRPC_USB_BATCH;
+    
+    irpc_send_func(func, ci);
+    
+    // Send batch size and flags to server, there is no reply.
+    tn = tpl_map(IRPC_BATCH_FMT, &count, &flags);
+    tpl_pack(tn, 0);
+    irpc_dump_request(tn, ci);
+    tpl_free(tn);
+}
+
+void
+irpc_send_usb_batch(struct irpc_connection_info *ci)
+{
+    tpl_node *tn = NULL;
+    
+    // Read batch size and flags from client.
+    ci->batch_left = 0;
+    ci->batch_flags = 0;
+    tn = tpl_map(IRPC_BATCH_FMT, &ci->batch_left, &ci->batch_flags);
+    irpc_load_request(tn, ci);
+    tpl_unpack(tn, 0);
+    tpl_free(tn);
+    
+    ci->result = 0;
+}
+
+/* Server: answers a call of a batch which is being skipped. */
+static int
+irpc_batch_skip(struct irpc_connection_info *ci)
+{
+    tpl_node *tn = NULL;
+    int retval = IRPC_BATCH_SKIPPED;
+    
+    if (ci->batch_left <= 0)
+        return 0;
+    ci->batch_left--;
+    if (!(ci->batch_flags & IRPC_BATCH_STOP_ON_ERROR) || ci->result >= 0)
+        return 0;
+    
+    tn = tpl_map(IRPC_INT_FMT, &retval);
+    tpl_pack(tn, 0);
+    irpc_dump_reply(tn, ci);
+    tpl_free(tn);
+    
+    return 1;
+}
+
+/* Calls of a batch may use several infos, all on one connection. */
+static void
+irpc_batch_sync(struct irpc_connection_info *to, struct irpc_connection_info *from)
+{
+    if (to == from)
+        return;
+    
+    to->server_sock = from->server_sock;
+    to->seq = from->seq;
+    to->replies = from->replies;
+    to->token = from->token;
+}
+
+/*
+ * Writes the requests of the batch after the written ones, as many as
+ * the credit leaves room for next to the calls from first on, which
+ * are in flight.  The request of first always goes out.  ends[i] is
+ * where the request of call i ends in reqs.
+ */
+static int
+irpc_batch_write(struct irpc_connection_info *ci,
+                 const char *reqs,
+                 const size_t *ends,
+                 int n,
+                 int first,
+                 int *written)
+{
+    size_t start = first > 0 ? ends[first - 1] : 0;
+    size_t from = *written > 0 ? ends[*written - 1] : 0;
+    int last = *written;
+    
+    while (last < n) {
+        if (last > first && ci->credit > 0 &&
+            ends[last] - start + (size_t)(last - first + 1) * IRPC_REPLY_RESERVE >
+            (size_t)ci->credit)
+            break;
+        last++;
+    }
+    
+    if (last == *written)
+        return 0;
+    if (irpc_write_all(ci->server_sock, reqs + from, ends[last - 1] - from) != 0)
+        return -1;
+    *written = last;
+    
+    return 0;
+}
+
+static int
+irpc_batch_read_skipped(struct irpc_connection_info *ci)
+{
+    tpl_node *tn = NULL;
+    int retval = IRPC_FAILURE;
+    
+    tn = tpl_map(IRPC_INT_FMT, &retval);
+    if (irpc_load_reply(tn, ci) == 0)
+        tpl_unpack(tn, 0);
+    tpl_free(tn);
+    
+    return retval;
+}
+
+irpc_retval_t
+irpc_call_batch(struct irpc_batch_op *ops, int n, int flags)
+{
+    irpc_context_t ctx = IRPC_CONTEXT_CLIENT;
+    irpc_retval_t retval = IRPC_SUCCESS;
+    struct irpc_connection_info *ci;
+    void *buf = NULL, *reqs;
+    size_t len = 0, size = 0;
+    size_t *ends;
+    int stop = flags & IRPC_BATCH_STOP_ON_ERROR;
+    int failed = 0;
+    int written = 0;
+    int i;
+    
+    if (n <= 0)
+        return IRPC_SUCCESS;
+    
+    for (i = 0; i < n; i++) {
+        if (ops[i].func == IRPC_USB_SESSION_OPEN ||
+            ops[i].func == IRPC_USB_DELEGATE ||
+            ops[i].func == IRPC_USB_BATCH)
+            return IRPC_FAILURE;
+        ops[i].retval = IRPC_BATCH_SKIPPED;
+    }
+    
+    ci = &ops[0].info->ci;
+    irpc_posted_drain(ci);
+    if (ci->posted_error)
+        return irpc_posted_wait(ci);
+    
+    // Delegated transfers bypass the server, and servers without batch
+    // support cannot skip calls: one call at a time then.
+    if (ci->delegated || (stop && !(ci->caps & IRPC_CAP_BATCH))) {
+        for (i = 0; i < n && !(stop && failed); i++) {
+            irpc_batch_sync(&ops[i].info->ci, ci);
+            ops[i].retval = irpc_call(ops[i].func, ctx, ops[i].info);
+            irpc_batch_sync(ci, &ops[i].info->ci);
+            if (ops[i].retval < 0)
+                failed = 1;
+        }
+        return failed ? IRPC_FAILURE : IRPC_SUCCESS;
+    }
+    
+    if (!(ends = malloc(n * sizeof(size_t))))
+        return IRPC_FAILURE;
+    
+    // Collect the requests, written at once if the credit allows.
+    if (stop) {
+        irpc_batch_enter(ci, IRPC_BATCH_COLLECT, buf, len, size);
+        irpc_recv_usb_batch(ci, n, flags);
+        irpc_batch_leave(ci, &buf, &len, &size);
+    }
+    for (i = 0; i < n; i++) {
+        irpc_batch_sync(&ops[i].info->ci, ci);
+        irpc_batch_enter(&ops[i].info->ci, IRPC_BATCH_COLLECT, buf, len, size);
+        (void)irpc_call(ops[i].func, ctx, ops[i].info);
+        irpc_batch_leave(&ops[i].info->ci, &buf, &len, &size);
+        irpc_batch_sync(ci, &ops[i].info->ci);
+        ends[i] = len;
+    }
+    reqs = buf;
+    
+    // Read the replies in order, writing requests as room is made.
+    for (i = 0; i < n; i++) {
+        if (irpc_batch_write(ci, reqs, ends, n, i, &written) != 0) {
+            retval = IRPC_FAILURE;
+            break;
+        }
+        if (stop && failed) {
+            ops[i].retval = irpc_batch_read_skipped(ci);
+            continue;
+        }
+        irpc_batch_sync(&ops[i].info->ci, ci);
+        irpc_batch_enter(&ops[i].info->ci, IRPC_BATCH_REPLY, NULL, 0, 0);
+        ops[i].retval = irpc_call(ops[i].func, ctx, ops[i].info);
+        irpc_batch_leave(&ops[i].info->ci, &buf, &len, &size);
+        irpc_batch_sync(ci, &ops[i].info->ci);
+        if (ops[i].retval < 0) {
+            failed = 1;
+            retval = IRPC_FAILURE;
+        }
+    }
+    free(reqs);
+    free(ends);
+    
+    return failed ? IRPC_FAILURE : retval;
+}
+
+// -----------------------------------------------------------------------------
+#pragma mark Bulk Streams
+// -----------------------------------------------------------------------------
+
+/*
+ * irpc_bulk_stream() splits a transfer into chunks and keeps a window
+ * of them in flight, like a batch whose requests are written as
+ * replies come in.  The window is twice the bandwidth-delay product:
+ * the delivery rate of the chunks times the shortest round trip seen,
+ * so that queueing on the way does not grow it further.  It never
+ * takes more than the credit.  The first stream of an endpoint uses
+ * chunks of ci.max_payload and starts at IRPC_STREAM_INIT_CHUNKS, the
+ * next ones start where it ended (see irpc_stream_tune()).  With
+ * IRPC_CAP_BATCH the chunks form one batch stopping on errors, so no
+ * chunk after a failed one reaches the device.  A session with data
+ * streams (see irpc_streams_open()) deals the chunks out to them
+ * instead of using its connection.
+ */
+
+/* A chunk of a stream in flight. */
+struct irpc_chunk {
+    int len;
+    int via;                                /* Index of its stream */
+    long long sent;                         /* us */
+    long long delivered;                    /* Of the stream when sent */
+};
+
+struct irpc_stream {
+    struct irpc_chunk chunks[IRPC_STREAM_MAX_CHUNKS];
+    struct irpc_info *infos[IRPC_MAX_STREAMS];  /* The chunks go by */
+    int ninfos;
+    int striped;                            /* infos are data streams */
+    int head, n;                            /* Chunks in flight */
+    int next, nchunks;                      /* Chunks written, of the stream */
+    int off;                                /* Bytes written */
+    int done;                               /* Bytes transfered */
+    int cost[IRPC_MAX_STREAMS];             /* Charged to the credit */
+    int req_cost;
+    int chunk;                              /* Bytes per chunk */
+    int window;                             /* Chunks allowed in flight */
+    int stop;                               /* Server skips after a failure */
+    int failed;
+    int shorted;                            /* A short IN chunk ended it */
+    int broken;                             /* A data stream failed */
+    long long delivered;                    /* Bytes of chunks answered */
+    long long min_rtt;                      /* us */
+    double rate;                            /* Bytes per us */
+    struct irpc_ep_stats *ep;               /* Of info.endpoint */
+};
+
+/* Chunks allowed in flight for twice a bandwidth-delay product. */
+static int
+irpc_stream_window(struct irpc_stream *st, double bdp)
+{
+    int window = (int)(2 * bdp / st->chunk) + 1;
+    
+    if (window < 2)
+        window = 2;
+    if (window > IRPC_STREAM_MAX_CHUNKS)
+        window = IRPC_STREAM_MAX_CHUNKS;
+    
+    return window;
+}
+
+/* Sizes the window after the reply to c came in at now. */
+static void
+irpc_stream_adapt(struct irpc_stream *st, struct irpc_chunk *c, long long now)
+{
+    long long rtt = now - c->sent > 0 ? now - c->sent : 1;
+    double sample, bdp;
+    
+    st->delivered += c->len;
+    if (st->min_rtt == 0 || rtt < st->min_rtt)
+        st->min_rtt = rtt;
+    
+    // Bytes delivered while c was in flight, rising at once.
+    sample = (double)(st->delivered - c->delivered) / rtt;
+    st->rate = sample > st->rate ? sample : (7 * st->rate + sample) / 8;
+    
+    // The credit is checked as the chunks are written.
+    bdp = st->rate * st->min_rtt;
+    st->window = irpc_stream_window(st, bdp);
+}
+
+static struct irpc_ep_stats *
+irpc_ep_stats(struct irpc_connection_info *ci, char endpoint)
+{
+    return &ci->ep_stats[(endpoint & 0x0f) | ((endpoint & 0x80) ? 0x10 : 0)];
+}
+
+/*
+ * Sizes the chunks and the first window of a stream of len bytes after
+ * the streams before on its endpoint.  A chunk costs h beyond its
+ * round trip and its bytes (the call on both sides), and the device
+ * only starts on one once it arrived, so chunks of s bytes over a rate
+ * r take about len / r + s / r + len / s * h.  Large transfers get the
+ * largest chunks, short ones smaller chunks if calls are cheap enough
+ * for them to save an eighth.
+ */
+static void
+irpc_stream_tune(struct irpc_connection_info *ci, struct irpc_stream *st, int len)
+{
+    struct irpc_ep_stats *ep = st->ep;
+    double h = ep->overhead, r = ep->rate;
+    double cost, best;
+    int max = IRPC_MAX_DATA;
+    int s;
+    
+    if (ci->max_payload > 0 && ci->max_payload < IRPC_MAX_DATA)
+        max = ci->max_payload;
+    st->chunk = max;
+    st->window = IRPC_STREAM_INIT_CHUNKS;
+    if (ep->chunk == 0 || r <= 0)
+        return;
+    
+    if (h > 0) {
+        best = 7 * (max / r + (double)len / max * h) / 8;
+        for (s = IRPC_STREAM_MIN_CHUNK; s < max; s += IRPC_STREAM_CHUNK_ALIGN) {
+            cost = s / r + (double)len / s * h;
+            if (cost < best) {
+                best = cost;
+                st->chunk = s;
+            }
+        }
+    }
+    
+    // Pick up at the rate the last stream ended with.
+    st->rate = r;
+    st->window = irpc_stream_window(st, r * ep->min_rtt);
+}
+
+/* Keeps what the stream measured for the next one of its endpoint. */
+static void
+irpc_stream_learn(struct irpc_connection_info *ci, struct irpc_stream *st)
+{
+    struct irpc_ep_stats *ep = st->ep;
+    double h;
+    
+    if (st->min_rtt == 0 || st->rate <= 0)
+        return;
+    
+    // Without a ping the round trip cannot be told from h.
+    h = st->min_rtt - ci->rtt - st->chunk / st->rate;
+    if (ci->rtt == 0 || h < 0)
+        h = 0;
+    ep->overhead = ep->chunk ? (7 * ep->overhead + h) / 8 : h;
+    ep->chunk = st->chunk;
+    ep->min_rtt = st->min_rtt;
+    ep->rate = st->rate;
+}
+
+/* Writes the chunks the window and the credit leave room for. */
+static int
+irpc_stream_write(struct irpc_info *info,
+                  struct irpc_stream *st,
+                  const char *buf,
+                  int len)
+{
+    struct irpc_connection_info *ci;
+    struct irpc_info *via;
+    struct irpc_chunk *c;
+    void *reqs[IRPC_MAX_STREAMS] = { NULL };
+    size_t rlen[IRPC_MAX_STREAMS] = { 0 }, rsize[IRPC_MAX_STREAMS] = { 0 };
+    size_t start;
+    long long now = irpc_clock_us();
+    int retval = 0;
+    int first, k;
+    
+    while (!st->failed && !st->shorted &&
+           st->next < st->nchunks && st->n < st->window) {
+        // The streams take the chunks in turn, each within the credit.
+        k = st->next % st->ninfos;
+        via = st->infos[k];
+        ci = &via->ci;
+        if (st->cost[k] > 0 && ci->credit > 0 &&
+            st->cost[k] + st->req_cost > ci->credit)
+            break;
+        
+        c = &st->chunks[(st->head + st->n) % IRPC_STREAM_MAX_CHUNKS];
+        c->len = len - st->off < st->chunk ? len - st->off : st->chunk;
+        c->via = k;
+        c->sent = now;
+        c->delivered = st->delivered;
+        via->length = c->len;
+        if (!(via->endpoint & 0x80))
+            memcpy(via->data, buf + st->off, c->len);
+        
+        first = st->next == 0 && st->stop;
+        irpc_batch_enter(ci, IRPC_BATCH_COLLECT, reqs[k], rlen[k], rsize[k]);
+        if (st->striped)
+            irpc_recv_usb_stripe(ci, info->ci.stripe_seq++, first ? 2 : 1);
+        if (first)
+            irpc_recv_usb_batch(ci, st->nchunks, IRPC_BATCH_STOP_ON_ERROR);
+        start = ci->batch_len;
+        (void)irpc_call(IRPC_USB_BULK_TRANSFER, IRPC_CONTEXT_CLIENT, via);
+        st->req_cost = irpc_call_cost(ci->batch_len - start);
+        irpc_batch_leave(ci, &reqs[k], &rlen[k], &rsize[k]);
+        
+        st->cost[k] += st->req_cost;
+        st->off += c->len;
+        st->next++;
+        st->n++;
+    }
+    
+    for (k = 0; k < st->ninfos; k++) {
+        if (rlen[k] > 0 && retval == 0)
+            retval = irpc_write_all(st->infos[k]->ci.server_sock,
+                                    reqs[k],
+                                    rlen[k]);
+        free(reqs[k]);
+    }
+    
+    return retval;
+}
+
+/* Reads the reply to the oldest chunk in flight. */
+static void
+irpc_stream_read(struct irpc_stream *st, char *buf)
+{
+    struct irpc_chunk *c = &st->chunks[st->head];
+    struct irpc_info *via = st->infos[c->via];
+    struct irpc_connection_info *ci = &via->ci;
+    void *reqs = NULL;
+    size_t rlen = 0, rsize = 0;
+    int replies = ci->replies;
+    int retval;
+    
+    if (st->failed && st->stop) {
+        (void)irpc_batch_read_skipped(ci);
+    } else {
+        via->length = c->len;
+        via->transfered = 0;
+        irpc_batch_enter(ci, IRPC_BATCH_REPLY, NULL, 0, 0);
+        retval = irpc_call(IRPC_USB_BULK_TRANSFER, IRPC_CONTEXT_CLIENT, via);
+        irpc_batch_leave(ci, &reqs, &rlen, &rsize);
+        
+        if (via->transfered < 0 || via->transfered > c->len)
+            via->transfered = retval < 0 ? 0 : c->len;
+        // Chunks answered after a failure or a short read do not
+        // count, the ones in flight are only read out.
+        if (!st->failed && !st->shorted) {
+            if (via->endpoint & 0x80) {
+                memcpy(buf + st->done, via->data, via->transfered);
+                st->shorted = via->transfered < c->len;
+            }
+            st->done += via->transfered;
+            if (retval < 0)
+                st->failed = retval;
+        }
+    }
+    
+    // A lost data stream takes the rest of the chunks along.
+    if (st->striped && ci->replies == replies) {
+        st->broken = 1;
+        return;
+    }
+    
+    irpc_stream_adapt(st, c, irpc_clock_us());
+    st->cost[c->via] -= st->req_cost;
+    st->head = (st->head + 1) % IRPC_STREAM_MAX_CHUNKS;
+    st->n--;
+}
+
+/*
+ * The chunks go by the data streams of the session if it has some,
+ * each a copy of info on its own connection, else by info.
+ */
+static int
+irpc_stream_setup(struct irpc_info *info, struct irpc_stream *st)
+{
+    struct irpc_connection_info *ci = &info->ci, *sci;
+    int k;
+    
+    st->infos[0] = info;
+    st->ninfos = 1;
+    if (ci->nstreams == 0)
+        return 0;
+    
+    for (k = 0; k < ci->nstreams; k++) {
+        if (!(st->infos[k] = malloc(sizeof(struct irpc_info))))
+            break;
+        memcpy(st->infos[k], info, sizeof(struct irpc_info));
+        sci = &st->infos[k]->ci;
+        sci->server_sock = ci->streams[k];
+        sci->nstreams = 0;
+        sci->token = 0;
+        sci->reconnect = NULL;
+        sci->deadline = 0;
+        sci->expires = 0;
+        sci->posted_head = sci->posted_n = 0;
+        sci->posted_error = sci->posted_total = 0;
+        sci->posted_cb = NULL;
+        sci->seq = sci->replies = 0;
+        sci->recv_buf = NULL;
+        sci->recv_size = 0;
+        irpc_batch_enter(sci, 0, NULL, 0, 0);
+    }
+    st->ninfos = k;
+    st->striped = 1;
+    
+    return k == ci->nstreams ? 0 : -1;
+}
+
+static void
+irpc_stream_free(struct irpc_stream *st)
+{
+    int k;
+    
+    if (st->striped)
+        for (k = 0; k < st->ninfos; k++) {
+            free(st->infos[k]->ci.recv_buf);
+            free(st->infos[k]);
+        }
+    free(st);
+}
+
+/* Ends the batch of a stream stopped early with an empty one. */
+static int
+irpc_stream_end(struct irpc_connection_info *ci)
+{
+    void *buf = NULL;
+    size_t len = 0, size = 0;
+    int retval;
+    
+    irpc_batch_enter(ci, IRPC_BATCH_COLLECT, NULL, 0, 0);
+    irpc_recv_usb_batch(ci, 0, 0);
+    irpc_batch_leave(ci, &buf, &len, &size);
+    retval = irpc_write_all(ci->server_sock, buf, len);
+    free(buf);
+    
+    return retval == 0 ? IRPC_SUCCESS : IRPC_FAILURE;
+}
+
+irpc_retval_t
+irpc_bulk_stream(struct irpc_info *info, char *buf, int len, int *transfered)
+{
+    struct irpc_connection_info *ci = &info->ci;
+    struct irpc_stream *st;
+    irpc_retval_t retval = IRPC_SUCCESS;
+    int length = info->length;
+    int off, k;
+    
+    *transfered = 0;
+    if (len <= 0)
+        return IRPC_SUCCESS;
+    
+    irpc_posted_drain(ci);
+    if (ci->posted_error)
+        return irpc_posted_wait(ci);
+    
+    // Delegated transfers do not go through the server at all.
+    if (ci->delegated) {
+        for (off = 0; off < len && retval >= 0; off += info->length) {
+            info->length = len - off < IRPC_MAX_DATA ? len - off : IRPC_MAX_DATA;
+            if (!(info->endpoint & 0x80))
+                memcpy(info->data, buf + off, info->length);
+            retval = irpc_call(IRPC_USB_BULK_TRANSFER, IRPC_CONTEXT_CLIENT, info);
+            if (info->transfered > 0 && info->transfered <= info->length) {
+                if (info->endpoint & 0x80)
+                    memcpy(buf + *transfered, info->data, info->transfered);
+                *transfered += info->transfered;
+            }
+        }
+        info->length = length;
+        return retval < 0 ? retval : IRPC_SUCCESS;
+    }
+    
+    // A round trip without the device, to tell what a chunk costs.
+    if ((ci->caps & IRPC_CAP_PING) && ci->rtt == 0)
+        for (k = 0; k < IRPC_PING_SAMPLES; k++)
+            if (irpc_call(IRPC_USB_PING, IRPC_CONTEXT_CLIENT, info) != IRPC_SUCCESS)
+                break;
+    
+    if (!(st = calloc(1, sizeof(struct irpc_stream))))
+        return IRPC_FAILURE;
+    if (irpc_stream_setup(info, st) != 0) {
+        irpc_stream_free(st);
+        return IRPC_FAILURE;
+    }
+    st->ep = irpc_ep_stats(ci, info->endpoint);
+    irpc_stream_tune(ci, st, len);
+    st->nchunks = (len + st->chunk - 1) / st->chunk;
+    st->stop = (ci->caps & IRPC_CAP_BATCH) != 0;
+    
+    // Keep the window full, a reply at a time.
+    while (st->next < st->nchunks || st->n > 0) {
+        if (irpc_stream_write(info, st, buf, len) != 0) {
+            st->broken = st->striped;
+            retval = IRPC_FAILURE;
+            break;
+        }
+        if (st->n == 0)
+            break;
+        irpc_stream_read(st, buf);
+        if (st->broken) {
+            retval = IRPC_FAILURE;
+            break;
+        }
+    }
+    
+    // The session's connection carries the transfers from now on.
+    if (st->broken)
+        irpc_streams_close(ci);
+    
+    // Chunks never written (or lost with a data stream) leave the
+    // server counting the batch down.
+    if ((retval == IRPC_SUCCESS || st->broken) && st->stop &&
+        (st->next < st->nchunks || st->broken) &&
+        irpc_stream_end(ci) != IRPC_SUCCESS)
+        retval = IRPC_FAILURE;
+    if (retval == IRPC_SUCCESS && st->failed)
+        retval = st->failed;
+    if (retval == IRPC_SUCCESS)
+        irpc_stream_learn(ci, st);
+    *transfered = st->done;
+    info->length = length;
+    irpc_stream_free(st);
+    
+    return retval;
+}
+
 // -----------------------------------------------------------------------------
 #pragma mark Public API
 // -----------------------------------------------------------------------------
@@ -1355,6 +4300,34 @@ irpc_retval_t
 irpc_call(irpc_func_t func, irpc_context_t ctx, struct irpc_info *info)
 {
     irpc_retval_t retval = IRPC_SUCCESS;
+    struct irpc_connection_info *ci = &info->ci;
+    int corked = 0;
+    void *buf = NULL;
+    size_t len = 0, size = 0;
+    // These apply to other calls and are no calls of their own.
+    int announce = func == IRPC_USB_BATCH ||
+                   func == IRPC_USB_DEADLINE ||
+                   func == IRPC_USB_CANCEL ||
+                   func == IRPC_USB_STRIPE;
+    
+    // Calls following a failure in a batch are not run.
+    if (ctx == IRPC_CONTEXT_SERVER && !announce && irpc_batch_skip(ci)) {
+        ci->expires = 0;
+        return IRPC_FAILURE;
+    }
+    
+    // Replies of posted calls come first, so do their failures.
+    if (ctx == IRPC_CONTEXT_CLIENT && !ci->batch) {
+        irpc_posted_drain(ci);
+        if (ci->posted_error &&
+            func != IRPC_USB_CLOSE && func != IRPC_USB_EXIT)
+            return irpc_posted_wait(ci);
+        
+        // All packets of the call in one write.
+        irpc_batch_enter(ci, IRPC_BATCH_CORK, NULL, 0, 0);
+        ci->cork_seq = ci->seq;
+        corked = 1;
+    }
     
     switch (func)
     {
@@ -1409,10 +4382,78 @@ irpc_call(irpc_func_t func, irpc_context_t ctx, struct irpc_info *info)
         case IRPC_USB_GET_STRING_DESCRIPTOR_ASCII:
             retval = irpc_usb_get_string_descriptor_ascii(&info->ci, ctx, &info->handle, info->idx, info->data, info->length);
             break;
+        case IRPC_USB_SESSION_OPEN:
+            retval = irpc_usb_session_open(&info->ci, ctx, &info->session, &info->devlist);
+            break;
+        case IRPC_USB_DELEGATE:
+            retval = irpc_usb_delegate(&info->ci, ctx, &info->handle);
+            break;
+        case IRPC_USB_BATCH:
+            // Clients announce batches through irpc_call_batch().
+            if (ctx == IRPC_CONTEXT_SERVER)
+                irpc_send_usb_batch(&info->ci);
+            else
+                retval = IRPC_FAILURE;
+            break;
+        case IRPC_USB_DEADLINE:
+            // Clients set ci.deadline instead.
+            if (ctx == IRPC_CONTEXT_SERVER)
+                irpc_send_usb_deadline(&info->ci);
+            else
+                retval = IRPC_FAILURE;
+            break;
+        case IRPC_USB_CANCEL:
+            if (ctx == IRPC_CONTEXT_SERVER)
+                irpc_send_usb_cancel(&info->ci);
+            else
+                retval = irpc_cancel(&info->ci);
+            break;
+        case IRPC_USB_RESUME:
+            if (ctx == IRPC_CONTEXT_SERVER)
+                irpc_send_usb_resume(&info->ci);
+            else
+                retval = irpc_recv_usb_resume(&info->ci);
+            break;
+        case IRPC_USB_CREDIT:
+            if (ctx == IRPC_CONTEXT_SERVER)
+                irpc_send_usb_credit(&info->ci);
+            else
+                retval = irpc_recv_usb_credit(&info->ci);
+            break;
+        case IRPC_USB_STREAM_ATTACH:
+            // Clients open data streams through irpc_streams_open().
+            if (ctx == IRPC_CONTEXT_SERVER)
+                irpc_send_usb_stream_attach(&info->ci);
+            else
+                retval = IRPC_FAILURE;
+            break;
+        case IRPC_USB_STRIPE:
+            // Clients stripe through irpc_bulk_stream().
+            if (ctx == IRPC_CONTEXT_SERVER)
+                irpc_send_usb_stripe(&info->ci);
+            else
+                retval = IRPC_FAILURE;
+            break;
+        case IRPC_USB_PING:
+            if (ctx == IRPC_CONTEXT_SERVER)
+                irpc_send_usb_ping(&info->ci);
+            else
+                retval = irpc_recv_usb_ping(&info->ci);
+            break;
         default:
             retval = IRPC_FAILURE;
             break;
     }
     
+    if (corked) {
+        (void)irpc_flush_requests(ci);
+        irpc_batch_leave(ci, &buf, &len, &size);
+        free(buf);
+    }
+    
+    // A deadline only holds for the call following it.
+    if (ctx == IRPC_CONTEXT_SERVER && !announce)
+        ci->expires = 0;
+    
     return retval;
 }
@@ -16,8 +16,20 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  **/
 
+#include <stddef.h>
+
 #define IRPC_MAX_DEVS 256           /* Max 256 devices */
 #define IRPC_MAX_DATA 1024          /* Max buffer size for usb transfers */
+#define IRPC_MAX_FILTER 8           /* Max product ids of a session filter */
+#define IRPC_MAX_POSTED 64          /* Max posted calls awaiting their reply */
+#define IRPC_MAX_STREAMS 8          /* Max data streams of a session */
+#define IRPC_MAX_STRIPE_CALLS 2     /* Max calls of a stripe */
+#define IRPC_MAX_ENDPOINTS 32       /* Endpoint addresses, IN and OUT */
+#define IRPC_MAX_PACKET 65536       /* Max size of a packet a peer may send */
+#define IRPC_REPLY_RESERVE 4352     /* Credit a call in flight takes for its reply */
+
+#define IRPC_PROTOCOL_VERSION 2     /* Negotiated by IRPC_USB_SESSION_OPEN */
+#define IRPC_PROTOCOL_MIN_VERSION 1 /* Oldest spoken, 1 is IRPC_USB_INIT */
 
 /* Identifies the function call. */
 enum irpc_func {
@@ -38,6 +50,16 @@ enum irpc_func {
     IRPC_USB_BULK_TRANSFER,                 /* libusb_bulk_transfer */
     IRPC_USB_CLEAR_HALT,                    /* libusb_clear_halt */
     IRPC_USB_GET_STRING_DESCRIPTOR_ASCII,   /* libusb_get_string_descriptor_ascii */
+    IRPC_USB_DELEGATE,                      /* Pass the usbfs fd (local clients) */
+    IRPC_USB_SESSION_OPEN,                  /* libusb_init + libusb_get_device_list */
+    IRPC_USB_BATCH,                         /* Announces a batch of calls */
+    IRPC_USB_DEADLINE,                      /* Time budget of the next transfer */
+    IRPC_USB_CANCEL,                        /* libusb_cancel_transfer */
+    IRPC_USB_RESUME,                        /* Resumes a session after a reconnect */
+    IRPC_USB_CREDIT,                        /* Window of calls in flight */
+    IRPC_USB_STREAM_ATTACH,                 /* Joins a data stream to a session */
+    IRPC_USB_STRIPE,                        /* Order of the calls which follow */
+    IRPC_USB_PING,                          /* Measures the round trip */
 };
 
 enum irpc_context {
@@ -50,10 +72,143 @@ typedef enum irpc_retval {
     IRPC_SUCCESS,                           /* Function call has failed */
 } irpc_retval_t;
 
+struct libusb_context;
+struct libusb_device_handle;
+struct libusb_transfer;
+
+/* Payload frames packed and unpacked by one side, see IRPC_CAP_COMPRESS. */
+struct irpc_zstats {
+    long long raw;                          /* Transfer data framed */
+    long long wire;                         /* Size of the frames */
+    long long us;                           /* Spent compressing and decompressing */
+    int frames;
+    int stored;                             /* Packed without compression */
+};
+
+/* What irpc_bulk_stream() learned of an endpoint, for its next stream. */
+struct irpc_ep_stats {
+    int chunk;                              /* Bytes per chunk, 0: no stream yet */
+    long long min_rtt;                      /* us, of a chunk */
+    double rate;                            /* Bytes per us delivered */
+    double overhead;                        /* us a chunk costs beyond a ping and its bytes */
+};
+
 /* Holds connection specific information. */
 struct irpc_connection_info {
     int client_sock;                        /* Client socked fd */
     int server_sock;                        /* Server socket fd */
+    struct libusb_context *ctx;             /* Server: libusb context */
+    struct libusb_device_handle *handle;    /* Server: opened device */
+    int delegated;                          /* usbfs_fd is valid */
+    int usbfs_fd;                           /* Delegated usbfs fd */
+    void *req_img;                          /* Gathered request packet */
+    size_t req_sz;                          /* Size of req_img */
+    /* Reply writer of the server I/O backend, takes ownership of buf.
+     * NULL writes the reply to client_sock directly. */
+    int (*send_reply)(struct irpc_connection_info *ci, void *buf, size_t sz);
+    /* Like send_reply, fd is passed to the client after the reply. */
+    int (*send_reply_fd)(struct irpc_connection_info *ci, void *buf,
+                         size_t sz, int fd);
+    /* Server: transfers are submitted asynchronously if set.
+     * async_begin() precedes the submission, async_end() follows the
+     * reply, called from the thread handling the libusb events. */
+    void (*async_begin)(struct irpc_connection_info *ci);
+    void (*async_end)(struct irpc_connection_info *ci);
+    /* Result of the negotiation, all zero for sessions started with
+     * IRPC_USB_INIT (or servers not supporting IRPC_USB_SESSION_OPEN). */
+    int version;                            /* Protocol version in use */
+    int caps;                               /* IRPC_CAP_* both sides support */
+    int max_payload;                        /* Max transfer length, 0: IRPC_MAX_DATA */
+    /* Client: state of irpc_call_batch(). */
+    int batch;                              /* IRPC_BATCH_COLLECT, _REPLY or 0 */
+    void *batch_buf;                        /* Collected requests */
+    size_t batch_len;
+    size_t batch_size;
+    size_t batch_sent;                      /* Written part of a corked call */
+    /* Client: replies are read into recv_buf, kept from call to call. */
+    void *recv_buf;
+    size_t recv_size;
+    /* Server: state of an announced batch. */
+    int batch_left;                         /* Calls of the batch still to come */
+    int batch_flags;                        /* IRPC_BATCH_* */
+    int result;                             /* Result of the last call */
+    /* Client: calls of irpc_call_posted() awaiting their reply. */
+    int posted[IRPC_MAX_POSTED];            /* Functions, oldest at posted_head */
+    int posted_head;
+    int posted_n;
+    int posted_error;                       /* First failure not reported yet */
+    int posted_cost[IRPC_MAX_POSTED];       /* Their charge against ci.credit */
+    int posted_total;
+    /* Client: gets failures of posted calls instead of the next call. */
+    void (*posted_cb)(struct irpc_connection_info *ci, int func, int retval);
+    /* Deadlines and cancellation, see IRPC_USB_DEADLINE. */
+    int deadline;                           /* Client: ms a transfer may take, 0: any */
+    int seq;                                /* Number of the current request */
+    long long expires;                      /* Its deadline, irpc_clock_ms() */
+    long long received;                     /* Server: its arrival */
+    int cancel_seq;                         /* Server: request to cancel */
+    int transfer_seq;                       /* Server: request of transfer */
+    struct libusb_transfer *transfer;       /* Server: transfer in flight */
+    /* Session resume, see IRPC_USB_RESUME. */
+    unsigned long long token;               /* Resumable session, 0: none */
+    int replies;                            /* Client: replies received */
+    int cork_seq;                           /* Client: ci.seq before the corked call */
+    int resumable;                          /* Server: backend keeps sessions */
+    /* Client: returns a new connection to the server, -1 if there is
+     * none.  Setting it makes sessions resumable if the server can. */
+    int (*reconnect)(struct irpc_connection_info *ci);
+    /* Flow control, see IRPC_USB_CREDIT.  Server: memory budget of the
+     * client set by the backend, 0: none.  Client: the budget granted,
+     * 0: unlimited. */
+    int credit;
+    /* Client: data streams of the session, see irpc_streams_open(). */
+    int streams[IRPC_MAX_STREAMS];
+    int nstreams;
+    int stream_set;                         /* Set of the streams, from 1 */
+    int stripe_seq;                         /* Next stripe of the set */
+    /* Compression ratio (raw / wire) and cost of bulk data. */
+    struct irpc_zstats zstats;
+    /* Client: shortest round trip of IRPC_USB_PING (us, 0: none yet)
+     * and the streams seen per endpoint, see irpc_bulk_stream(). */
+    long long rtt;
+    struct irpc_ep_stats ep_stats[IRPC_MAX_ENDPOINTS];
+};
+
+/* Phases of irpc_call_batch(). */
+#define IRPC_BATCH_COLLECT      1
+#define IRPC_BATCH_REPLY        2
+#define IRPC_BATCH_CORK         3           /* irpc_call(): one write per call */
+
+/*
+ * Capabilities negotiated with IRPC_USB_SESSION_OPEN.  A feature is
+ * only used if both sides announce it, so peers of different releases
+ * agree on the fastest mode they have in common.
+ */
+#define IRPC_CAP_ASYNC          (1 << 0)    /* Server: asynchronous transfers */
+#define IRPC_CAP_DELEGATE       (1 << 1)    /* Server: IRPC_USB_DELEGATE works */
+#define IRPC_CAP_COMPRESS       (1 << 2)    /* Bulk data in compressed frames */
+#define IRPC_CAP_BATCH          (1 << 4)    /* Batched calls */
+#define IRPC_CAP_DEADLINE       (1 << 5)    /* Deadlines and IRPC_USB_CANCEL */
+#define IRPC_CAP_RESUME         (1 << 6)    /* Server: IRPC_USB_RESUME works */
+#define IRPC_CAP_CREDIT         (1 << 7)    /* Server: grants a credit */
+#define IRPC_CAP_STREAMS        (1 << 8)    /* Server: takes data streams */
+#define IRPC_CAP_PING           (1 << 9)    /* Server: IRPC_USB_PING works */
+
+/* Session open flags. */
+#define IRPC_SESSION_ENUMERATE  (1 << 0)    /* Reply with the device list */
+
+/* IRPC_USB_SESSION_OPEN request and reply. */
+struct irpc_session {
+    int version;                            /* Highest version (reply: agreed) */
+    int min_version;                        /* Lowest version (reply: server's) */
+    int caps;                               /* IRPC_CAP_*, 0: all (reply: agreed) */
+    int max_payload;                        /* 0: IRPC_MAX_DATA (reply: agreed) */
+    int flags;                              /* IRPC_SESSION_* */
+    int vendor_id;                          /* Filter, 0 matches any vendor */
+    int n_products;                         /* Filter, 0 matches any product */
+    int products[IRPC_MAX_FILTER];
+    int status;                             /* Reply: libusb_init result */
+    int ids[IRPC_MAX_DEVS];                 /* Reply: idVendor << 16 | idProduct */
 };
 
 /* Reflection of libusb_device. */
@@ -120,6 +275,8 @@ struct irpc_info {
     int transfered;
     // int timeout;
     int status;
+    // Session open, the device list goes to devlist.
+    struct irpc_session session;
 };
 
 typedef enum irpc_func irpc_func_t;
@@ -127,3 +284,156 @@ typedef enum irpc_context irpc_context_t;
 
 irpc_retval_t
 irpc_call(irpc_func_t func, irpc_context_t ctx, struct irpc_info *info);
+
+/* One call of irpc_call_batch(). */
+struct irpc_batch_op {
+    irpc_func_t func;
+    struct irpc_info *info;                 /* Arguments and results */
+    int retval;                             /* What irpc_call() would return */
+};
+
+#define IRPC_BATCH_STOP_ON_ERROR (1 << 0)   /* Skip the calls after a failure */
+#define IRPC_BATCH_SKIPPED      (-1000)     /* retval of skipped calls */
+
+/*
+ * Client: issues n calls with one write and reads all replies, saving
+ * a round trip per call.  Calls depending on results of earlier ones
+ * (other than the server side device handle) do not belong in a batch.
+ * IRPC_USB_SESSION_OPEN and IRPC_USB_DELEGATE cannot be batched.
+ * Fails if any call failed or was skipped.
+ */
+irpc_retval_t
+irpc_call_batch(struct irpc_batch_op *ops, int n, int flags);
+
+/*
+ * Client: posts a call whose result is not needed right away: OUT
+ * transfers and interface or configuration changes.  It returns once
+ * the request is written and runs on the server in order with all
+ * other calls.  A failure is passed to ci.posted_cb if set, otherwise
+ * the next call (but IRPC_USB_CLOSE and IRPC_USB_EXIT) is not made and
+ * returns it instead.  Other calls are made synchronously.
+ */
+irpc_retval_t
+irpc_call_posted(irpc_func_t func, struct irpc_info *info);
+
+/* Client: waits for all posted calls, returns their first failure. */
+irpc_retval_t
+irpc_posted_wait(struct irpc_connection_info *ci);
+
+/*
+ * Client: transfers len bytes of buf on info.endpoint as bulk transfers
+ * of up to ci.max_payload bytes, keeping as many in flight as the round
+ * trip time, the throughput and the server's credit call for.  The
+ * chunk size and the first window follow what earlier streams of the
+ * endpoint and IRPC_USB_PING measured.  Short IN transfers are packed
+ * together.  The first failure ends the stream and is returned,
+ * *transfered is what got through before it.
+ */
+irpc_retval_t
+irpc_bulk_stream(struct irpc_info *info, char *buf, int len, int *transfered);
+
+/*
+ * Client: opens n more connections through ci.reconnect as data
+ * streams of the session, which irpc_bulk_stream() stripes its chunks
+ * over instead of using ci.server_sock.  The server runs the chunks in
+ * order.  Needs a token (see
+ * IRPC_USB_RESUME) and IRPC_CAP_STREAMS.  Replaces the streams open
+ * before, n 0 just closes them.  Failed streams are closed, later
+ * transfers use the session's connection again.
+ */
+irpc_retval_t
+irpc_streams_open(struct irpc_connection_info *ci, int n);
+
+/*
+ * Client: cancels the transfer of the last request, e.g. a posted one.
+ * Calls waiting past ci.deadline for their reply do so themselves.
+ */
+irpc_retval_t
+irpc_cancel(struct irpc_connection_info *ci);
+
+/* Monotonic clock in ms, used for deadlines. */
+long long
+irpc_clock_ms(void);
+
+/* Helpers for servers which gather packets themselves. */
+irpc_func_t
+irpc_read_func(int sock);
+
+int
+irpc_func_nargs(irpc_func_t func);
+
+irpc_retval_t
+irpc_func_from_image(void *img, size_t sz, irpc_func_t *func);
+
+int
+irpc_device_key(struct irpc_connection_info *ci);
+
+/*
+ * Server: runs a gathered IRPC_USB_CANCEL right away, instead of
+ * behind the request it cancels.
+ */
+void
+irpc_server_cancel(struct irpc_connection_info *ci, void *img, size_t sz);
+
+/*
+ * Server: arguments of a gathered IRPC_USB_RESUME and the reply to it,
+ * for servers which keep the sessions of lost connections.
+ */
+irpc_retval_t
+irpc_resume_from_image(void *img,
+                       size_t sz,
+                       unsigned long long *token,
+                       int *replies);
+
+int
+irpc_resume_reply(int status,
+                  int seq,
+                  unsigned long long token,
+                  void **buf,
+                  size_t *sz);
+
+/*
+ * Server: arguments of a gathered IRPC_USB_STREAM_ATTACH and the reply
+ * to it, and of a gathered IRPC_USB_STRIPE, for servers which take
+ * data streams.
+ */
+irpc_retval_t
+irpc_attach_from_image(void *img,
+                       size_t sz,
+                       unsigned long long *token,
+                       int *set);
+
+int
+irpc_attach_reply(int status, void **buf, size_t *sz);
+
+irpc_retval_t
+irpc_stripe_from_image(void *img, size_t sz, int *seq, int *calls);
+
+void
+irpc_server_cleanup(struct irpc_connection_info *ci);
+
+/*
+ * Server: handoff of a session to another server process (Linux).
+ * Export yields the opened device (session_data -1 and fd -1: none),
+ * its claimed interfaces and its usbfs fd, still owned by ci.  Import
+ * attaches ci to the shared context and adopts the device, taking the
+ * fd over.
+ */
+int
+irpc_server_export(struct irpc_connection_info *ci,
+                   int *session_data,
+                   unsigned long long *claimed,
+                   int *fd);
+
+int
+irpc_server_import(struct irpc_connection_info *ci,
+                   int session_data,
+                   unsigned long long claimed,
+                   int fd);
+
+/* Pre-initialize the libusb context shared by all server sessions. */
+int
+irpc_server_init(void);
+
+void
+irpc_server_exit(void);
@@ -106,10 +106,6 @@ struct linux_device_priv {
 	unsigned char *config_descriptor;
 };
 
-struct linux_device_handle_priv {
-	int fd;
-};
-
 enum reap_action {
 	NORMAL = 0,
 	/* submission failed after the first URB, so await cancellation/completion
@@ -115,6 +115,12 @@ struct usbfs_hub_portinfo {
 	unsigned char port[127];	/* port to device num mapping */
 };
 
+/* Backend private data of a device handle (handle->os_priv), shared
+ * with libirpc which hands the usbfs fd to local clients. */
+struct linux_device_handle_priv {
+	int fd;
+};
+
 #define IOCTL_USBFS_CONTROL	_IOWR('U', 0, struct usbfs_ctrltransfer)
 #define IOCTL_USBFS_BULK		_IOWR('U', 2, struct usbfs_bulktransfer)
 #define IOCTL_USBFS_RESETEP	_IOR('U', 3, unsigned int)
@@ -33,6 +33,7 @@ static const char id[]="$Id: tpl.c 192 2009-04-24 10:35:30Z thanson $";
 
 #ifndef _WIN32
 #include <unistd.h>     /* for ftruncate */
+#include <sys/uio.h>    /* writev */
 #else
 #include <io.h>
 #define ftruncate(x,y) _chsize(x,y)
@@ -60,9 +61,19 @@ typedef unsigned __int64 uint64_t;
 #include <sys/mman.h>   /* mmap */
 #endif
 
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define TPL_X86_SIMD
+#include <immintrin.h>  /* SSE2, AVX2 byte swapping */
+#endif
+
 #include "tpl.h"
 
 #define TPL_GATHER_BUFLEN 8192
+#define TPL_STREAM_BUFLEN 512
+#define TPL_DUMP_BUFLEN 1024
+#define TPL_DUMP_LEAF_MIN 4096  /* B payloads written in place by TPL_FD */
+#define TPL_DUMP_MAX_SEGS 16
+#define TPL_FIXED_MAX_RUNS 64
 #define TPL_MAGIC "tpl"
 
 /* macro to add a structure to a doubly-linked list */
@@ -82,11 +93,17 @@ typedef unsigned __int64 uint64_t;
 
 #define fatal_oom() tpl_hook.fatal("out of memory\n")
 
+/* make room to dump sz bytes at dv, which moves if the output grows */
+#define TPL_ROOM(o,dv,sz)                                             \
+  (((size_t)((dv) - (o)->addr) + (sz) <= (o)->size) ? (dv) :           \
+   tpl_out_room((o),(dv),(sz)))
+
 /* bit flags (internal). preceded by the external flags in tpl.h */
-#define TPL_WRONLY         (1 << 9)  /* app has initiated tpl packing  */
-#define TPL_RDONLY         (1 << 10)  /* tpl was loaded (for unpacking) */
-#define TPL_XENDIAN        (1 << 11)  /* swap endianness when unpacking */
-#define TPL_OLD_STRING_FMT (1 << 12) /* tpl has strings in 1.2 format */
+#define TPL_WRONLY         (1 << 12)  /* app has initiated tpl packing  */
+#define TPL_RDONLY         (1 << 13)  /* tpl was loaded (for unpacking) */
+#define TPL_XENDIAN        (1 << 14)  /* swap endianness when unpacking */
+#define TPL_OLD_STRING_FMT (1 << 15) /* tpl has strings in 1.2 format */
+#define TPL_STREAMED       (1 << 16) /* root was unpacked by TPL_STREAM load */
 
 /* values for the flags byte that appears after the magic prefix */
 #define TPL_SUPPORTED_BITFLAGS 3
@@ -154,6 +171,23 @@ typedef struct tpl_mmap_rec {
     size_t text_sz;
 } tpl_mmap_rec;
 
+/* Maps of fixed size scalars only (no s, B or A) pack and unpack in runs
+ * of contiguous memory, instead of field by field. The runs are in image
+ * order and their packed data is kept in one block, dumped in one copy.
+ */
+typedef struct tpl_fixed_run {
+    char *addr;                      /* mapped memory */
+    size_t sz;
+    int wsz;                         /* word size, for byte swapping */
+} tpl_fixed_run;
+
+typedef struct tpl_fixed {
+    size_t sz;                       /* data bytes of an image */
+    int num_runs;
+    tpl_fixed_run *runs;
+    char *data;                      /* packed data */
+} tpl_fixed;
+
 /* root node datum */
 typedef struct tpl_root_data {
     int flags;
@@ -161,8 +195,30 @@ typedef struct tpl_root_data {
     tpl_mmap_rec mmap;
     char *fmt;
     int *fxlens, num_fxlens;
+    tpl_fixed *fixed;                /* fixed layout, or NULL */
 } tpl_root_data;
 
+/* Output of a dump. The image is serialized at addr+base. If grow is set,
+ * addr is enlarged as needed, otherwise it must fit the image (tpl_ser_osz).
+ * With segs, large leaves are not copied but written from where they are.
+ */
+typedef struct tpl_out_seg {
+    size_t off;                      /* buffered bytes preceding the leaf */
+    void *addr;
+    size_t sz;
+} tpl_out_seg;
+
+typedef struct tpl_out {
+    char *addr;
+    size_t len, size;
+    size_t base;                     /* offset of the image in addr */
+    int grow;
+    char *stack;                     /* initial addr not to be realloc'd */
+    tpl_out_seg *segs;
+    int num_segs, max_segs;
+    size_t seg_sz;                   /* bytes in segs */
+} tpl_out;
+
 /* node type to size mapping */
 struct tpl_type_t {
     char c;
@@ -176,22 +232,28 @@ static tpl_node *tpl_find_i(tpl_node *n, int i);
 static void *tpl_cpv(void *datav, void *data, size_t sz);
 static void *tpl_extend_backbone(tpl_node *n);
 static char *tpl_fmt(tpl_node *r);
-static void *tpl_dump_atyp(tpl_node *n, tpl_atyp* at, void *dv);
+static char *tpl_dump_atyp(tpl_node *n, tpl_atyp* at, tpl_out *o, char *dv);
 static size_t tpl_ser_osz(tpl_node *n);
+static int tpl_dump_out(tpl_node *r, tpl_out *o);
+static int tpl_out_write(tpl_out *o, int fd);
+static char *tpl_out_room(tpl_out *o, char *dv, size_t sz);
 static void tpl_free_atyp(tpl_node *n,tpl_atyp *atyp);
-static int tpl_dump_to_mem(tpl_node *r, void *addr, size_t sz);
 static int tpl_mmap_file(char *filename, tpl_mmap_rec *map_rec);
 static int tpl_mmap_output_file(char *filename, size_t sz, void **text_out);
 static int tpl_cpu_bigendian(void);
 static int tpl_needs_endian_swap(void *);
 static void tpl_byteswap(void *word, int len);
+static void tpl_byteswap_n(void *words, size_t num, int len);
+static void tpl_fixed_layout(tpl_node *r);
 static void tpl_fatal(char *fmt, ...);
 static int tpl_serlen(tpl_node *r, tpl_node *n, void *dv, size_t *serlen);
 static int tpl_unpackA0(tpl_node *r);
 static int tpl_oops(const char *fmt, ...);
 static int tpl_gather_mem( char *buf, size_t len, tpl_gather_t **gs, tpl_gather_cb *cb, void *data);
+static int tpl_gather_mem_grow( char *buf, size_t len, tpl_gather_t **gs, tpl_gather_cb *cb, void *data);
 static int tpl_gather_nonblocking( int fd, tpl_gather_t **gs, tpl_gather_cb *cb, void *data);
-static int tpl_gather_blocking(int fd, void **img, size_t *sz);
+static int tpl_gather_blocking(int fd, void **img, size_t *sz, size_t *size);
+static int tpl_load_stream(tpl_node *r, int fd, int mode, void **bufp, size_t *sizep);
 static tpl_node *tpl_map_va(char *fmt, va_list ap);
 
 /* This is used internally to help calculate padding when a 'double' 
@@ -560,6 +622,7 @@ static tpl_node *tpl_map_va(char *fmt, va_list ap) {
         fatal_oom();
     memcpy(((tpl_root_data*)(root->data))->fmt,fmt,strlen(fmt)+1);
 
+    tpl_fixed_layout(root);
     return root;
 
 fail:
@@ -568,6 +631,82 @@ fail:
     return NULL;
 }
 
+/* Walk the runs of a fixed layout map in image order, coalescing fields
+ * which are adjacent in memory. Fills runs if given, returns their number
+ * and their total size in sz.
+ */
+static int tpl_fixed_runs(tpl_node *r, tpl_fixed_run *runs, size_t *sz) {
+    tpl_node *c, *np;
+    tpl_pound_data *pd;
+    tpl_fixed_run cur;
+    size_t itermax, csz;
+    int n=0;
+
+    cur.addr = NULL;
+    cur.sz = 0;
+    cur.wsz = 0;
+    *sz = 0;
+    c = r->children;
+    while (c) {
+        if (c->type == TPL_TYPE_POUND) {
+            pd = (tpl_pound_data*)c->data;
+            itermax = c->num;
+            if (++(pd->iternum) < itermax) {
+              for(np=pd->iter_start_node; np != c; np = np->next) {
+                np->addr = (char*)(np->addr) + pd->inter_elt_len;
+              }
+              c = pd->iter_start_node;
+              continue;
+            } else {
+              pd->iternum = 0;
+              for(np=pd->iter_start_node; np != c; np = np->next) {
+                np->addr = (char*)(np->addr) - ((itermax-1) * pd->inter_elt_len);
+              }
+            }
+        } else {
+            csz = tpl_types[c->type].sz * c->num;
+            *sz += csz;
+            if (n > 0 && cur.addr + cur.sz == (char*)c->addr &&
+                cur.wsz == tpl_types[c->type].sz) {
+                cur.sz += csz;
+            } else {
+                cur.addr = c->addr;
+                cur.sz = csz;
+                cur.wsz = tpl_types[c->type].sz;
+                n++;
+            }
+            if (runs) runs[n-1] = cur;
+        }
+        c = c->next;
+    }
+    return n;
+}
+
+/* set up the fixed layout of a map which has one */
+static void tpl_fixed_layout(tpl_node *r) {
+    tpl_node *c;
+    tpl_fixed *fx;
+    size_t sz;
+    int n;
+
+    if (!r->children) return;
+    for(c=r->children; c; c=c->next) {
+        if (c->type == TPL_TYPE_STR || c->type == TPL_TYPE_BIN ||
+            c->type == TPL_TYPE_ARY) return;
+    }
+    n = tpl_fixed_runs(r,NULL,&sz);
+    if (n > TPL_FIXED_MAX_RUNS) return;
+
+    /* one block: the header, the runs, then the packed data */
+    fx = (tpl_fixed*)tpl_hook.malloc(sizeof(tpl_fixed) + n*sizeof(tpl_fixed_run) + sz);
+    if (!fx) fatal_oom();
+    fx->runs = (tpl_fixed_run*)(fx + 1);
+    fx->data = (char*)(fx->runs + n);
+    fx->num_runs = tpl_fixed_runs(r,fx->runs,&fx->sz);
+    memset(fx->data,0,sz);
+    ((tpl_root_data*)(r->data))->fixed = fx;
+}
+
 static int tpl_unmap_file( tpl_mmap_rec *mr) {
 
     if ( munmap( mr->text, mr->text_sz ) == -1 ) {
@@ -768,6 +907,9 @@ TPL_API void tpl_free(tpl_node *r) {
     if (((tpl_root_data*)(r->data))->num_fxlens > 0) {
         tpl_hook.free(((tpl_root_data*)(r->data))->fxlens);
     }
+    if (((tpl_root_data*)(r->data))->fixed) {
+        tpl_hook.free(((tpl_root_data*)(r->data))->fixed);
+    }
     tpl_hook.free(r->data);  /* tpl_root_data */
     tpl_hook.free(r);
 }
@@ -824,11 +966,44 @@ static int *tpl_fxlens(tpl_node *r, int *num_fxlens) {
     return ((tpl_root_data*)(r->data))->fxlens;
 }
 
-/* called when serializing an 'A' type node into a buffer which has
- * already been set up with the proper space. The backbone is walked
+static char *tpl_out_room(tpl_out *o, char *dv, size_t sz) {
+    size_t len, size;
+    char *addr;
+
+    if (!o->grow) tpl_hook.fatal("internal error: tpl_dump output overflow\n");
+    len = dv - o->addr;
+    size = o->size ? o->size : TPL_DUMP_BUFLEN;
+    while (size < len + sz) size *= 2;
+    if (o->stack && o->addr == o->stack) {
+        if ( (addr = tpl_hook.malloc(size)) == NULL) fatal_oom();
+        memcpy(addr,o->addr,len);
+    } else if ( (addr = tpl_hook.realloc(o->addr,size)) == NULL) fatal_oom();
+    o->addr = addr;
+    o->size = size;
+    return addr + len;
+}
+
+/* copy a B payload, or leave it in place if it is large enough to be
+ * worth a write of its own */
+static char *tpl_out_leaf(tpl_out *o, char *dv, void *data, size_t sz) {
+    tpl_out_seg *seg;
+
+    if (sz < TPL_DUMP_LEAF_MIN || o->num_segs == o->max_segs) {
+        dv = TPL_ROOM(o,dv,sz);
+        return tpl_cpv(dv,data,sz);
+    }
+    seg = &o->segs[o->num_segs++];
+    seg->off = dv - o->addr;
+    seg->addr = data;
+    seg->sz = sz;
+    o->seg_sz += sz;
+    return dv;
+}
+
+/* called when serializing an 'A' type node. The backbone is walked
  * which was obtained from the tpl_atyp header passed in. 
  */
-static void *tpl_dump_atyp(tpl_node *n, tpl_atyp* at, void *dv) {
+static char *tpl_dump_atyp(tpl_node *n, tpl_atyp* at, tpl_out *o, char *dv) {
     tpl_backbone *bb;
     tpl_node *c;
     void *datav;
@@ -838,9 +1013,10 @@ static void *tpl_dump_atyp(tpl_node *n, tpl_atyp* at, void *dv) {
     tpl_atyp *atypp;
     tpl_pound_data *pd;
     int i;
-    size_t itermax;
+    size_t itermax, sz;
 
     /* handle 'A' nodes */
+    dv = TPL_ROOM(o,dv,sizeof(uint32_t));
     dv = tpl_cpv(dv,&at->num,sizeof(uint32_t));  /* array len */
     for(bb=at->bb; bb; bb=bb->next) {
         datav = bb->data;
@@ -855,15 +1031,18 @@ static void *tpl_dump_atyp(tpl_node *n, tpl_atyp* at, void *dv) {
                 case TPL_TYPE_UINT64:
                 case TPL_TYPE_INT16:
                 case TPL_TYPE_UINT16:
-                    dv = tpl_cpv(dv,datav,tpl_types[c->type].sz * c->num);
-                    datav = (void*)((uintptr_t)datav + tpl_types[c->type].sz * c->num);
+                    sz = tpl_types[c->type].sz * c->num;
+                    dv = TPL_ROOM(o,dv,sz);
+                    dv = tpl_cpv(dv,datav,sz);
+                    datav = (void*)((uintptr_t)datav + sz);
                     break;
                 case TPL_TYPE_BIN:
                     /* dump the buffer length followed by the buffer */
                     memcpy(&binp,datav,sizeof(tpl_bin*)); /* cp to aligned */
                     slen = binp->sz;
+                    dv = TPL_ROOM(o,dv,sizeof(uint32_t));
                     dv = tpl_cpv(dv,&slen,sizeof(uint32_t));
-                    dv = tpl_cpv(dv,binp->addr,slen);
+                    dv = tpl_out_leaf(o,dv,binp->addr,slen);
                     datav = (void*)((uintptr_t)datav + sizeof(tpl_bin*));
                     break;
                 case TPL_TYPE_STR:
@@ -871,6 +1050,7 @@ static void *tpl_dump_atyp(tpl_node *n, tpl_atyp* at, void *dv) {
                     for(i=0; i < c->num; i++) {
                       memcpy(&strp,datav,sizeof(char*)); /* cp to aligned */
                       slen = strp ? (strlen(strp)+1) : 0;
+                      dv = TPL_ROOM(o,dv,sizeof(uint32_t) + (slen > 1 ? slen-1 : 0));
                       dv = tpl_cpv(dv,&slen,sizeof(uint32_t));
                       if (slen > 1) dv = tpl_cpv(dv,strp,slen-1);
                       datav = (void*)((uintptr_t)datav + sizeof(char*));
@@ -878,7 +1058,7 @@ static void *tpl_dump_atyp(tpl_node *n, tpl_atyp* at, void *dv) {
                     break;
                 case TPL_TYPE_ARY:
                     memcpy(&atypp,datav,sizeof(tpl_atyp*)); /* cp to aligned */
-                    dv = tpl_dump_atyp(c,atypp,dv);
+                    dv = tpl_dump_atyp(c,atypp,o,dv);
                     datav = (void*)((uintptr_t)datav + sizeof(void*));
                     break;
                 case TPL_TYPE_POUND:
@@ -917,6 +1097,8 @@ static size_t tpl_ser_osz(tpl_node *n) {
     }
 
     sz = n->ser_osz;    /* start with fixed overhead, already stored */
+    if (((tpl_root_data*)(n->data))->fixed)
+        return sz + ((tpl_root_data*)(n->data))->fixed->sz;
     c=n->children;
     while (c) {
         switch (c->type) {
@@ -978,25 +1160,29 @@ static size_t tpl_ser_osz(tpl_node *n) {
 
 TPL_API int tpl_dump(tpl_node *r, int mode, ...) {
     va_list ap;
-    char *filename, *bufv;
+    char *filename, stack[TPL_DUMP_BUFLEN];
     void **addr_out,*buf, *pa_addr;
     int fd,rc=0;
-    size_t sz,*sz_out, pa_sz;
+    size_t sz,*sz_out,*size_out,pa_sz;
+    tpl_out o;
+    tpl_out_seg segs[TPL_DUMP_MAX_SEGS];
 
     if (((tpl_root_data*)(r->data))->flags & TPL_RDONLY) {  /* unusual */
         tpl_hook.oops("error: tpl_dump called for a loaded tpl\n");
         return -1;
     }
 
-    sz = tpl_ser_osz(r); /* compute the size needed to serialize  */
-
+    memset(&o,0,sizeof(o));
     va_start(ap,mode);
     if (mode & TPL_FILE) {
         filename = va_arg(ap,char*);
+        sz = tpl_ser_osz(r); /* compute the size needed to serialize  */
         fd = tpl_mmap_output_file(filename, sz, &buf);
         if (fd == -1) rc = -1;
         else {
-            rc = tpl_dump_to_mem(r,buf,sz);
+            o.addr = buf;
+            o.size = sz;
+            rc = tpl_dump_out(r,&o);
             if (msync(buf,sz,MS_SYNC) == -1) {
                 tpl_hook.oops("msync failed on fd %d: %s\n", fd, strerror(errno));
             }
@@ -1006,44 +1192,68 @@ TPL_API int tpl_dump(tpl_node *r, int mode, ...) {
             close(fd);
         }
     } else if (mode & TPL_FD) {
+        /* serialized in one pass, into the caller's buffer (TPL_GROW) or
+         * the stack until it outgrows it */
         fd = va_arg(ap, int);
-        if ( (buf = tpl_hook.malloc(sz)) == NULL) fatal_oom();
-        tpl_dump_to_mem(r,buf,sz);
-        bufv = buf;
-        do {
-            rc = write(fd,bufv,sz);
-            if (rc > 0) {
-                sz -= rc;
-                bufv += rc;
-            } else if (rc == -1) {
-                if (errno == EINTR || errno == EAGAIN) continue;
-                tpl_hook.oops("error writing to fd %d: %s\n", fd, strerror(errno));
-                free(buf);
-                return -1;
-            }
-        } while (sz > 0);
-        free(buf);
-        rc = 0;
+        if (mode & TPL_GROW) {
+          addr_out = (void**)va_arg(ap, void*);
+          size_out = va_arg(ap, size_t*);
+          o.addr = *addr_out;
+          o.size = *size_out;
+        } else {
+          o.addr = o.stack = stack;
+          o.size = sizeof(stack);
+        }
+        o.grow = 1;
+#ifndef _WIN32
+        o.segs = segs;
+        o.max_segs = TPL_DUMP_MAX_SEGS;
+#endif
+        tpl_dump_out(r,&o);
+        rc = tpl_out_write(&o,fd);
+        if (mode & TPL_GROW) {
+          *addr_out = o.addr;
+          *size_out = o.size;
+        } else if (o.addr != stack) tpl_hook.free(o.addr);
     } else if (mode & TPL_MEM) {
         if (mode & TPL_PREALLOCD) { /* caller allocated */
           pa_addr = (void*)va_arg(ap, void*);
           pa_sz = va_arg(ap, size_t);
+          sz = tpl_ser_osz(r);
           if (pa_sz < sz) {
               tpl_hook.oops("tpl_dump: buffer too small, need %d bytes\n", sz);
+              va_end(ap);
               return -1;
           }
-          rc=tpl_dump_to_mem(r,pa_addr,sz);
+          o.addr = pa_addr;
+          o.size = sz;
+          rc=tpl_dump_out(r,&o);
+        } else if (mode & TPL_GROW) { /* appended to the caller's buffer */
+          addr_out = (void**)va_arg(ap, void*);
+          sz_out = va_arg(ap, size_t*);
+          size_out = va_arg(ap, size_t*);
+          o.addr = *addr_out;
+          o.base = *sz_out;
+          o.size = *size_out;
+          o.grow = 1;
+          rc=tpl_dump_out(r,&o);
+          *addr_out = o.addr;
+          *sz_out = o.len;
+          *size_out = o.size;
         } else { /* we allocate */
           addr_out = (void**)va_arg(ap, void*);
           sz_out = va_arg(ap, size_t*);
+          sz = tpl_ser_osz(r);
           if ( (buf = tpl_hook.malloc(sz)) == NULL) fatal_oom();
           *sz_out = sz;
           *addr_out = buf;
-          rc=tpl_dump_to_mem(r,buf,sz);
+          o.addr = buf;
+          o.size = sz;
+          rc=tpl_dump_out(r,&o);
         }
     } else if (mode & TPL_GETSIZE) {
         sz_out = va_arg(ap, size_t*);
-        *sz_out = sz;
+        *sz_out = tpl_ser_osz(r);
     } else {
         tpl_hook.oops("unsupported tpl_dump mode %d\n", mode);
         rc=-1;
@@ -1052,35 +1262,102 @@ TPL_API int tpl_dump(tpl_node *r, int mode, ...) {
     return rc;
 }
 
-/* This function expects the caller to have set up a memory buffer of 
- * adequate size to hold the serialized tpl. The sz parameter must be
- * the result of tpl_ser_osz(r).
+/* Write the dumped image to fd, the large leaves from where they are. */
+static int tpl_out_write(tpl_out *o, int fd) {
+    char *bufv = o->addr;
+    size_t sz = o->len;
+#ifndef _WIN32
+    struct iovec iov[2*TPL_DUMP_MAX_SEGS+1];
+    size_t off=0;
+    int i,n=0;
+#endif
+    ssize_t rc;
+
+#ifndef _WIN32
+    if (o->num_segs > 0) {
+        for(i=0; i < o->num_segs; i++) {
+            if (o->segs[i].off > off) {
+                iov[n].iov_base = o->addr + off;
+                iov[n++].iov_len = o->segs[i].off - off;
+                off = o->segs[i].off;
+            }
+            iov[n].iov_base = o->segs[i].addr;
+            iov[n++].iov_len = o->segs[i].sz;
+        }
+        if (o->len > off) {
+            iov[n].iov_base = o->addr + off;
+            iov[n++].iov_len = o->len - off;
+        }
+
+        i=0;
+        while (i < n) {
+            rc = writev(fd,&iov[i],n-i);
+            if (rc == -1) {
+                if (errno == EINTR || errno == EAGAIN) continue;
+                tpl_hook.oops("error writing to fd %d: %s\n", fd, strerror(errno));
+                return -1;
+            }
+            while (i < n && (size_t)rc >= iov[i].iov_len) rc -= iov[i++].iov_len;
+            if (i < n) {
+                iov[i].iov_base = (char*)iov[i].iov_base + rc;
+                iov[i].iov_len -= rc;
+            }
+        }
+        return 0;
+    }
+#endif
+
+    do {
+        rc = write(fd,bufv,sz);
+        if (rc > 0) {
+            sz -= rc;
+            bufv += rc;
+        } else if (rc == -1) {
+            if (errno == EINTR || errno == EAGAIN) continue;
+            tpl_hook.oops("error writing to fd %d: %s\n", fd, strerror(errno));
+            return -1;
+        }
+    } while (sz > 0);
+    return 0;
+}
+
+/* Serialize the tpl in a single pass, writing the overall length into the
+ * header once the end of the image is known.
  */
-static int tpl_dump_to_mem(tpl_node *r,void *addr,size_t sz) {
+static int tpl_dump_out(tpl_node *r, tpl_out *o) {
     uint32_t slen, sz32;
     int *fxlens, num_fxlens, i;
-    void *dv;
-    char *fmt,flags;
+    char *fmt,flags,*dv;
     tpl_node *c, *np;
     tpl_pound_data *pd;
-    size_t itermax;
+    tpl_fixed *fx;
+    size_t itermax, sz;
 
     fmt = tpl_fmt(r);
     flags = 0;
     if (tpl_cpu_bigendian()) flags |= TPL_FL_BIGENDIAN;
     if (strchr(fmt,'s')) flags |= TPL_FL_NULLSTRINGS;
-    sz32 = sz; 
+    sz32 = 0;  /* patched below */
 
-    dv = addr;
+    fxlens = tpl_fxlens(r,&num_fxlens);
+
+    dv = o->addr + o->base;
+    dv = TPL_ROOM(o,dv,3+1+sizeof(uint32_t)+strlen(fmt)+1+num_fxlens*sizeof(uint32_t));
     dv = tpl_cpv(dv,TPL_MAGIC,3);         /* copy tpl magic prefix */
     dv = tpl_cpv(dv,&flags,1);            /* copy flags byte */
     dv = tpl_cpv(dv,&sz32,sizeof(uint32_t));/* overall length (inclusive) */
     dv = tpl_cpv(dv,fmt,strlen(fmt)+1);   /* copy format with NUL-term */
-    fxlens = tpl_fxlens(r,&num_fxlens);
     dv = tpl_cpv(dv,fxlens,num_fxlens*sizeof(uint32_t));/* fmt # lengths */
 
+    /* fixed layout: the content is packed in one block */
+    fx = ((tpl_root_data*)(r->data))->fixed;
+    if (fx) {
+        dv = TPL_ROOM(o,dv,fx->sz);
+        dv = tpl_cpv(dv,fx->data,fx->sz);
+    }
+
     /* serialize the tpl content, iterating over direct children of root */
-    c = r->children;
+    c = fx ? NULL : r->children;
     while (c) {
         switch (c->type) {
             case TPL_TYPE_BYTE:
@@ -1091,23 +1368,27 @@ static int tpl_dump_to_mem(tpl_node *r,void *addr,size_t sz) {
             case TPL_TYPE_UINT64:
             case TPL_TYPE_INT16:
             case TPL_TYPE_UINT16:
-                dv = tpl_cpv(dv,c->data,tpl_types[c->type].sz * c->num);
+                sz = tpl_types[c->type].sz * c->num;
+                dv = TPL_ROOM(o,dv,sz);
+                dv = tpl_cpv(dv,c->data,sz);
                 break;
             case TPL_TYPE_BIN:
                 slen = (*(tpl_bin**)(c->data))->sz;
+                dv = TPL_ROOM(o,dv,sizeof(uint32_t));
                 dv = tpl_cpv(dv,&slen,sizeof(uint32_t));  /* buffer len */
-                dv = tpl_cpv(dv,(*(tpl_bin**)(c->data))->addr,slen); /* buf */
+                dv = tpl_out_leaf(o,dv,(*(tpl_bin**)(c->data))->addr,slen); /* buf */
                 break;
             case TPL_TYPE_STR:
                 for(i=0; i < c->num; i++) {
                   char *str = ((char**)c->data)[i];
                   slen = str ? strlen(str)+1 : 0;
+                  dv = TPL_ROOM(o,dv,sizeof(uint32_t) + (slen>1 ? slen-1 : 0));
                   dv = tpl_cpv(dv,&slen,sizeof(uint32_t));  /* string len */
                   if (slen>1) dv = tpl_cpv(dv,str,slen-1); /*string*/
                 }
                 break;
             case TPL_TYPE_ARY:
-                dv = tpl_dump_atyp(c,(tpl_atyp*)c->data,dv);
+                dv = tpl_dump_atyp(c,(tpl_atyp*)c->data,o,dv);
                 break;
             case TPL_TYPE_POUND:
                  pd = (tpl_pound_data*)c->data;
@@ -1142,6 +1423,9 @@ static int tpl_dump_to_mem(tpl_node *r,void *addr,size_t sz) {
         c = c->next;
     }
 
+    o->len = dv - o->addr;
+    sz32 = o->len - o->base + o->seg_sz;
+    memcpy(o->addr + o->base + 4,&sz32,sizeof(uint32_t));
     return 0;
 }
 
@@ -1221,8 +1505,12 @@ static int tpl_sanity(tpl_node *r, int excess_ok) {
     }
 
     /* dv now points to beginning of data */
-    rc = tpl_serlen(r,r,dv,&serlen);  /* get computed serlen of data part */
-    if (rc == -1) return ERR_INCONSISTENT_SZ2; /* internal inconsistency in tpl image */
+    if (((tpl_root_data*)(r->data))->fixed) {  /* fixed layout, known size */
+        serlen = ((tpl_root_data*)(r->data))->fixed->sz;
+    } else {
+        rc = tpl_serlen(r,r,dv,&serlen);  /* get computed serlen of data part */
+        if (rc == -1) return ERR_INCONSISTENT_SZ2; /* internal inconsistency in tpl image */
+    }
     serlen += ((uintptr_t)dv - (uintptr_t)d);   /* add back serlen of preamble part */
     if (excess_ok && (bufsz < serlen)) return ERR_INCONSISTENT_SZ3;  
     if (!excess_ok && (serlen != bufsz)) return ERR_INCONSISTENT_SZ3;  /* buffer/internal sz exceeds serlen */
@@ -1464,8 +1752,8 @@ TPL_API int tpl_load(tpl_node *r, int mode, ...) {
     va_list ap;
     int rc=0,fd=0;
     char *filename=NULL;
-    void *addr;
-    size_t sz;
+    void *addr, **bufp=NULL;
+    size_t sz, *sizep=NULL;
 
     va_start(ap,mode);
     if (mode & TPL_FILE) filename = va_arg(ap,char *);
@@ -1474,6 +1762,10 @@ TPL_API int tpl_load(tpl_node *r, int mode, ...) {
         sz = va_arg(ap,size_t);
     } else if (mode & TPL_FD) {
         fd = va_arg(ap,int);
+        if (mode & TPL_GROW) {
+            bufp = va_arg(ap,void **);
+            sizep = va_arg(ap,size_t *);
+        }
     } else {
         tpl_hook.oops("unsupported tpl_load mode %d\n", mode);
         return -1;
@@ -1505,6 +1797,7 @@ TPL_API int tpl_load(tpl_node *r, int mode, ...) {
             return -1;
         }
         ((tpl_root_data*)(r->data))->flags = (TPL_FILE | TPL_RDONLY);
+        if (mode & TPL_BORROW) ((tpl_root_data*)(r->data))->flags |= TPL_BORROW;
     } else if (mode & TPL_MEM) {
         ((tpl_root_data*)(r->data))->mmap.text = addr;
         ((tpl_root_data*)(r->data))->mmap.text_sz = sz;
@@ -1518,10 +1811,24 @@ TPL_API int tpl_load(tpl_node *r, int mode, ...) {
         }
         ((tpl_root_data*)(r->data))->flags = (TPL_MEM | TPL_RDONLY);
         if (mode & TPL_UFREE) ((tpl_root_data*)(r->data))->flags |= TPL_UFREE;
+        if (mode & TPL_BORROW) ((tpl_root_data*)(r->data))->flags |= TPL_BORROW;
+    } else if ((mode & TPL_FD) && (mode & TPL_STREAM)) {
+        /* data goes from fd straight to the mapped addresses */
+        if ((mode & TPL_BORROW) && !(mode & TPL_GROW)) {
+            tpl_hook.oops("TPL_BORROW needs an image or a TPL_GROW buffer\n");
+            return -1;
+        }
+        return tpl_load_stream(r, fd, mode, bufp, sizep);
     } else if (mode & TPL_FD) {
         /* if fd read succeeds, resulting mem img is used for load */
+        if (mode & TPL_GROW) {
+            /* the image goes to the caller's buffer, which keeps it */
+            if (tpl_gather_blocking(fd,bufp,&sz,sizep) > 0) {
+                return tpl_load(r, TPL_MEM|(mode & TPL_BORROW), *bufp, sz);
+            } else return -1;
+        }
         if (tpl_gather(TPL_GATHER_BLOCKING,fd,&addr,&sz) > 0) {
-            return tpl_load(r, TPL_MEM|TPL_UFREE, addr, sz);
+            return tpl_load(r, TPL_MEM|TPL_UFREE|(mode & TPL_BORROW), addr, sz);
         } else return -1;
     } else {
         tpl_hook.oops("invalid tpl_load mode %d\n", mode);
@@ -1530,7 +1837,8 @@ TPL_API int tpl_load(tpl_node *r, int mode, ...) {
     /* this applies to TPL_MEM or TPL_FILE */
     if (tpl_needs_endian_swap(((tpl_root_data*)(r->data))->mmap.text))
         ((tpl_root_data*)(r->data))->flags |= TPL_XENDIAN;
-    tpl_unpackA0(r);   /* prepare root A nodes for use */
+    if (!((tpl_root_data*)(r->data))->fixed)
+        tpl_unpackA0(r);   /* prepare root A nodes for use */
     return 0;
 }
 
@@ -1775,6 +2083,7 @@ TPL_API int tpl_pack(tpl_node *r, int i) {
     char *str;
     tpl_bin *bin;
     tpl_pound_data *pd;
+    tpl_fixed *fx;
     int fidx;
 
     n = tpl_find_i(r,i);
@@ -1790,6 +2099,15 @@ TPL_API int tpl_pack(tpl_node *r, int i) {
 
     ((tpl_root_data*)(r->data))->flags |= TPL_WRONLY;
 
+    /* fixed layout: copy the runs into the packed data block */
+    if (i == 0 && (fx = ((tpl_root_data*)(r->data))->fixed) != NULL) {
+        datav = fx->data;
+        for(fidx=0; fidx < fx->num_runs; fidx++) {
+            datav = tpl_cpv(datav,fx->runs[fidx].addr,fx->runs[fidx].sz);
+        }
+        return 0;
+    }
+
     if (n->type == TPL_TYPE_ARY) datav = tpl_extend_backbone(n);
     child = n->children;
     while(child) {
@@ -1936,9 +2254,11 @@ TPL_API int tpl_unpack(tpl_node *r, int i) {
     uint32_t slen;
     int rc=1, fidx;
     char *str;
-    void *dv=NULL, *caddr;
+    void *dv=NULL;
     size_t A_bytes, itermax;
     tpl_pound_data *pd;
+    tpl_fixed *fx;
+    tpl_fixed_run *run;
     void *img;
     size_t sz;
 
@@ -1961,7 +2281,19 @@ TPL_API int tpl_unpack(tpl_node *r, int i) {
 
     /* either root node or an A node */
     if (n->type == TPL_TYPE_ROOT) {
+        /* already unpacked as it was read */
+        if (((tpl_root_data*)(n->data))->flags & TPL_STREAMED) return 1;
         dv = tpl_find_data_start( ((tpl_root_data*)(n->data))->mmap.text );
+        /* fixed layout: copy out the runs, swapping each in one go */
+        if ((fx = ((tpl_root_data*)(n->data))->fixed) != NULL) {
+            for(run=fx->runs; run < fx->runs + fx->num_runs; run++) {
+                memcpy(run->addr,dv,run->sz);
+                if (((tpl_root_data*)(n->data))->flags & TPL_XENDIAN)
+                    tpl_byteswap_n(run->addr, run->sz / run->wsz, run->wsz);
+                dv = (void*)((uintptr_t)dv + run->sz);
+            }
+            return rc;
+        }
     } else if (n->type == TPL_TYPE_ARY) {
         if (((tpl_atyp*)(n->data))->num <= 0) return 0; /* array consumed */
         else rc = ((tpl_atyp*)(n->data))->num--;
@@ -1980,30 +2312,25 @@ TPL_API int tpl_unpack(tpl_node *r, int i) {
             case TPL_TYPE_UINT64:
             case TPL_TYPE_INT16:
             case TPL_TYPE_UINT16:
-                /* unpack elements of cross-endian octothorpic array individually */
-                if (((tpl_root_data*)(r->data))->flags & TPL_XENDIAN) {
-                    for(fidx=0; fidx < c->num; fidx++) {
-                        caddr = (void*)((uintptr_t)c->addr + (fidx * tpl_types[c->type].sz));
-                        memcpy(caddr,dv,tpl_types[c->type].sz);
-                        tpl_byteswap(caddr, tpl_types[c->type].sz);
-                        dv = (void*)((uintptr_t)dv + tpl_types[c->type].sz);
-                    }
-                } else {
-                    /* bulk unpack ok if not cross-endian */
-                    memcpy(c->addr, dv, tpl_types[c->type].sz * c->num);
-                    dv = (void*)((uintptr_t)dv + tpl_types[c->type].sz * c->num);
-                }
+                /* bulk unpack, cross-endian octothorpic arrays swapped in place */
+                memcpy(c->addr, dv, tpl_types[c->type].sz * c->num);
+                if (((tpl_root_data*)(r->data))->flags & TPL_XENDIAN)
+                    tpl_byteswap_n(c->addr, c->num, tpl_types[c->type].sz);
+                dv = (void*)((uintptr_t)dv + tpl_types[c->type].sz * c->num);
                 break;
             case TPL_TYPE_BIN:
                 memcpy(&slen,dv,sizeof(uint32_t));
                 if (((tpl_root_data*)(r->data))->flags & TPL_XENDIAN)
                     tpl_byteswap(&slen, sizeof(uint32_t));
-                if (slen > 0) {
+                dv = (void*)((uintptr_t)dv + sizeof(uint32_t));
+                if (slen > 0 && (((tpl_root_data*)(r->data))->flags & TPL_BORROW)) {
+                    /* a view, valid as long as the image; the app must not free it */
+                    str = (char*)dv;
+                } else if (slen > 0) {
                     str = (char*)tpl_hook.malloc(slen);
                     if (!str) fatal_oom();
+                    memcpy(str,dv,slen);
                 } else str=NULL;
-                dv = (void*)((uintptr_t)dv + sizeof(uint32_t));
-                if (slen>0) memcpy(str,dv,slen);
                 memcpy(&(((tpl_bin*)c->addr)->addr),&str,sizeof(void*));
                 memcpy(&(((tpl_bin*)c->addr)->sz),&slen,sizeof(uint32_t));
                 dv = (void*)((uintptr_t)dv + slen);
@@ -2155,6 +2482,129 @@ static void tpl_byteswap(void *word, int len) {
     }
 }
 
+/* Bulk byte order swapping of num words of length "len" bytes, vectorized
+ * where the CPU allows. The variant is picked on first use.
+ */
+typedef void (tpl_bswap_fcn)(char *w, size_t num, int len);
+
+static void tpl_bswap_scalar(char *w, size_t num, int len) {
+    uint16_t x16;
+    uint32_t x32;
+    uint64_t x64;
+    size_t i;
+
+    /* one loop per size, which compilers turn into bswap instructions */
+    switch (len) {
+        case 2:
+            for(i=0; i < num; i++, w += 2) {
+                memcpy(&x16,w,2);
+                x16 = (uint16_t)((x16 >> 8) | (x16 << 8));
+                memcpy(w,&x16,2);
+            }
+            break;
+        case 4:
+            for(i=0; i < num; i++, w += 4) {
+                memcpy(&x32,w,4);
+                x32 = (x32 >> 24) | ((x32 >> 8) & 0xff00) |
+                      ((x32 << 8) & 0xff0000) | (x32 << 24);
+                memcpy(w,&x32,4);
+            }
+            break;
+        case 8:
+            for(i=0; i < num; i++, w += 8) {
+                memcpy(&x64,w,8);
+                x64 = ((x64 >> 56)) | ((x64 >> 40) & 0xff00ULL) |
+                      ((x64 >> 24) & 0xff0000ULL) | ((x64 >> 8) & 0xff000000ULL) |
+                      ((x64 << 8) & 0xff00000000ULL) | ((x64 << 24) & 0xff0000000000ULL) |
+                      ((x64 << 40) & 0xff000000000000ULL) | (x64 << 56);
+                memcpy(w,&x64,8);
+            }
+            break;
+        default:
+            for(i=0; i < num; i++, w += len) tpl_byteswap(w, len);
+            break;
+    }
+}
+
+#ifdef TPL_X86_SIMD
+/* SSE2 has no byte shuffle: swap the bytes of each 16-bit word by shifts,
+ * then reverse the 16-bit words of each 32 or 64-bit word */
+__attribute__((target("sse2")))
+static void tpl_bswap_sse2(char *w, size_t num, int len) {
+    __m128i v;
+    size_t i=0, per = 16 / len;
+
+    if (len == 2 || len == 4 || len == 8) {
+        for(; i + per <= num; i += per, w += 16) {
+            v = _mm_loadu_si128((__m128i*)w);
+            v = _mm_or_si128(_mm_slli_epi16(v,8), _mm_srli_epi16(v,8));
+            if (len == 4) {
+                v = _mm_shufflelo_epi16(v,_MM_SHUFFLE(2,3,0,1));
+                v = _mm_shufflehi_epi16(v,_MM_SHUFFLE(2,3,0,1));
+            } else if (len == 8) {
+                v = _mm_shufflelo_epi16(v,_MM_SHUFFLE(0,1,2,3));
+                v = _mm_shufflehi_epi16(v,_MM_SHUFFLE(0,1,2,3));
+            }
+            _mm_storeu_si128((__m128i*)w, v);
+        }
+    }
+    tpl_bswap_scalar(w, num - i, len);
+}
+
+__attribute__((target("avx2")))
+static void tpl_bswap_avx2(char *w, size_t num, int len) {
+    __m256i v, mask;
+    size_t i=0, per = 32 / len;
+
+    switch (len) {
+        case 2:
+            mask = _mm256_setr_epi8(1,0,3,2,5,4,7,6,9,8,11,10,13,12,15,14,
+                                    1,0,3,2,5,4,7,6,9,8,11,10,13,12,15,14);
+            break;
+        case 4:
+            mask = _mm256_setr_epi8(3,2,1,0,7,6,5,4,11,10,9,8,15,14,13,12,
+                                    3,2,1,0,7,6,5,4,11,10,9,8,15,14,13,12);
+            break;
+        case 8:
+            mask = _mm256_setr_epi8(7,6,5,4,3,2,1,0,15,14,13,12,11,10,9,8,
+                                    7,6,5,4,3,2,1,0,15,14,13,12,11,10,9,8);
+            break;
+        default:
+            tpl_bswap_scalar(w, num, len);
+            return;
+    }
+    for(; i + per <= num; i += per, w += 32) {
+        v = _mm256_loadu_si256((__m256i*)w);
+        v = _mm256_shuffle_epi8(v, mask);
+        _mm256_storeu_si256((__m256i*)w, v);
+    }
+    tpl_bswap_sse2(w, num - i, len);
+}
+#endif
+
+static tpl_bswap_fcn *tpl_bswap_select(void) {
+#ifdef TPL_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) return tpl_bswap_avx2;
+    if (__builtin_cpu_supports("sse2")) return tpl_bswap_sse2;
+#endif
+    return tpl_bswap_scalar;
+}
+
+/* In-place byte order swapping of num words of length "len" bytes */
+static void tpl_byteswap_n(void *words, size_t num, int len) {
+    static tpl_bswap_fcn *cached;  /* racing first calls pick the same */
+    tpl_bswap_fcn *bswap;
+
+    if (len < 2 || num == 0) return;
+    bswap = __atomic_load_n(&cached, __ATOMIC_RELAXED);
+    if (!bswap) {
+        bswap = tpl_bswap_select();
+        __atomic_store_n(&cached, bswap, __ATOMIC_RELAXED);
+    }
+    bswap((char*)words, num, len);
+}
+
 static void tpl_fatal(char *fmt, ...) {
     va_list ap;
     char exit_msg[100];
@@ -2176,12 +2626,12 @@ TPL_API int tpl_gather(int mode, ...) {
     tpl_gather_cb *cb;
 
     va_start(ap,mode);
-    switch (mode) {
+    switch (mode & ~TPL_GROW) {
         case TPL_GATHER_BLOCKING:
             fd = va_arg(ap,int);
             img = va_arg(ap,void*);
             szp = va_arg(ap,size_t*);
-            rc = tpl_gather_blocking(fd,img,szp);
+            rc = tpl_gather_blocking(fd,img,szp,NULL);
             break;
         case TPL_GATHER_NONBLOCKING:
             fd = va_arg(ap,int);
@@ -2196,7 +2646,8 @@ TPL_API int tpl_gather(int mode, ...) {
             gs = (tpl_gather_t**)va_arg(ap,void*);
             cb = (tpl_gather_cb*)va_arg(ap,tpl_gather_cb*);
             data = va_arg(ap,void*);
-            rc = tpl_gather_mem(addr,sz,gs,cb,data);
+            if (mode & TPL_GROW) rc = tpl_gather_mem_grow(addr,sz,gs,cb,data);
+            else rc = tpl_gather_mem(addr,sz,gs,cb,data);
             break;
         default:
             tpl_hook.fatal("unsupported tpl_gather mode %d\n",mode);
@@ -2210,8 +2661,10 @@ TPL_API int tpl_gather(int mode, ...) {
  * We take care not to read past the end of the tpl.
  * This is intended as a blocking call i.e. for use with a blocking fd.
  * It can be given a non-blocking fd, but the read spins if we have to wait.
+ * If size is given, *img is a buffer of that size the caller keeps: it is
+ * only grown (TPL_GROW) and never freed here.
  */
-static int tpl_gather_blocking(int fd, void **img, size_t *sz) {
+static int tpl_gather_blocking(int fd, void **img, size_t *sz, size_t *size) {
     char preamble[8];
     int i=0, rc;
     uint32_t tpllen;
@@ -2250,8 +2703,15 @@ static int tpl_gather_blocking(int fd, void **img, size_t *sz) {
         return -2;
     }
     *sz = tpllen;
-    if ( (*img = tpl_hook.malloc(tpllen)) == NULL) {
-        fatal_oom();
+    if (size == NULL) {
+        if ( (*img = tpl_hook.malloc(tpllen)) == NULL) {
+            fatal_oom();
+        }
+    } else if (*size < tpllen) {
+        if ( (*img = tpl_hook.realloc(*img,tpllen)) == NULL) {
+            fatal_oom();
+        }
+        *size = tpllen;
     }
 
     memcpy(*img,preamble,8);  /* copy preamble to output buffer */
@@ -2263,15 +2723,15 @@ static int tpl_gather_blocking(int fd, void **img, size_t *sz) {
 
     if (rc<0) {
         tpl_hook.oops("tpl_gather_fd_blocking failed: %s\n", strerror(errno));
-        tpl_hook.free(*img);
+        if (size == NULL) tpl_hook.free(*img);
         return -1;
     } else if (rc == 0) {
         /* tpl_hook.oops("tpl_gather_fd_blocking: eof\n"); */
-        tpl_hook.free(*img);
+        if (size == NULL) tpl_hook.free(*img);
         return 0;
     } else if (i != tpllen) {
         tpl_hook.oops("internal error\n");
-        tpl_hook.free(*img);
+        if (size == NULL) tpl_hook.free(*img);
         return -1;
     }
 
@@ -2470,3 +2930,410 @@ static int tpl_gather_mem( char *buf, size_t len, tpl_gather_t **gs, tpl_gather_
     }
     return 1;
 }
+
+/* length of the tpl starting at tpl (8 bytes of it at hand), 0 if invalid */
+static uint32_t tpl_gather_len(char *tpl) {
+    uint32_t tpllen;
+
+    if (strncmp("tpl", tpl, 3) != 0) {
+        tpl_hook.oops("tpl prefix invalid\n");
+        return 0;
+    }
+    memcpy(&tpllen,&tpl[4],4);
+    if (tpl_needs_endian_swap(tpl)) tpl_byteswap(&tpllen,4);
+    if (tpllen < 8) {
+        tpl_hook.oops("tpl prefix invalid\n");
+        return 0;
+    }
+    return tpllen;
+}
+
+/* make room for sz bytes in the buffer of a TPL_GROW gather */
+static void tpl_gather_reserve(tpl_gather_t *gs, size_t sz) {
+    if ((size_t)gs->size >= sz) return;
+    if ( (gs->img = tpl_hook.realloc(gs->img, sz)) == NULL) {
+        fatal_oom();
+    }
+    gs->size = (int)sz;
+}
+
+/* tpl_gather_mem for TPL_GROW: *gs is kept from call to call, along with its
+ * buffer, and holds a partial tpl while len > 0. The buffer grows to the
+ * length of the tpl being completed, tpls within buf go to cb from where they
+ * lie, so once the buffer has grown nothing is allocated or concatenated.
+ * The caller frees (*gs)->img and *gs when done with the source.
+ */
+static int tpl_gather_mem_grow( char *buf, size_t len, tpl_gather_t **gs, tpl_gather_cb *cb, void *data) {
+    tpl_gather_t *g;
+    char *end = buf + len;
+    uint32_t tpllen=0;
+    size_t need, k;
+
+    if ((g = *gs) == NULL) {
+        if ( (g = tpl_hook.malloc(sizeof(tpl_gather_t))) == NULL ) {
+            fatal_oom();
+        }
+        g->img = NULL;
+        g->len = g->size = 0;
+        *gs = g;
+    }
+
+    /* complete the partial tpl from the last call */
+    while (g->len > 0) {
+        need = 8;
+        if (g->len >= 8) {
+            if ((need = tpl_gather_len(g->img)) == 0) {
+                g->len = 0;
+                return -3; /* error, caller should stop accepting input from source*/
+            }
+            if (tpl_hook.gather_max > 0 && need > tpl_hook.gather_max) {
+                g->len = 0;
+                tpl_hook.oops("tpl exceeds max length %d\n",
+                    tpl_hook.gather_max);
+                return -2;
+            }
+            if ((size_t)g->len == need) {
+                g->len = 0;
+                if ((cb)(g->img,need,data) < 0) {
+                    tpl_hook.oops("tpl_mem_gather aborted by app callback\n");
+                    return -4;
+                }
+                break;
+            }
+        }
+        if (buf == end) return 1;
+        k = need - g->len;
+        if (k > (size_t)(end - buf)) k = end - buf;
+        tpl_gather_reserve(g, need);
+        memcpy(g->img + g->len, buf, k);
+        g->len += k;
+        buf += k;
+    }
+
+    /* full tpls in buf */
+    while (end - buf >= 8) {
+        if ((tpllen = tpl_gather_len(buf)) == 0) return -3;
+        if (tpl_hook.gather_max > 0 && tpllen > tpl_hook.gather_max) {
+            tpl_hook.oops("tpl exceeds max length %d\n",
+                tpl_hook.gather_max);
+            return -2;
+        }
+        if (tpllen > (size_t)(end - buf)) break;
+        if ((cb)(buf,tpllen,data) < 0) {
+            tpl_hook.oops("tpl_mem_gather aborted by app callback\n");
+            return -4;
+        }
+        buf += tpllen;
+    }
+
+    /* keep the start of the next one, with room for all of it */
+    if (buf < end) {
+        tpl_gather_reserve(g, end - buf >= 8 ? tpllen : 8);
+        memcpy(g->img, buf, end - buf);
+        g->len = end - buf;
+    }
+    return 1;
+}
+
+/* Reader for tpl_load_stream. Buffers small fields, reads large ones straight
+ * into their destination, and never reads past the end of the image (left).
+ */
+typedef struct tpl_stream {
+    int fd;
+    size_t left;                     /* image bytes not yet read from fd */
+    size_t pos, len;                 /* unconsumed part of buf */
+    void **bins;                     /* TPL_BORROW: caller's buffer for B */
+    size_t *bins_size, bins_len;
+    char buf[TPL_STREAM_BUFLEN];
+} tpl_stream;
+
+static int tpl_read_fd(int fd, void *dst, size_t n) {
+    size_t i=0;
+    ssize_t rc;
+
+    while (i < n) {
+        rc = read(fd,(char*)dst + i,n - i);
+        if (rc > 0) i += rc;
+        else if (rc == 0) return -1;
+        else if (errno != EINTR && errno != EAGAIN) return -1;
+    }
+    return 0;
+}
+
+/* bytes of the image still to come, buffered or not */
+static size_t tpl_stream_avail(tpl_stream *s) {
+    return s->left + (s->len - s->pos);
+}
+
+/* returns 0 on success, -1 if the image ends first, -2 if reading fails */
+static int tpl_stream_read(tpl_stream *s, void *dst, size_t n) {
+    size_t k;
+
+    if (n > tpl_stream_avail(s)) return -1;
+    k = s->len - s->pos;
+    if (k > n) k = n;
+    memcpy(dst, s->buf + s->pos, k);
+    s->pos += k;
+    dst = (char*)dst + k;
+    n -= k;
+    if (n == 0) return 0;
+
+    /* buffer drained. large remainders skip it */
+    if (n >= TPL_STREAM_BUFLEN) {
+        if (tpl_read_fd(s->fd, dst, n) != 0) return -2;
+        s->left -= n;
+        return 0;
+    }
+    k = s->left < TPL_STREAM_BUFLEN ? s->left : TPL_STREAM_BUFLEN;
+    if (tpl_read_fd(s->fd, s->buf, k) != 0) return -2;
+    s->left -= k;
+    s->len = k;
+    memcpy(dst, s->buf, n);
+    s->pos = n;
+    return 0;
+}
+
+/* consume the rest of an image that is not going to be unpacked */
+static int tpl_stream_drain(tpl_stream *s) {
+    size_t k;
+
+    s->pos = s->len;
+    while (s->left > 0) {
+        k = s->left < TPL_STREAM_BUFLEN ? s->left : TPL_STREAM_BUFLEN;
+        if (tpl_read_fd(s->fd, s->buf, k) != 0) return -2;
+        s->left -= k;
+    }
+    return -1;
+}
+
+/* maps without A or s nodes unpack field by field as the bytes arrive */
+static int tpl_streamable(tpl_node *r) {
+    tpl_node *c;
+
+    for(c=r->children; c; c=c->next) {
+        if (c->type == TPL_TYPE_ARY || c->type == TPL_TYPE_STR) return 0;
+    }
+    return 1;
+}
+
+/* undo a partial stream unpack: rewind S(...)# loops and free bins */
+static void tpl_stream_abort(tpl_node *r, tpl_node *upto, int borrowed) {
+    tpl_node *c, *np;
+    tpl_pound_data *pd;
+    tpl_bin *bin;
+
+    for(c=r->children; c && c != upto; c=c->next) {
+        if (c->type == TPL_TYPE_BIN) {
+            bin = (tpl_bin*)c->addr;
+            if (bin->addr && !borrowed) tpl_hook.free(bin->addr);
+            bin->addr = NULL;
+            bin->sz = 0;
+        }
+    }
+    for(c=r->children; c; c=c->next) {
+        if (c->type != TPL_TYPE_POUND) continue;
+        pd = (tpl_pound_data*)c->data;
+        for(np=pd->iter_start_node; np != c; np = np->next) {
+            np->addr = (char*)(np->addr) - (pd->iternum * pd->inter_elt_len);
+        }
+        pd->iternum = 0;
+    }
+}
+
+/* unpack the root of r from the data part of the image in s */
+static int tpl_stream_unpack(tpl_node *r, tpl_stream *s, int xendian) {
+    tpl_node *c, *np;
+    tpl_pound_data *pd;
+    tpl_fixed *fx;
+    tpl_fixed_run *run;
+    uint32_t slen;
+    char *str, *dv;
+    size_t itermax;
+    int rc=0;
+
+    /* fixed layout: one read, straight into a single run */
+    if ((fx = ((tpl_root_data*)(r->data))->fixed) != NULL) {
+        if (tpl_stream_avail(s) != fx->sz) return -1;
+        dv = fx->num_runs == 1 ? fx->runs[0].addr : fx->data;
+        if ((rc = tpl_stream_read(s, dv, fx->sz)) != 0) return rc;
+        for(run=fx->runs; run < fx->runs + fx->num_runs; run++) {
+            if (dv != run->addr) memcpy(run->addr,dv,run->sz);
+            if (xendian) tpl_byteswap_n(run->addr, run->sz / run->wsz, run->wsz);
+            dv += run->sz;
+        }
+        return 0;
+    }
+
+    c = r->children;
+    while (c) {
+        switch (c->type) {
+            case TPL_TYPE_BYTE:
+            case TPL_TYPE_DOUBLE:
+            case TPL_TYPE_INT32:
+            case TPL_TYPE_UINT32:
+            case TPL_TYPE_INT64:
+            case TPL_TYPE_UINT64:
+            case TPL_TYPE_INT16:
+            case TPL_TYPE_UINT16:
+                rc = tpl_stream_read(s, c->addr, tpl_types[c->type].sz * c->num);
+                if (rc != 0) break;
+                if (xendian) tpl_byteswap_n(c->addr, c->num, tpl_types[c->type].sz);
+                break;
+            case TPL_TYPE_BIN:
+                if ((rc = tpl_stream_read(s, &slen, sizeof(uint32_t))) != 0) break;
+                if (xendian) tpl_byteswap(&slen, sizeof(uint32_t));
+                if (slen > tpl_stream_avail(s)) {
+                    rc = -1;
+                    break;
+                }
+                if (slen > 0 && s->bins) {
+                    /* views into the caller's buffer. it gets room for the
+                     * rest of the image at the first one, so none moves */
+                    if (s->bins_len == 0 && *s->bins_size < tpl_stream_avail(s)) {
+                        *s->bins = tpl_hook.realloc(*s->bins, tpl_stream_avail(s));
+                        if (*s->bins == NULL) fatal_oom();
+                        *s->bins_size = tpl_stream_avail(s);
+                    }
+                    str = (char*)*s->bins + s->bins_len;
+                    if ((rc = tpl_stream_read(s, str, slen)) != 0) break;
+                    s->bins_len += slen;
+                } else if (slen > 0) {
+                    str = (char*)tpl_hook.malloc(slen);
+                    if (!str) fatal_oom();
+                    if ((rc = tpl_stream_read(s, str, slen)) != 0) {
+                        tpl_hook.free(str);
+                        break;
+                    }
+                } else str=NULL;
+                memcpy(&(((tpl_bin*)c->addr)->addr),&str,sizeof(void*));
+                memcpy(&(((tpl_bin*)c->addr)->sz),&slen,sizeof(uint32_t));
+                break;
+            case TPL_TYPE_POUND:
+                /* iterate over preceding nodes, as tpl_unpack does */
+                pd = (tpl_pound_data*)c->data;
+                itermax = c->num;
+                if (++(pd->iternum) < itermax) {
+                  for(np=pd->iter_start_node; np != c; np = np->next) {
+                    np->addr = (char*)(np->addr) + pd->inter_elt_len;
+                  }
+                  c = pd->iter_start_node;
+                  continue;
+                } else {
+                  pd->iternum = 0;
+                  for(np=pd->iter_start_node; np != c; np = np->next) {
+                    np->addr = (char*)(np->addr) - ((itermax-1) * pd->inter_elt_len);
+                  }
+                }
+                break;
+            default:
+                tpl_hook.fatal("unsupported format character\n");
+                break;
+        }
+        if (rc != 0) {
+            tpl_stream_abort(r, c, s->bins != NULL);
+            return rc;
+        }
+        c = c->next;
+    }
+    /* the image must end with the data */
+    if (tpl_stream_avail(s) != 0) {
+        tpl_stream_abort(r, NULL, s->bins != NULL);
+        return -1;
+    }
+    return 0;
+}
+
+/* Load and unpack the next image on a blocking fd in one pass (TPL_FD with
+ * TPL_STREAM). Fixed size data goes straight to the mapped addresses, only
+ * B fields are allocated, so no image of the whole message is ever held.
+ * Maps with A or s nodes gather the image first, like TPL_FD does.
+ * With TPL_GROW that image goes to the caller's buffer (bufp, sizep), and
+ * with TPL_BORROW too the B fields unpack as views into that buffer, valid
+ * until it is used for the next image.
+ * Returns 0 if the root was unpacked (tpl_unpack of it then returns 1 and
+ * does nothing), -1 if the image did not fit the map (it was consumed all
+ * the same), -2 on read errors or end of file.
+ */
+static int tpl_load_stream(tpl_node *r, int fd, int mode, void **bufp, size_t *sizep) {
+    tpl_stream st, *s = &st;
+    char c, preamble[8], *fmt, *mapfmt;
+    uint32_t tpllen, flen;
+    int i, rc, xendian, num_fxlens, *fxlens;
+    void *img;
+
+    if (tpl_read_fd(fd, preamble, 8) != 0) return -2;
+    if (memcmp(preamble, TPL_MAGIC, 3) != 0) {
+        tpl_hook.oops("tpl_load_stream: non-tpl input\n");
+        return -2;
+    }
+    xendian = tpl_needs_endian_swap(preamble);
+    memcpy(&tpllen, &preamble[4], 4);
+    if (xendian) tpl_byteswap(&tpllen, 4);
+    if (tpllen < 8 + 1 ||
+        (tpl_hook.gather_max > 0 && tpllen > tpl_hook.gather_max)) {
+        tpl_hook.oops("tpl exceeds max length %d\n", tpl_hook.gather_max);
+        return -2;
+    }
+
+    if (!tpl_streamable(r) && bufp) {
+        if (*sizep < tpllen) {
+            if ((*bufp = tpl_hook.realloc(*bufp, tpllen)) == NULL) fatal_oom();
+            *sizep = tpllen;
+        }
+        memcpy(*bufp, preamble, 8);
+        if (tpl_read_fd(fd, (char*)*bufp + 8, tpllen - 8) != 0) return -2;
+        if (tpl_load(r, TPL_MEM|(mode & TPL_BORROW), *bufp, (size_t)tpllen) != 0)
+            return -1;
+        return 0;
+    } else if (!tpl_streamable(r)) {
+        if ((img = tpl_hook.malloc(tpllen)) == NULL) fatal_oom();
+        memcpy(img, preamble, 8);
+        if (tpl_read_fd(fd, (char*)img + 8, tpllen - 8) != 0) {
+            tpl_hook.free(img);
+            return -2;
+        }
+        if (tpl_load(r, TPL_MEM|TPL_UFREE, img, (size_t)tpllen) != 0) {
+            tpl_hook.free(img);
+            return -1;
+        }
+        return 0;
+    }
+
+    s->fd = fd;
+    s->left = tpllen - 8;
+    s->pos = s->len = 0;
+    s->bins = (mode & TPL_BORROW) ? bufp : NULL;
+    s->bins_size = sizep;
+    s->bins_len = 0;
+
+    /* the format string and the # lengths must be those of the map */
+    rc = -1;
+    mapfmt = tpl_fmt(r);
+    if (preamble[3] & ~TPL_SUPPORTED_BITFLAGS) goto drain;
+    for(fmt=mapfmt; ; fmt++) {
+        if ((rc = tpl_stream_read(s, &c, 1)) != 0) goto drain;
+        rc = -1;
+        if (c != *fmt) goto drain;
+        if (c == '\0') break;
+    }
+    fxlens = tpl_fxlens(r, &num_fxlens);
+    for(i=0; i < num_fxlens; i++) {
+        if ((rc = tpl_stream_read(s, &flen, sizeof(uint32_t))) != 0) goto drain;
+        rc = -1;
+        if (xendian) tpl_byteswap(&flen, sizeof(uint32_t));
+        if ((int)flen != fxlens[i]) goto drain;
+    }
+
+    if ((rc = tpl_stream_unpack(r, s, xendian)) != 0) goto drain;
+    ((tpl_root_data*)(r->data))->flags = (TPL_FD | TPL_RDONLY | TPL_STREAMED);
+    if (s->bins) ((tpl_root_data*)(r->data))->flags |= TPL_BORROW;
+    if (xendian) ((tpl_root_data*)(r->data))->flags |= TPL_XENDIAN;
+    return 0;
+
+drain:
+    if (rc == -1) {
+        tpl_hook.oops("tpl_load_stream: image does not match the map\n");
+        rc = tpl_stream_drain(s);
+    }
+    return rc;
+}
@@ -64,6 +64,9 @@ extern "C" {
 #define TPL_DATAPEEK  (1 << 6)  
 #define TPL_FXLENS    (1 << 7)  
 #define TPL_GETSIZE   (1 << 8)
+#define TPL_STREAM    (1 << 9)  /* with TPL_FD: unpack while reading */
+#define TPL_BORROW    (1 << 10) /* B unpacks as a view into the image */
+#define TPL_GROW      (1 << 11) /* reuse a caller's growable buffer */
 /* do not add flags here without renumbering the internal flags! */
 
 /* flags for tpl_gather mode */
@@ -108,6 +111,7 @@ typedef struct tpl_bin {
 typedef struct tpl_gather_t {
     char *img;
     int len;
+    int size;                    /* allocated length of img (TPL_GROW) */
 } tpl_gather_t;
 
 /* Callback used when tpl_gather has read a full tpl image */
@@ -0,0 +1,352 @@
+/**
+ * libirpc - tpl_test.c
+ * Copyright (C) 2010 Manuel Gebele
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// The byte swapping variants are static.
+#include "tpl/tpl.c"
+
+#define ROUNDS      20
+#define MAXBIN      3000
+#define WORDS       70
+
+static char data[2][MAXBIN];
+static int gathered = 0;
+static int failures = 0;
+
+static void
+check(int ok, const char *what, int n)
+{
+    if (ok)
+        return;
+    
+    printf("tpl_test: %s failed (%d)\n", what, n);
+    failures++;
+}
+
+/* The failures provoked below are expected. */
+static int
+quiet(const char *fmt, ...)
+{
+    (void)fmt;
+    
+    return 0;
+}
+
+static void
+fill(int round, int *len1, int *len2)
+{
+    int k;
+    
+    *len1 = (round * 397) % MAXBIN;
+    *len2 = (round * 31) % 100;
+    for (k = 0; k < MAXBIN; k++) {
+        data[0][k] = (char)(k + round);
+        data[1][k] = (char)(k * round);
+    }
+}
+
+static int
+same(tpl_bin *b, const char *src, int len)
+{
+    return (int)b->sz == len && (len == 0 || memcmp(b->addr, src, len) == 0);
+}
+
+static int
+inside(tpl_bin *b, void *buf, size_t len)
+{
+    return b->sz == 0 || ((char *)b->addr >= (char *)buf &&
+                          (char *)b->addr + b->sz <= (char *)buf + len);
+}
+
+/* Dumps "iBiB" for round to fd, or appends it to buf with TPL_GROW. */
+static int
+dump(int round, int fd, void **buf, size_t *len, size_t *size)
+{
+    tpl_bin b1, b2;
+    tpl_node *tn;
+    int rc, len1, len2;
+    
+    fill(round, &len1, &len2);
+    b1.addr = len1 ? data[0] : NULL;
+    b1.sz = len1;
+    b2.addr = len2 ? data[1] : NULL;
+    b2.sz = len2;
+    tn = tpl_map("iBiB", &round, &b1, &round, &b2);
+    tpl_pack(tn, 0);
+    if (buf)
+        rc = tpl_dump(tn, TPL_MEM|TPL_GROW, buf, len, size);
+    else
+        rc = tpl_dump(tn, TPL_FD, fd);
+    tpl_free(tn);
+    
+    return rc;
+}
+
+/* Unpacks one loaded "iBiB" image of round, freeing copied B fields. */
+static int
+unpack(int mode, int round, void *img, size_t len)
+{
+    tpl_bin b1, b2;
+    tpl_node *tn;
+    int r1, r2, len1, len2, ok;
+    
+    tn = tpl_map("iBiB", &r1, &b1, &r2, &b2);
+    if (tpl_load(tn, mode, img, len) != 0) {
+        tpl_free(tn);
+        return 0;
+    }
+    tpl_unpack(tn, 0);
+    tpl_free(tn);
+    
+    fill(round, &len1, &len2);
+    ok = r1 == round && r2 == round &&
+         same(&b1, data[0], len1) && same(&b2, data[1], len2);
+    if (mode & TPL_BORROW)
+        ok = ok && inside(&b1, img, len) && inside(&b2, img, len);
+    else {
+        ok = ok && (b1.sz == 0 || !inside(&b1, img, len));
+        free(b1.addr);
+        free(b2.addr);
+    }
+    
+    return ok;
+}
+
+/* Images appended to one buffer, which is reused once grown. */
+static void
+grow(void)
+{
+    void *buf = NULL, *kept;
+    size_t len, size = 0, kept_size, start;
+    int round, mode;
+    
+    for (mode = 0; mode < 2; mode++) {
+        for (round = 0; round < ROUNDS; round++) {
+            len = 0;
+            check(dump(round, -1, &buf, &len, &size) == 0, "grow dump", round);
+            start = len;
+            check(dump(round + 1, -1, &buf, &len, &size) == 0,
+                  "grow append", round);
+            check(len <= size, "grow size", round);
+            
+            check(unpack(TPL_MEM|(mode ? TPL_BORROW : 0), round,
+                         buf, start), "grow load", round);
+            check(unpack(TPL_MEM|(mode ? TPL_BORROW : 0), round + 1,
+                         (char *)buf + start, len - start),
+                  "grow load appended", round);
+        }
+    }
+    
+    // Nothing larger than what the buffer held, so it stays.
+    kept = buf;
+    kept_size = size;
+    for (round = 0; round < ROUNDS; round++) {
+        len = 0;
+        dump(round, -1, &buf, &len, &size);
+    }
+    check(buf == kept && size == kept_size, "grow reuse", (int)size);
+    free(buf);
+}
+
+/* Images read off a pipe in one pass, B fields as views with TPL_BORROW. */
+static void
+stream(void)
+{
+    void *buf = NULL;
+    size_t size = 0;
+    tpl_bin b1, b2;
+    tpl_node *tn;
+    int p[2], round, r1, r2, len1, len2, x, sum;
+    
+    if (pipe(p) != 0) {
+        check(0, "pipe", 0);
+        return;
+    }
+    
+    for (round = 0; round < ROUNDS; round++) {
+        dump(round, p[1], NULL, NULL, NULL);
+        tn = tpl_map("iBiB", &r1, &b1, &r2, &b2);
+        check(tpl_load(tn, TPL_FD|TPL_STREAM|TPL_GROW|TPL_BORROW, p[0],
+                       &buf, &size) == 0, "stream load", round);
+        tpl_unpack(tn, 0);
+        tpl_free(tn);
+        fill(round, &len1, &len2);
+        check(r1 == round && r2 == round && same(&b1, data[0], len1) &&
+              same(&b2, data[1], len2), "stream borrow", round);
+        check(inside(&b1, buf, size) && inside(&b2, buf, size),
+              "stream view", round);
+        
+        // Without TPL_BORROW B fields are the caller's.
+        dump(round, p[1], NULL, NULL, NULL);
+        tn = tpl_map("iBiB", &r1, &b1, &r2, &b2);
+        check(tpl_load(tn, TPL_FD|TPL_STREAM, p[0]) == 0,
+              "stream copy load", round);
+        tpl_unpack(tn, 0);
+        tpl_free(tn);
+        check(r1 == round && same(&b1, data[0], len1) &&
+              same(&b2, data[1], len2), "stream copy", round);
+        free(b1.addr);
+        free(b2.addr);
+        
+        // Arrays are gathered into the buffer first.
+        tn = tpl_map("A(i)", &x);
+        for (x = round; x < round + 5; x++)
+            tpl_pack(tn, 1);
+        tpl_dump(tn, TPL_FD, p[1]);
+        tpl_free(tn);
+        tn = tpl_map("A(i)", &x);
+        check(tpl_load(tn, TPL_FD|TPL_STREAM|TPL_GROW, p[0],
+                       &buf, &size) == 0, "stream array load", round);
+        for (sum = 0; tpl_unpack(tn, 1) > 0; )
+            sum += x;
+        tpl_free(tn);
+        check(sum == 5 * round + 10, "stream array", round);
+    }
+    
+    // A mismatch consumes the image, the next one still loads.
+    dump(1, p[1], NULL, NULL, NULL);
+    dump(2, p[1], NULL, NULL, NULL);
+    tn = tpl_map("ii", &r1, &r2);
+    check(tpl_load(tn, TPL_FD|TPL_STREAM|TPL_GROW, p[0], &buf, &size) == -1,
+          "stream mismatch", 1);
+    tpl_free(tn);
+    tn = tpl_map("iBiB", &r1, &b1, &r2, &b2);
+    check(tpl_load(tn, TPL_FD|TPL_STREAM|TPL_GROW|TPL_BORROW, p[0],
+                   &buf, &size) == 0, "stream after mismatch", 2);
+    tpl_unpack(tn, 0);
+    tpl_free(tn);
+    check(r1 == 2, "stream after mismatch", r1);
+    
+    // Views need a buffer which outlives the load.
+    tn = tpl_map("iBiB", &r1, &b1, &r2, &b2);
+    check(tpl_load(tn, TPL_FD|TPL_STREAM|TPL_BORROW, p[0]) == -1,
+          "stream borrow without buffer", 0);
+    tpl_free(tn);
+    
+    free(buf);
+    close(p[0]);
+    close(p[1]);
+}
+
+static int
+gather_cb(void *img, size_t sz, void *arg)
+{
+    (void)arg;
+    check(unpack(TPL_MEM|TPL_BORROW, gathered, img, sz), "gather",
+          gathered);
+    gathered++;
+    
+    return 0;
+}
+
+/* Images split at every chunk size go to the callback whole and in order. */
+static void
+gather(void)
+{
+    static const size_t chunks[] = { 1, 3, 8, 100, 4096, 1 << 20 };
+    tpl_gather_t *gs = NULL;
+    void *all = NULL;
+    size_t len = 0, size = 0, off, n;
+    int round, k;
+    
+    for (round = 0; round < ROUNDS; round++)
+        dump(round, -1, &all, &len, &size);
+    
+    for (k = 0; k < (int)(sizeof chunks / sizeof chunks[0]); k++) {
+        gathered = 0;
+        for (off = 0; off < len; off += n) {
+            n = len - off < chunks[k] ? len - off : chunks[k];
+            if (tpl_gather(TPL_GATHER_MEM|TPL_GROW, (char *)all + off, n,
+                           &gs, gather_cb, NULL) < 0) {
+                check(0, "gather rc", (int)chunks[k]);
+                break;
+            }
+        }
+        check(gathered == ROUNDS && gs->len == 0, "gather count",
+              (int)chunks[k]);
+    }
+    
+    free(gs->img);
+    free(gs);
+    free(all);
+}
+
+/* A variant against the scalar loop, words at every offset. */
+static void
+bswap(const char *what, tpl_bswap_fcn *fcn)
+{
+    static const int lens[] = { 2, 4, 8 };
+    char src[WORDS * 8 + 16], want[sizeof src], got[sizeof src];
+    int k, off, num, i;
+    
+    for (i = 0; i < (int)sizeof src; i++)
+        src[i] = (char)rand();
+    
+    for (k = 0; k < 3; k++) {
+        for (off = 0; off < 8; off++) {
+            for (num = 0; num <= WORDS; num++) {
+                memcpy(want, src, sizeof src);
+                memcpy(got, src, sizeof src);
+                tpl_bswap_scalar(want + off, num, lens[k]);
+                fcn(got + off, num, lens[k]);
+                if (memcmp(want, got, sizeof src) != 0) {
+                    check(0, what, lens[k] * 1000 + num);
+                    return;
+                }
+            }
+        }
+    }
+    
+    // The scalar loop itself, against the generic swap.
+    memcpy(want, src, sizeof src);
+    memcpy(got, src, sizeof src);
+    tpl_bswap_scalar(got + 1, WORDS, 4);
+    for (i = 0; i < WORDS; i++)
+        tpl_byteswap(want + 1 + 4 * i, 4);
+    check(memcmp(want, got, sizeof src) == 0, "scalar byteswap", 4);
+}
+
+int main(int argc, char **argv)
+{
+    (void)argc;
+    (void)argv;
+    srand(1);
+    tpl_hook.oops = quiet;
+    
+    grow();
+    stream();
+    gather();
+    
+    bswap("scalar", tpl_bswap_scalar);
+#ifdef TPL_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse2"))
+        bswap("sse2 byteswap", tpl_bswap_sse2);
+    if (__builtin_cpu_supports("avx2"))
+        bswap("avx2 byteswap", tpl_bswap_avx2);
+#endif
+    
+    if (failures == 0)
+        printf("tpl_test: ok\n");
+    
+    return failures == 0 ? 0 : 1;
+}